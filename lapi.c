@@ -855,7 +855,9 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
   api_checkpop(L, 1);
   luaV_fastset(t, str, s2v(L->top.p - 1), hres, luaH_psetstr);
   if (hres == HOK) {
-    luaV_finishfastset(L, t, s2v(L->top.p - 1));
+    TValue key;
+    setsvalue(L, &key, str);
+    luaV_finishfastset(L, t, &key, s2v(L->top.p - 1));
     L->top.p--;  /* pop value */
   }
   else {
@@ -884,7 +886,7 @@ LUA_API void lua_settable (lua_State *L, int idx) {
   t = index2value(L, idx);
   luaV_fastset(t, s2v(L->top.p - 2), s2v(L->top.p - 1), hres, luaH_pset);
   if (hres == HOK) {
-    luaV_finishfastset(L, t, s2v(L->top.p - 1));
+    luaV_finishfastset(L, t, s2v(L->top.p - 2), s2v(L->top.p - 1));
   }
   else
     luaV_finishset(L, t, s2v(L->top.p - 2), s2v(L->top.p - 1), hres);
@@ -907,7 +909,7 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   t = index2value(L, idx);
   luaV_fastseti(t, n, s2v(L->top.p - 1), hres);
   if (hres == HOK)
-    luaV_finishfastset(L, t, s2v(L->top.p - 1));
+    luaV_finishfastseti(L, t, n, s2v(L->top.p - 1));
   else {
     TValue temp;
     setivalue(&temp, n);
@@ -925,7 +927,7 @@ static void aux_rawset (lua_State *L, int idx, TValue *key, int n) {
   t = gettable(L, idx);
   luaH_set(L, t, key, s2v(L->top.p - 1));
   invalidateTMcache(t);
-  luaC_barrierback(L, obj2gco(t), s2v(L->top.p - 1));
+  luaC_barriertable(L, t, key, s2v(L->top.p - 1));
   L->top.p -= n;
   lua_unlock(L);
 }
@@ -949,7 +951,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   api_checkpop(L, 1);
   t = gettable(L, idx);
   luaH_setint(L, t, n, s2v(L->top.p - 1));
-  luaC_barrierback(L, obj2gco(t), s2v(L->top.p - 1));
+  luaC_barriertablei(L, t, n, s2v(L->top.p - 1));
   L->top.p--;
   lua_unlock(L);
 }
@@ -1153,6 +1155,15 @@ LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data, int strip) {
 }
 
 
+LUA_API int lua_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  lua_lock(L);
+  status = luaC_snapshot(L, writer, data);
+  lua_unlock(L);
+  return status;
+}
+
+
 LUA_API int lua_status (lua_State *L) {
   return APIstatus(L->status);
 }
@@ -1229,6 +1240,56 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
         g->gcparams[param] = luaO_codeparam(cast_uint(value));
       break;
     }
+    case LUA_GCTHREADS: {
+      int n = va_arg(argp, int);
+      res = luaC_gcthreads(L, n);
+      break;
+    }
+    case LUA_GCBGFREE: {
+      int on = va_arg(argp, int);
+      res = luaC_bgfree(L, on);
+      break;
+    }
+    case LUA_GCSTEPTIME: {
+      lu_byte oldstp = g->gcstp;
+      int budget = va_arg(argp, int);
+      g->gcstp = 0;  /* allow GC to run (other bits must be zero here) */
+      res = luaC_steptime(L, (budget > 0) ? budget : 0);
+      g->gcstp = oldstp;  /* restore previous state */
+      break;
+    }
+    case LUA_GCPAUSES: {
+      int i = va_arg(argp, int);
+      if (i >= GCPAUSEN)
+        res = 0;  /* no such bucket */
+      else if (i >= 0) {  /* query a bucket */
+        lu_mem n = g->gcpauses[i];
+        res = (n > INT_MAX) ? INT_MAX : cast_int(n);
+      }
+      else {
+        if (i == -1 || i == -2)  /* start/stop recording? */
+          luaC_recpauses(L, i == -1);
+        res = GCPAUSEN;
+      }
+      break;
+    }
+    case LUA_GCSTATS: {
+      int tt = va_arg(argp, int);
+      size_t *stats = va_arg(argp, size_t *);
+      api_check(L, -2 <= tt && tt <= LUA_TPROTO, "invalid type");
+      res = luaC_stats(L, tt, stats);
+      break;
+    }
+    case LUA_GCDEFERFIN: {
+      int on = va_arg(argp, int);
+      res = luaC_deferfinalizers(L, on);
+      break;
+    }
+    case LUA_GCRUNFIN: {
+      int n = va_arg(argp, int);
+      res = luaC_runfinalizers(L, n);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   va_end(argp);
@@ -1328,6 +1389,22 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+LUA_API size_t lua_setmemlimit (lua_State *L, size_t limit) {
+  global_State *g;
+  size_t old;
+  lua_lock(L);
+  g = G(L);
+  old = cast_sizet(g->GClimit);
+  if (limit > cast_sizet(MAX_LMEM))
+    limit = cast_sizet(MAX_LMEM);
+  g->GClimit = cast(l_mem, limit);
+  if (limit != 0 && (old == 0 || limit < old))  /* limit is tighter? */
+    luaE_setdebt(g, 0);  /* let the collector adjust its pace */
+  lua_unlock(L);
+  return old;
+}
+
+
 void lua_setwarnf (lua_State *L, lua_WarnFunction f, void *ud) {
   lua_lock(L);
   G(L)->ud_warn = ud;
@@ -513,7 +513,7 @@ static const luaL_Reg boxmt[] = {  /* box metamethods */
 };
 
 
-static void newbox (lua_State *L) {
+LUALIB_API void luaL_newbox (lua_State *L) {
   UBox *box = (UBox *)lua_newuserdatauv(L, sizeof(UBox), 0);
   box->box = NULL;
   box->bsize = 0;
@@ -574,7 +574,7 @@ static char *prepbuffsize (luaL_Buffer *B, size_t sz, int boxidx) {
       newbuff = (char *)resizebox(L, boxidx, newsize);  /* resize it */
     else {  /* no box yet */
       lua_remove(L, boxidx);  /* remove placeholder */
-      newbox(L);  /* create a new box */
+      luaL_newbox(L);  /* create a new box */
       lua_insert(L, boxidx);  /* move box to its intended position */
       lua_toclose(L, boxidx);
       newbuff = (char *)resizebox(L, boxidx, newsize);
@@ -608,25 +608,34 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 }
 
 
+/*
+** Push the first 'len' bytes of the box on the top of the stack as an
+** external string, handing the memory of the box over to that string.
+** The box is left empty.
+*/
+static void pushboxstring (lua_State *L, size_t len) {
+  UBox *box = (UBox *)lua_touserdata(L, -1);
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);  /* function to free buffer */
+  char *s;
+  resizebox(L, -1, len + 1);  /* adjust box size to content size */
+  s = (char*)box->box;  /* final buffer address */
+  s[len] = '\0';  /* add ending zero */
+  /* clear box, as Lua will take control of the buffer */
+  box->bsize = 0;  box->box = NULL;
+  lua_pushexternalstring(L, s, len, allocf, ud);
+}
+
+
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
   lua_State *L = B->L;
   checkbufferlevel(B, -1);
   if (!buffonstack(B))  /* using static buffer? */
     lua_pushlstring(L, B->b, B->n);  /* save result as regular string */
   else {  /* reuse buffer already allocated */
-    UBox *box = (UBox *)lua_touserdata(L, -1);
-    void *ud;
-    lua_Alloc allocf = lua_getallocf(L, &ud);  /* function to free buffer */
-    size_t len = B->n;  /* final string length */
-    char *s;
-    resizebox(L, -1, len + 1);  /* adjust box size to content size */
-    s = (char*)box->box;  /* final buffer address */
-    s[len] = '\0';  /* add ending zero */
-    /* clear box, as Lua will take control of the buffer */
-    box->bsize = 0;  box->box = NULL;
-    lua_pushexternalstring(L, s, len, allocf, ud);
+    pushboxstring(L, B->n);
     lua_closeslot(L, -2);  /* close the box */
-    lua_gc(L, LUA_GCSTEP, len);
+    lua_gc(L, LUA_GCSTEP, B->n);
   }
   lua_remove(L, -2);  /* remove box or placeholder from the stack */
 }
@@ -672,6 +681,41 @@ LUALIB_API char *luaL_buffinitsize (lua_State *L, luaL_Buffer *B, size_t sz) {
   return prepbuffsize(B, sz, -1);
 }
 
+
+/*
+** Buffers over boxes: the box on the top of the stack (created by
+** 'luaL_newbox') keeps the contents after the buffer is gone, so that
+** they can be reused by later buffers over the same box.
+*/
+LUALIB_API void luaL_buffinitbox (lua_State *L, luaL_Buffer *B, size_t n) {
+  UBox *box = (UBox *)lua_touserdata(L, -1);
+  lua_assert(box != NULL && n <= box->bsize);
+  if (box->box == NULL)  /* empty box? */
+    resizebox(L, -1, LUAL_BUFFERSIZE);  /* give it some space */
+  B->L = L;
+  B->b = (char *)box->box;
+  B->n = n;
+  B->size = box->bsize;
+}
+
+
+/*
+** Small results are copied, so that the box keeps its memory for
+** later uses. Larger ones take the memory of the box, without copying.
+** Either way, the box is removed from the stack.
+*/
+LUALIB_API void luaL_pushboxresult (luaL_Buffer *B) {
+  lua_State *L = B->L;
+  lua_assert(buffonstack(B) && lua_touserdata(L, -1) != NULL);
+  if (B->n < LUAL_BUFFERSIZE)  /* small result? */
+    lua_pushlstring(L, B->b, B->n);
+  else {
+    pushboxstring(L, B->n);
+    lua_gc(L, LUA_GCSTEP, B->n);
+  }
+  lua_remove(L, -2);  /* remove box from the stack */
+}
+
 /* }====================================================== */
 
 
@@ -1057,6 +1101,193 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
 }
 
 
+/*
+** {======================================================
+** Pool allocator
+** =======================================================
+*/
+
+/*
+** The pool allocator serves small blocks from size classes with a
+** granularity of POOLGRAIN bytes, which fit exactly the sizes of most
+** core objects (tables, short strings, upvalues, closures with few
+** upvalues, etc.). Blocks are carved from big chunks, and freed blocks
+** go to a free list for their class. As Lua always gives the size of
+** a block being freed or resized, blocks need no headers. Larger
+** blocks go to 'realloc'. Memory in chunks returns to the system only
+** when the state is closed, which the allocator detects when Lua frees
+** the first block it allocated (the state itself).
+*/
+
+typedef union PoolChunk {
+  union PoolChunk *previous;  /* chunks are kept in a list */
+  LUAI_MAXALIGN;  /* ensures that blocks after the header are aligned */
+} PoolChunk;
+
+
+/* granularity of size classes (keeps the alignment of any type) */
+#define POOLGRAIN	sizeof(PoolChunk)
+
+/* size of the largest block served by the pool */
+#define POOLMAX		(32 * POOLGRAIN)
+
+/* number of size classes */
+#define POOLNCLASSES	(POOLMAX / POOLGRAIN)
+
+/* size of the chunks the pool gets from 'malloc' */
+#define POOLCHUNK	(64 * 1024)
+
+#define sizeclass(sz)	(((sz) - 1) / POOLGRAIN)
+#define classsize(c)	(((c) + 1) * POOLGRAIN)
+
+
+
+
+typedef struct Pool {
+  void *freelist[POOLNCLASSES];  /* free blocks of each class */
+  char *next;  /* free space in the current chunk */
+  char *limit;  /* end of the current chunk */
+  PoolChunk *chunks;  /* list of all chunks */
+  void *state;  /* first block allocated (the state) */
+#if defined(LUA_USE_GCTHREADS)
+  int lock;  /* the collector may free blocks from another thread */
+#endif
+} Pool;
+
+
+#if defined(LUA_USE_GCTHREADS)
+#define lockpool(p)  \
+  { while (__atomic_exchange_n(&(p)->lock, 1, __ATOMIC_ACQUIRE)) ; }
+#define unlockpool(p)	__atomic_store_n(&(p)->lock, 0, __ATOMIC_RELEASE)
+#else
+#define lockpool(p)	((void)0)
+#define unlockpool(p)	((void)0)
+#endif
+
+
+static void poolput (Pool *p, void *b, size_t sz) {
+  size_t c = sizeclass(sz);
+  *cast(void **, b) = p->freelist[c];
+  p->freelist[c] = b;
+}
+
+
+static void *poolget (Pool *p, size_t sz) {
+  size_t c = sizeclass(sz);
+  void *b = p->freelist[c];
+  if (b != NULL)  /* is there a free block? */
+    p->freelist[c] = *cast(void **, b);
+  else {  /* carve a new block from current chunk */
+    size_t csize = classsize(c);
+    if (cast_sizet(p->limit - p->next) < csize) {  /* no space? */
+      PoolChunk *ch = cast(PoolChunk *, malloc(POOLCHUNK));
+      if (ch == NULL)
+        return NULL;
+      if (p->next < p->limit)  /* reuse the rest of current chunk */
+        poolput(p, p->next, cast_sizet(p->limit - p->next));
+      ch->previous = p->chunks;
+      p->chunks = ch;
+      p->next = cast_charp(ch + 1);
+      p->limit = cast_charp(ch) + POOLCHUNK;
+    }
+    b = p->next;
+    p->next += csize;
+  }
+  return b;
+}
+
+
+static void pooldestroy (Pool *p) {
+  while (p->chunks != NULL) {
+    PoolChunk *ch = p->chunks;
+    p->chunks = ch->previous;
+    free(ch);
+  }
+  free(p);
+}
+
+
+/*
+** A large block 'b' (from 'malloc') shrinks to a small size, but the
+** pool has no memory for a new small block. The block cannot keep its
+** address as it is: it will be freed as a small block, going to a free
+** list and never back to the system. Instead, it is cut with 'realloc'
+** to a pool chunk with just one block, which is freed with all other
+** chunks.
+*/
+static void *pooladopt (Pool *p, void *b, size_t nsize) {
+  size_t csize = classsize(sizeclass(nsize));
+  PoolChunk *ch = cast(PoolChunk *, realloc(b, sizeof(PoolChunk) + csize));
+  if (ch == NULL)  /* could not grow it to fit the chunk header? */
+    return b;  /* keep the block (shrinking cannot fail) */
+  memmove(ch + 1, ch, nsize);  /* move contents after the header */
+  ch->previous = p->chunks;
+  p->chunks = ch;
+  return ch + 1;
+}
+
+
+static void *poolrealloc (Pool *p, void *ptr, size_t osize, size_t nsize) {
+  if (nsize == 0) {  /* free block? */
+    if (ptr == NULL)
+      return NULL;  /* nothing to be freed */
+    else if (osize <= POOLMAX)
+      poolput(p, ptr, osize);
+    else
+      free(ptr);
+    return NULL;
+  }
+  else if (nsize > POOLMAX && (ptr == NULL || osize > POOLMAX))
+    return realloc(ptr, nsize);  /* large blocks go to 'realloc' */
+  else if (ptr != NULL && osize <= POOLMAX && nsize <= POOLMAX &&
+           sizeclass(osize) == sizeclass(nsize))
+    return ptr;  /* block already has the right size */
+  else {  /* must move the block */
+    void *nb = (nsize <= POOLMAX) ? poolget(p, nsize) : malloc(nsize);
+    if (nb == NULL) {  /* allocation failed? */
+      if (nsize > osize)
+        return NULL;
+      else if (osize > POOLMAX)  /* large block becoming small? */
+        return pooladopt(p, ptr, nsize);
+      else
+        return ptr;  /* shrinking cannot fail */
+    }
+    if (ptr != NULL) {
+      memcpy(nb, ptr, (osize < nsize) ? osize : nsize);
+      poolrealloc(p, ptr, osize, 0);  /* free old block */
+    }
+    return nb;
+  }
+}
+
+
+static void *l_poolalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  Pool *p = cast(Pool *, ud);
+  void *res;
+  if (ptr == NULL)
+    osize = 0;  /* 'osize' is the type of a new object */
+  else if (ptr == p->state && nsize == 0) {  /* closing the state? */
+    if (osize > POOLMAX)
+      free(ptr);
+    pooldestroy(p);
+    return NULL;
+  }
+  lockpool(p);
+  res = poolrealloc(p, ptr, osize, nsize);
+  unlockpool(p);
+  if (p->state == NULL) {  /* first block? */
+    if (res == NULL)  /* could not create the state? */
+      pooldestroy(p);  /* Lua will not call the allocator again */
+    else
+      p->state = res;
+  }
+  return res;
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** Standard panic function just prints an error message. The test
 ** with 'lua_type' avoids possible memory errors in 'lua_tostring'.
@@ -1177,8 +1408,17 @@ LUALIB_API unsigned int luaL_makeseed (lua_State *L) {
 }
 
 
-LUALIB_API lua_State *luaL_newstate (void) {
-  lua_State *L = lua_newstate(l_alloc, NULL, luai_makeseed());
+LUALIB_API lua_State *luaL_newstatex (int pool) {
+  lua_State *L;
+  if (pool) {
+    Pool *p = cast(Pool *, malloc(sizeof(Pool)));
+    if (p == NULL)
+      return NULL;
+    memset(p, 0, sizeof(Pool));
+    L = lua_newstate(l_poolalloc, p, luai_makeseed());
+  }
+  else
+    L = lua_newstate(l_alloc, NULL, luai_makeseed());
   if (l_likely(L)) {
     lua_atpanic(L, &panic);
     lua_setwarnf(L, warnfoff, L);  /* default is warnings off */
@@ -1187,6 +1427,15 @@ LUALIB_API lua_State *luaL_newstate (void) {
 }
 
 
+LUALIB_API lua_State *luaL_newstate (void) {
+#if defined(LUA_USE_POOLALLOC)
+  return luaL_newstatex(1);
+#else
+  return luaL_newstatex(0);
+#endif
+}
+
+
 LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
   lua_Number v = lua_version(L);
   if (sz != LUAL_NUMSIZES)  /* check numeric types */
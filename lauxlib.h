@@ -99,6 +99,7 @@ LUALIB_API int (luaL_loadbufferx) (lua_State *L, const char *buff, size_t sz,
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
+LUALIB_API lua_State *(luaL_newstatex) (int pool);
 
 LUALIB_API unsigned luaL_makeseed (lua_State *L);
 
@@ -211,6 +212,9 @@ LUALIB_API void (luaL_addvalue) (luaL_Buffer *B);
 LUALIB_API void (luaL_pushresult) (luaL_Buffer *B);
 LUALIB_API void (luaL_pushresultsize) (luaL_Buffer *B, size_t sz);
 LUALIB_API char *(luaL_buffinitsize) (lua_State *L, luaL_Buffer *B, size_t sz);
+LUALIB_API void (luaL_newbox) (lua_State *L);
+LUALIB_API void (luaL_buffinitbox) (lua_State *L, luaL_Buffer *B, size_t n);
+LUALIB_API void (luaL_pushboxresult) (luaL_Buffer *B);
 
 #define luaL_prepbuffer(B)	luaL_prepbuffsize(B, LUAL_BUFFERSIZE)
 
@@ -198,13 +198,68 @@ static int pushmode (lua_State *L, int oldmode) {
 */
 #define checkvalres(res) { if (res == -1) break; }
 
+/*
+** Set field 'k' of the table on the top to 'v'.
+*/
+static void setstat (lua_State *L, const char *k, size_t v) {
+  lua_pushinteger(L, (lua_Integer)v);
+  lua_setfield(L, -2, k);
+}
+
+
+/*
+** Push a table with the allocation statistics: one entry per type of
+** collectable object, an entry 'sites' with the bytes requested by
+** each kind of allocation site, an entry 'limit' with the number of
+** allocations refused by the memory limit, and an entry 'finalizers'
+** with the number of objects waiting for their finalizers and the
+** number of finalizers called.
+*/
+static int pushstats (lua_State *L) {
+  static const char *const names[] = {"string", "table", "function",
+    "userdata", "thread", "upvalue", "proto"};
+  static const int types[] = {LUA_TSTRING, LUA_TTABLE, LUA_TFUNCTION,
+    LUA_TUSERDATA, LUA_TTHREAD, LUA_NUMTYPES, LUA_NUMTYPES + 1};
+  size_t st[4 * (LUA_NUMTYPES + 2)];
+  int i;
+  if (lua_gc(L, LUA_GCSTATS, -2, st) == -1)  /* all types at once */
+    return 0;  /* invalid call (inside a finalizer) */
+  lua_createtable(L, 0, 10);
+  for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+    const size_t *ts = st + 4 * types[i];
+    lua_createtable(L, 0, 4);
+    setstat(L, "count", ts[0]);
+    setstat(L, "bytes", ts[1]);
+    setstat(L, "freed", ts[2]);
+    setstat(L, "created", ts[3]);
+    lua_setfield(L, -2, names[i]);
+  }
+  lua_gc(L, LUA_GCSTATS, -1, st);
+  lua_createtable(L, 0, 3);
+  setstat(L, "blocks", st[0]);
+  setstat(L, "objects", st[1]);
+  setstat(L, "resizes", st[2]);
+  lua_setfield(L, -2, "sites");
+  lua_createtable(L, 0, 1);
+  setstat(L, "refused", st[3]);
+  lua_setfield(L, -2, "limit");
+  lua_createtable(L, 0, 2);
+  setstat(L, "pending", st[4]);
+  setstat(L, "called", st[5]);
+  lua_setfield(L, -2, "finalizers");
+  return 1;
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "isrunning", "generational", "incremental",
-    "param", NULL};
+    "param", "threads", "bgfree", "steptime", "pauses", "stats",
+    "deferfin", "runfin", NULL};
   static const char optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC,
-    LUA_GCPARAM};
+    LUA_GCPARAM, LUA_GCTHREADS, LUA_GCBGFREE, LUA_GCSTEPTIME,
+    LUA_GCPAUSES, LUA_GCSTATS, LUA_GCDEFERFIN, LUA_GCRUNFIN};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   switch (o) {
     case LUA_GCCOUNT: {
@@ -236,15 +291,67 @@ static int luaB_collectgarbage (lua_State *L) {
     case LUA_GCPARAM: {
       static const char *const params[] = {
         "minormul", "majorminor", "minormajor",
-        "pause", "stepmul", "stepsize", NULL};
+        "pause", "stepmul", "stepsize", "nursery", NULL};
       static const char pnum[] = {
         LUA_GCPMINORMUL, LUA_GCPMAJORMINOR, LUA_GCPMINORMAJOR,
-        LUA_GCPPAUSE, LUA_GCPSTEPMUL, LUA_GCPSTEPSIZE};
+        LUA_GCPPAUSE, LUA_GCPSTEPMUL, LUA_GCPSTEPSIZE, LUA_GCPNURSERY};
       int p = pnum[luaL_checkoption(L, 2, NULL, params)];
       lua_Integer value = luaL_optinteger(L, 3, -1);
       lua_pushinteger(L, lua_gc(L, o, p, (int)value));
       return 1;
     }
+    case LUA_GCTHREADS: {
+      lua_Integer n = luaL_optinteger(L, 2, 0);
+      luaL_argcheck(L, 0 <= n && n <= INT_MAX, 2, "out of range");
+      lua_pushinteger(L, lua_gc(L, o, (int)n));
+      return 1;
+    }
+    case LUA_GCBGFREE: {
+      int on = lua_isnoneornil(L, 2) ? -1 : lua_toboolean(L, 2);
+      lua_pushboolean(L, lua_gc(L, o, on));
+      return 1;
+    }
+    case LUA_GCSTEPTIME: {
+      lua_Number t = luaL_checknumber(L, 2) * 1e9;  /* in nanoseconds */
+      int res;
+      luaL_argcheck(L, 0 <= t && t <= INT_MAX, 2, "out of range");
+      res = lua_gc(L, o, (int)t);
+      checkvalres(res);
+      lua_pushboolean(L, res);
+      return 1;
+    }
+    case LUA_GCPAUSES: {
+      int i, n;
+      if (!lua_isnoneornil(L, 2))  /* start or stop recording? */
+        lua_gc(L, o, lua_toboolean(L, 2) ? -1 : -2);
+      n = lua_gc(L, o, -3);  /* number of buckets */
+      checkvalres(n);
+      lua_createtable(L, n, 0);
+      for (i = 0; i < n; i++) {
+        lua_pushinteger(L, lua_gc(L, o, i));
+        lua_rawseti(L, -2, i + 1);
+      }
+      return 1;
+    }
+    case LUA_GCSTATS: {
+      if (pushstats(L))
+        return 1;
+      break;
+    }
+    case LUA_GCDEFERFIN: {
+      int on = lua_isnoneornil(L, 2) ? -1 : lua_toboolean(L, 2);
+      int res = lua_gc(L, o, on);
+      checkvalres(res);
+      lua_pushboolean(L, res);
+      return 1;
+    }
+    case LUA_GCRUNFIN: {
+      lua_Integer n = luaL_optinteger(L, 2, 0);  /* 0 means all */
+      int res = lua_gc(L, o, (0 < n && n <= INT_MAX) ? (int)n : 0);
+      checkvalres(res);
+      lua_pushinteger(L, res);
+      return 1;
+    }
     default: {
       int res = lua_gc(L, o);
       checkvalres(res);
@@ -1901,4 +1901,5 @@ void luaK_finish (FuncState *fs) {
       default: break;
     }
   }
+  luaP_fuse(p->code, fs->pc);  /* create superinstructions */
 }
@@ -449,6 +449,30 @@ static int db_traceback (lua_State *L) {
 }
 
 
+static int snapwriter (lua_State *L, const void *p, size_t sz, void *f) {
+  (void)L;  /* not used */
+  return (fwrite(p, 1, sz, (FILE *)f) != sz);
+}
+
+
+/*
+** Write a snapshot of the heap into the given file. The file is written
+** through a plain C stream, so this works even when the Lua heap is
+** almost full.
+*/
+static int db_heapsnapshot (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  FILE *f = fopen(fname, "wb");
+  int status;
+  if (f == NULL)
+    return luaL_fileresult(L, 0, fname);
+  status = lua_heapsnapshot(L, snapwriter, f);
+  if (fclose(f) != 0)
+    status = 1;
+  return luaL_fileresult(L, status == 0, fname);
+}
+
+
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
   {"getuservalue", db_getuservalue},
@@ -458,6 +482,7 @@ static const luaL_Reg dblib[] = {
   {"getregistry", db_getregistry},
   {"getmetatable", db_getmetatable},
   {"getupvalue", db_getupvalue},
+  {"heapsnapshot", db_heapsnapshot},
   {"upvaluejoin", db_upvaluejoin},
   {"upvalueid", db_upvalueid},
   {"setuservalue", db_setuservalue},
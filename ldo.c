@@ -273,6 +273,37 @@ static void correctstack (lua_State *L, StkId oldstack) {
 #endif
 
 
+#if !defined(LUAI_NANBOX)
+
+#define reallocslots(L,s,os,ns)  \
+	luaM_reallocvector(L, s, (os) + EXTRA_STACK, (ns) + EXTRA_STACK, \
+	                      StackValue)
+
+#else
+
+/*
+** With NaN boxing, the block of a stack ends with the deltas of the
+** to-be-closed variables (see 'tbcdelta'), which must be moved to the
+** end of the new block.
+*/
+static StkId reallocslots (lua_State *L, StkId oldstack, int oldsize,
+                                         int newsize) {
+  StkId newstack = cast(StkId,
+                     luaM_reallocvector(L, NULL, 0, stackbytes(newsize), char));
+  if (newstack != NULL) {
+    size_t n = cast_sizet((oldsize < newsize) ? oldsize : newsize)
+             + EXTRA_STACK;
+    memcpy(newstack, oldstack, n * sizeof(StackValue));
+    memcpy(newstack + newsize + EXTRA_STACK, oldstack + oldsize + EXTRA_STACK,
+           n * sizeof(unsigned short));
+    luaM_freemem(L, oldstack, stackbytes(oldsize));
+  }
+  return newstack;
+}
+
+#endif
+
+
 /*
 ** Reallocate the stack to a new size, correcting all pointers into it.
 ** In case of allocation error, raise an error or return false according
@@ -287,8 +318,7 @@ int luaD_reallocstack (lua_State *L, int newsize, int raiseerror) {
   lua_assert(newsize <= MAXSTACK || newsize == ERRORSTACKSIZE);
   relstack(L);  /* change pointers to offsets */
   G(L)->gcstopem = 1;  /* stop emergency collection */
-  newstack = luaM_reallocvector(L, oldstack, oldsize + EXTRA_STACK,
-                                   newsize + EXTRA_STACK, StackValue);
+  newstack = reallocslots(L, oldstack, oldsize, newsize);
   G(L)->gcstopem = oldgcstop;  /* restore emergency collection */
   if (l_unlikely(newstack == NULL)) {  /* reallocation failed? */
     correctstack(L, oldstack);  /* change offsets back to pointers */
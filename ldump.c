@@ -18,6 +18,7 @@
 #include "lapi.h"
 #include "lgc.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "ltable.h"
 #include "lundump.h"
@@ -155,11 +156,27 @@ static void dumpString (DumpState *D, TString *ts) {
 }
 
 
+/*
+** Dump the code of a function. Instructions with internal opcodes
+** (superinstructions and quickened instructions) are dumped as their
+** original instructions, so that binary chunks do not depend on them.
+*/
 static void dumpCode (DumpState *D, const Proto *f) {
+  int pc;
+  int first = 0;  /* first instruction not dumped yet */
   dumpInt(D, f->sizecode);
   dumpAlign(D, sizeof(f->code[0]));
   lua_assert(f->code != NULL);
-  dumpVector(D, f->code, cast_uint(f->sizecode));
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    if (isinternalop(GET_OPCODE(i))) {
+      dumpVector(D, f->code + first, cast_uint(pc - first));
+      SET_OPCODE(i, GET_BASEOP(i));
+      dumpVar(D, i);
+      first = pc + 1;
+    }
+  }
+  dumpVector(D, f->code + first, cast_uint(f->sizecode - first));
 }
 
 
@@ -18,8 +18,10 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -168,7 +170,7 @@ static void prepcallclosemth (lua_State *L, StkId level, TStatus status,
 ** is used.)
 */
 #define MAXDELTA  \
-	((256ul << ((sizeof(L->stack.p->tbclist.delta) - 1) * 8)) - 1)
+	((256ul << ((sizeof(tbcdelta(L, L->stack.p)) - 1) * 8)) - 1)
 
 
 /*
@@ -181,9 +183,9 @@ void luaF_newtbcupval (lua_State *L, StkId level) {
   checkclosemth(L, level);  /* value must have a close method */
   while (cast_uint(level - L->tbclist.p) > MAXDELTA) {
     L->tbclist.p += MAXDELTA;  /* create a dummy node at maximum delta */
-    L->tbclist.p->tbclist.delta = 0;
+    tbcdelta(L, L->tbclist.p) = 0;
   }
-  level->tbclist.delta = cast(unsigned short, level - L->tbclist.p);
+  tbcdelta(L, level) = cast(unsigned short, level - L->tbclist.p);
   L->tbclist.p = level;
 }
 
@@ -221,9 +223,9 @@ void luaF_closeupval (lua_State *L, StkId level) {
 */
 static void poptbclist (lua_State *L) {
   StkId tbc = L->tbclist.p;
-  lua_assert(tbc->tbclist.delta > 0);  /* first element cannot be dummy */
-  tbc -= tbc->tbclist.delta;
-  while (tbc > L->stack.p && tbc->tbclist.delta == 0)
+  lua_assert(tbcdelta(L, tbc) > 0);  /* first element cannot be dummy */
+  tbc -= tbcdelta(L, tbc);
+  while (tbc > L->stack.p && tbcdelta(L, tbc) == 0)
     tbc -= MAXDELTA;  /* remove dummy nodes */
   L->tbclist.p = tbc;
 }
@@ -259,6 +261,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->sizelineinfo = 0;
   f->abslineinfo = NULL;
   f->sizeabslineinfo = 0;
+  f->icache = NULL;
+  f->sizeicache = 0;
   f->upvalues = NULL;
   f->sizeupvalues = 0;
   f->numparams = 0;
@@ -269,21 +273,58 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  luaJ_initproto(f);
   return f;
 }
 
 
+/*
+** Create the inline caches of a prototype, if it has any instruction
+** that uses them (field accesses with constant short-string keys).
+** There is one cache per instruction, indexed by its 'pc'; each one
+** keeps the index of the node where the key was last found. A cache is
+** only a hint: the VM always checks that the node still holds the key,
+** so stale entries (after a rehash, for instance) are harmless.
+** Prototypes with fixed code do not get caches, as they are meant to
+** use as little memory as possible.
+*/
+void luaF_initicache (lua_State *L, Proto *f) {
+  int pc;
+  lua_assert(f->icache == NULL);
+  if (f->flag & PF_FIXED)
+    return;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    switch (GET_BASEOP(f->code[pc])) {
+      case OP_GETTABUP: case OP_GETFIELD: case OP_SELF:
+      case OP_SETTABUP: case OP_SETFIELD: {
+        f->icache = luaM_newvectorchecked(L, f->sizecode, unsigned int);
+        f->sizeicache = f->sizecode;
+        for (pc = 0; pc < f->sizecode; pc++)
+          f->icache[pc] = 0;
+        return;
+      }
+      default: break;
+    }
+  }
+}
+
+
 lu_mem luaF_protosize (Proto *p) {
   lu_mem sz = cast(lu_mem, sizeof(Proto))
             + cast_uint(p->sizep) * sizeof(Proto*)
             + cast_uint(p->sizek) * sizeof(TValue)
             + cast_uint(p->sizelocvars) * sizeof(LocVar)
-            + cast_uint(p->sizeupvalues) * sizeof(Upvaldesc);
+            + cast_uint(p->sizeupvalues) * sizeof(Upvaldesc)
+            + cast_uint(p->sizeicache) * sizeof(unsigned int);
   if (!(p->flag & PF_FIXED)) {
     sz += cast_uint(p->sizecode) * sizeof(Instruction);
     sz += cast_uint(p->sizelineinfo) * sizeof(lu_byte);
     sz += cast_uint(p->sizeabslineinfo) * sizeof(AbsLineInfo);
   }
+#if defined(LUA_USE_JIT)
+  if (p->jit != NULL)
+    sz += p->jit->bsize;  /* native code */
+#endif
   return sz;
 }
 
@@ -298,7 +339,9 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->k, cast_sizet(f->sizek));
   luaM_freearray(L, f->locvars, cast_sizet(f->sizelocvars));
   luaM_freearray(L, f->upvalues, cast_sizet(f->sizeupvalues));
-  luaM_free(L, f);
+  luaM_freearray(L, f->icache, cast_sizet(f->sizeicache));
+  luaJ_freeproto(L, f);
+  luaM_freeobject(L, f, sizeof(*f));
 }
 
 
@@ -10,10 +10,17 @@
 #include "lprefix.h"
 
 #include <string.h>
+#include <time.h>
+
+#if defined(LUA_USE_GCTHREADS)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 
 #include "lua.h"
 
+#include "lapi.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -39,25 +46,28 @@
 */
 #define CWUFIN	10
 
+/*
+** Maximum number of finalizers called in one collector step.
+*/
+#if !defined(GCFINBATCH)
+#define GCFINBATCH	10
+#endif
+
 
 /* mask with all color bits */
 #define maskcolors	(bitmask(BLACKBIT) | WHITEBITS)
 
-/* mask with all GC bits */
-#define maskgcbits      (maskcolors | AGEBITS)
-
-
 /* macro to erase all color bits then set only the current white bit */
 #define makewhite(g,x)	\
-  (x->marked = cast_byte((x->marked & ~maskcolors) | luaC_white(g)))
+  (gcmarks(x) = cast_byte((gcmarks(x) & ~maskcolors) | luaC_white(g)))
 
 /* make an object gray (neither white nor black) */
-#define set2gray(x)	resetbits(x->marked, maskcolors)
+#define set2gray(x)	resetbits(gcmarks(x), maskcolors)
 
 
 /* make an object black (coming from any color) */
 #define set2black(x)  \
-  (x->marked = cast_byte((x->marked & ~WHITEBITS) | bitmask(BLACKBIT)))
+  (gcmarks(x) = cast_byte((gcmarks(x) & ~WHITEBITS) | bitmask(BLACKBIT)))
 
 
 #define valiswhite(x)   (iscollectable(x) && iswhite(gcvalue(x)))
@@ -75,7 +85,7 @@
 ** Access to collectable objects in array part of tables
 */
 #define gcvalarr(t,i)  \
-	((*getArrTag(t,i) & BIT_ISCOLLECTABLE) ? getArrVal(t,i)->gc : NULL)
+	((arrtag(t,i) & BIT_ISCOLLECTABLE) ? gcvalueraw(*getArrVal(t,i)) : NULL)
 
 
 #define markvalue(g,o) { checkliveness(mainthread(g),o); \
@@ -97,6 +107,39 @@ static void atomic (lua_State *L);
 static void entersweep (lua_State *L);
 
 
+#if defined(LUA_USE_GCTHREADS)
+
+/*
+** A marker thread in a parallel traversal (see 'parallelmark'). Each
+** one has its own list of gray objects, from which the other markers
+** can steal work; 'lock' protects that list. Objects that only the
+** main thread can traverse go to 'serial'; objects that go back to
+** 'grayagain' go to a private list too.
+*/
+typedef struct GCWorker {
+  GCObject *gray;  /* gray objects to be traversed by this marker */
+  GCObject *serial;  /* objects left for the main thread */
+  GCObject *grayagain;  /* objects to be added to 'g->grayagain' */
+  l_mem marked;  /* number of bytes marked by this marker */
+  int lock;  /* spin lock for 'gray' */
+  int id;  /* index of this marker in its pool */
+  struct GCPool *pool;
+  pthread_t thread;
+} GCWorker;
+
+
+/* marker running in the current thread (NULL if not marking in parallel) */
+static __thread GCWorker *gcworker = NULL;
+
+#define getworker()	gcworker
+
+#else
+
+#define getworker()	NULL
+
+#endif
+
+
 /*
 ** {======================================================
 ** Generic functions
@@ -109,6 +152,11 @@ static void entersweep (lua_State *L);
 */
 #define gnodelast(h)	gnode(h, cast_sizet(sizenode(h)))
 
+/*
+** one after last used slot in a shaped hash part
+*/
+#define gslotlast(h)	gslot(h, getshape(h)->nkeys)
+
 
 static l_mem objsize (GCObject *o) {
   lu_mem res;
@@ -198,6 +246,55 @@ static void linkgclist_ (GCObject *o, GCObject **pnext, GCObject **list) {
 #define linkobjgclist(o,p) linkgclist_(obj2gco(o), getgclist(o), &(p))
 
 
+#if defined(LUAI_PAGEHEAP)
+
+/*
+** With the page heap, gray objects waiting to be traversed go to a
+** stack outside them, so that marking does not write into the objects.
+** The stack is not part of the heap (its memory is not counted by the
+** collector). If it cannot grow, objects go to list 'gray', as usual.
+*/
+static void pushgraystack (global_State *g, GCObject *o) {
+  if (g->ngray == g->sizegray) {  /* stack is full? */
+    int n = (g->sizegray == 0) ? 256 : g->sizegray * 2;
+    GCObject **s = cast(GCObject **, (*g->frealloc)(g->ud, g->graystack,
+                           cast_sizet(g->sizegray) * sizeof(GCObject *),
+                           cast_sizet(n) * sizeof(GCObject *)));
+    if (s == NULL) {  /* cannot grow it? */
+      linkobjgclist(o, g->gray);  /* use the list */
+      return;
+    }
+    g->graystack = s;
+    g->sizegray = n;
+  }
+  lua_assert(!isgray(o));
+  g->graystack[g->ngray++] = o;
+  set2gray(o);
+}
+
+
+static void freegraystack (global_State *g) {
+  if (g->graystack != NULL)
+    (*g->frealloc)(g->ud, g->graystack,
+                   cast_sizet(g->sizegray) * sizeof(GCObject *), 0);
+  g->graystack = NULL;
+  g->ngray = g->sizegray = 0;
+}
+
+
+#define hasgray(g)	((g)->gray != NULL || (g)->ngray > 0)
+
+#define linkgray(g,o)	pushgraystack(g, o)
+
+#else
+
+#define hasgray(g)	((g)->gray != NULL)
+
+#define linkgray(g,o)	linkobjgclist(o, (g)->gray)
+
+#endif
+
+
 
 /*
 ** Clear keys for empty entries in tables. If entry is empty, mark its
@@ -269,9 +366,10 @@ void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
 void luaC_barrierback_ (lua_State *L, GCObject *o) {
   global_State *g = G(L);
   lua_assert(isblack(o) && !isdead(g, o));
-  lua_assert((g->gckind != KGC_GENMINOR)
-          || (isold(o) && getage(o) != G_TOUCHED1));
-  if (getage(o) == G_TOUCHED2)  /* already in gray list? */
+  lua_assert((g->gckind != KGC_GENMINOR) || isold(o));
+  /* black touched objects are already in a gray list (a 'touched1'
+     one can be black only if it is a table using cards) */
+  if (getage(o) >= G_TOUCHED1)  /* already in gray list? */
     set2gray(o);  /* make it gray to become touched1 */
   else  /* link it in 'grayagain' and paint it gray */
     linkobjgclist(o, g->grayagain);
@@ -299,10 +397,18 @@ GCObject *luaC_newobjdt (lua_State *L, lu_byte tt, size_t sz, size_t offset) {
   global_State *g = G(L);
   char *p = cast_charp(luaM_newobject(L, novariant(tt), sz));
   GCObject *o = cast(GCObject *, p + offset);
+#if defined(LUAI_PAGEHEAP)
+  if (luaM_inpages(sz)) {  /* object lives in a page? */
+    o->marked = PAGEMARK;
+    luaM_pagecolors(o) = luaC_white(g);
+  }
+  else
+#endif
   o->marked = luaC_white(g);
   o->tt = tt;
   o->next = g->allgc;
   g->allgc = o;
+  g->gcstats.nnew[novariant(tt)]++;
   return o;
 }
 
@@ -318,6 +424,257 @@ GCObject *luaC_newobj (lua_State *L, lu_byte tt, size_t sz) {
 
 
 
+/*
+** {======================================================
+** Cards
+** =======================================================
+*/
+
+/*
+** In generational mode, the barrier for a black old table turns it
+** gray again, so that the next two minor collections traverse all of
+** it. For large tables, that can dominate the cost of minor
+** collections. Instead, the slots of a large table (first the ones of
+** its array part, then the ones of its hash part) are grouped in cards
+** of 2^CARDBITS slots, and the barrier marks only the card of the
+** written slot. The table goes to 'grayagain' but stays black, so that
+** later writes also call the barrier; minor collections traverse only
+** its marked cards. As with touched objects, a card marked in a cycle
+** is traversed in that cycle and in the next one.
+** A table gets its cards in its first barrier as a 'touched' table and
+** loses them when it is not touched anymore. Cards are kept outside
+** the heap (their memory is not counted by the collector), in a hash
+** table indexed by the table address. If that memory cannot be
+** allocated, the table uses the regular barrier.
+*/
+
+/* log2 of the number of slots in a card */
+#define CARDBITS	6
+
+/* minimum number of slots for a table to use cards */
+#define CARDMIN		(16u << CARDBITS)
+
+/* states of a card */
+#define CARDCLEAN	0  /* no writes */
+#define CARDTOUCHED1	1  /* written in this cycle */
+#define CARDTOUCHED2	2  /* written in previous cycle */
+
+#define tableslots(t)	((t)->asize + sizenode(t))
+
+#define numcards(n)	(((n) + (1u << CARDBITS) - 1u) >> CARDBITS)
+
+
+typedef struct Cards {
+  struct Cards *next;  /* next in its chain in 'cardhash' */
+  Table *t;  /* owner of these cards */
+  unsigned nslots;  /* number of slots covered (0 if not valid) */
+  unsigned size;  /* number of cards in 'c' */
+  lu_byte c[1];
+} Cards;
+
+
+#define sizecards(n)	(offsetof(Cards, c) + cast_sizet(n))
+
+#define cardchain(g,t)  \
+	(&(g)->cardhash[(point2uint(t) >> 4) & ((g)->sizecardhash - 1)])
+
+
+/*
+** Check whether the barrier for table 't' can use cards: the collector
+** must be in minor mode, and the table must be large and really old
+** or touched (the other old ages need whole traversals).
+*/
+#define usecards(g,t)  \
+	((g)->gckind == KGC_GENMINOR && getage(t) >= G_OLD && \
+	 tableslots(t) >= CARDMIN)
+
+
+static Cards *findcards (global_State *g, Table *t) {
+  Cards *c;
+  if (g->ncards == 0)
+    return NULL;
+  for (c = *cardchain(g, t); c != NULL; c = c->next) {
+    if (c->t == t)
+      return c;
+  }
+  return NULL;
+}
+
+
+static void removecards (global_State *g, Cards **p) {
+  Cards *c = *p;
+  *p = c->next;
+  if (g->lastcards == c)
+    g->lastcards = NULL;
+  (*g->frealloc)(g->ud, c, sizecards(c->size), 0);
+  g->ncards--;
+}
+
+
+/*
+** Double the size of 'cardhash'. Returns 0 if it cannot do it.
+*/
+static int growcardhash (global_State *g) {
+  unsigned osize = g->sizecardhash;
+  unsigned nsize = (osize == 0) ? 16 : 2 * osize;
+  Cards **oh = g->cardhash;
+  Cards **nh = cast(Cards **, (*g->frealloc)(g->ud, NULL, 0,
+                                     cast_sizet(nsize) * sizeof(Cards *)));
+  unsigned i;
+  if (nh == NULL)
+    return 0;
+  for (i = 0; i < nsize; i++)
+    nh[i] = NULL;
+  g->cardhash = nh;
+  g->sizecardhash = nsize;
+  for (i = 0; i < osize; i++) {  /* move entries to new chains */
+    Cards *c = oh[i];
+    while (c != NULL) {
+      Cards *next = c->next;
+      Cards **chain = cardchain(g, c->t);
+      c->next = *chain;
+      *chain = c;
+      c = next;
+    }
+  }
+  if (oh != NULL)
+    (*g->frealloc)(g->ud, oh, cast_sizet(osize) * sizeof(Cards *), 0);
+  return 1;
+}
+
+
+/*
+** Get the cards of table 't', creating them if needed. New cards (or
+** cards too small for the current size of the table) are not valid.
+** Returns NULL if it cannot allocate them.
+*/
+static Cards *getcards (global_State *g, Table *t) {
+  Cards *c = g->lastcards;
+  unsigned n = numcards(tableslots(t));
+  if (c == NULL || c->t != t)
+    c = findcards(g, t);
+  if (c != NULL && c->size < n) {  /* cards too small? */
+    Cards **p = cardchain(g, t);
+    while (*p != c) p = &(*p)->next;
+    removecards(g, p);  /* create new ones */
+    c = NULL;
+  }
+  if (c == NULL) {
+    Cards **chain;
+    if (g->ncards >= g->sizecardhash && !growcardhash(g))
+      return NULL;
+    c = cast(Cards *, (*g->frealloc)(g->ud, NULL, 0, sizecards(n)));
+    if (c == NULL)
+      return NULL;
+    c->t = t;
+    c->nslots = 0;  /* not valid */
+    c->size = n;
+    chain = cardchain(g, t);
+    c->next = *chain;
+    *chain = c;
+    g->ncards++;
+  }
+  g->lastcards = c;
+  return c;
+}
+
+
+/*
+** Remove the cards of tables that are not touched anymore. (Called at
+** the end of minor collections.)
+*/
+static void prunecards (global_State *g) {
+  unsigned i;
+  for (i = 0; g->ncards > 0 && i < g->sizecardhash; i++) {
+    Cards **p = &g->cardhash[i];
+    while (*p != NULL) {
+      if (getage((*p)->t) < G_TOUCHED1)  /* not touched anymore? */
+        removecards(g, p);
+      else
+        p = &(*p)->next;
+    }
+  }
+}
+
+
+static void freecards (global_State *g) {
+  unsigned i;
+  for (i = 0; i < g->sizecardhash; i++) {
+    while (g->cardhash[i] != NULL)
+      removecards(g, &g->cardhash[i]);
+  }
+  if (g->cardhash != NULL)
+    (*g->frealloc)(g->ud, g->cardhash,
+                   cast_sizet(g->sizecardhash) * sizeof(Cards *), 0);
+  g->cardhash = NULL;
+  g->sizecardhash = 0;
+  lua_assert(g->ncards == 0 && g->lastcards == NULL);
+}
+
+
+/*
+** Barrier for a write into position 'slot' of black table 't', in
+** minor mode. Valid cards of a 'touched' table describe everything
+** that its next traversal has to visit. Cards not valid are set to
+** cover all slots for the duties of the table: none for a table not
+** yet touched, all in the current cycle for a 'touched2' one. (A
+** black 'touched1' table always has valid cards.)
+*/
+static void markcard (lua_State *L, Table *t, unsigned slot) {
+  global_State *g = G(L);
+  lu_byte age = getage(t);
+  unsigned nslots = tableslots(t);
+  Cards *c;
+  lua_assert(isblack(t) && usecards(g, t));
+  if (slot >= nslots || (c = getcards(g, t)) == NULL) {
+    luaC_barrierback_(L, obj2gco(t));  /* use a regular barrier */
+    return;
+  }
+  if (age == G_OLD || c->nslots != nslots) {  /* must reset cards? */
+    if (age == G_TOUCHED1) {  /* cannot happen; be safe */
+      luaC_barrierback_(L, obj2gco(t));
+      return;
+    }
+    memset(c->c, (age == G_TOUCHED2) ? CARDTOUCHED2 : CARDCLEAN,
+                 numcards(nslots));
+    c->nslots = nslots;
+  }
+  if (age == G_OLD) {  /* not in a gray list? */
+    linkgclist(t, g->grayagain);
+    set2black(t);  /* keep it black */
+  }
+  c->c[slot >> CARDBITS] = CARDTOUCHED1;
+  setage(t, G_TOUCHED1);
+}
+
+
+void luaC_barriertable_ (lua_State *L, Table *t, const TValue *key) {
+  if (usecards(G(L), t))
+    markcard(L, t, luaH_slotof(t, key));
+  else
+    luaC_barrierback_(L, obj2gco(t));
+}
+
+
+void luaC_barriertablei_ (lua_State *L, Table *t, lua_Integer i) {
+  if (usecards(G(L), t)) {
+    lua_Unsigned u = l_castS2U(i) - 1u;
+    if (u < t->asize)  /* key in the array part? */
+      markcard(L, t, cast_uint(u));
+    else {
+      TValue key;
+      setivalue(&key, i);
+      markcard(L, t, luaH_slotof(t, &key));
+    }
+  }
+  else
+    luaC_barrierback_(L, obj2gco(t));
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** Mark functions
@@ -325,6 +682,59 @@ GCObject *luaC_newobj (lua_State *L, lu_byte tt, size_t sz) {
 */
 
 
+#if defined(LUA_USE_GCTHREADS)
+
+/*
+** Try to turn a white object gray. When marking in parallel, several
+** markers may reach the same object; only the one that changes its
+** color may mark it.
+*/
+static int claimobject (GCObject *o) {
+  lu_byte m = __atomic_load_n(&o->marked, __ATOMIC_RELAXED);
+  do {
+    if (!(m & WHITEBITS))
+      return 0;  /* someone else got it */
+  } while (!__atomic_compare_exchange_n(&o->marked, &m,
+                cast_byte(m & ~maskcolors), 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+
+static void lockworker (GCWorker *w) {
+  while (__atomic_exchange_n(&w->lock, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(&w->lock, __ATOMIC_RELAXED))
+      ;  /* spin */
+}
+
+#define unlockworker(w)	__atomic_store_n(&(w)->lock, 0, __ATOMIC_RELEASE)
+
+
+static void pushgray (GCWorker *w, GCObject *o) {
+  lockworker(w);
+  *getgclist(o) = w->gray;
+  __atomic_store_n(&w->gray, o, __ATOMIC_RELAXED);
+  unlockworker(w);
+}
+
+
+/*
+** Remove an object from the gray list of 'w', or return NULL if
+** that list is empty.
+*/
+static GCObject *popgray (GCWorker *w) {
+  GCObject *o;
+  lockworker(w);
+  o = w->gray;
+  if (o != NULL)
+    __atomic_store_n(&w->gray, *getgclist(o), __ATOMIC_RELAXED);
+  unlockworker(w);
+  return o;
+}
+
+#endif
+
+
 /*
 ** Mark an object.  Userdata with no user values, strings, and closed
 ** upvalues are visited and turned black here.  Open upvalues are
@@ -338,6 +748,15 @@ GCObject *luaC_newobj (lua_State *L, lu_byte tt, size_t sz) {
 ** (only closures can), and a userdata's metatable must be a table.
 */
 static void reallymarkobject (global_State *g, GCObject *o) {
+#if defined(LUA_USE_GCTHREADS)
+  GCWorker *w = getworker();
+  if (w != NULL) {  /* marking in parallel? */
+    if (!claimobject(o))
+      return;  /* another marker got it first */
+    w->marked += objsize(o);
+  }
+  else
+#endif
   g->GCmarked += objsize(o);
   switch (o->tt) {
     case LUA_VSHRSTR:
@@ -365,7 +784,13 @@ static void reallymarkobject (global_State *g, GCObject *o) {
     }  /* FALLTHROUGH */
     case LUA_VLCL: case LUA_VCCL: case LUA_VTABLE:
     case LUA_VTHREAD: case LUA_VPROTO: {
-      linkobjgclist(o, g->gray);  /* to be visited later */
+#if defined(LUA_USE_GCTHREADS)
+      if (w != NULL) {
+        pushgray(w, o);  /* to be visited later by some marker */
+        break;
+      }
+#endif
+      linkgray(g, o);  /* to be visited later */
       break;
     }
     default: lua_assert(0); break;
@@ -430,6 +855,9 @@ static void remarkupvals (global_State *g) {
 static void cleargraylists (global_State *g) {
   g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = NULL;
+#if defined(LUAI_PAGEHEAP)
+  g->ngray = 0;
+#endif
 }
 
 
@@ -469,6 +897,11 @@ static void restartcollection (global_State *g) {
 static void genlink (global_State *g, GCObject *o) {
   lua_assert(isblack(o));
   if (getage(o) == G_TOUCHED1) {  /* touched in this cycle? */
+#if defined(LUA_USE_GCTHREADS)
+    if (getworker() != NULL)
+      linkobjgclist(o, getworker()->grayagain);  /* merged later */
+    else
+#endif
     linkobjgclist(o, g->grayagain);  /* link it back in 'grayagain' */
   }  /* everything else do not need to be linked back */
   else if (getage(o) == G_TOUCHED2)
@@ -476,6 +909,59 @@ static void genlink (global_State *g, GCObject *o) {
 }
 
 
+/*
+** {======================================================
+** Log of ephemeron entries
+** =======================================================
+*/
+
+/*
+** In the atomic phase, each ephemeron table is traversed only once,
+** and the traversal logs in 'ephlog' its entries with white keys. Then
+** ephemeron convergence and the clearing of dead keys go only through
+** those entries, instead of traversing again all entries of all tables
+** in the 'ephemeron' list. If the log cannot grow, 'gclogeph' goes to
+** false and the collector uses that list for the rest of the cycle, as
+** the log is not complete anymore. (All tables with logged entries are
+** in that list.)
+*/
+
+#define logging(g)	((g)->gcstate == GCSatomic && (g)->gclogeph)
+
+
+static void logentry (global_State *g, Node *n) {
+  if (!g->gclogeph)
+    return;  /* log is already incomplete */
+  if (g->nephlog >= g->sizeephlog) {  /* log is full? */
+    unsigned osize = g->sizeephlog;
+    unsigned nsize = (osize == 0) ? 64 : 2 * osize;
+    Node **l = NULL;
+    if (nsize > osize && !luaM_testsize(nsize, sizeof(Node *)))
+      l = cast(Node **, (*g->frealloc)(g->ud, g->ephlog,
+                                       cast_sizet(osize) * sizeof(Node *),
+                                       cast_sizet(nsize) * sizeof(Node *)));
+    if (l == NULL) {  /* cannot grow? */
+      g->gclogeph = 0;  /* stop logging */
+      return;
+    }
+    g->ephlog = l;
+    g->sizeephlog = nsize;
+  }
+  g->ephlog[g->nephlog++] = n;
+}
+
+
+static void freeephlog (global_State *g) {
+  if (g->ephlog != NULL)
+    (*g->frealloc)(g->ud, g->ephlog,
+                   cast_sizet(g->sizeephlog) * sizeof(Node *), 0);
+  g->ephlog = NULL;
+  g->nephlog = g->sizeephlog = 0;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Traverse a table with weak values and link it to proper list. During
 ** propagate phase, keep it in 'grayagain' list, to be revisited in the
@@ -484,19 +970,28 @@ static void genlink (global_State *g, GCObject *o) {
 */
 static void traverseweakvalue (global_State *g, Table *h) {
   Node *n, *limit = gnodelast(h);
-  /* if there is array part, assume it may have white values (it is not
-     worth traversing it now just to check) */
-  int hasclears = (h->asize > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else {
-      lua_assert(!keyisnil(n));
-      markkey(g, n);
-      if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* a white value? */
+  /* if there is a generic array part, assume it may have white values
+     (it is not worth traversing it now just to check) */
+  int hasclears = (h->asize > 0 && !istyped(h));
+  if (isshaped(h)) {  /* keys were already marked */
+    TValue *slot;
+    for (slot = gslot(h, 0); slot < gslotlast(h); slot++) {
+      if (!hasclears && iscleared(g, gcvalueN(slot)))  /* a white value? */
         hasclears = 1;  /* table will have to be cleared */
     }
   }
+  else {
+    for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+      if (isempty(gval(n)))  /* entry is empty? */
+        clearkey(n);  /* clear its key */
+      else {
+        lua_assert(!keyisnil(n));
+        markkey(g, n);
+        if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* white value? */
+          hasclears = 1;  /* table will have to be cleared */
+      }
+    }
+  }
   if (g->gcstate == GCSatomic && hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
   else
@@ -511,6 +1006,8 @@ static int traversearray (global_State *g, Table *h) {
   unsigned asize = h->asize;
   int marked = 0;  /* true if some object is marked in this traversal */
   unsigned i;
+  if (istyped(h))
+    return 0;  /* only numbers; nothing to mark */
   for (i = 0; i < asize; i++) {
     GCObject *o = gcvalarr(h, i);
     if (o != NULL && iswhite(o)) {
@@ -530,16 +1027,28 @@ static int traversearray (global_State *g, Table *h) {
 ** the atomic phase, if table has any white->white entry, it has to
 ** be revisited during ephemeron convergence (as that key may turn
 ** black). Otherwise, if it has any white key, table has to be cleared
-** (in the atomic phase). In generational mode, some tables
-** must be kept in some gray list for post-processing; this is done
-** by 'genlink'.
+** (in the atomic phase). When logging, entries with white keys go to
+** the log and the table goes to the 'ephemeron' list if it has any of
+** them. In generational mode, some tables must be kept in some gray
+** list for post-processing; this is done by 'genlink'.
 */
 static int traverseephemeron (global_State *g, Table *h, int inv) {
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
+  int log = logging(g);
   unsigned int i;
   unsigned int nsize = sizenode(h);
   int marked = traversearray(g, h);  /* traverse array part */
+  if (isshaped(h)) {  /* keys (strings) were marked; mark values */
+    TValue *slot;
+    for (slot = gslot(h, 0); slot < gslotlast(h); slot++) {
+      if (valiswhite(slot)) {  /* value not marked yet? */
+        marked = 1;
+        reallymarkobject(g, gcvalue(slot));  /* mark it now */
+      }
+    }
+    nsize = 0;  /* no nodes to traverse */
+  }
   /* traverse hash part; if 'inv', traverse descending
      (see 'convergeephemerons') */
   for (i = 0; i < nsize; i++) {
@@ -550,6 +1059,8 @@ static int traverseephemeron (global_State *g, Table *h, int inv) {
       hasclears = 1;  /* table must be cleared */
       if (valiswhite(gval(n)))  /* value not marked yet? */
         hasww = 1;  /* white-white entry */
+      if (log)
+        logentry(g, n);
     }
     else if (valiswhite(gval(n))) {  /* value not marked yet? */
       marked = 1;
@@ -559,7 +1070,7 @@ static int traverseephemeron (global_State *g, Table *h, int inv) {
   /* link table into proper list */
   if (g->gcstate == GCSpropagate)
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
-  else if (hasww)  /* table has white->white entries? */
+  else if (hasww || (log && hasclears))  /* may have to visit it again? */
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
@@ -569,32 +1080,147 @@ static int traverseephemeron (global_State *g, Table *h, int inv) {
 }
 
 
-static void traversestrongtable (global_State *g, Table *h) {
+/*
+** Traverse the slots of table 'h' from position 'i' up to 'limit'
+** (not included), numbered as for cards.
+*/
+static void traverseslots (global_State *g, Table *h, unsigned i,
+                                                     unsigned limit) {
+  unsigned asize = h->asize;
+  if (i < asize) {  /* start in the array part? */
+    unsigned alimit = (limit < asize) ? limit : asize;
+    if (!istyped(h)) {
+      for (; i < alimit; i++) {
+        GCObject *o = gcvalarr(h, i);
+        if (o != NULL && iswhite(o))
+          reallymarkobject(g, o);
+      }
+    }
+    i = alimit;
+  }
+  for (; i < limit; i++) {  /* hash part */
+    if (isshaped(h)) {  /* keys were already marked */
+      markvalue(g, gslot(h, i - asize));
+    }
+    else {
+      Node *n = gnode(h, i - asize);
+      if (isempty(gval(n)))  /* entry is empty? */
+        clearkey(n);  /* clear its key */
+      else {
+        markkey(g, n);
+        markvalue(g, gval(n));
+      }
+    }
+  }
+}
+
+
+/*
+** Traverse the marked cards of table 'h', advancing their states.
+*/
+static void traversecards (global_State *g, Table *h, Cards *c) {
+  unsigned nslots = c->nslots;
+  unsigned i;
+  for (i = 0; i < numcards(nslots); i++) {
+    if (c->c[i] != CARDCLEAN) {
+      unsigned first = i << CARDBITS;
+      unsigned limit = (nslots - first > (1u << CARDBITS))
+                     ? first + (1u << CARDBITS) : nslots;
+      traverseslots(g, h, first, limit);
+      c->c[i] = (c->c[i] == CARDTOUCHED1) ? CARDTOUCHED2 : CARDCLEAN;
+    }
+  }
+}
+
+
+/*
+** Get the cards of table 'h', if it has any.
+*/
+#define tablecards(g,h)  \
+	((tableslots(h) >= CARDMIN) ? findcards(g, h) : NULL)
+
+
+/*
+** A whole traversal of a table invalidates its cards, as its entries
+** may have moved since the cards were marked.
+*/
+static void invalidatecards (global_State *g, Table *h) {
+  Cards *c = tablecards(g, h);
+  if (c != NULL)
+    c->nslots = 0;
+}
+
+
+/*
+** Traverse a table with strong keys and values. A black table (one in
+** a gray list that did not become gray again) with valid cards, in a
+** minor collection, only needs its marked cards traversed.
+*/
+static void traversestrongtable (global_State *g, Table *h, int black) {
   Node *n, *limit = gnodelast(h);
+  Cards *c = tablecards(g, h);
+  if (c != NULL && black && g->gckind == KGC_GENMINOR &&
+      c->nslots == tableslots(h)) {
+    traversecards(g, h, c);
+    genlink(g, obj2gco(h));
+    return;
+  }
+  if (c != NULL)
+    c->nslots = 0;  /* cards are not valid anymore */
   traversearray(g, h);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else {
-      lua_assert(!keyisnil(n));
-      markkey(g, n);
-      markvalue(g, gval(n));
+  if (isshaped(h)) {  /* keys were already marked */
+    TValue *slot;
+    for (slot = gslot(h, 0); slot < gslotlast(h); slot++)
+      markvalue(g, slot);
+  }
+  else {
+    for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+      if (isempty(gval(n)))  /* entry is empty? */
+        clearkey(n);  /* clear its key */
+      else {
+        lua_assert(!keyisnil(n));
+        markkey(g, n);
+        markvalue(g, gval(n));
+      }
     }
   }
   genlink(g, obj2gco(h));
 }
 
 
-static l_mem traversetable (global_State *g, Table *h) {
+/*
+** Mark the keys in the shape of a shaped table.
+*/
+static void traverseshape (global_State *g, Table *h) {
+  if (isshaped(h)) {
+    const Shape *s = getshape(h);
+    unsigned i;
+    for (i = 0; i < s->nkeys; i++)
+      markobject(g, s->keys[i]);
+  }
+}
+
+
+/* work done when traversing a table */
+#define tablework(h)	(1 + 2*sizenode(h) + (istyped(h) ? 0 : (h)->asize))
+
+
+/*
+** Traverse a table. 'black' tells whether the table was black (see
+** 'traversestrongtable').
+*/
+static l_mem traversetable (global_State *g, Table *h, int black) {
   const char *weakkey, *weakvalue;
   const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
   TString *smode;
   markobjectN(g, h->metatable);
+  traverseshape(g, h);
   if (mode && ttisshrstring(mode) &&  /* is there a weak mode? */
       (cast_void(smode = tsvalue(mode)),
        cast_void(weakkey = strchr(getshrstr(smode), 'k')),
        cast_void(weakvalue = strchr(getshrstr(smode), 'v')),
        (weakkey || weakvalue))) {  /* is really weak? */
+    invalidatecards(g, h);
     if (!weakkey)  /* strong keys? */
       traverseweakvalue(g, h);
     else if (!weakvalue)  /* strong values? */
@@ -603,8 +1229,8 @@ static l_mem traversetable (global_State *g, Table *h) {
       linkgclist(h, g->allweak);  /* nothing to traverse now */
   }
   else  /* not weak */
-    traversestrongtable(g, h);
-  return 1 + 2*sizenode(h) + h->asize;
+    traversestrongtable(g, h, black);
+  return tablework(h);
 }
 
 
@@ -705,11 +1331,21 @@ static l_mem traversethread (global_State *g, lua_State *th) {
 ** of the number of slots traversed.
 */
 static l_mem propagatemark (global_State *g) {
-  GCObject *o = g->gray;
+  GCObject *o;
+  int black;
+#if defined(LUAI_PAGEHEAP)
+  if (g->ngray > 0)
+    o = g->graystack[--g->ngray];  /* pop it from the stack */
+  else
+#endif
+  {
+    o = g->gray;
+    g->gray = *getgclist(o);  /* remove from 'gray' list */
+  }
+  black = isblack(o);
   nw2black(o);
-  g->gray = *getgclist(o);  /* remove from 'gray' list */
   switch (o->tt) {
-    case LUA_VTABLE: return traversetable(g, gco2t(o));
+    case LUA_VTABLE: return traversetable(g, gco2t(o), black);
     case LUA_VUSERDATA: return traverseudata(g, gco2u(o));
     case LUA_VLCL: return traverseLclosure(g, gco2lcl(o));
     case LUA_VCCL: return traverseCclosure(g, gco2ccl(o));
@@ -720,21 +1356,377 @@ static l_mem propagatemark (global_State *g) {
 }
 
 
+#if defined(LUA_USE_GCTHREADS)
+
+/*
+** {======================================================
+** Parallel marking
+** =======================================================
+*/
+
+/* maximum number of markers in a pool */
+#define MAXGCTHREADS	64
+
+/*
+** Number of objects the main thread traverses alone before calling
+** the other markers. (Small propagations are not worth the trouble
+** of waking up the other threads.)
+*/
+#define PARMINWORK	256
+
+
+/*
+** A pool of markers. Marker 0 is the thread running the collector;
+** the others are helper threads, which sleep on 'start' until
+** 'round' changes. 'running' counts helpers still in the current
+** round; 'idle' counts markers looking for work.
+*/
+typedef struct GCPool {
+  global_State *g;
+  pthread_mutex_t mtx;
+  pthread_cond_t start;  /* signals a new round (or 'quit') */
+  pthread_cond_t done;  /* signals the end of all helpers */
+  unsigned round;
+  int running;
+  int idle;
+  int quit;  /* true when helpers must exit */
+  int n;  /* number of markers (including the main thread) */
+  int size;  /* number of slots in 'w' */
+  GCWorker w[1];
+} GCPool;
+
+
+#define sizepool(n)	(offsetof(GCPool, w) + cast_sizet(n) * sizeof(GCWorker))
+
+
+/*
+** Check whether table 'h' may be weak. Unlike 'gfasttm', it does not
+** update the cache of absent metamethods in the metatable, as other
+** markers may be reading it.
+*/
+static int mayweak (global_State *g, Table *h) {
+  Table *mt = h->metatable;
+  if (mt == NULL || (mt->flags & (1u << TM_MODE)))
+    return 0;
+  else
+    return !notm(luaH_Hgetshortstr(mt, g->tmname[TM_MODE]));
+}
+
+
+/*
+** Traverse gray object 'o' in marker 'w'. Threads and tables that may
+** be weak go to the 'serial' list, to be traversed later by the main
+** thread: their traversals change global lists, and threads may have
+** their stacks shrunk.
+*/
+static void partraverse (global_State *g, GCWorker *w, GCObject *o) {
+  switch (o->tt) {
+    case LUA_VTABLE: {
+      Table *h = gco2t(o);
+      int black = isblack(h);
+      if (mayweak(g, h))
+        break;
+      nw2black(h);
+      markobjectN(g, h->metatable);
+      traverseshape(g, h);
+      traversestrongtable(g, h, black);
+      return;
+    }
+    case LUA_VUSERDATA: {
+      nw2black(o);
+      traverseudata(g, gco2u(o));
+      return;
+    }
+    case LUA_VLCL: {
+      nw2black(o);
+      traverseLclosure(g, gco2lcl(o));
+      return;
+    }
+    case LUA_VCCL: {
+      nw2black(o);
+      traverseCclosure(g, gco2ccl(o));
+      return;
+    }
+    case LUA_VPROTO: {
+      nw2black(o);
+      traverseproto(g, gco2p(o));
+      return;
+    }
+    case LUA_VTHREAD: break;
+    default: lua_assert(0); break;
+  }
+  *getgclist(o) = w->serial;  /* leave it (still gray) for later */
+  w->serial = o;
+}
+
+
+/*
+** Get work for marker 'w' from some other marker. Returns NULL when
+** all markers are idle, which means that there is no more work.
+*/
+static GCObject *steal (GCPool *p, GCWorker *w) {
+  __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    int i;
+    for (i = 1; i < p->n; i++) {
+      GCWorker *v = &p->w[(w->id + i) % p->n];
+      if (__atomic_load_n(&v->gray, __ATOMIC_RELAXED) != NULL) {
+        GCObject *o;
+        __atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+        o = popgray(v);
+        if (o != NULL)
+          return o;
+        __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+      }
+    }
+    if (__atomic_load_n(&p->idle, __ATOMIC_SEQ_CST) == p->n)
+      return NULL;  /* everybody is idle */
+    sched_yield();
+  }
+}
+
+
+/*
+** Traverse gray objects until there is no more work for anyone.
+*/
+static void drain (GCPool *p, GCWorker *w) {
+  GCObject *o;
+  gcworker = w;
+  for (;;) {
+    o = popgray(w);
+    if (o == NULL && (o = steal(p, w)) == NULL)
+      break;
+    partraverse(p->g, w, o);
+  }
+  gcworker = NULL;
+}
+
+
+static void *markermain (void *ud) {
+  GCWorker *w = cast(GCWorker *, ud);
+  GCPool *p = w->pool;
+  unsigned round = 0;
+  pthread_mutex_lock(&p->mtx);
+  for (;;) {
+    while (p->round == round && !p->quit)
+      pthread_cond_wait(&p->start, &p->mtx);
+    if (p->quit)
+      break;
+    round = p->round;
+    pthread_mutex_unlock(&p->mtx);
+    drain(p, w);
+    pthread_mutex_lock(&p->mtx);
+    if (--p->running == 0)
+      pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->mtx);
+  return NULL;
+}
+
+
+/*
+** Move all objects from list 'l' to list '*to'.
+*/
+static void movelist (GCObject **to, GCObject *l) {
+  while (l != NULL) {
+    GCObject *o = l;
+    l = *getgclist(o);
+    *getgclist(o) = *to;
+    *to = o;
+  }
+}
+
+
+/*
+** Traverse all objects in the gray list using all markers of the
+** pool. Returns the list of objects left for the main thread.
+*/
+static GCObject *parallelmark (global_State *g) {
+  GCPool *p = g->gcpool;
+  GCObject *serial = NULL;
+  int i = 0;
+  while (g->gray != NULL) {  /* distribute gray objects */
+    GCObject *o = g->gray;
+    g->gray = *getgclist(o);
+    *getgclist(o) = p->w[i].gray;
+    p->w[i].gray = o;
+    i = (i + 1) % p->n;
+  }
+  p->idle = 0;
+  pthread_mutex_lock(&p->mtx);
+  p->running = p->n - 1;
+  p->round++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->mtx);
+  drain(p, &p->w[0]);
+  pthread_mutex_lock(&p->mtx);
+  while (p->running > 0)
+    pthread_cond_wait(&p->done, &p->mtx);
+  pthread_mutex_unlock(&p->mtx);
+  for (i = 0; i < p->n; i++) {  /* collect results */
+    GCWorker *w = &p->w[i];
+    lua_assert(w->gray == NULL);
+    g->GCmarked += w->marked;
+    w->marked = 0;
+    movelist(&serial, w->serial);
+    w->serial = NULL;
+    movelist(&g->grayagain, w->grayagain);
+    w->grayagain = NULL;
+  }
+  return serial;
+}
+
+
+static void stoppool (lua_State *L, GCPool *p) {
+  int i;
+  pthread_mutex_lock(&p->mtx);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->mtx);
+  for (i = 1; i < p->n; i++)
+    pthread_join(p->w[i].thread, NULL);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->mtx);
+  luaM_freemem(L, p, sizepool(p->size));
+}
+
+
+/*
+** Create a pool with 'n' markers. If it cannot create all threads,
+** the pool works with fewer markers; returns NULL if it cannot
+** create any.
+*/
+static GCPool *newpool (lua_State *L, int n) {
+  GCPool *p = cast(GCPool *, luaM_newblock(L, sizepool(n)));
+  int i;
+  memset(p, 0, sizepool(n));
+  p->g = G(L);
+  p->size = n;
+  p->n = 1;
+  pthread_mutex_init(&p->mtx, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  for (i = 0; i < n; i++) {
+    p->w[i].id = i;
+    p->w[i].pool = p;
+  }
+  for (i = 1; i < n; i++) {
+    if (pthread_create(&p->w[i].thread, NULL, markermain, &p->w[i]) != 0)
+      break;
+    p->n++;
+  }
+  if (p->n == 1) {  /* could not create any thread? */
+    stoppool(L, p);
+    return NULL;
+  }
+  return p;
+}
+
+
+int luaC_gcthreads (lua_State *L, int n) {
+  global_State *g = G(L);
+  GCPool *old = g->gcpool;
+  int res = (old == NULL) ? 1 : old->n;
+  if (n > MAXGCTHREADS)
+    n = MAXGCTHREADS;
+  if (n > 0 && n != res) {
+    g->gcpool = (n > 1) ? newpool(L, n) : NULL;
+    if (old != NULL)
+      stoppool(L, old);
+  }
+  return res;
+}
+
+/* }====================================================== */
+
+#else
+
+int luaC_gcthreads (lua_State *L, int n) {
+  UNUSED(L); UNUSED(n);
+  return 1;  /* no parallel marking */
+}
+
+#endif
+
+
 static void propagateall (global_State *g) {
-  while (g->gray)
+#if defined(LUA_USE_GCTHREADS)
+  if (g->gcpool != NULL) {
+    for (;;) {
+      GCObject *l;
+      int i;
+      for (i = 0; g->gray != NULL && i < PARMINWORK; i++)
+        propagatemark(g);
+      if (g->gray == NULL)
+        break;
+      l = parallelmark(g);  /* traverse the rest in parallel */
+      while (l != NULL) {  /* traverse what was left for this thread */
+        GCObject *o = l;
+        l = *getgclist(o);
+        *getgclist(o) = g->gray;
+        g->gray = o;
+        propagatemark(g);
+      }
+    }
+    return;
+  }
+#endif
+  while (hasgray(g))
     propagatemark(g);
 }
 
 
+/*
+** Propagate marks from keys to values through the entries in 'ephlog',
+** removing the entries whose keys were marked. Repeat until nothing
+** new is marked; as in 'convergeephemerons', 'dir' alternates the
+** direction of the traversals. Returns false if the log became
+** incomplete in the process.
+*/
+static int convergelog (global_State *g) {
+  int dir = 0;
+  int changed;
+  do {
+    Node **l = g->ephlog;
+    unsigned n = g->nephlog;
+    unsigned i, j;
+    changed = 0;
+    for (i = j = 0; i < n; i++) {  /* 'j' counts the kept entries */
+      Node *nd = l[dir ? n - 1 - i : i];
+      if (iscleared(g, gckeyN(nd)))  /* key is still white? */
+        l[dir ? n - 1 - j++ : j++] = nd;  /* keep entry */
+      else if (valiswhite(gval(nd))) {  /* value not marked yet? */
+        changed = 1;
+        reallymarkobject(g, gcvalue(gval(nd)));  /* mark it now */
+      }
+    }
+    if (dir)  /* kept entries are at the end of the log? */
+      memmove(l, l + (n - j), cast_sizet(j) * sizeof(Node *));
+    g->nephlog = j;
+    if (changed) {
+      propagateall(g);  /* may log new entries */
+      if (!g->gclogeph)
+        return 0;
+    }
+    dir = !dir;
+  } while (changed);
+  return 1;
+}
+
+
 /*
 ** Traverse all ephemeron tables propagating marks from keys to values.
 ** Repeat until it converges, that is, nothing new is marked. 'dir'
 ** inverts the direction of the traversals, trying to speed up
-** convergence on chains in the same table.
+** convergence on chains in the same table. While the log of ephemeron
+** entries is complete, it is enough to go through that log.
 */
 static void convergeephemerons (global_State *g) {
   int changed;
   int dir = 0;
+  if (g->gclogeph && convergelog(g))
+    return;
   do {
     GCObject *w;
     GCObject *next = g->ephemeron;  /* get ephemeron list */
@@ -771,6 +1763,8 @@ static void clearbykeys (global_State *g, GCObject *l) {
     Table *h = gco2t(l);
     Node *limit = gnodelast(h);
     Node *n;
+    if (isshaped(h))  /* no weak keys? (strings are never weak) */
+      continue;
     for (n = gnode(h, 0); n < limit; n++) {
       if (iscleared(g, gckeyN(n)))  /* unmarked key? */
         setempty(gval(n));  /* remove entry */
@@ -781,40 +1775,231 @@ static void clearbykeys (global_State *g, GCObject *l) {
 }
 
 
-/*
-** clear entries with unmarked values from all weaktables in list 'l' up
-** to element 'f'
-*/
-static void clearbyvalues (global_State *g, GCObject *l, GCObject *f) {
-  for (; l != f; l = gco2t(l)->gclist) {
-    Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
-    unsigned int i;
-    unsigned int asize = h->asize;
-    for (i = 0; i < asize; i++) {
-      GCObject *o = gcvalarr(h, i);
-      if (iscleared(g, o))  /* value was collected? */
-        *getArrTag(h, i) = LUA_VEMPTY;  /* remove entry */
-    }
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (iscleared(g, gcvalueN(gval(n))))  /* unmarked value? */
-        setempty(gval(n));  /* remove entry */
-      if (isempty(gval(n)))  /* is entry empty? */
-        clearkey(n);  /* clear its key */
-    }
-  }
+/*
+** clear entries with unmarked values from all weaktables in list 'l' up
+** to element 'f'
+*/
+static void clearbyvalues (global_State *g, GCObject *l, GCObject *f) {
+  for (; l != f; l = gco2t(l)->gclist) {
+    Table *h = gco2t(l);
+    Node *n, *limit = gnodelast(h);
+    unsigned int i;
+    unsigned int asize = istyped(h) ? 0 : h->asize;
+    for (i = 0; i < asize; i++) {
+      GCObject *o = gcvalarr(h, i);
+      if (iscleared(g, o))  /* value was collected? */
+        setarrempty(h, i);  /* remove entry */
+    }
+    if (isshaped(h)) {
+      TValue *slot;
+      for (slot = gslot(h, 0); slot < gslotlast(h); slot++) {
+        if (iscleared(g, gcvalueN(slot)))  /* unmarked value? */
+          setempty(slot);  /* remove entry */
+      }
+      continue;
+    }
+    for (n = gnode(h, 0); n < limit; n++) {
+      if (iscleared(g, gcvalueN(gval(n))))  /* unmarked value? */
+        setempty(gval(n));  /* remove entry */
+      if (isempty(gval(n)))  /* is entry empty? */
+        clearkey(n);  /* clear its key */
+    }
+  }
+}
+
+
+/*
+** clear logged entries with unmarked keys
+*/
+static void clearlogkeys (global_State *g) {
+  unsigned i;
+  for (i = 0; i < g->nephlog; i++) {
+    Node *n = g->ephlog[i];
+    if (iscleared(g, gckeyN(n))) {  /* unmarked key? */
+      setempty(gval(n));  /* remove entry */
+      clearkey(n);  /* clear its key */
+    }
+  }
+  g->nephlog = 0;
+}
+
+
+#if defined(LUA_USE_GCTHREADS)
+
+/*
+** {======================================================
+** Background freeing
+** =======================================================
+*/
+
+/* size of the queue of blocks to be freed (must be a power of 2) */
+#define FREEQSIZE	4096
+
+/* number of queued blocks that justify waking up the freer */
+#define FREEBATCH	(FREEQSIZE / 2)
+
+
+/*
+** A thread that frees memory blocks for the main thread. 'luaM_free_'
+** puts blocks in a single-producer single-consumer ring buffer; the
+** freer takes them out and calls the allocator. The collector wakes
+** it up after sweeping. The freer only sleeps (on 'wake') after it
+** sets 'sleeping' and sees an empty queue.
+*/
+typedef struct GCFreer {
+  lua_Alloc frealloc;  /* allocator used to free the blocks */
+  void *ud;
+  size_t head;  /* next slot to be filled (written by main thread) */
+  size_t tail;  /* next slot to be freed (written by freer) */
+  int sleeping;
+  int quit;
+  pthread_mutex_t mtx;
+  pthread_cond_t wake;
+  pthread_t thread;
+  struct {
+    void *block;
+    size_t size;
+  } q[FREEQSIZE];
+} GCFreer;
+
+
+static void *freermain (void *ud) {
+  GCFreer *fr = cast(GCFreer *, ud);
+  size_t tail = fr->tail;
+  for (;;) {
+    size_t head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+    while (tail != head) {  /* free all queued blocks */
+      size_t i = tail % FREEQSIZE;
+      (*fr->frealloc)(fr->ud, fr->q[i].block, fr->q[i].size, 0);
+      tail++;
+      __atomic_store_n(&fr->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&fr->mtx);
+    __atomic_store_n(&fr->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!fr->quit && __atomic_load_n(&fr->head, __ATOMIC_SEQ_CST) == tail)
+      pthread_cond_wait(&fr->wake, &fr->mtx);
+    __atomic_store_n(&fr->sleeping, 0, __ATOMIC_RELAXED);
+    if (fr->quit && __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE) == tail)
+      break;  /* nothing else to free */
+    pthread_mutex_unlock(&fr->mtx);
+  }
+  pthread_mutex_unlock(&fr->mtx);
+  return NULL;
+}
+
+
+static void signalfreer (GCFreer *fr) {
+  pthread_mutex_lock(&fr->mtx);
+  __atomic_store_n(&fr->sleeping, 0, __ATOMIC_RELAXED);  /* signal once */
+  pthread_cond_signal(&fr->wake);
+  pthread_mutex_unlock(&fr->mtx);
+}
+
+
+/*
+** Wake up the freer if it is sleeping and there is something to free.
+*/
+static void wakefreer (global_State *g) {
+  GCFreer *fr = g->gcfreer;
+  if (fr != NULL && __atomic_load_n(&fr->sleeping, __ATOMIC_SEQ_CST) &&
+      fr->head != __atomic_load_n(&fr->tail, __ATOMIC_RELAXED))
+    signalfreer(fr);
+}
+
+
+/*
+** Queue 'block' to be freed by the freer. Returns 0 if it cannot do
+** that (queue is full or the allocator has changed); then, the caller
+** must free the block itself.
+*/
+int luaC_deferfree (global_State *g, void *block, size_t osize) {
+  GCFreer *fr = g->gcfreer;
+  size_t head = fr->head;
+  size_t n = head - __atomic_load_n(&fr->tail, __ATOMIC_ACQUIRE);
+  if (n == FREEQSIZE || g->frealloc != fr->frealloc || g->ud != fr->ud)
+    return 0;
+  fr->q[head % FREEQSIZE].block = block;
+  fr->q[head % FREEQSIZE].size = osize;
+  __atomic_store_n(&fr->head, head + 1, __ATOMIC_SEQ_CST);
+  if (n + 1 >= FREEBATCH && __atomic_load_n(&fr->sleeping, __ATOMIC_SEQ_CST))
+    signalfreer(fr);
+  return 1;
+}
+
+
+/*
+** Stop the freer, after it frees all queued blocks.
+*/
+static void stopfreer (lua_State *L, GCFreer *fr) {
+  pthread_mutex_lock(&fr->mtx);
+  fr->quit = 1;
+  pthread_cond_signal(&fr->wake);
+  pthread_mutex_unlock(&fr->mtx);
+  pthread_join(fr->thread, NULL);
+  pthread_cond_destroy(&fr->wake);
+  pthread_mutex_destroy(&fr->mtx);
+  luaM_free(L, fr);
+}
+
+
+/*
+** Turn background freeing on (on > 0) or off (on == 0); a negative
+** 'on' does not change it. Returns whether it was on.
+*/
+int luaC_bgfree (lua_State *L, int on) {
+  global_State *g = G(L);
+  GCFreer *fr = g->gcfreer;
+  int res = (fr != NULL);
+  if (on == 0 && fr != NULL) {
+    g->gcfreer = NULL;  /* from now on, free blocks directly */
+    stopfreer(L, fr);
+  }
+  else if (on > 0 && fr == NULL) {
+    fr = luaM_new(L, GCFreer);
+    fr->frealloc = g->frealloc;
+    fr->ud = g->ud;
+    fr->head = fr->tail = 0;
+    fr->sleeping = fr->quit = 0;
+    pthread_mutex_init(&fr->mtx, NULL);
+    pthread_cond_init(&fr->wake, NULL);
+    if (pthread_create(&fr->thread, NULL, freermain, fr) != 0) {
+      pthread_cond_destroy(&fr->wake);  /* cannot create thread */
+      pthread_mutex_destroy(&fr->mtx);
+      luaM_free(L, fr);
+    }
+    else
+      g->gcfreer = fr;
+  }
+  return res;
+}
+
+/* }====================================================== */
+
+#else
+
+#define wakefreer(g)	((void)0)
+
+int luaC_bgfree (lua_State *L, int on) {
+  UNUSED(L); UNUSED(on);
+  return 0;  /* no background freeing */
 }
 
+#endif
+
 
 static void freeupval (lua_State *L, UpVal *uv) {
   if (upisopen(uv))
     luaF_unlinkupval(uv);
-  luaM_free(L, uv);
+  luaM_freeobject(L, uv, sizeof(*uv));
 }
 
 
 static void freeobj (lua_State *L, GCObject *o) {
-  assert_code(l_mem newmem = gettotalbytes(G(L)) - objsize(o));
+  GCStats *st = &G(L)->gcstats;
+  l_mem size = objsize(o);
+  assert_code(l_mem newmem = gettotalbytes(G(L)) - size);
+  st->nfree[novariant(o->tt)]++;
+  st->freed[novariant(o->tt)] += cast(lu_mem, size);
   switch (o->tt) {
     case LUA_VPROTO:
       luaF_freeproto(L, gco2p(o));
@@ -824,12 +2009,12 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     case LUA_VLCL: {
       LClosure *cl = gco2lcl(o);
-      luaM_freemem(L, cl, sizeLclosure(cl->nupvalues));
+      luaM_freeobject(L, cl, sizeLclosure(cl->nupvalues));
       break;
     }
     case LUA_VCCL: {
       CClosure *cl = gco2ccl(o);
-      luaM_freemem(L, cl, sizeCclosure(cl->nupvalues));
+      luaM_freeobject(L, cl, sizeCclosure(cl->nupvalues));
       break;
     }
     case LUA_VTABLE:
@@ -840,20 +2025,20 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     case LUA_VUSERDATA: {
       Udata *u = gco2u(o);
-      luaM_freemem(L, o, sizeudata(u->nuvalue, u->len));
+      luaM_freeobject(L, o, sizeudata(u->nuvalue, u->len));
       break;
     }
     case LUA_VSHRSTR: {
       TString *ts = gco2ts(o);
       luaS_remove(L, ts);  /* remove it from hash table */
-      luaM_freemem(L, ts, sizestrshr(cast_uint(ts->shrlen)));
+      luaM_freeobject(L, ts, sizestrshr(cast_uint(ts->shrlen)));
       break;
     }
     case LUA_VLNGSTR: {
       TString *ts = gco2ts(o);
       if (ts->shrlen == LSTRMEM)  /* must free external string? */
         (*ts->falloc)(ts->ud, ts->contents, ts->u.lnglen + 1, 0);
-      luaM_freemem(L, ts, luaS_sizelngstr(ts->u.lnglen, ts->shrlen));
+      luaM_freeobject(L, ts, luaS_sizelngstr(ts->u.lnglen, ts->shrlen));
       break;
     }
     default: lua_assert(0);
@@ -872,19 +2057,20 @@ static void freeobj (lua_State *L, GCObject *o) {
 static GCObject **sweeplist (lua_State *L, GCObject **p, l_mem countin) {
   global_State *g = G(L);
   int ow = otherwhite(g);
-  int white = luaC_white(g);  /* current white */
   while (*p != NULL && countin-- > 0) {
     GCObject *curr = *p;
-    int marked = curr->marked;
-    if (isdeadm(ow, marked)) {  /* is 'curr' dead? */
+    if (isdeadm(ow, gcmarks(curr))) {  /* is 'curr' dead? */
       *p = curr->next;  /* remove 'curr' from list */
       freeobj(L, curr);  /* erase 'curr' */
     }
     else {  /* change mark to 'white' and age to 'new' */
-      curr->marked = cast_byte((marked & ~maskgcbits) | white | G_NEW);
+      makewhite(g, curr);
+      if (getage(curr) != G_NEW)  /* avoid needless writes to 'curr' */
+        setage(curr, G_NEW);
       p = &curr->next;  /* go to next element */
     }
   }
+  wakefreer(g);  /* free what was swept */
   return (*p == NULL) ? NULL : p;
 }
 
@@ -910,16 +2096,40 @@ static GCObject **sweeptolive (lua_State *L, GCObject **p) {
 */
 
 /*
-** If possible, shrink string table.
+** Number of buckets of the string table moved in each collector step
+** while the table is being resized (see 'luaS_rehash').
+*/
+#if !defined(GCSTRMOVE)
+#define GCSTRMOVE	64
+#endif
+
+
+/*
+** Free unused shapes and, if possible, shrink string table.
 */
 static void checkSizes (lua_State *L, global_State *g) {
-  if (!g->gcemergency) {
+  luaH_freeshapes(L);
+  if (!g->gcemergency && g->strt.old == NULL) {  /* not resizing? */
     if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
       luaS_resize(L, g->strt.size / 2);
   }
 }
 
 
+/*
+** End a cycle for the allocation statistics: bytes freed in this
+** cycle become the bytes freed in the last cycle.
+*/
+static void endstatcycle (global_State *g) {
+  GCStats *st = &g->gcstats;
+  int i;
+  for (i = 0; i < LUA_TOTALTYPES; i++) {
+    st->lastfreed[i] = st->freed[i];
+    st->freed[i] = 0;
+  }
+}
+
+
 /*
 ** Get the next udata to be finalized from the 'tobefnz' list, and
 ** link it back into the 'allgc' list.
@@ -928,6 +2138,7 @@ static GCObject *udata2finalize (global_State *g) {
   GCObject *o = g->tobefnz;  /* get first element */
   lua_assert(tofinalize(o));
   g->tobefnz = o->next;  /* remove it from 'tobefnz' list */
+  g->gcstats.npendingfin--;
   o->next = g->allgc;  /* return it to 'allgc' list */
   g->allgc = o;
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
@@ -939,37 +2150,61 @@ static GCObject *udata2finalize (global_State *g) {
 }
 
 
-static void dothecall (lua_State *L, void *ud) {
-  UNUSED(ud);
-  luaD_callnoyield(L, L->top.p - 2, 0);
+/*
+** Call up to 'n' finalizers in a row, counting them in '*ud'. (An
+** object counts as finalized before its finalizer runs, so an error
+** in it does not make the caller run it again.)
+*/
+static void dofinalizers (lua_State *L, void *ud) {
+  global_State *g = G(L);
+  int *n = cast(int *, ud);
+  while (*n > 0 && g->tobefnz != NULL) {
+    const TValue *tm;
+    TValue v;
+    (*n)--;
+    setgcovalue(L, &v, udata2finalize(g));
+    tm = luaT_gettmbyobj(L, &v, TM_GC);
+    if (!notm(tm)) {  /* is there a finalizer? */
+      g->gcstats.nfinalized++;
+      setobj2s(L, L->top.p++, tm);  /* push finalizer... */
+      setobj2s(L, L->top.p++, &v);  /* ... and its argument */
+      luaD_callnoyield(L, L->top.p - 2, 0);
+    }
+  }
 }
 
 
-static void GCTM (lua_State *L) {
+/*
+** Call up to 'n' pending finalizers; returns how many objects it
+** took from the 'tobefnz' list. All finalizers in a batch run inside
+** a single protected call; an error in one of them is reported as a
+** warning and a new protected call goes on with the rest.
+*/
+static int GCTM (lua_State *L, int n) {
   global_State *g = G(L);
-  const TValue *tm;
-  TValue v;
+  int left = n;
+  lu_byte oldah = L->allowhook;
+  lu_byte oldgcstp  = g->gcstp;
   lua_assert(!g->gcemergency);
-  setgcovalue(L, &v, udata2finalize(g));
-  tm = luaT_gettmbyobj(L, &v, TM_GC);
-  if (!notm(tm)) {  /* is there a finalizer? */
-    TStatus status;
-    lu_byte oldah = L->allowhook;
-    lu_byte oldgcstp  = g->gcstp;
-    g->gcstp |= GCSTPGC;  /* avoid GC steps */
-    L->allowhook = 0;  /* stop debug hooks during GC metamethod */
-    setobj2s(L, L->top.p++, tm);  /* push finalizer... */
-    setobj2s(L, L->top.p++, &v);  /* ... and its argument */
-    L->ci->callstatus |= CIST_FIN;  /* will run a finalizer */
-    status = luaD_pcall(L, dothecall, NULL, savestack(L, L->top.p - 2), 0);
-    L->ci->callstatus &= ~CIST_FIN;  /* not running a finalizer anymore */
-    L->allowhook = oldah;  /* restore hooks */
-    g->gcstp = oldgcstp;  /* restore state */
+  if (g->tobefnz == NULL)
+    return 0;  /* nothing to be done (state may be incomplete, too) */
+  g->gcstp |= GCSTPGC;  /* avoid GC steps */
+  L->allowhook = 0;  /* stop debug hooks during GC metamethods */
+  L->ci->callstatus |= CIST_FIN;  /* will run finalizers */
+  while (left > 0 && g->tobefnz != NULL) {
+    TStatus status = luaD_pcall(L, dofinalizers, &left,
+                                savestack(L, L->top.p), 0);
     if (l_unlikely(status != LUA_OK)) {  /* error while running __gc? */
+      L->ci->callstatus &= ~CIST_FIN;  /* (to report the warning) */
       luaE_warnerror(L, "__gc");
       L->top.p--;  /* pops error object */
+      L->ci->callstatus |= CIST_FIN;
     }
   }
+  L->ci->callstatus &= ~CIST_FIN;  /* not running a finalizer anymore */
+  L->allowhook = oldah;  /* restore hooks */
+  g->gcstp = oldgcstp;  /* restore state */
+  return n - left;
 }
 
 
@@ -977,9 +2212,30 @@ static void GCTM (lua_State *L) {
 ** call all pending finalizers
 */
 static void callallpendingfinalizers (lua_State *L) {
+  GCTM(L, INT_MAX);
+}
+
+
+/*
+** Calls up to 'n' pending finalizers ('n' <= 0 means all of them) in
+** thread 'L'; returns how many objects it finalized.
+*/
+int luaC_runfinalizers (lua_State *L, int n) {
+  return GCTM(L, (n > 0) ? n : INT_MAX);
+}
+
+
+/*
+** Turns on (if 'on' > 0) or off (if 'on' == 0) the deferred mode for
+** finalizers, where the collector leaves them pending until the
+** program calls them; returns the previous mode.
+*/
+int luaC_deferfinalizers (lua_State *L, int on) {
   global_State *g = G(L);
-  while (g->tobefnz)
-    GCTM(L);
+  int old = g->gcdeferfin;
+  if (on >= 0)
+    g->gcdeferfin = (on > 0);
+  return old;
 }
 
 
@@ -1015,6 +2271,7 @@ static void separatetobefnz (global_State *g, int all) {
       curr->next = *lastnext;  /* link at the end of 'tobefnz' list */
       *lastnext = curr;
       lastnext = &curr->next;
+      g->gcstats.npendingfin++;
     }
   }
 }
@@ -1094,6 +2351,36 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 */
 
 
+/*
+** Maximum factor by which the work of incremental steps grows as the
+** memory in use approaches the limit; closer than that, a step finishes
+** the whole cycle.
+*/
+#if !defined(LIMITSPEEDUP)
+#define LIMITSPEEDUP	8
+#endif
+
+/* minimum debt under a memory limit */
+#define LIMITMINDEBT	cast(l_mem, 10 * sizeof(Table))
+
+
+/*
+** With a memory limit, the collector must run again before the memory
+** in use reaches it; so, a debt can be at most half the room left
+** under the limit (but not so small that steps run at every check).
+*/
+static l_mem limitdebt (global_State *g, l_mem debt) {
+  if (g->GClimit > 0) {
+    l_mem half = (g->GClimit - gettotalbytes(g)) / 2;
+    if (half < LIMITMINDEBT)
+      half = LIMITMINDEBT;
+    if (debt > half)
+      debt = half;
+  }
+  return debt;
+}
+
+
 /*
 ** Set the "time" to wait before starting a new incremental cycle;
 ** cycle will start when number of bytes in use hits the threshold of
@@ -1101,7 +2388,14 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 */
 static void setpause (global_State *g) {
   l_mem threshold = applygcparam(g, PAUSE, g->GCmarked);
-  l_mem debt = threshold - gettotalbytes(g);
+  l_mem debt;
+  if (g->GClimit > 0) {  /* memory limit? */
+    /* start next cycle halfway between what is in use and the limit */
+    l_mem half = g->GCmarked + (g->GClimit - g->GCmarked) / 2;
+    if (threshold > half)
+      threshold = half;
+  }
+  debt = threshold - gettotalbytes(g);
   if (debt < 0) debt = 0;
   luaE_setdebt(g, debt);
 }
@@ -1162,7 +2456,6 @@ static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
     G_TOUCHED2   /* from G_TOUCHED2 (do not change) */
   };
   l_mem addedold = 0;
-  int white = luaC_white(g);
   GCObject *curr;
   while ((curr = *p) != limit) {
     if (iswhite(curr)) {  /* is 'curr' dead? */
@@ -1173,8 +2466,8 @@ static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
     else {  /* correct mark and age */
       int age = getage(curr);
       if (age == G_NEW) {  /* new objects go back to white */
-        int marked = curr->marked & ~maskgcbits;  /* erase GC bits */
-        curr->marked = cast_byte(marked | G_SURVIVAL | white);
+        makewhite(g, curr);
+        setage(curr, G_SURVIVAL);
       }
       else {  /* all other objects will be old, and so keep their color */
         lua_assert(age != G_OLD1);  /* advanced in 'markold' */
@@ -1189,6 +2482,7 @@ static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
     }
   }
   *paddedold += addedold;
+  wakefreer(g);  /* free what was swept */
   return p;
 }
 
@@ -1271,9 +2565,11 @@ static void markold (global_State *g, GCObject *from, GCObject *to) {
 */
 static void finishgencycle (lua_State *L, global_State *g) {
   correctgraylists(g);
+  prunecards(g);
   checkSizes(L, g);
+  endstatcycle(g);
   g->gcstate = GCSpropagate;  /* skip restart */
-  if (!g->gcemergency)
+  if (!g->gcemergency && !g->gcdeferfin)
     callallpendingfinalizers(L);
 }
 
@@ -1288,6 +2584,7 @@ static void minor2inc (lua_State *L, global_State *g, lu_byte kind) {
   g->gckind = kind;
   g->reallyold = g->old1 = g->survival = NULL;
   g->finobjrold = g->finobjold1 = g->finobjsur = NULL;
+  freecards(g);  /* only minor collections use cards */
   entersweep(L);  /* continue as an incremental cycle */
   /* set a debt equal to the step size */
   luaE_setdebt(g, applygcparam(g, STEPSIZE, 100));
@@ -1298,10 +2595,14 @@ static void minor2inc (lua_State *L, global_State *g, lu_byte kind) {
 ** Decide whether to shift to major mode. It shifts if the accumulated
 ** number of added old bytes (counted in 'GCmarked') is larger than
 ** 'minormajor'% of the number of lived bytes after the last major
-** collection. (This number is kept in 'GCmajorminor'.)
+** collection. (This number is kept in 'GCmajorminor'.) It also shifts
+** when the memory in use gets close to the memory limit, as only a
+** major collection can free old garbage.
 */
 static int checkminormajor (global_State *g) {
   l_mem limit = applygcparam(g, MINORMAJOR, g->GCmajorminor);
+  if (g->GClimit > 0 && g->GClimit - gettotalbytes(g) < g->GClimit / 4)
+    return 1;  /* near the memory limit */
   if (limit == 0)
     return 0;  /* special case: 'minormajor' 0 stops major collections */
   return (g->GCmarked >= limit);
@@ -1392,10 +2693,15 @@ static void atomic2gen (lua_State *L, global_State *g) {
 ** Set debt for the next minor collection, which will happen when
 ** total number of bytes grows 'genminormul'% in relation to
 ** the base, GCmajorminor, which is the number of bytes being used
-** after the last major collection.
+** after the last major collection, or when the program creates
+** 'gennursery' Kbytes, whichever is larger.
 */
 static void setminordebt (global_State *g) {
-  luaE_setdebt(g, applygcparam(g, MINORMUL, g->GCmajorminor));
+  l_mem debt = applygcparam(g, MINORMUL, g->GCmajorminor);
+  l_mem nursery = applygcparam(g, NURSERY, 1024 * 100);
+  if (debt < nursery)
+    debt = nursery;
+  luaE_setdebt(g, limitdebt(g, debt));
 }
 
 
@@ -1517,6 +2823,13 @@ void luaC_freeallobjects (lua_State *L) {
   lua_assert(g->finobj == NULL);  /* no new finalizers */
   deletelist(L, g->fixedgc, NULL);  /* collect fixed objects */
   lua_assert(g->strt.nuse == 0);
+  luaH_freeshapes(L);
+  luaC_gcthreads(L, 1);  /* stop marker threads */
+  luaC_bgfree(L, 0);  /* stop freer thread */
+#if defined(LUAI_PAGEHEAP)
+  freegraystack(g);
+#endif
+  lua_assert(g->cardhash == NULL);  /* freed when leaving minor mode */
 }
 
 
@@ -1524,10 +2837,12 @@ static void atomic (lua_State *L) {
   global_State *g = G(L);
   GCObject *origweak, *origall;
   GCObject *grayagain = g->grayagain;  /* save original list */
+  l_mem marked;
   g->grayagain = NULL;
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(mainthread(g)));
   g->gcstate = GCSatomic;
+  g->gclogeph = 1;  /* log ephemeron entries from now on */
   markobject(g, L);  /* mark running thread */
   /* registry and global metatables may be changed by API */
   markvalue(g, &g->l_registry);
@@ -1544,20 +2859,27 @@ static void atomic (lua_State *L) {
   clearbyvalues(g, g->weak, NULL);
   clearbyvalues(g, g->allweak, NULL);
   origweak = g->weak; origall = g->allweak;
+  marked = g->GCmarked;
   separatetobefnz(g, 0);  /* separate objects to be finalized */
   markbeingfnz(g);  /* mark objects that will be finalized */
   propagateall(g);  /* remark, to propagate 'resurrection' */
-  convergeephemerons(g);
+  if (g->GCmarked != marked)  /* resurrected something? */
+    convergeephemerons(g);
   /* at this point, all resurrected objects are marked. */
   /* remove dead objects from weak tables */
-  clearbykeys(g, g->ephemeron);  /* clear keys from all ephemeron */
+  if (g->gclogeph)
+    clearlogkeys(g);
+  else
+    clearbykeys(g, g->ephemeron);  /* clear keys from all ephemeron */
   clearbykeys(g, g->allweak);  /* clear keys from all 'allweak' */
   /* clear values from resurrected weak tables */
   clearbyvalues(g, g->weak, origweak);
   clearbyvalues(g, g->allweak, origall);
+  g->gclogeph = 0;
+  freeephlog(g);
   luaS_clearcache(g);
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
-  lua_assert(g->gray == NULL);
+  lua_assert(!hasgray(g));
 }
 
 
@@ -1607,7 +2929,7 @@ static l_mem singlestep (lua_State *L, int fast) {
       break;
     }
     case GCSpropagate: {
-      if (fast || g->gray == NULL) {
+      if (fast || !hasgray(g)) {
         g->gcstate = GCSenteratomic;  /* finish propagate phase */
         stepresult = 1;
       }
@@ -1642,17 +2964,17 @@ static l_mem singlestep (lua_State *L, int fast) {
     }
     case GCSswpend: {  /* finish sweeps */
       checkSizes(L, g);
+      endstatcycle(g);
       g->gcstate = GCScallfin;
       stepresult = GCSWEEPMAX;
       break;
     }
     case GCScallfin: {  /* call finalizers */
-      if (g->tobefnz && !g->gcemergency) {
+      if (g->tobefnz && !g->gcemergency && !g->gcdeferfin) {
         g->gcstopem = 0;  /* ok collections during finalizers */
-        GCTM(L);  /* call one finalizer */
-        stepresult = CWUFIN;
+        stepresult = CWUFIN * GCTM(L, GCFINBATCH);  /* call a batch */
       }
-      else {  /* emergency mode or no more finalizers */
+      else {  /* emergency mode, deferred mode, or no more finalizers */
         g->gcstate = GCSpause;  /* finish collection */
         stepresult = step2pause;
       }
@@ -1690,7 +3012,17 @@ static void incstep (lua_State *L, global_State *g) {
   l_mem stepsize = applygcparam(g, STEPSIZE, 100);
   l_mem work2do = applygcparam(g, STEPMUL, stepsize / cast_int(sizeof(void*)));
   l_mem stres;
-  int fast = (work2do == 0);  /* special case: do a full collection */
+  int fast;
+  if (g->GClimit > 0) {  /* memory limit? */
+    l_mem room = g->GClimit - gettotalbytes(g);
+    l_mem quarter = g->GClimit / 4;
+    if (room <= quarter / LIMITSPEEDUP)  /* (almost) at the limit? */
+      work2do = 0;  /* finish the cycle now */
+    else if (room < quarter)  /* do more work as room shrinks */
+      work2do *= quarter / room;
+    stepsize = limitdebt(g, stepsize);
+  }
+  fast = (work2do == 0);  /* special case: do a full collection */
   do {  /* repeat until enough work */
     stres = singlestep(L, fast);  /* perform one single step */
     if (stres == step2minor)  /* returned to minor collections? */
@@ -1711,6 +3043,147 @@ static void incstep (lua_State *L, global_State *g) {
 #define luai_tracegc(L,f)		((void)0)
 #endif
 
+
+/*
+** Clock used to measure collector pauses and time budgets, in
+** nanoseconds. (Only differences between readings matter.)
+*/
+#if !defined(l_gcclock)		/* { */
+
+#if defined(LUA_USE_POSIX)		/* { */
+
+static double l_gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(double, ts.tv_sec) * 1e9 + cast(double, ts.tv_nsec);
+}
+
+#else		/* }{ */
+
+#define l_gcclock()	(cast(double, clock()) * (1e9 / CLOCKS_PER_SEC))
+
+#endif				/* } */
+
+#endif				/* } */
+
+
+/* start of a pause, if recording pauses */
+#define startpause(g)	((g)->gcrecpauses ? l_gcclock() : 0.0)
+
+
+/*
+** Add to the histogram a pause that started at time 't0'.
+*/
+static void endpause (global_State *g, double t0) {
+  if (g->gcrecpauses) {
+    double us = (l_gcclock() - t0) / 1e3;  /* pause in microseconds */
+    int i;
+    if (us < 1)
+      i = 0;
+    else if (us >= cast(double, 1u << (GCPAUSEN - 2)))
+      i = GCPAUSEN - 1;
+    else
+      i = luaO_ceillog2(cast_uint(us) + 1);
+    g->gcpauses[i]++;
+  }
+}
+
+
+/*
+** Start (if 'on') or stop recording pause times. Starting clears the
+** histogram.
+*/
+void luaC_recpauses (lua_State *L, int on) {
+  global_State *g = G(L);
+  if (on) {
+    int i;
+    for (i = 0; i < GCPAUSEN; i++)
+      g->gcpauses[i] = 0;
+  }
+  g->gcrecpauses = cast_byte(on);
+}
+
+
+/*
+** Add to 'bytes' the bytes used by the objects in list 'o', per type
+** (without variant bits).
+*/
+static void censuslist (GCObject *o, lu_mem *bytes) {
+  for (; o != NULL; o = o->next)
+    bytes[novariant(o->tt)] += cast(lu_mem, objsize(o));
+}
+
+
+/*
+** Fill 'bytes' with the bytes used by the objects of each type (without
+** variant bits), with one traversal of all objects.
+*/
+void luaC_census (lua_State *L, lu_mem bytes[LUA_TOTALTYPES]) {
+  global_State *g = G(L);
+  int i;
+  for (i = 0; i < LUA_TOTALTYPES; i++)
+    bytes[i] = 0;
+  censuslist(g->allgc, bytes);
+  censuslist(g->finobj, bytes);
+  censuslist(g->tobefnz, bytes);
+  censuslist(g->fixedgc, bytes);
+}
+
+
+/*
+** Fill 'res' with the four statistics for objects of type 'tt', which
+** use 'bytes'.
+*/
+static void typestats (GCStats *st, int tt, lu_mem bytes, size_t *res) {
+  res[0] = cast_sizet(st->nnew[tt] - st->nfree[tt]);
+  res[1] = cast_sizet(bytes);
+  res[2] = cast_sizet(st->lastfreed[tt]);
+  res[3] = cast_sizet(st->nnew[tt]);
+}
+
+
+/*
+** Fill 'res' with the statistics for objects of type 'tt' (without
+** variant bits): number of objects not yet freed, bytes they use,
+** bytes freed in the last cycle, and number of objects ever created.
+** The bytes in use come from a traversal of all objects, so they cost
+** time proportional to the heap size; the other counters are updated
+** as objects are created and freed. A 'tt' of -1 fills 'res' with
+** the bytes requested by each kind of allocation site, followed by
+** the number of allocations refused by the memory limit, the number
+** of objects waiting for their finalizers, and the number of
+** finalizers called. A 'tt' of -2 fills 'res' with the statistics
+** for all types from 0 to LUA_TPROTO, four entries per type, with a
+** single traversal. Returns the number of entries filled.
+*/
+int luaC_stats (lua_State *L, int tt, size_t *res) {
+  global_State *g = G(L);
+  GCStats *st = &g->gcstats;
+  if (tt == -1) {
+    int i;
+    for (i = 0; i < MEMNSITES; i++)
+      res[i] = cast_sizet(st->sites[i]);
+    res[MEMNSITES] = cast_sizet(st->nrefused);
+    res[MEMNSITES + 1] = cast_sizet(st->npendingfin);
+    res[MEMNSITES + 2] = cast_sizet(st->nfinalized);
+    return MEMNSITES + 3;
+  }
+  else {
+    lu_mem bytes[LUA_TOTALTYPES];
+    luaC_census(L, bytes);
+    if (tt == -2) {  /* all types? */
+      int i;
+      for (i = 0; i <= LUA_TPROTO; i++)
+        typestats(st, i, bytes[i], res + 4 * i);
+      return 4 * (LUA_TPROTO + 1);
+    }
+    lua_assert(0 <= tt && tt < LUA_TOTALTYPES);
+    typestats(st, tt, bytes[tt], res);
+    return 4;
+  }
+}
+
+
 /*
 ** Performs a basic GC step if collector is running. (If collector was
 ** stopped by the user, set a reasonable debt to avoid it being called
@@ -1724,6 +3197,7 @@ void luaC_step (lua_State *L) {
       luaE_setdebt(g, 20000);
   }
   else {
+    double t0 = startpause(g);
     luai_tracegc(L, 1);  /* for internal debugging */
     switch (g->gckind) {
       case KGC_INC: case KGC_GENMAJOR:
@@ -1734,8 +3208,63 @@ void luaC_step (lua_State *L) {
         setminordebt(g);
         break;
     }
+    if (g->strt.old != NULL)  /* resizing the string table? */
+      luaS_rehash(L, GCSTRMOVE);  /* help it */
     luai_tracegc(L, 0);  /* for internal debugging */
+    endpause(g, t0);
+  }
+}
+
+
+/*
+** Work done between checks of the clock in 'luaC_steptime'.
+*/
+#if !defined(GCCLOCKWORK)
+#define GCCLOCKWORK	200
+#endif
+
+
+/*
+** Performs incremental steps until 'budget' nanoseconds have passed
+** or the cycle ends; returns true in the latter case. The clock is
+** read after every GCCLOCKWORK units of work and after indivisible
+** steps (such as the atomic one, which can take longer than any
+** budget). In generational mode, it does a young collection, which
+** is indivisible too.
+*/
+int luaC_steptime (lua_State *L, l_mem budget) {
+  global_State *g = G(L);
+  double t0 = l_gcclock();
+  double deadline = t0 + cast(double, budget);
+  int res = 0;
+  luai_tracegc(L, 1);  /* for internal debugging */
+  if (g->gckind == KGC_GENMINOR) {
+    youngcollection(L, g);
+    setminordebt(g);
+  }
+  else {
+    l_mem work = 0;
+    for (;;) {
+      l_mem stres = singlestep(L, 0);
+      if (stres == step2minor)  /* returned to minor collections? */
+        break;
+      else if (stres == step2pause) {  /* end of cycle? */
+        setpause(g);
+        res = 1;
+        break;
+      }
+      else if (stres == atomicstep || (work += stres) >= GCCLOCKWORK) {
+        work = 0;
+        if (l_gcclock() >= deadline)
+          break;
+      }
+    }
+    if (g->gcstate != GCSpause)
+      luaE_setdebt(g, limitdebt(g, applygcparam(g, STEPSIZE, 100)));
   }
+  luai_tracegc(L, 0);  /* for internal debugging */
+  endpause(g, t0);
+  return res;
 }
 
 
@@ -1764,6 +3293,7 @@ static void fullinc (lua_State *L, global_State *g) {
 */
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
+  double t0 = startpause(g);
   lua_assert(!g->gcemergency);
   g->gcemergency = cast_byte(isemergency);  /* set flag */
   switch (g->gckind) {
@@ -1776,6 +3306,297 @@ void luaC_fullgc (lua_State *L, int isemergency) {
       break;
   }
   g->gcemergency = 0;
+  endpause(g, t0);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Heap snapshots
+** =======================================================
+*/
+
+/*
+** A snapshot starts with a header (SNAPSIGNATURE, SNAPVERSION, and the
+** roots: the registry, the main thread, and the LUA_NUMTYPES basic
+** metatables, 0 for none), followed by one record per object and a
+** final zero byte. A record has the object's tag, id (its address),
+** flags, and size, plus a prefix of the contents for strings, and a
+** list of outgoing edges ended by SEEND. All integers are written as
+** unsigned LEB128 varints.
+*/
+#define SNAPSIGNATURE	"\x1bLuaHeap"
+#define SNAPVERSION	1
+
+/* maximum number of bytes written from the contents of a string */
+#define SNAPSTRMAX	32
+
+/* object flags */
+#define SNAPFIXED	1  /* object is never collected */
+#define SNAPFIN		2  /* object has a finalizer */
+#define SNAPTOBEFNZ	4  /* object is being finalized (so, it is a root) */
+
+/* kinds of edges */
+#define SEEND		0  /* end of edges */
+#define SEREF		1  /* plain reference: target */
+#define SEWEAK		2  /* weak reference: target */
+#define SEFIELD		3  /* field with string key: target, key id */
+#define SEINDEX		4  /* array element, stack slot, etc: target, index */
+#define SEMETA		5  /* metatable: target */
+#define SEUPVAL		6  /* upvalue of a closure: target, index */
+
+#define SNAPBUFFSIZE	512
+
+
+typedef struct SnapState {
+  lua_State *L;
+  lua_Writer writer;
+  void *data;
+  int status;
+  size_t n;  /* number of bytes in 'buff' */
+  char buff[SNAPBUFFSIZE];
+} SnapState;
+
+
+#define snapid(o)	cast_sizet(cast(L_P2I, (o)))
+
+
+static void snapflush (SnapState *S) {
+  if (S->status == 0 && S->n > 0) {
+    lua_unlock(S->L);
+    S->status = (*S->writer)(S->L, S->buff, S->n, S->data);
+    lua_lock(S->L);
+  }
+  S->n = 0;
+}
+
+
+static void snapbyte (SnapState *S, int b) {
+  if (S->n == SNAPBUFFSIZE)
+    snapflush(S);
+  S->buff[S->n++] = cast_char(b);
+}
+
+
+static void snapvarint (SnapState *S, size_t x) {
+  while (x >= 0x80) {
+    snapbyte(S, cast_int(x & 0x7f) | 0x80);
+    x >>= 7;
+  }
+  snapbyte(S, cast_int(x));
+}
+
+
+static void snapedge (SnapState *S, int kind, GCObject *o) {
+  snapbyte(S, kind);
+  snapvarint(S, snapid(o));
+}
+
+
+/* write edge to an object that can be NULL */
+#define snapedgeN(S,kind,t)	{ if (t) snapedge(S, kind, obj2gco(t)); }
+
+
+/* write edge with an extra label */
+static void snapedgelabel (SnapState *S, int kind, GCObject *o,
+                                                 size_t label) {
+  snapedge(S, kind, o);
+  snapvarint(S, label);
+}
+
+
+static void snapvalue (SnapState *S, int kind, const TValue *v) {
+  if (iscollectable(v))
+    snapedge(S, kind, gcvalue(v));
+}
+
+
+static void snapindex (SnapState *S, const TValue *v, size_t i) {
+  if (iscollectable(v))
+    snapedgelabel(S, SEINDEX, gcvalue(v), i);
+}
+
+
+/*
+** Write the edges of a table. Weak references are written as such;
+** values in ephemeron tables are written as strong references, as if
+** their keys were alive.
+*/
+static void snaptable (SnapState *S, Table *h) {
+  global_State *g = G(S->L);
+  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  int kkind = SEREF, vweak = 0;
+  unsigned i;
+  if (mode && ttisshrstring(mode)) {
+    const char *smode = getshrstr(tsvalue(mode));
+    if (strchr(smode, 'k')) kkind = SEWEAK;
+    if (strchr(smode, 'v')) vweak = 1;
+  }
+  snapedgeN(S, SEMETA, h->metatable);
+  if (!istyped(h)) {
+    for (i = 0; i < h->asize; i++) {
+      GCObject *o = gcvalarr(h, i);
+      if (o == NULL) continue;
+      if (vweak) snapedge(S, SEWEAK, o);
+      else snapedgelabel(S, SEINDEX, o, i + 1u);
+    }
+  }
+  if (isshaped(h)) {
+    const Shape *s = getshape(h);
+    for (i = 0; i < s->nkeys; i++) {
+      const TValue *v = gslot(h, i);
+      snapedge(S, SEREF, obj2gco(s->keys[i]));  /* keys are strong */
+      if (!iscollectable(v)) continue;
+      if (vweak) snapedge(S, SEWEAK, gcvalue(v));
+      else snapedgelabel(S, SEFIELD, gcvalue(v), snapid(s->keys[i]));
+    }
+  }
+  else {
+    Node *n, *limit = gnodelast(h);
+    for (n = gnode(h, 0); n < limit; n++) {
+      const TValue *v = gval(n);
+      if (isempty(v)) continue;
+      if (keyiscollectable(n))
+        snapedge(S, kkind, gckey(n));
+      if (!iscollectable(v)) continue;
+      if (vweak)
+        snapedge(S, SEWEAK, gcvalue(v));
+      else if (keyisshrstr(n))
+        snapedgelabel(S, SEFIELD, gcvalue(v), snapid(keystrval(n)));
+      else if (keyisinteger(n) && keyival(n) >= 0)
+        snapedgelabel(S, SEINDEX, gcvalue(v), l_castS2U(keyival(n)));
+      else
+        snapedge(S, SEREF, gcvalue(v));
+    }
+  }
+}
+
+
+static void snapobject (SnapState *S, GCObject *o, int flags) {
+  int i;
+  snapbyte(S, o->tt);
+  snapvarint(S, snapid(o));
+  snapbyte(S, flags);
+  snapvarint(S, cast_sizet(objsize(o)));
+  switch (o->tt) {
+    case LUA_VSHRSTR: case LUA_VLNGSTR: {
+      TString *ts = gco2ts(o);
+      size_t len = tsslen(ts);
+      size_t n = (len < SNAPSTRMAX) ? len : SNAPSTRMAX;
+      const char *s = getstr(ts);
+      snapvarint(S, len);
+      while (n--)
+        snapbyte(S, cast_uchar(*s++));
+      break;
+    }
+    case LUA_VTABLE: {
+      snaptable(S, gco2t(o));
+      break;
+    }
+    case LUA_VUSERDATA: {
+      Udata *u = gco2u(o);
+      snapedgeN(S, SEMETA, u->metatable);
+      for (i = 0; i < u->nuvalue; i++)
+        snapindex(S, &u->uv[i].uv, cast_sizet(i) + 1);
+      break;
+    }
+    case LUA_VLCL: {
+      LClosure *cl = gco2lcl(o);
+      snapedgeN(S, SEREF, cl->p);
+      for (i = 0; i < cl->nupvalues; i++) {
+        if (cl->upvals[i] != NULL)
+          snapedgelabel(S, SEUPVAL, obj2gco(cl->upvals[i]),
+                                    cast_sizet(i) + 1);
+      }
+      break;
+    }
+    case LUA_VCCL: {
+      CClosure *cl = gco2ccl(o);
+      for (i = 0; i < cl->nupvalues; i++) {
+        if (iscollectable(&cl->upvalue[i]))
+          snapedgelabel(S, SEUPVAL, gcvalue(&cl->upvalue[i]),
+                                    cast_sizet(i) + 1);
+      }
+      break;
+    }
+    case LUA_VUPVAL: {
+      snapvalue(S, SEREF, gco2upv(o)->v.p);
+      break;
+    }
+    case LUA_VPROTO: {
+      Proto *f = gco2p(o);
+      snapedgeN(S, SEREF, f->source);
+      for (i = 0; i < f->sizek; i++)
+        snapvalue(S, SEREF, &f->k[i]);
+      for (i = 0; i < f->sizeupvalues; i++)
+        snapedgeN(S, SEREF, f->upvalues[i].name);
+      for (i = 0; i < f->sizep; i++)
+        snapedgeN(S, SEREF, f->p[i]);
+      for (i = 0; i < f->sizelocvars; i++)
+        snapedgeN(S, SEREF, f->locvars[i].varname);
+      break;
+    }
+    case LUA_VTHREAD: {
+      lua_State *th = gco2th(o);
+      UpVal *uv;
+      StkId p;
+      if (th->stack.p == NULL)
+        break;  /* stack not completely built yet */
+      for (p = th->stack.p; p < th->top.p; p++)
+        snapindex(S, s2v(p), cast_sizet(p - th->stack.p) + 1);
+      for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+        snapedge(S, SEREF, obj2gco(uv));
+      break;
+    }
+    default: lua_assert(0);
+  }
+  snapbyte(S, SEEND);
+}
+
+
+static void snaplist (SnapState *S, GCObject *o, int flags) {
+  global_State *g = G(S->L);
+  for (; o != NULL && S->status == 0; o = o->next) {
+    if (!isdead(g, o))  /* skip garbage not yet swept */
+      snapobject(S, o, flags);
+  }
+}
+
+
+/*
+** Write a snapshot of the heap through 'writer'. Objects already found
+** dead by the collector are not written. The collector is kept stopped
+** during the traversal, so the writer must not raise errors. Returns
+** the first non-zero status returned by the writer, or 0.
+*/
+int luaC_snapshot (lua_State *L, lua_Writer writer, void *data) {
+  global_State *g = G(L);
+  lu_byte oldstp = g->gcstp;
+  lu_byte oldstopem = g->gcstopem;
+  SnapState S;
+  int i;
+  S.L = L; S.writer = writer; S.data = data;
+  S.status = 0; S.n = 0;
+  g->gcstp |= GCSTPGC;  /* avoid GC steps while writing */
+  g->gcstopem = 1;  /* also emergency collections */
+  for (i = 0; SNAPSIGNATURE[i] != '\0'; i++)
+    snapbyte(&S, cast_uchar(SNAPSIGNATURE[i]));
+  snapbyte(&S, SNAPVERSION);
+  snapvarint(&S, snapid(gcvalue(&g->l_registry)));
+  snapvarint(&S, snapid(mainthread(g)));
+  for (i = 0; i < LUA_NUMTYPES; i++)
+    snapvarint(&S, (g->mt[i] == NULL) ? 0 : snapid(g->mt[i]));
+  snaplist(&S, g->allgc, 0);
+  snaplist(&S, g->finobj, SNAPFIN);
+  snaplist(&S, g->tobefnz, SNAPFIN | SNAPTOBEFNZ);
+  snaplist(&S, g->fixedgc, SNAPFIXED);
+  snapbyte(&S, 0);  /* end of records */
+  snapflush(&S);
+  g->gcstp = oldstp;
+  g->gcstopem = oldstopem;
+  return S.status;
 }
 
 /* }====================================================== */
@@ -11,6 +11,7 @@
 #include <stddef.h>
 
 
+#include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
 
@@ -88,20 +89,43 @@
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
 
 
-#define iswhite(x)      testbits((x)->marked, WHITEBITS)
-#define isblack(x)      testbit((x)->marked, BLACKBIT)
+#if defined(LUAI_PAGEHEAP)
+
+/*
+** Objects living in pages keep their colors in the side map of their
+** page, so that marking does not write into the objects themselves.
+** Their 'marked' fields keep the age and the other bits, plus both
+** white bits ('PAGEMARK'), a combination that is never a valid color.
+*/
+#define PAGEMARK	WHITEBITS
+
+#define inpage(x)	(((x)->marked & PAGEMARK) == PAGEMARK)
+
+/* byte with the color bits of object 'x' */
+#define gcmarks(x)  \
+	(*(inpage(x) ? &luaM_pagecolors(x) : &(x)->marked))
+
+#else
+
+#define gcmarks(x)	((x)->marked)
+
+#endif
+
+
+#define iswhite(x)      testbits(gcmarks(x), WHITEBITS)
+#define isblack(x)      testbit(gcmarks(x), BLACKBIT)
 #define isgray(x)  /* neither white nor black */  \
-	(!testbits((x)->marked, WHITEBITS | bitmask(BLACKBIT)))
+	(!testbits(gcmarks(x), WHITEBITS | bitmask(BLACKBIT)))
 
 #define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
 
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	((m) & (ow))
-#define isdead(g,v)	isdeadm(otherwhite(g), (v)->marked)
+#define isdead(g,v)	isdeadm(otherwhite(g), gcmarks(v))
 
-#define changewhite(x)	((x)->marked ^= WHITEBITS)
+#define changewhite(x)	(gcmarks(x) ^= WHITEBITS)
 #define nw2black(x)  \
-	check_exp(!iswhite(x), l_setbit((x)->marked, BLACKBIT))
+	check_exp(!iswhite(x), l_setbit(gcmarks(x), BLACKBIT))
 
 #define luaC_white(g)	cast_byte((g)->currentwhite & WHITEBITS)
 
@@ -184,6 +208,12 @@
 */
 #define LUAI_GENMINORMUL         20
 
+/*
+** ... but not before creating LUAI_GENNURSERY Kbytes. (That size keeps
+** minor collections from being too frequent when the heap is small.)
+*/
+#define LUAI_GENNURSERY         64
+
 
 /* incremental */
 
@@ -251,6 +281,29 @@
 #define luaC_barrierback(L,p,v) (  \
 	iscollectable(v) ? luaC_objbarrierback(L, p, gcvalue(v)) : cast_void(0))
 
+/*
+** Barriers for a write of value 'v' into the entry with key 'k' (or
+** integer key 'i') of table 't'. Large tables use the key to mark only
+** the card of that entry (see 'luaC_barriertable_').
+*/
+#define luaC_barriertable(L,t,k,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ? \
+	luaC_barriertable_(L,t,k) : cast_void(0))
+
+#define luaC_barriertablei(L,t,i,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ? \
+	luaC_barriertablei_(L,t,i) : cast_void(0))
+
+/*
+** A black touched table may be using cards, which track writes by
+** position. When entries move inside such a table, it goes back to
+** gray, to be traversed entirely.
+*/
+#define luaC_tablemoved(t)  \
+	((isblack(t) && getage(t) >= G_TOUCHED1) ? \
+	 (resetbit(gcmarks(t), BLACKBIT), setage(t, G_TOUCHED1)) : \
+	 cast_void(0))
+
 LUAI_FUNC void luaC_fix (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
@@ -261,8 +314,25 @@ LUAI_FUNC GCObject *luaC_newobjdt (lua_State *L, lu_byte tt, size_t sz,
                                                  size_t offset);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, GCObject *o);
+LUAI_FUNC void luaC_barriertable_ (lua_State *L, Table *t,
+                                                 const TValue *key);
+LUAI_FUNC void luaC_barriertablei_ (lua_State *L, Table *t, lua_Integer i);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_changemode (lua_State *L, int newmode);
+LUAI_FUNC int luaC_gcthreads (lua_State *L, int n);
+LUAI_FUNC int luaC_bgfree (lua_State *L, int on);
+LUAI_FUNC int luaC_steptime (lua_State *L, l_mem budget);
+LUAI_FUNC void luaC_recpauses (lua_State *L, int on);
+LUAI_FUNC void luaC_census (lua_State *L, lu_mem bytes[LUA_TOTALTYPES]);
+LUAI_FUNC int luaC_stats (lua_State *L, int tt, size_t *res);
+LUAI_FUNC int luaC_runfinalizers (lua_State *L, int n);
+LUAI_FUNC int luaC_deferfinalizers (lua_State *L, int on);
+LUAI_FUNC int luaC_snapshot (lua_State *L, lua_Writer writer, void *data);
+#if defined(LUA_USE_GCTHREADS)
+LUAI_FUNC int luaC_deferfree (global_State *g, void *block, size_t osize);
+#else
+#define luaC_deferfree(g,b,s)	0
+#endif
 
 
 #endif
@@ -0,0 +1,987 @@
+/*
+** $Id: ljit.c $
+** Baseline compiler to native code
+** See Copyright Notice in lua.h
+*/
+
+#define ljit_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include "lua.h"
+
+#if defined(LUA_USE_JIT)
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lfunc.h"
+#include "ljit.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "ltable.h"
+
+
+/*
+** The compiler translates each instruction of a prototype into a
+** template of x86-64 code that does the fast path of the instruction.
+** Whenever the native code finds something it does not handle (a
+** call, a metamethod, an allocation, a type it does not expect, etc.),
+** it returns to the interpreter, which redoes that instruction and goes
+** on. The interpreter reenters the native code at function entries,
+** returns, and backward jumps.
+**
+** The native code of a prototype is a single function
+**   int f (StkId base, UpVal **upvals, volatile l_signalT *hookmask,
+**          const unsigned char *start);
+** that jumps to 'start' (the code of some instruction) and returns the
+** index of the instruction where the interpreter must continue. While
+** it runs, 'rbx' holds 'base', 'r12' holds 'upvals', and 'r13' holds
+** 'hookmask'.
+**
+** Native code never calls Lua functions or anything that can raise
+** errors, yield, run the garbage collector, or reallocate the stack;
+** so, it does not need 'savedpc' nor barriers. The interpreter only
+** enters it when there are no hooks, and backward jumps check
+** 'hookmask' so that a signal can stop a loop.
+*/
+
+typedef int (*JitFunction) (StkId base, UpVal **upvals,
+                            volatile l_signalT *hookmask,
+                            const unsigned char *start);
+
+
+/* registers */
+#define RAX	0
+#define RCX	1
+#define RDX	2
+#define RBX	3
+#define RSI	6
+#define RDI	7
+#define R12	12
+#define R13	13
+
+/* condition codes */
+#define CC_P	0xA  /* parity (unordered floats) */
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_AE	0x3
+#define CC_A	0x7
+#define CC_L	0xC
+#define CC_GE	0xD
+#define CC_LE	0xE
+#define CC_G	0xF
+
+/* size of the code that leaves the native code at a given instruction */
+#define STUBSIZE	10
+
+/* mark in 'label' for instructions that always go to the interpreter */
+#define EXITONLY	0x80000000u
+
+/* offset of the prologue and of the epilogue */
+#define PROLOGUE	0
+#define EPILOGUE	16
+
+
+/* displacements of register 'r' and of its value and tag */
+#define RS(r)	(cast_int(sizeof(StackValue)) * (r))
+#define RV(r)	(cast_int(sizeof(StackValue)) * (r) + \
+                 cast_int(offsetof(TValue, value_)))
+#define RT(r)	(cast_int(sizeof(StackValue)) * (r) + \
+                 cast_int(offsetof(TValue, tt_)))
+
+/* displacements of the value and of the tag in a TValue */
+#define VV	cast_int(offsetof(TValue, value_))
+#define VT	cast_int(offsetof(TValue, tt_))
+
+#define TINT	LUA_VNUMINT
+#define TFLT	LUA_VNUMFLT
+#define TTAB	ctb(LUA_VTABLE)
+
+
+/*
+** The compiler runs three passes over the code: the first one only
+** computes the size of the code, the second computes the offset of
+** each instruction, and the third writes the code.
+*/
+typedef struct JitState {
+  const Proto *p;
+  unsigned char *code;  /* where to write the code (NULL if not writing) */
+  unsigned int *label;  /* offset of each instruction (NULL in 1st pass) */
+  unsigned int pos;  /* current offset */
+  unsigned int stubs;  /* offset of the first exit stub */
+} JitState;
+
+
+/*
+** {======================================================
+** Assembler
+** =======================================================
+*/
+
+static void emitb (JitState *J, int b) {
+  if (J->code != NULL)
+    J->code[J->pos] = cast_byte(b);
+  J->pos++;
+}
+
+
+static void emit32 (JitState *J, l_uint32 x) {
+  int i;
+  for (i = 0; i < 4; i++, x >>= 8)
+    emitb(J, cast_int(x & 0xFF));
+}
+
+
+static void emit64 (JitState *J, lua_Unsigned x) {
+  emit32(J, cast(l_uint32, x & 0xFFFFFFFFu));
+  emit32(J, cast(l_uint32, x >> 32));
+}
+
+
+/*
+** Emit optional prefix, REX prefix (when needed), and opcode (one or
+** two bytes).
+*/
+static void opcode (JitState *J, int pfx, int w, int opc, int reg, int rm) {
+  int rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+  if (pfx != 0)
+    emitb(J, pfx);
+  if (rex != 0x40)
+    emitb(J, rex);
+  if (opc > 0xFF)
+    emitb(J, opc >> 8);
+  emitb(J, opc & 0xFF);
+}
+
+
+/* instruction with a memory operand '[base + disp]' */
+static void opm (JitState *J, int pfx, int w, int opc,
+                              int reg, int base, int disp) {
+  opcode(J, pfx, w, opc, reg, base);
+  emitb(J, 0x80 | ((reg & 7) << 3) | (base & 7));  /* disp32 */
+  if ((base & 7) == 4)  /* rsp or r12? */
+    emitb(J, 0x24);  /* needs a SIB byte */
+  emit32(J, cast(l_uint32, disp));
+}
+
+
+/* instruction with register operands */
+static void opr (JitState *J, int pfx, int w, int opc, int reg, int rm) {
+  opcode(J, pfx, w, opc, reg, rm);
+  emitb(J, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* mov reg, imm64 */
+static void movimm (JitState *J, int reg, lua_Unsigned x) {
+  opcode(J, 0, 1, 0xB8 + (reg & 7), 0, reg);
+  emit64(J, x);
+}
+
+
+/* jump to offset 'target' ('cc' < 0 means an unconditional jump) */
+static void jumpto (JitState *J, int cc, unsigned int target) {
+  if (cc < 0)
+    emitb(J, 0xE9);
+  else {
+    emitb(J, 0x0F);
+    emitb(J, 0x80 | cc);
+  }
+  emit32(J, cast(l_uint32, target - (J->pos + 4)));
+}
+
+
+/* forward jump inside a template; returns the position to be fixed */
+static unsigned int jumpfwd (JitState *J, int cc) {
+  jumpto(J, cc, J->pos);
+  return J->pos - 4;
+}
+
+
+/* fix a forward jump to the current position */
+static void fixfwd (JitState *J, unsigned int p) {
+  if (J->code != NULL) {
+    l_uint32 d = cast(l_uint32, J->pos - (p + 4));
+    memcpy(J->code + p, &d, sizeof(d));
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Templates
+** =======================================================
+*/
+
+/* offset of the code for instruction 'pc' */
+static unsigned int label (JitState *J, int pc) {
+  return (J->label != NULL) ? J->label[pc] & ~EXITONLY : 0;
+}
+
+
+/* jump to the code of instruction 'pc' */
+static void jumppc (JitState *J, int cc, int pc) {
+  jumpto(J, cc, label(J, pc));
+}
+
+
+/* leave the native code to continue in instruction 'pc' */
+static void jumpexit (JitState *J, int cc, int pc) {
+  jumpto(J, cc, J->stubs + cast_uint(pc) * STUBSIZE);
+}
+
+
+static void guardtag (JitState *J, int r, int tag, int pc) {
+  opm(J, 0, 0, 0x80, 7, RBX, RT(r));  /* cmp byte [r.tt], tag */
+  emitb(J, tag);
+  jumpexit(J, CC_NE, pc);
+}
+
+
+/* jump to the returned position if tag of 'r' is not 'tag' */
+static unsigned int testtag (JitState *J, int r, int tag) {
+  opm(J, 0, 0, 0x80, 7, RBX, RT(r));  /* cmp byte [r.tt], tag */
+  emitb(J, tag);
+  return jumpfwd(J, CC_NE);
+}
+
+
+static void settag (JitState *J, int r, int tag) {
+  opm(J, 0, 0, 0xC6, 0, RBX, RT(r));  /* mov byte [r.tt], tag */
+  emitb(J, tag);
+}
+
+
+static void loadv (JitState *J, int reg, int r) {
+  opm(J, 0, 1, 0x8B, reg, RBX, RV(r));
+}
+
+
+static void storev (JitState *J, int reg, int r) {
+  opm(J, 0, 1, 0x89, reg, RBX, RV(r));
+}
+
+
+/* copy TValue at '[reg]' to register 'r' (uses 'rcx') */
+static void copyfrom (JitState *J, int r, int reg) {
+  opm(J, 0, 1, 0x8B, RCX, reg, VV);
+  storev(J, RCX, r);
+  opm(J, 0, 0, 0x0FB6, RCX, reg, VT);  /* movzx ecx, byte [reg.tt] */
+  opm(J, 0, 0, 0x88, RCX, RBX, RT(r));
+}
+
+
+/* 'rax' = address of TValue of upvalue 'n' */
+static void upvalue (JitState *J, int n) {
+  opm(J, 0, 1, 0x8B, RAX, R12, n * cast_int(sizeof(UpVal *)));
+  opm(J, 0, 1, 0x8B, RAX, RAX, cast_int(offsetof(UpVal, v)));
+}
+
+
+/* load a float constant into 'xmm1' */
+static void loadfltk (JitState *J, lua_Number n) {
+  lua_Unsigned u;
+  memcpy(&u, &n, sizeof(u));
+  movimm(J, RAX, u);
+  opr(J, 0x66, 1, 0x0F6E, 1, RAX);  /* movq xmm1, rax */
+}
+
+
+/* store 'rax' as an integer or 'xmm0' as a float into register 'r' */
+static void storeint (JitState *J, int r) {
+  storev(J, RAX, r);
+  settag(J, r, TINT);
+}
+
+static void storeflt (JitState *J, int r) {
+  opm(J, 0xF2, 0, 0x0F11, 0, RBX, RV(r));  /* movsd [r], xmm0 */
+  settag(J, r, TFLT);
+}
+
+
+/* jumps to the two returned positions if register 'r' is false */
+static void testfalse (JitState *J, int r, unsigned int fix[2]) {
+  opm(J, 0, 0, 0x0FB6, RAX, RBX, RT(r));  /* movzx eax, byte [r.tt] */
+  emitb(J, 0xA8); emitb(J, 0x0F);  /* test al, 0x0F */
+  fix[0] = jumpfwd(J, CC_E);  /* nil */
+  emitb(J, 0x3C); emitb(J, LUA_VFALSE);  /* cmp al, LUA_VFALSE */
+  fix[1] = jumpfwd(J, CC_E);  /* false */
+}
+
+
+/* check for pending hooks before jumping back to instruction 'pc' */
+static void checkhooks (JitState *J, int pc) {
+  opm(J, 0, 0, 0x83, 7, R13, 0);  /* cmp dword [hookmask], 0 */
+  emitb(J, 0);
+  jumpexit(J, CC_NE, pc);
+}
+
+
+/*
+** Conditional jump of a test at 'pc': when condition 'cc' holds,
+** 'cond' is true. A true 'nanfalse' means that unordered floats make
+** the condition false.
+*/
+static void branch (JitState *J, int pc, int cc, int nanfalse) {
+  int k = GETARG_k(J->p->code[pc]);
+  int t = k ? pc + 1 : pc + 2;  /* target when 'cond' is true */
+  int f = k ? pc + 2 : pc + 1;  /* target when 'cond' is false */
+  if (nanfalse)
+    jumppc(J, CC_P, f);
+  jumppc(J, cc, t);
+  jumppc(J, -1, f);
+}
+
+
+/* operations: integer opcode (reg, r/m) and float opcode */
+typedef struct ArithOp {
+  int iop;  /* 0 if there is no integer operation */
+  int fop;  /* 0 if there is no float operation */
+} ArithOp;
+
+static const ArithOp arithops[] = {
+  {0x03, 0x0F58},  /* add */
+  {0x2B, 0x0F5C},  /* sub */
+  {0x0FAF, 0x0F59},  /* mul */
+  {0, 0x0F5E},  /* div */
+  {0x23, 0},  /* band */
+  {0x0B, 0},  /* bor */
+  {0x33, 0}  /* bxor */
+};
+
+enum { AADD, ASUB, AMUL, ADIV, ABAND, ABOR, ABXOR };
+
+
+/*
+** Arithmetic with register operands, skipping the following MMBIN
+** instruction.
+*/
+static void arithRR (JitState *J, int pc, int op, int a, int b, int c) {
+  const ArithOp *o = &arithops[op];
+  if (o->iop != 0) {
+    unsigned int f1 = testtag(J, b, TINT);
+    unsigned int f2 = testtag(J, c, TINT);
+    loadv(J, RAX, b);
+    opm(J, 0, 1, o->iop, RAX, RBX, RV(c));
+    storeint(J, a);
+    jumppc(J, -1, pc + 2);
+    fixfwd(J, f1);
+    fixfwd(J, f2);
+  }
+  if (o->fop != 0) {
+    guardtag(J, b, TFLT, pc);
+    guardtag(J, c, TFLT, pc);
+    opm(J, 0xF2, 0, 0x0F10, 0, RBX, RV(b));  /* movsd xmm0, [b] */
+    opm(J, 0xF2, 0, o->fop, 0, RBX, RV(c));
+    storeflt(J, a);
+    jumppc(J, -1, pc + 2);
+  }
+  else
+    jumpexit(J, -1, pc);
+}
+
+
+/*
+** Arithmetic with a numeric constant 'kv', skipping the following
+** MMBIN instruction.
+*/
+static void arithRK (JitState *J, int pc, int op, int a, int b,
+                                 const TValue *kv) {
+  const ArithOp *o = &arithops[op];
+  if (ttisinteger(kv) && o->iop != 0) {
+    unsigned int f = testtag(J, b, TINT);
+    loadv(J, RAX, b);
+    movimm(J, RCX, l_castS2U(ivalue(kv)));
+    opr(J, 0, 1, o->iop, RAX, RCX);
+    storeint(J, a);
+    jumppc(J, -1, pc + 2);
+    fixfwd(J, f);
+  }
+  if (o->fop != 0) {
+    guardtag(J, b, TFLT, pc);
+    loadfltk(J, ttisinteger(kv) ? cast_num(ivalue(kv)) : fltvalue(kv));
+    opm(J, 0xF2, 0, 0x0F10, 0, RBX, RV(b));  /* movsd xmm0, [b] */
+    opr(J, 0xF2, 0, o->fop, 0, 1);  /* op xmm0, xmm1 */
+    storeflt(J, a);
+    jumppc(J, -1, pc + 2);
+  }
+  else
+    jumpexit(J, -1, pc);
+}
+
+
+/*
+** Order comparison of two registers: 'icc' is the integer condition;
+** 'fcc' is the float condition after comparing 'b' with 'a'.
+*/
+static void orderRR (JitState *J, int pc, int a, int b, int icc, int fcc) {
+  unsigned int f1 = testtag(J, a, TINT);
+  unsigned int f2 = testtag(J, b, TINT);
+  loadv(J, RAX, a);
+  opm(J, 0, 1, 0x3B, RAX, RBX, RV(b));  /* cmp rax, [b] */
+  branch(J, pc, icc, 0);
+  fixfwd(J, f1);
+  fixfwd(J, f2);
+  guardtag(J, a, TFLT, pc);
+  guardtag(J, b, TFLT, pc);
+  opm(J, 0xF2, 0, 0x0F10, 0, RBX, RV(b));  /* movsd xmm0, [b] */
+  opm(J, 0x66, 0, 0x0F2E, 0, RBX, RV(a));  /* ucomisd xmm0, [a] */
+  branch(J, pc, fcc, 0);
+}
+
+
+/*
+** Comparison of a register with an immediate: 'icc' is the integer
+** condition; 'fcc' is the float condition after comparing the two
+** operands, in the order given by 'swap'.
+*/
+static void orderRI (JitState *J, int pc, int a, int im,
+                                 int icc, int fcc, int swap) {
+  unsigned int f = testtag(J, a, TINT);
+  opm(J, 0, 1, 0x81, 7, RBX, RV(a));  /* cmp qword [a], im */
+  emit32(J, cast(l_uint32, im));
+  branch(J, pc, icc, 0);
+  fixfwd(J, f);
+  guardtag(J, a, TFLT, pc);
+  loadfltk(J, cast_num(im));
+  opm(J, 0xF2, 0, 0x0F10, 0, RBX, RV(a));  /* movsd xmm0, [a] */
+  if (swap)
+    opr(J, 0x66, 0, 0x0F2E, 1, 0);  /* ucomisd xmm1, xmm0 */
+  else
+    opr(J, 0x66, 0, 0x0F2E, 0, 1);  /* ucomisd xmm0, xmm1 */
+  branch(J, pc, fcc, 0);
+}
+
+
+/* equality between register 'a' and constant 'kv' */
+static void equalRK (JitState *J, int pc, int a, const TValue *kv) {
+  int k = GETARG_k(J->p->code[pc]);
+  int f = k ? pc + 2 : pc + 1;  /* target when not equal */
+  switch (ttypetag(kv)) {
+    case LUA_VNUMINT: case LUA_VNUMFLT: {
+      int other = ttisinteger(kv) ? TFLT : TINT;
+      unsigned int fo = testtag(J, a, ttypetag(kv));
+      if (ttisinteger(kv)) {
+        movimm(J, RAX, l_castS2U(ivalue(kv)));
+        opm(J, 0, 1, 0x3B, RAX, RBX, RV(a));  /* cmp rax, [a] */
+        branch(J, pc, CC_E, 0);
+      }
+      else {
+        loadfltk(J, fltvalue(kv));
+        opm(J, 0x66, 0, 0x0F2E, 1, RBX, RV(a));  /* ucomisd xmm1, [a] */
+        branch(J, pc, CC_E, 1);
+      }
+      fixfwd(J, fo);
+      opm(J, 0, 0, 0x80, 7, RBX, RT(a));  /* cmp byte [a.tt], other */
+      emitb(J, other);
+      jumpexit(J, CC_E, pc);  /* let the interpreter compare mixed numbers */
+      jumppc(J, -1, f);  /* other types cannot be equal to a number */
+      break;
+    }
+    case LUA_VSHRSTR: {
+      unsigned int fo = testtag(J, a, ctb(LUA_VSHRSTR));
+      movimm(J, RAX, cast(lua_Unsigned, cast(L_P2I, tsvalue(kv))));
+      opm(J, 0, 1, 0x3B, RAX, RBX, RV(a));  /* cmp rax, [a] */
+      branch(J, pc, CC_E, 0);
+      fixfwd(J, fo);
+      jumppc(J, -1, f);
+      break;
+    }
+    default: {
+      if (iscollectable(kv))  /* long string? */
+        jumpexit(J, -1, pc);
+      else {  /* nil or boolean: tags are enough */
+        opm(J, 0, 0, 0x80, 7, RBX, RT(a));  /* cmp byte [a.tt], tag */
+        emitb(J, ttypetag(kv));
+        branch(J, pc, CC_E, 0);
+      }
+      break;
+    }
+  }
+}
+
+
+/*
+** Table access 'R[a] := t[key]', with 't' in 'rdi' and the key in 'rsi',
+** through function 'get' ('luaH_getint' or 'luaH_getshortstr'). These
+** functions do not change the result when the key is absent, so in that
+** case the interpreter can redo the whole instruction.
+*/
+static void tableget (JitState *J, int pc, int a, L_P2I get) {
+  opm(J, 0, 1, 0x8D, RDX, RBX, RS(a));  /* lea rdx, [a] */
+  movimm(J, RAX, cast(lua_Unsigned, get));
+  emitb(J, 0xFF); emitb(J, 0xD0);  /* call rax */
+  emitb(J, 0xA8); emitb(J, 0x0F);  /* test al, 0x0F */
+  jumpexit(J, CC_E, pc);  /* empty result? */
+}
+
+
+/* 'rdi' := table in register 'r' */
+static void loadtable (JitState *J, int pc, int r) {
+  guardtag(J, r, TTAB, pc);
+  loadv(J, RDI, r);
+}
+
+
+/*
+** Table update 't[key] = v', with 't' in 'rdi' and the key in 'rsi',
+** through function 'pset' ('luaH_pseti' or 'luaH_psetshortstr'). The
+** value comes from operand 'C' of the instruction. Only values that
+** are not collectable are handled here, as they need no barriers.
+** Returns 0 if the instruction always goes to the interpreter.
+*/
+static int tableset (JitState *J, int pc, L_P2I pset) {
+  Instruction i = J->p->code[pc];
+  int c = GETARG_C(i);
+  if (GETARG_k(i)) {  /* constant value? */
+    const TValue *kv = &J->p->k[c];
+    if (iscollectable(kv)) {
+      jumpexit(J, -1, pc);
+      return 0;
+    }
+    movimm(J, RDX, cast(lua_Unsigned, cast(L_P2I, kv)));
+  }
+  else {
+    opm(J, 0, 0, 0xF6, 0, RBX, RT(c));  /* test byte [c.tt], ... */
+    emitb(J, BIT_ISCOLLECTABLE);
+    jumpexit(J, CC_NE, pc);
+    opm(J, 0, 1, 0x8D, RDX, RBX, RS(c));  /* lea rdx, [c] */
+  }
+  movimm(J, RAX, cast(lua_Unsigned, pset));
+  emitb(J, 0xFF); emitb(J, 0xD0);  /* call rax */
+  opr(J, 0, 0, 0x85, RAX, RAX);  /* test eax, eax */
+  jumpexit(J, CC_NE, pc);  /* not HOK? */
+  return 1;
+}
+
+
+/*
+** Generate the template for instruction 'pc'. Returns 0 if it always
+** goes to the interpreter.
+*/
+static int instruction (JitState *J, int pc) {
+  const Proto *p = J->p;
+  Instruction i = p->code[pc];
+  int a = GETARG_A(i);
+  switch (GET_BASEOP(i)) {
+    case OP_MOVE: {
+      int b = GETARG_B(i);
+      loadv(J, RAX, b);
+      storev(J, RAX, a);
+      opm(J, 0, 0, 0x0FB6, RAX, RBX, RT(b));  /* movzx eax, byte [b.tt] */
+      opm(J, 0, 0, 0x88, RAX, RBX, RT(a));  /* mov [a.tt], al */
+      break;
+    }
+    case OP_LOADI: {
+      opm(J, 0, 1, 0xC7, 0, RBX, RV(a));  /* mov qword [a], imm32 */
+      emit32(J, cast(l_uint32, GETARG_sBx(i)));
+      settag(J, a, TINT);
+      break;
+    }
+    case OP_LOADF: {
+      lua_Number n = cast_num(GETARG_sBx(i));
+      lua_Unsigned u;
+      memcpy(&u, &n, sizeof(u));
+      movimm(J, RAX, u);
+      storev(J, RAX, a);
+      settag(J, a, TFLT);
+      break;
+    }
+    case OP_LOADK: {
+      const TValue *kv = &p->k[GETARG_Bx(i)];
+      lua_Unsigned u;
+      memcpy(&u, &kv->value_, sizeof(u));  /* raw value */
+      movimm(J, RAX, u);
+      storev(J, RAX, a);
+      settag(J, a, rawtt(kv));
+      break;
+    }
+    case OP_LOADFALSE: {
+      settag(J, a, LUA_VFALSE);
+      break;
+    }
+    case OP_LFALSESKIP: {
+      settag(J, a, LUA_VFALSE);
+      jumppc(J, -1, pc + 2);
+      break;
+    }
+    case OP_LOADTRUE: {
+      settag(J, a, LUA_VTRUE);
+      break;
+    }
+    case OP_LOADNIL: {
+      int b = GETARG_B(i);
+      do {
+        settag(J, a++, LUA_VNIL);
+      } while (b--);
+      break;
+    }
+    case OP_GETUPVAL: {
+      upvalue(J, GETARG_B(i));
+      copyfrom(J, a, RAX);
+      break;
+    }
+    case OP_SETUPVAL: {
+      opm(J, 0, 0, 0x0FB6, RCX, RBX, RT(a));  /* movzx ecx, byte [a.tt] */
+      opr(J, 0, 0, 0xF6, 0, RCX);  /* test cl, BIT_ISCOLLECTABLE */
+      emitb(J, BIT_ISCOLLECTABLE);
+      jumpexit(J, CC_NE, pc);  /* collectable values need a barrier */
+      upvalue(J, GETARG_B(i));
+      loadv(J, RDX, a);
+      opm(J, 0, 1, 0x89, RDX, RAX, VV);
+      opm(J, 0, 0, 0x88, RCX, RAX, VT);
+      break;
+    }
+    case OP_GETTABUP: {
+      upvalue(J, GETARG_B(i));
+      opm(J, 0, 0, 0x80, 7, RAX, VT);  /* cmp byte [rax.tt], TTAB */
+      emitb(J, TTAB);
+      jumpexit(J, CC_NE, pc);
+      opm(J, 0, 1, 0x8B, RDI, RAX, VV);
+      movimm(J, RSI, cast(lua_Unsigned,
+                          cast(L_P2I, tsvalue(&p->k[GETARG_C(i)]))));
+      tableget(J, pc, a, cast(L_P2I, luaH_getshortstr));
+      break;
+    }
+    case OP_GETTABLE: {
+      int c = GETARG_C(i);
+      guardtag(J, c, TINT, pc);
+      loadtable(J, pc, GETARG_B(i));
+      loadv(J, RSI, c);
+      tableget(J, pc, a, cast(L_P2I, luaH_getint));
+      break;
+    }
+    case OP_GETI: {
+      loadtable(J, pc, GETARG_B(i));
+      movimm(J, RSI, cast(lua_Unsigned, GETARG_C(i)));
+      tableget(J, pc, a, cast(L_P2I, luaH_getint));
+      break;
+    }
+    case OP_GETFIELD: {
+      loadtable(J, pc, GETARG_B(i));
+      movimm(J, RSI, cast(lua_Unsigned,
+                          cast(L_P2I, tsvalue(&p->k[GETARG_C(i)]))));
+      tableget(J, pc, a, cast(L_P2I, luaH_getshortstr));
+      break;
+    }
+    case OP_ADDI: {
+      TValue kv;
+      setivalue(&kv, GETARG_sC(i));
+      arithRK(J, pc, AADD, a, GETARG_B(i), &kv);
+      break;
+    }
+    case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_DIVK:
+    case OP_BANDK: case OP_BORK: case OP_BXORK: {
+      static const int ops[] = {AADD, ASUB, AMUL, -1, -1, ADIV, -1,
+                                ABAND, ABOR, ABXOR};
+      const TValue *kv = &p->k[GETARG_C(i)];
+      int op = ops[GET_BASEOP(i) - OP_ADDK];
+      if (!ttisnumber(kv))  /* should not happen */
+        jumpexit(J, -1, pc);
+      else
+        arithRK(J, pc, op, a, GETARG_B(i), kv);
+      break;
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+    case OP_BAND: case OP_BOR: case OP_BXOR: {
+      static const int ops[] = {AADD, ASUB, AMUL, -1, -1, ADIV, -1,
+                                ABAND, ABOR, ABXOR};
+      int op = ops[GET_BASEOP(i) - OP_ADD];
+      arithRR(J, pc, op, a, GETARG_B(i), GETARG_C(i));
+      break;
+    }
+    case OP_UNM: {
+      int b = GETARG_B(i);
+      unsigned int f = testtag(J, b, TINT);
+      loadv(J, RAX, b);
+      opr(J, 0, 1, 0xF7, 3, RAX);  /* neg rax */
+      storeint(J, a);
+      jumppc(J, -1, pc + 1);
+      fixfwd(J, f);
+      guardtag(J, b, TFLT, pc);
+      loadv(J, RAX, b);
+      movimm(J, RCX, cast(lua_Unsigned, 1) << 63);
+      opr(J, 0, 1, 0x33, RAX, RCX);  /* xor rax, rcx (flip sign) */
+      storev(J, RAX, a);
+      settag(J, a, TFLT);
+      break;
+    }
+    case OP_NOT: {
+      unsigned int f[2], e;
+      testfalse(J, GETARG_B(i), f);
+      settag(J, a, LUA_VFALSE);
+      e = jumpfwd(J, -1);
+      fixfwd(J, f[0]); fixfwd(J, f[1]);
+      settag(J, a, LUA_VTRUE);
+      fixfwd(J, e);
+      break;
+    }
+    case OP_JMP: {
+      int target = pc + 1 + GETARG_sJ(i);
+      if (target <= pc)
+        checkhooks(J, target);
+      jumppc(J, -1, target);
+      break;
+    }
+    case OP_EQ: {
+      int b = GETARG_B(i);
+      unsigned int f1 = testtag(J, a, TINT);
+      unsigned int f2 = testtag(J, b, TINT);
+      loadv(J, RAX, a);
+      opm(J, 0, 1, 0x3B, RAX, RBX, RV(b));  /* cmp rax, [b] */
+      branch(J, pc, CC_E, 0);
+      fixfwd(J, f1);
+      fixfwd(J, f2);
+      guardtag(J, a, TFLT, pc);
+      guardtag(J, b, TFLT, pc);
+      opm(J, 0xF2, 0, 0x0F10, 0, RBX, RV(b));  /* movsd xmm0, [b] */
+      opm(J, 0x66, 0, 0x0F2E, 0, RBX, RV(a));  /* ucomisd xmm0, [a] */
+      branch(J, pc, CC_E, 1);
+      break;
+    }
+    case OP_LT: {
+      orderRR(J, pc, a, GETARG_B(i), CC_L, CC_A);
+      break;
+    }
+    case OP_LE: {
+      orderRR(J, pc, a, GETARG_B(i), CC_LE, CC_AE);
+      break;
+    }
+    case OP_EQK: {
+      equalRK(J, pc, a, &p->k[GETARG_B(i)]);
+      break;
+    }
+    case OP_EQI: {
+      TValue kv;
+      setivalue(&kv, GETARG_sB(i));
+      equalRK(J, pc, a, &kv);
+      break;
+    }
+    case OP_LTI: {  /* a < im  <==>  im > a */
+      orderRI(J, pc, a, GETARG_sB(i), CC_L, CC_A, 1);
+      break;
+    }
+    case OP_LEI: {
+      orderRI(J, pc, a, GETARG_sB(i), CC_LE, CC_AE, 1);
+      break;
+    }
+    case OP_GTI: {
+      orderRI(J, pc, a, GETARG_sB(i), CC_G, CC_A, 0);
+      break;
+    }
+    case OP_GEI: {
+      orderRI(J, pc, a, GETARG_sB(i), CC_GE, CC_AE, 0);
+      break;
+    }
+    case OP_TEST: {
+      int k = GETARG_k(i);
+      unsigned int f[2];
+      testfalse(J, a, f);
+      jumppc(J, -1, k ? pc + 1 : pc + 2);
+      fixfwd(J, f[0]); fixfwd(J, f[1]);
+      jumppc(J, -1, k ? pc + 2 : pc + 1);
+      break;
+    }
+    case OP_TESTSET: {
+      int b = GETARG_B(i);
+      unsigned int f[2];
+      testfalse(J, b, f);
+      if (GETARG_k(i)) {  /* true values are copied */
+        loadv(J, RAX, b);
+        storev(J, RAX, a);
+        opm(J, 0, 0, 0x0FB6, RAX, RBX, RT(b));  /* movzx eax, byte [b.tt] */
+        opm(J, 0, 0, 0x88, RAX, RBX, RT(a));  /* mov [a.tt], al */
+        jumppc(J, -1, pc + 1);
+        fixfwd(J, f[0]); fixfwd(J, f[1]);
+        jumppc(J, -1, pc + 2);
+      }
+      else {  /* false values are copied */
+        jumppc(J, -1, pc + 2);
+        fixfwd(J, f[0]); fixfwd(J, f[1]);
+        loadv(J, RCX, b);
+        storev(J, RCX, a);
+        opm(J, 0, 0, 0x88, RAX, RBX, RT(a));  /* mov [a.tt], al */
+      }
+      break;
+    }
+    case OP_FORLOOP: {
+      int target = pc + 1 - GETARG_Bx(i);
+      unsigned int e;
+      guardtag(J, a + 1, TINT, pc);  /* float loops go to the interpreter */
+      loadv(J, RAX, a);  /* counter */
+      opr(J, 0, 1, 0x85, RAX, RAX);  /* test rax, rax */
+      e = jumpfwd(J, CC_E);  /* no more iterations? */
+      opr(J, 0, 1, 0x83, 5, RAX);  /* sub rax, 1 */
+      emitb(J, 1);
+      storev(J, RAX, a);
+      loadv(J, RAX, a + 2);  /* control variable */
+      opm(J, 0, 1, 0x03, RAX, RBX, RV(a + 1));  /* add rax, step */
+      storev(J, RAX, a + 2);
+      checkhooks(J, target);
+      jumppc(J, -1, target);
+      fixfwd(J, e);
+      break;
+    }
+    case OP_TFORLOOP: {
+      int target = pc + 1 - GETARG_Bx(i);
+      unsigned int e;
+      opm(J, 0, 0, 0x0FB6, RAX, RBX, RT(a + 3));  /* movzx eax, byte... */
+      emitb(J, 0xA8); emitb(J, 0x0F);  /* test al, 0x0F */
+      e = jumpfwd(J, CC_E);  /* nil? */
+      checkhooks(J, target);
+      jumppc(J, -1, target);
+      fixfwd(J, e);
+      break;
+    }
+    case OP_SETTABUP: {
+      upvalue(J, a);
+      opm(J, 0, 0, 0x80, 7, RAX, VT);  /* cmp byte [rax.tt], TTAB */
+      emitb(J, TTAB);
+      jumpexit(J, CC_NE, pc);
+      opm(J, 0, 1, 0x8B, RDI, RAX, VV);
+      movimm(J, RSI, cast(lua_Unsigned,
+                          cast(L_P2I, tsvalue(&p->k[GETARG_B(i)]))));
+      return tableset(J, pc, cast(L_P2I, luaH_psetshortstr));
+    }
+    case OP_SETTABLE: {
+      int b = GETARG_B(i);
+      guardtag(J, b, TINT, pc);
+      loadtable(J, pc, a);
+      loadv(J, RSI, b);
+      return tableset(J, pc, cast(L_P2I, luaH_pseti));
+    }
+    case OP_SETI: {
+      loadtable(J, pc, a);
+      movimm(J, RSI, cast(lua_Unsigned, GETARG_B(i)));
+      return tableset(J, pc, cast(L_P2I, luaH_pseti));
+    }
+    case OP_SETFIELD: {
+      loadtable(J, pc, a);
+      movimm(J, RSI, cast(lua_Unsigned,
+                          cast(L_P2I, tsvalue(&p->k[GETARG_B(i)]))));
+      return tableset(J, pc, cast(L_P2I, luaH_psetshortstr));
+    }
+    default: {  /* everything else goes to the interpreter */
+      jumpexit(J, -1, pc);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static void compile (JitState *J) {
+  int pc;
+  J->pos = 0;
+  /* prologue */
+  emitb(J, 0x53);  /* push rbx */
+  emitb(J, 0x41); emitb(J, 0x54);  /* push r12 */
+  emitb(J, 0x41); emitb(J, 0x55);  /* push r13 */
+  opr(J, 0, 1, 0x89, RDI, RBX);  /* mov rbx, rdi */
+  opr(J, 0, 1, 0x89, RSI, R12);  /* mov r12, rsi */
+  opr(J, 0, 1, 0x89, RDX, R13);  /* mov r13, rdx */
+  emitb(J, 0xFF); emitb(J, 0xE1);  /* jmp rcx */
+  while (J->pos < EPILOGUE)
+    emitb(J, 0xCC);  /* int3 */
+  /* epilogue */
+  emitb(J, 0x41); emitb(J, 0x5D);  /* pop r13 */
+  emitb(J, 0x41); emitb(J, 0x5C);  /* pop r12 */
+  emitb(J, 0x5B);  /* pop rbx */
+  emitb(J, 0xC3);  /* ret */
+  for (pc = 0; pc < J->p->sizecode; pc++) {
+    unsigned int start = J->pos;
+    int native = instruction(J, pc);
+    if (J->label != NULL)
+      J->label[pc] = start | (native ? 0 : EXITONLY);
+  }
+  lua_assert(J->stubs == 0 || J->pos == J->stubs);
+  J->stubs = J->pos;
+  for (pc = 0; pc < J->p->sizecode; pc++) {  /* exit stubs */
+    emitb(J, 0xB8);  /* mov eax, pc */
+    emit32(J, cast(l_uint32, pc));
+    jumpto(J, -1, EPILOGUE);
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** Compile prototype 'p' to native code. On failure, 'p' simply stays
+** in the interpreter.
+*/
+void luaJ_compile (lua_State *L, Proto *p) {
+  JitState J;
+  size_t pagesize = cast_sizet(sysconf(_SC_PAGESIZE));
+  size_t hsize, size, bsize;
+  void *block;
+  p->jitcount = 0;  /* do not try again */
+  J.p = p;
+  J.code = NULL;
+  J.label = NULL;
+  J.stubs = 0;
+  compile(&J);  /* compute size of the code */
+  hsize = offsetof(JitCode, label) +
+          sizeof(unsigned int) * cast_sizet(p->sizecode);
+  hsize = (hsize + 15) & ~cast_sizet(15);  /* align code */
+  size = (hsize + J.pos + pagesize - 1) & ~(pagesize - 1);  /* whole pages */
+  bsize = size + pagesize - 1;  /* room to align the pages in the block */
+  block = luaM_trymalloc_(L, bsize);  /* counted as memory in use */
+  if (block != NULL) {
+    JitCode *jc = cast(JitCode *,
+        (cast(L_P2I, block) + pagesize - 1) & ~cast(L_P2I, pagesize - 1));
+    jc->block = block;
+    jc->bsize = bsize;
+    jc->size = size;
+    jc->mcode = cast(unsigned char *, jc) + hsize;
+    J.label = jc->label;
+    J.stubs = J.pos - cast_uint(p->sizecode) * STUBSIZE;
+    compile(&J);  /* compute labels */
+    J.code = jc->mcode;
+    compile(&J);  /* generate code */
+    if (mprotect(jc, size, PROT_READ | PROT_EXEC) == 0)
+      p->jit = jc;
+    else
+      luaM_freemem(L, block, bsize);
+  }
+}
+
+
+/*
+** Run the native code of the function in 'cl' from instruction 'pc'
+** on. Returns the instruction where the interpreter must continue.
+*/
+int luaJ_run (lua_State *L, LClosure *cl, StkId base, int pc) {
+  JitCode *jc = cl->p->jit;
+  unsigned int start = jc->label[pc];
+  if (start & EXITONLY)  /* nothing to do in native code? */
+    return pc;
+  else {
+    JitFunction f;
+    void *entry = jc->mcode;
+    memcpy(&f, &entry, sizeof(f));  /* ISO C does not convert these types */
+    return f(base, cl->upvals, &L->hookmask, jc->mcode + start);
+  }
+}
+
+
+void luaJ_freeproto (lua_State *L, Proto *p) {
+  JitCode *jc = p->jit;
+  if (jc != NULL) {
+    void *block = jc->block;
+    size_t bsize = jc->bsize;
+    mprotect(jc, jc->size, PROT_READ | PROT_WRITE);  /* give pages back */
+    luaM_freemem(L, block, bsize);
+  }
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+** $Id: ljit.h $
+** Baseline compiler to native code
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ljit_h
+#define ljit_h
+
+#include "lobject.h"
+#include "lstate.h"
+
+
+#if defined(LUA_USE_JIT)
+
+/*
+** Number of calls, returns, and loop iterations of a function before
+** it is compiled to native code.
+*/
+#if !defined(LUAI_JITHOT)
+#define LUAI_JITHOT	50
+#endif
+
+
+/* native code of a prototype */
+typedef struct JitCode {
+  void *block;  /* memory block that contains this structure */
+  size_t bsize;  /* size of 'block' */
+  size_t size;  /* size of the pages with the code, including this header */
+  unsigned char *mcode;  /* machine code */
+  unsigned int label[1];  /* offset in 'mcode' of each instruction */
+} JitCode;
+
+
+#define luaJ_initproto(p)	((p)->jitcount = LUAI_JITHOT, (p)->jit = NULL)
+
+LUAI_FUNC void luaJ_compile (lua_State *L, Proto *p);
+LUAI_FUNC int luaJ_run (lua_State *L, LClosure *cl, StkId base, int pc);
+LUAI_FUNC void luaJ_freeproto (lua_State *L, Proto *p);
+
+#else
+
+#define luaJ_initproto(p)	((void)0)
+#define luaJ_freeproto(L,p)	((void)0)
+
+#endif
+
+#endif
@@ -231,6 +231,15 @@ typedef unsigned long l_uint32;
 #endif
 
 
+/*
+** An unsigned with exactly 8 bytes (only needed for NaN boxing)
+*/
+#if defined(LUAI_NANBOX)
+#include <stdint.h>
+typedef uint64_t l_uint64;
+#endif
+
+
 /*
 ** The luai_num* macros define the primitive operations over numbers.
 */
@@ -58,6 +58,26 @@
 #define cantryagain(g)	(completestate(g) && !g->gcstopem)
 
 
+/*
+** Checks whether growing a block from 'os' to 'ns' bytes would take
+** the memory in use over the limit set by 'lua_setmemlimit'. (When
+** 'block' is NULL, 'os' is a tag, and the block grows by 'ns' bytes.)
+*/
+static int overlimit (global_State *g, void *block, size_t os, size_t ns) {
+  if (l_likely(g->GClimit == 0))  /* no limit? */
+    return 0;
+  else {
+    size_t n = (block == NULL) ? ns : (ns > os) ? ns - os : 0;
+    l_mem room = g->GClimit - gettotalbytes(g);
+    if (n > 0 && (room < 0 || n > cast_sizet(room))) {
+      g->gcstats.nrefused++;
+      return 1;
+    }
+    return 0;
+  }
+}
+
+
 
 
 #if defined(EMERGENCYGCTESTS)
@@ -150,11 +170,25 @@ l_noret luaM_toobig (lua_State *L) {
 void luaM_free_ (lua_State *L, void *block, size_t osize) {
   global_State *g = G(L);
   lua_assert((osize == 0) == (block == NULL));
-  callfrealloc(g, block, osize, 0);
+  if (g->gcfreer == NULL || block == NULL ||
+      !luaC_deferfree(g, block, osize))  /* cannot free it later? */
+    callfrealloc(g, block, osize, 0);
   g->GCdebt += cast(l_mem, osize);
 }
 
 
+/*
+** Allocation that respects the memory limit of the state.
+*/
+static void *tryalloc (global_State *g, void *block,
+                       size_t osize, size_t nsize) {
+  if (l_unlikely(overlimit(g, block, osize, nsize)))
+    return NULL;
+  else
+    return firsttry(g, block, osize, nsize);
+}
+
+
 /*
 ** In case of allocation fail, this function will do an emergency
 ** collection to free some memory and then try the allocation again.
@@ -164,6 +198,8 @@ static void *tryagain (lua_State *L, void *block,
   global_State *g = G(L);
   if (cantryagain(g)) {
     luaC_fullgc(L, 1);  /* try to free some memory... */
+    if (overlimit(g, block, osize, nsize))  /* still over the limit? */
+      return NULL;
     return callfrealloc(g, block, osize, nsize);  /* try again */
   }
   else return NULL;  /* cannot run an emergency collection */
@@ -177,7 +213,7 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   void *newblock;
   global_State *g = G(L);
   lua_assert((osize == 0) == (block == NULL));
-  newblock = firsttry(g, block, osize, nsize);
+  newblock = tryalloc(g, block, osize, nsize);
   if (l_unlikely(newblock == NULL && nsize > 0)) {
     newblock = tryagain(L, block, osize, nsize);
     if (newblock == NULL)  /* still no memory? */
@@ -185,6 +221,7 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   }
   lua_assert((nsize == 0) == (newblock == NULL));
   g->GCdebt -= cast(l_mem, nsize) - cast(l_mem, osize);
+  g->gcstats.sites[MEMSRESIZE] += nsize;
   return newblock;
 }
 
@@ -203,13 +240,308 @@ void *luaM_malloc_ (lua_State *L, size_t size, int tag) {
     return NULL;  /* that's all */
   else {
     global_State *g = G(L);
-    void *newblock = firsttry(g, NULL, cast_sizet(tag), size);
+    void *newblock = tryalloc(g, NULL, cast_sizet(tag), size);
     if (l_unlikely(newblock == NULL)) {
       newblock = tryagain(L, NULL, cast_sizet(tag), size);
       if (newblock == NULL)
         luaM_error(L);
     }
     g->GCdebt -= cast(l_mem, size);
+    g->gcstats.sites[(tag != 0) ? MEMSOBJ : MEMSBLOCK] += size;
     return newblock;
   }
 }
+
+
+/*
+** Allocates a block without raising errors or running the collector,
+** so that it can be called anywhere. Returns NULL if the memory limit
+** or the allocator refuses the block.
+*/
+void *luaM_trymalloc_ (lua_State *L, size_t size) {
+  global_State *g = G(L);
+  void *block = tryalloc(g, NULL, 0, size);
+  if (block != NULL) {
+    g->GCdebt -= cast(l_mem, size);
+    g->gcstats.sites[MEMSBLOCK] += size;
+  }
+  return block;
+}
+
+
+#if defined(LUAI_PAGEHEAP)
+
+/*
+** {==================================================================
+** Page heap
+** ===================================================================
+*/
+
+/*
+** Hooks for the test library: 'luai_pagealloc' returns false to fake
+** a memory error when allocating an object in a page.
+*/
+#if !defined(luai_pagealloc)
+#define luai_pagealloc(L,s)	1
+#define luai_pagefree(L,s)	((void)0)
+#endif
+
+
+/* number of pages in an arena */
+#define ARENAPAGES	16
+
+/* number of size classes */
+#define PAGENCLASSES	(PAGEMAXOBJ / PAGEGRAIN)
+
+/* size class for a block of size 's' (> 0) and cell size of class 'c' */
+#define pageclass(s)	(((s) - 1) / PAGEGRAIN)
+#define classsize(c)	(((c) + 1) * PAGEGRAIN)
+
+/* offset of the first cell in a page */
+#define PAGEHEADER  \
+	((sizeof(Page) + PAGEGRAIN - 1) & ~cast_sizet(PAGEGRAIN - 1))
+
+#define pagefull(p)  \
+  ((p)->freecell == NULL && (p)->top + (p)->cellsize > cast_charp(p) + PAGESIZE)
+
+
+/*
+** Arenas are blocks from the allocator holding ARENAPAGES aligned
+** pages. An arena is returned to the allocator when all its pages are
+** free (except the last one).
+*/
+typedef struct Arena {
+  struct Arena *next;  /* list of all arenas */
+  struct Arena **previous;  /* pointer to the link to this arena */
+  void *block;  /* block from the allocator */
+  unsigned int nfree;  /* number of free pages */
+} Arena;
+
+
+#define ARENABLOCK	(ARENAPAGES * cast_sizet(PAGESIZE) + PAGESIZE)
+
+
+typedef struct PageHeap {
+  Page *partial[PAGENCLASSES];  /* pages with free cells, by class */
+  Page *free;  /* free pages */
+  Arena *arenas;  /* list of all arenas */
+  unsigned int narenas;
+} PageHeap;
+
+
+static void linkpage (Page **l, Page *p) {
+  p->previous = NULL;
+  p->next = *l;
+  if (*l != NULL)
+    (*l)->previous = p;
+  *l = p;
+}
+
+
+static void unlinkpage (Page **l, Page *p) {
+  if (p->previous != NULL)
+    p->previous->next = p->next;
+  else
+    *l = p->next;
+  if (p->next != NULL)
+    p->next->previous = p->previous;
+}
+
+
+static void freearena (global_State *g, PageHeap *h, Arena *a) {
+  char *pages = cast_charp(luaM_pageof(cast_charp(a->block) + PAGESIZE - 1));
+  int i;
+  for (i = 0; i < ARENAPAGES; i++)
+    unlinkpage(&h->free, cast(Page *, pages + cast_sizet(i) * PAGESIZE));
+  *a->previous = a->next;
+  if (a->next != NULL)
+    a->next->previous = a->previous;
+  h->narenas--;
+  callfrealloc(g, a->block, ARENABLOCK, 0);
+  callfrealloc(g, a, sizeof(Arena), 0);
+}
+
+
+/*
+** Create a new arena and put its pages in the free list. Returns 0
+** if there is no memory.
+*/
+static int newarena (global_State *g, PageHeap *h) {
+  Arena *a = cast(Arena *, firsttry(g, NULL, 0, sizeof(Arena)));
+  char *pages;
+  int i;
+  if (a == NULL)
+    return 0;
+  a->block = firsttry(g, NULL, 0, ARENABLOCK);
+  if (a->block == NULL) {
+    callfrealloc(g, a, sizeof(Arena), 0);
+    return 0;
+  }
+  pages = cast_charp(luaM_pageof(cast_charp(a->block) + PAGESIZE - 1));
+  for (i = ARENAPAGES - 1; i >= 0; i--) {
+    Page *p = cast(Page *, pages + cast_sizet(i) * PAGESIZE);
+    p->arena = a;
+    p->cellsize = 0;
+    linkpage(&h->free, p);
+  }
+  a->nfree = ARENAPAGES;
+  a->next = h->arenas;
+  a->previous = &h->arenas;
+  if (h->arenas != NULL)
+    h->arenas->previous = &a->next;
+  h->arenas = a;
+  h->narenas++;
+  return 1;
+}
+
+
+/*
+** Get a free page for class 'c' and put it in the list of partial
+** pages of that class. Returns NULL if there is no memory.
+*/
+static Page *newpage (global_State *g, PageHeap *h, size_t c) {
+  Page *p;
+  if (h->free == NULL && !newarena(g, h))
+    return NULL;
+  p = h->free;
+  unlinkpage(&h->free, p);
+  p->arena->nfree--;
+  p->cellsize = cast_uint(classsize(c));
+  p->freecell = NULL;
+  p->top = cast_charp(p) + PAGEHEADER;
+  p->nused = 0;
+  linkpage(&h->partial[c], p);
+  return p;
+}
+
+
+static void freepage (global_State *g, PageHeap *h, Page *p) {
+  Arena *a = p->arena;
+  p->cellsize = 0;
+  linkpage(&h->free, p);
+  if (++a->nfree == ARENAPAGES && h->narenas > 1)
+    freearena(g, h, a);
+}
+
+
+static PageHeap *newpageheap (global_State *g) {
+  PageHeap *h = cast(PageHeap *, firsttry(g, NULL, 0, sizeof(PageHeap)));
+  if (h != NULL) {
+    size_t c;
+    for (c = 0; c < PAGENCLASSES; c++)
+      h->partial[c] = NULL;
+    h->free = NULL;
+    h->arenas = NULL;
+    h->narenas = 0;
+    g->pageheap = h;
+  }
+  return h;
+}
+
+
+/*
+** Get a cell for a new object of class 'c'; returns NULL if there is
+** no memory.
+*/
+static void *getcell (global_State *g, size_t c) {
+  PageHeap *h = g->pageheap;
+  Page *p;
+  char *cell;
+  if (h == NULL && (h = newpageheap(g)) == NULL)
+    return NULL;
+  p = h->partial[c];
+  if (p == NULL && (p = newpage(g, h, c)) == NULL)
+    return NULL;
+  if (p->freecell != NULL) {  /* reuse a free cell? */
+    cell = p->freecell;
+    p->freecell = *cast(char **, cell);
+  }
+  else {  /* use a new one */
+    cell = p->top;
+    p->top += p->cellsize;
+  }
+  p->nused++;
+  if (pagefull(p))
+    unlinkpage(&h->partial[c], p);
+  return cell;
+}
+
+
+static void *trycell (lua_State *L, size_t size) {
+  void *cell;
+  if (!luai_pagealloc(L, size))
+    return NULL;
+  cell = getcell(G(L), pageclass(size));
+  if (cell == NULL)
+    luai_pagefree(L, size);
+  return cell;
+}
+
+
+void *luaM_newpageobj_ (lua_State *L, size_t size, int tag) {
+  if (!luaM_inpages(size))
+    return luaM_malloc_(L, size, tag);
+  else {
+    global_State *g = G(L);
+    void *cell = overlimit(g, NULL, 0, size) ? NULL : trycell(L, size);
+    if (l_unlikely(cell == NULL)) {
+      if (cantryagain(g)) {
+        luaC_fullgc(L, 1);  /* try to free some memory... */
+        if (!overlimit(g, NULL, 0, size))
+          cell = trycell(L, size);  /* try again */
+      }
+      if (cell == NULL)
+        luaM_error(L);
+    }
+    g->GCdebt -= cast(l_mem, size);
+    g->gcstats.sites[MEMSOBJ] += size;
+    return cell;
+  }
+}
+
+
+void luaM_freepageobj_ (lua_State *L, void *block, size_t osize) {
+  if (!luaM_inpages(osize))
+    luaM_free_(L, block, osize);
+  else {
+    global_State *g = G(L);
+    PageHeap *h = g->pageheap;
+    Page *p = luaM_pageof(block);
+    size_t c = pageclass(osize);
+    int wasfull = pagefull(p);
+    lua_assert(p->cellsize == classsize(c));
+    *cast(char **, block) = p->freecell;
+    p->freecell = cast_charp(block);
+    if (--p->nused == 0) {  /* page is empty? */
+      if (!wasfull)
+        unlinkpage(&h->partial[c], p);
+      freepage(g, h, p);
+    }
+    else if (wasfull)  /* page has free cells again? */
+      linkpage(&h->partial[c], p);
+    g->GCdebt += cast(l_mem, osize);
+    luai_pagefree(L, osize);
+  }
+}
+
+
+/*
+** Free the page heap. (All objects must have been freed.)
+*/
+void luaM_freepages (lua_State *L) {
+  global_State *g = G(L);
+  PageHeap *h = g->pageheap;
+  if (h != NULL) {
+    while (h->arenas != NULL) {
+      lua_assert(h->arenas->nfree == ARENAPAGES);
+      freearena(g, h, h->arenas);
+    }
+    callfrealloc(g, h, sizeof(PageHeap), 0);
+    g->pageheap = NULL;
+  }
+}
+
+/* }================================================================== */
+
+#endif
+
@@ -62,7 +62,53 @@
 #define luaM_newvectorchecked(L,n,t) \
   (luaM_checksize(L,n,sizeof(t)), luaM_newvector(L,n,t))
 
+#if defined(LUAI_PAGEHEAP)
+
+/*
+** With the page heap, collectable objects up to PAGEMAXOBJ bytes live
+** in aligned pages of PAGESIZE bytes, each with cells of a single size
+** (a multiple of PAGEGRAIN). The header of a page keeps a side map
+** with one byte for each PAGEGRAIN bytes of the page, where the
+** collector keeps the colors of the objects in the page.
+*/
+#define PAGEBITS	16
+#define PAGESIZE	(1u << PAGEBITS)
+#define PAGEGRAIN	16u
+#define PAGEMAXOBJ	1024u
+
+typedef struct Page {
+  struct Page *next;  /* next page in its list */
+  struct Page *previous;  /* previous page in its list */
+  struct Arena *arena;  /* arena this page belongs to */
+  char *freecell;  /* list of free cells */
+  char *top;  /* first cell never used */
+  unsigned int nused;  /* number of cells in use */
+  unsigned int cellsize;  /* size of the cells (0 if page is free) */
+  lu_byte colors[PAGESIZE / PAGEGRAIN];  /* side map of colors */
+} Page;
+
+#define luaM_inpages(s)	((s) <= PAGEMAXOBJ)
+
+#define luaM_pageof(b)  \
+	cast(Page *, cast(L_P2I, (b)) & ~cast(L_P2I, PAGESIZE - 1))
+
+/* entry in the side map of a page for the object at 'b' */
+#define luaM_pagecolors(b)  (luaM_pageof(b)->colors[ \
+	(cast(L_P2I, (b)) & cast(L_P2I, PAGESIZE - 1)) / PAGEGRAIN])
+
+#define luaM_newobject(L,tag,s)	luaM_newpageobj_(L, (s), tag)
+#define luaM_freeobject(L,b,s)	luaM_freepageobj_(L, (b), (s))
+
+LUAI_FUNC void *luaM_newpageobj_ (lua_State *L, size_t size, int tag);
+LUAI_FUNC void luaM_freepageobj_ (lua_State *L, void *block, size_t osize);
+LUAI_FUNC void luaM_freepages (lua_State *L);
+
+#else
+
 #define luaM_newobject(L,tag,s)	luaM_malloc_(L, (s), tag)
+#define luaM_freeobject(L,b,s)	luaM_free_(L, (b), (s))
+
+#endif
 
 #define luaM_newblock(L, size)	luaM_newvector(L, size, char)
 
@@ -91,6 +137,7 @@ LUAI_FUNC void *luaM_growaux_ (lua_State *L, void *block, int nelems,
 LUAI_FUNC void *luaM_shrinkvector_ (lua_State *L, void *block, int *nelem,
                                     int final_n, unsigned size_elem);
 LUAI_FUNC void *luaM_malloc_ (lua_State *L, size_t size, int tag);
+LUAI_FUNC void *luaM_trymalloc_ (lua_State *L, size_t size);
 
 #endif
 
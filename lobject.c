@@ -30,6 +30,16 @@
 #include "lvm.h"
 
 
+#if defined(LUAI_NANBOX)
+LUAI_DDEF const lu_byte luaO_nbtag[16] = {
+  LUA_VNIL, LUA_VNUMINT, LUA_VLIGHTUSERDATA, LUA_VLCF,
+  LUA_TDEADKEY, LUA_VNIL, LUA_VNIL, LUA_VNIL,
+  ctb(LUA_VSHRSTR), ctb(LUA_VLNGSTR), ctb(LUA_VTABLE), ctb(LUA_VUSERDATA),
+  ctb(LUA_VLCL), ctb(LUA_VCCL), ctb(LUA_VTHREAD), LUA_VNIL
+};
+#endif
+
+
 /*
 ** Computes ceil(log2(x))
 */
@@ -43,6 +43,15 @@
 
 
 
+/* tag with no variants (bits 0-3) */
+#define novariant(t)	((t) & 0x0F)
+
+/* type tag of a TValue (bits 0-3 for tags + variant bits 4-5) */
+#define withvariant(t)	((t) & 0x3F)
+
+
+#if !defined(LUAI_NANBOX)	/* { */
+
 /*
 ** Union of all Lua values
 */
@@ -76,22 +85,173 @@ typedef struct TValue {
 /* raw type tag of a TValue */
 #define rawtt(o)	((o)->tt_)
 
-/* tag with no variants (bits 0-3) */
-#define novariant(t)	((t) & 0x0F)
 
-/* type tag of a TValue (bits 0-3 for tags + variant bits 4-5) */
-#define withvariant(t)	((t) & 0x3F)
+/* Macros to test type */
+#define checktag(o,t)		(rawtt(o) == (t))
+#define checktype(o,t)		(ttype(o) == (t))
+
+
+/* access to the contents of a 'Value' */
+#define gcvalueraw(v)	((v).gc)
+#define pvalueraw(v)	((v).p)
+#define fvalueraw(v)	((v).f)
+#define ivalueraw(v)	((v).i)
+#define fltvalueraw(v)	((v).n)
+
+
+/* set a value's tag */
+#define settt_(o,t)	((o)->tt_=(t))
+
+/* set the contents and the tag of a value */
+#define setgcval_(o,x,t)	(val_(o).gc=(x), settt_(o,t))
+#define setpval_(o,x)	(val_(o).p=(x), settt_(o, LUA_VLIGHTUSERDATA))
+#define setfval_(o,x)	(val_(o).f=(x), settt_(o, LUA_VLCF))
+#define setival_(o,x)	(val_(o).i=(x), settt_(o, LUA_VNUMINT))
+#define setfltval_(o,x)	(val_(o).n=(x), settt_(o, LUA_VNUMFLT))
+
+/* change the contents of a number, keeping its tag */
+#define chgival_(o,x)	(val_(o).i=(x))
+#define chgfltval_(o,x)	(val_(o).n=(x))
+
+/* copy a whole value */
+#define copyval_(o1,o2)	((o1)->value_ = (o2)->value_, settt_(o1, (o2)->tt_))
+
+#else				/* }{ */
+
+/*
+** NaN boxing: each value is a single 64-bit word. A float is stored
+** as itself. Any other value is a quiet NaN with the sign bit set, a
+** pattern that no float stored in Lua has (see 'setfltval_'), with a
+** 4-bit code in bits 47-50 and a 47-bit payload. Code NBSIMPLE has the
+** values with no contents (nils and booleans), whose payload is their
+** tag. Integers have 32 bits. Codes with bit 3 set are collectable.
+*/
+
+typedef union Value {
+  l_uint64 u;  /* boxed value */
+  lua_Number n;  /* float numbers */
+} Value;
+
+#define TValuefields	Value value_
+
+typedef struct TValue {
+  TValuefields;
+} TValue;
+
+
+#define val_(o)		((o)->value_)
+#define valraw(o)	(val_(o))
+
+
+#define NBBOXED		(~(~cast(l_uint64, 0) >> 13))
+#define NBPAYLOAD	((cast(l_uint64, 1) << 47) - 1)
+
+/* box a payload with a code */
+#define nbbox(c,p)	(NBBOXED | (cast(l_uint64, c) << 47) | cast(l_uint64, p))
+
+/* code of a boxed value */
+#define nbcode(u)	(cast_int((u) >> 47) & 0xF)
+
+#define NBSIMPLE	0
+#define NBINT		1
+#define NBLIGHTUD	2
+#define NBLCF		3
+#define NBDEADKEY	4
+#define NBSHRSTR	8
+#define NBLNGSTR	9
+#define NBTABLE		10
+#define NBUSERDATA	11
+#define NBLCL		12
+#define NBCCL		13
+#define NBTHREAD	14
+
+/* code for a tag (a constant, for constant tags) */
+#define nbtagcode(t)  \
+  ((t) == ctb(LUA_VSHRSTR) ? NBSHRSTR : (t) == ctb(LUA_VLNGSTR) ? NBLNGSTR : \
+   (t) == ctb(LUA_VTABLE) ? NBTABLE : (t) == ctb(LUA_VUSERDATA) ? NBUSERDATA : \
+   (t) == ctb(LUA_VLCL) ? NBLCL : (t) == ctb(LUA_VCCL) ? NBCCL : \
+   (t) == ctb(LUA_VTHREAD) ? NBTHREAD : (t) == LUA_VNUMINT ? NBINT : \
+   (t) == LUA_VLIGHTUSERDATA ? NBLIGHTUD : (t) == LUA_VLCF ? NBLCF : \
+   (t) == LUA_TDEADKEY ? NBDEADKEY : NBSIMPLE)
+
+/* tag for each code */
+LUAI_DDEC(const lu_byte luaO_nbtag[16];)
+
+/* tag of a boxed value */
+#define nbtag(u)  \
+  ((u) < NBBOXED ? LUA_VNUMFLT : \
+   nbcode(u) == NBSIMPLE ? cast_byte(u) : luaO_nbtag[nbcode(u)])
+
+
+/* raw type tag of a TValue */
+#define rawtt(o)	nbtag(val_(o).u)
+
+
+/*
+** Macros to test type. Tests for constant tags and types are done
+** directly over the boxed value.
+*/
+#define checktag(o,t)  \
+  ((t) == LUA_VNUMFLT ? val_(o).u < NBBOXED : \
+   nbtagcode(t) == NBSIMPLE ? val_(o).u == nbbox(NBSIMPLE, t) : \
+   (val_(o).u >> 47) == (nbbox(nbtagcode(t), 0) >> 47))
+
+#define checktype(o,t)  \
+  ((t) == LUA_TNIL ? (val_(o).u | 0x30) == nbbox(NBSIMPLE, 0x30) : \
+   (t) == LUA_TBOOLEAN ? (val_(o).u | 0x10) == nbbox(NBSIMPLE, 0x11) : \
+   (t) == LUA_TNUMBER ? \
+     (val_(o).u < NBBOXED || nbcode(val_(o).u) == NBINT) : \
+   (t) == LUA_TSTRING ? \
+     (val_(o).u >> 48) == (nbbox(NBSHRSTR, 0) >> 48) : \
+   ttype(o) == (t))
+
+
+/* access to the contents of a 'Value' */
+#define nbpointer(v)	cast(void *, cast(L_P2I, (v).u & NBPAYLOAD))
+#define gcvalueraw(v)	cast(struct GCObject *, nbpointer(v))
+#define pvalueraw(v)	nbpointer(v)
+#define fvalueraw(v)	cast(lua_CFunction, cast(L_P2I, (v).u & NBPAYLOAD))
+#define ivalueraw(v)	l_castU2S(cast(lua_Unsigned, cast(l_uint32, (v).u)))
+#define fltvalueraw(v)	((v).n)
+
+
+/* box a pointer */
+#define nbboxp(c,x)  \
+  check_exp((cast(L_P2I, x) & ~cast(L_P2I, NBPAYLOAD)) == 0, \
+            nbbox(c, cast(l_uint64, cast(L_P2I, x))))
+
+/* set a value's tag (only for tags with no contents) */
+#define settt_(o,t)	(val_(o).u = nbbox(NBSIMPLE, t))
+
+/* set the contents and the tag of a value */
+#define setgcval_(o,x,t)	(val_(o).u = nbboxp(nbtagcode(t), x))
+#define setpval_(o,x)	(val_(o).u = nbboxp(NBLIGHTUD, x))
+#define setfval_(o,x)	(val_(o).u = nbboxp(NBLCF, x))
+#define setival_(o,x)	\
+	(val_(o).u = nbbox(NBINT, cast(l_uint32, l_castS2U(x))))
+
+/* NaNs with the boxing pattern are replaced by a positive quiet NaN */
+#define setfltval_(o,x)	\
+	(val_(o).n = (x), \
+	 (l_unlikely(val_(o).u >= NBBOXED) ? \
+	   (val_(o).u = NBBOXED >> 1) : 0))
+
+/* change the contents of a number, keeping its tag */
+#define chgival_(o,x)	setival_(o,x)
+#define chgfltval_(o,x)	setfltval_(o,x)
+
+/* copy a whole value */
+#define copyval_(o1,o2)	((o1)->value_ = (o2)->value_)
+
+#endif				/* } */
+
+
 #define ttypetag(o)	withvariant(rawtt(o))
 
 /* type of a TValue */
 #define ttype(o)	(novariant(rawtt(o)))
 
 
-/* Macros to test type */
-#define checktag(o,t)		(rawtt(o) == (t))
-#define checktype(o,t)		(ttype(o) == (t))
-
-
 /* Macros for internal tests */
 
 /* collectable object has the same tag as the original value */
@@ -110,14 +270,10 @@ typedef struct TValue {
 
 /* Macros to set values */
 
-/* set a value's tag */
-#define settt_(o,t)	((o)->tt_=(t))
-
-
 /* main macro to copy values (from 'obj2' to 'obj1') */
 #define setobj(L,obj1,obj2) \
 	{ TValue *io1=(obj1); const TValue *io2=(obj2); \
-          io1->value_ = io2->value_; settt_(io1, io2->tt_); \
+          copyval_(io1, io2); \
 	  checkliveness(L,io1); lua_assert(!isnonstrictnil(io1)); }
 
 /*
@@ -145,6 +301,7 @@ typedef struct TValue {
 ** their real delta is always the maximum value that fits in
 ** that field.
 */
+#if !defined(LUAI_NANBOX)
 typedef union StackValue {
   TValue val;
   struct {
@@ -152,6 +309,12 @@ typedef union StackValue {
     unsigned short delta;
   } tbclist;
 } StackValue;
+#else
+/* with NaN boxing, deltas live outside the stack (see 'tbcdelta') */
+typedef union StackValue {
+  TValue val;
+} StackValue;
+#endif
 
 
 /* index to stack elements */
@@ -229,7 +392,11 @@ typedef union {
 
 
 /* macro defining a value corresponding to an absent key */
+#if !defined(LUAI_NANBOX)
 #define ABSTKEYCONSTANT		{NULL}, LUA_VABSTKEY
+#else
+#define ABSTKEYCONSTANT		{nbbox(NBSIMPLE, LUA_VABSTKEY)}
+#endif
 
 
 /* mark an entry as empty */
@@ -276,11 +443,11 @@ typedef union {
 
 #define ttisthread(o)		checktag((o), ctb(LUA_VTHREAD))
 
-#define thvalue(o)	check_exp(ttisthread(o), gco2th(val_(o).gc))
+#define thvalue(o)	check_exp(ttisthread(o), gco2th(gcvalueraw(val_(o))))
 
 #define setthvalue(L,obj,x) \
   { TValue *io = (obj); lua_State *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_VTHREAD)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_VTHREAD)); \
     checkliveness(L,io); }
 
 #define setthvalue2s(L,o,t)	setthvalue(L,s2v(o),t)
@@ -310,18 +477,20 @@ typedef struct GCObject {
 /* Bit mark for collectable types */
 #define BIT_ISCOLLECTABLE	(1 << 6)
 
+#if !defined(LUAI_NANBOX)
 #define iscollectable(o)	(rawtt(o) & BIT_ISCOLLECTABLE)
+#else
+#define iscollectable(o)	(val_(o).u >= nbbox(8, 0))
+#endif
 
 /* mark a tag as collectable */
 #define ctb(t)			((t) | BIT_ISCOLLECTABLE)
 
-#define gcvalue(o)	check_exp(iscollectable(o), val_(o).gc)
-
-#define gcvalueraw(v)	((v).gc)
+#define gcvalue(o)	check_exp(iscollectable(o), gcvalueraw(val_(o)))
 
 #define setgcovalue(L,obj,x) \
   { TValue *io = (obj); GCObject *i_g=(x); \
-    val_(io).gc = i_g; settt_(io, ctb(i_g->tt)); }
+    setgcval_(io, i_g, ctb(i_g->tt)); }
 
 /* }================================================================== */
 
@@ -342,23 +511,20 @@ typedef struct GCObject {
 
 #define nvalue(o)	check_exp(ttisnumber(o), \
 	(ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o)))
-#define fltvalue(o)	check_exp(ttisfloat(o), val_(o).n)
-#define ivalue(o)	check_exp(ttisinteger(o), val_(o).i)
-
-#define fltvalueraw(v)	((v).n)
-#define ivalueraw(v)	((v).i)
+#define fltvalue(o)	check_exp(ttisfloat(o), fltvalueraw(val_(o)))
+#define ivalue(o)	check_exp(ttisinteger(o), ivalueraw(val_(o)))
 
 #define setfltvalue(obj,x) \
-  { TValue *io=(obj); val_(io).n=(x); settt_(io, LUA_VNUMFLT); }
+  { TValue *io=(obj); setfltval_(io, x); }
 
 #define chgfltvalue(obj,x) \
-  { TValue *io=(obj); lua_assert(ttisfloat(io)); val_(io).n=(x); }
+  { TValue *io=(obj); lua_assert(ttisfloat(io)); chgfltval_(io, x); }
 
 #define setivalue(obj,x) \
-  { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_VNUMINT); }
+  { TValue *io=(obj); setival_(io, x); }
 
 #define chgivalue(obj,x) \
-  { TValue *io=(obj); lua_assert(ttisinteger(io)); val_(io).i=(x); }
+  { TValue *io=(obj); lua_assert(ttisinteger(io)); chgival_(io, x); }
 
 /* }================================================================== */
 
@@ -377,13 +543,13 @@ typedef struct GCObject {
 #define ttisshrstring(o)	checktag((o), ctb(LUA_VSHRSTR))
 #define ttislngstring(o)	checktag((o), ctb(LUA_VLNGSTR))
 
-#define tsvalueraw(v)	(gco2ts((v).gc))
+#define tsvalueraw(v)	(gco2ts(gcvalueraw(v)))
 
-#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(val_(o).gc))
+#define tsvalue(o)	check_exp(ttisstring(o), tsvalueraw(val_(o)))
 
 #define setsvalue(L,obj,x) \
   { TValue *io = (obj); TString *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(x_->tt)); \
+    setgcval_(io, obj2gco(x_), ctb(x_->tt)); \
     checkliveness(L,io); }
 
 /* set a string to the stack */
@@ -462,17 +628,15 @@ typedef struct TString {
 #define ttislightuserdata(o)	checktag((o), LUA_VLIGHTUSERDATA)
 #define ttisfulluserdata(o)	checktag((o), ctb(LUA_VUSERDATA))
 
-#define pvalue(o)	check_exp(ttislightuserdata(o), val_(o).p)
-#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(val_(o).gc))
-
-#define pvalueraw(v)	((v).p)
+#define pvalue(o)	check_exp(ttislightuserdata(o), pvalueraw(val_(o)))
+#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(gcvalueraw(val_(o))))
 
 #define setpvalue(obj,x) \
-  { TValue *io=(obj); val_(io).p=(x); settt_(io, LUA_VLIGHTUSERDATA); }
+  { TValue *io=(obj); setpval_(io, x); }
 
 #define setuvalue(L,obj,x) \
   { TValue *io = (obj); Udata *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_VUSERDATA)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_VUSERDATA)); \
     checkliveness(L,io); }
 
 
@@ -601,6 +765,7 @@ typedef struct Proto {
   int sizep;  /* size of 'p' */
   int sizelocvars;
   int sizeabslineinfo;  /* size of 'abslineinfo' */
+  int sizeicache;  /* size of 'icache' (0 or 'sizecode') */
   int linedefined;  /* debug information  */
   int lastlinedefined;  /* debug information  */
   TValue *k;  /* constants used by the function */
@@ -610,8 +775,13 @@ typedef struct Proto {
   ls_byte *lineinfo;  /* information about source lines (debug information) */
   AbsLineInfo *abslineinfo;  /* idem */
   LocVar *locvars;  /* information about local variables (debug information) */
+  unsigned int *icache;  /* inline caches for field accesses */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
+#if defined(LUA_USE_JIT)
+  int jitcount;  /* countdown to compilation to native code */
+  struct JitCode *jit;  /* native code (or NULL) */
+#endif
 } Proto;
 
 /* }================================================================== */
@@ -640,26 +810,24 @@ typedef struct Proto {
 
 #define isLfunction(o)	ttisLclosure(o)
 
-#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(val_(o).gc))
-#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(val_(o).gc))
-#define fvalue(o)	check_exp(ttislcf(o), val_(o).f)
-#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(val_(o).gc))
-
-#define fvalueraw(v)	((v).f)
+#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(gcvalueraw(val_(o))))
+#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(gcvalueraw(val_(o))))
+#define fvalue(o)	check_exp(ttislcf(o), fvalueraw(val_(o)))
+#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(gcvalueraw(val_(o))))
 
 #define setclLvalue(L,obj,x) \
   { TValue *io = (obj); LClosure *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_VLCL)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_VLCL)); \
     checkliveness(L,io); }
 
 #define setclLvalue2s(L,o,cl)	setclLvalue(L,s2v(o),cl)
 
 #define setfvalue(obj,x) \
-  { TValue *io=(obj); val_(io).f=(x); settt_(io, LUA_VLCF); }
+  { TValue *io=(obj); setfval_(io, x); }
 
 #define setclCvalue(L,obj,x) \
   { TValue *io = (obj); CClosure *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_VCCL)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_VCCL)); \
     checkliveness(L,io); }
 
 
@@ -721,11 +889,11 @@ typedef union Closure {
 
 #define ttistable(o)		checktag((o), ctb(LUA_VTABLE))
 
-#define hvalue(o)	check_exp(ttistable(o), gco2t(val_(o).gc))
+#define hvalue(o)	check_exp(ttistable(o), gco2t(gcvalueraw(val_(o))))
 
 #define sethvalue(L,obj,x) \
   { TValue *io = (obj); Table *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_VTABLE)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_VTABLE)); \
     checkliveness(L,io); }
 
 #define sethvalue2s(L,o,h)	sethvalue(L,s2v(o),h)
@@ -736,8 +904,9 @@ typedef union Closure {
 ** plus a 'next' field to link colliding entries. The distribution
 ** of the key's fields ('key_tt' and 'key_val') not forming a proper
 ** 'TValue' allows for a smaller size for 'Node' both in 4-byte
-** and 8-byte alignments.
+** and 8-byte alignments. (With NaN boxing, 'key_val' has its own tag.)
 */
+#if !defined(LUAI_NANBOX)
 typedef union Node {
   struct NodeKey {
     TValuefields;  /* fields for value */
@@ -761,6 +930,48 @@ typedef union Node {
 	  io_->value_ = n_->u.key_val; io_->tt_ = n_->u.key_tt; \
 	  checkliveness(L,io_); }
 
+#else
+
+typedef union Node {
+  struct NodeKey {
+    TValuefields;  /* fields for value */
+    int next;  /* for chaining */
+    Value key_val;  /* key value */
+  } u;
+  TValue i_val;  /* direct access to node's value as a proper 'TValue' */
+} Node;
+
+
+#define setnodekey(node,obj) \
+	{ Node *n_=(node); const TValue *io_=(obj); \
+	  n_->u.key_val = io_->value_; }
+
+
+#define getnodekey(L,obj,node) \
+	{ TValue *io_=(obj); const Node *n_=(node); \
+	  io_->value_ = n_->u.key_val; \
+	  checkliveness(L,io_); }
+
+#endif
+
+
+
+/*
+** Shapes describe the key sets of record-like tables (see 'ltable.c').
+** Tables with equal keys inserted in the same order share a shape, which
+** is an immutable list of short strings. Shapes form a tree, where the
+** children of a shape extend it with one more key.
+*/
+typedef struct Shape {
+  struct Shape *parent;  /* shape without the last key */
+  struct Shape *child;  /* list of shapes extending this one */
+  struct Shape *sibling;  /* next shape in the parent's list */
+  unsigned int nref;  /* number of tables and children using this shape */
+  unsigned int nchild;  /* number of shapes in list 'child' */
+  unsigned int nkeys;  /* number of keys */
+  unsigned int bloom;  /* one bit for each key, selected by its hash */
+  TString *keys[1];  /* keys, in insertion order */
+} Shape;
 
 
 typedef struct Table {
@@ -778,21 +989,41 @@ typedef struct Table {
 /*
 ** Macros to manipulate keys inserted in nodes
 */
-#define keytt(node)		((node)->u.key_tt)
 #define keyval(node)		((node)->u.key_val)
 
+#define keyival(node)		(ivalueraw(keyval(node)))
+#define keystrval(node)		(tsvalueraw(keyval(node)))
+
+#define gckey(n)	(gcvalueraw(keyval(n)))
+#define gckeyN(n)	(keyiscollectable(n) ? gckey(n) : NULL)
+
+#if !defined(LUAI_NANBOX)
+
+#define keytt(node)		((node)->u.key_tt)
+
 #define keyisnil(node)		(keytt(node) == LUA_TNIL)
 #define keyisinteger(node)	(keytt(node) == LUA_VNUMINT)
-#define keyival(node)		(keyval(node).i)
 #define keyisshrstr(node)	(keytt(node) == ctb(LUA_VSHRSTR))
-#define keystrval(node)		(gco2ts(keyval(node).gc))
 
 #define setnilkey(node)		(keytt(node) = LUA_TNIL)
 
 #define keyiscollectable(n)	(keytt(n) & BIT_ISCOLLECTABLE)
 
-#define gckey(n)	(keyval(n).gc)
-#define gckeyN(n)	(keyiscollectable(n) ? gckey(n) : NULL)
+#else
+
+#define keytt(node)		nbtag(keyval(node).u)
+
+#define keyiscode(node,c)	((keyval(node).u >> 47) == (nbbox(c, 0) >> 47))
+
+#define keyisnil(node)		(keyval(node).u == nbbox(NBSIMPLE, LUA_VNIL))
+#define keyisinteger(node)	keyiscode(node, NBINT)
+#define keyisshrstr(node)	keyiscode(node, NBSHRSTR)
+
+#define setnilkey(node)		(keyval(node).u = nbbox(NBSIMPLE, LUA_VNIL))
+
+#define keyiscollectable(n)	(keyval(n).u >= nbbox(8, 0))
+
+#endif
 
 
 /*
@@ -801,8 +1032,14 @@ typedef struct Table {
 ** be found when searched in a special way. ('next' needs that to find
 ** keys removed from a table during a traversal.)
 */
+#if !defined(LUAI_NANBOX)
 #define setdeadkey(node)	(keytt(node) = LUA_TDEADKEY)
 #define keyisdead(node)		(keytt(node) == LUA_TDEADKEY)
+#else
+#define setdeadkey(node)  \
+	(keyval(node).u = nbbox(NBDEADKEY, keyval(node).u & NBPAYLOAD))
+#define keyisdead(node)		keyiscode(node, NBDEADKEY)
+#endif
 
 /* }================================================================== */
 
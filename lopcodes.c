@@ -104,6 +104,28 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 1, 0, 0, 1, iABC)		/* OP_VARARG */
  ,opmode(0, 0, 1, 0, 1, iABC)		/* OP_VARARGPREP */
  ,opmode(0, 0, 0, 0, 0, iAx)		/* OP_EXTRAARG */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MOVECALL */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_GETFIELDCALL */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SELFCALL */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADDFF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SUBFF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MULFF */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_LTFF */
+ ,opmode(0, 0, 0, 1, 0, iABC)		/* OP_LEFF */
+};
+
+
+/* ORDER OP */
+
+LUAI_DDEF const lu_byte luaP_baseop[NUM_OPCODES - OP_FIRSTINTERNAL] = {
+  OP_MOVE		/* OP_MOVECALL */
+ ,OP_GETFIELD		/* OP_GETFIELDCALL */
+ ,OP_SELF		/* OP_SELFCALL */
+ ,OP_ADD		/* OP_ADDFF */
+ ,OP_SUB		/* OP_SUBFF */
+ ,OP_MUL		/* OP_MULFF */
+ ,OP_LT			/* OP_LTFF */
+ ,OP_LE			/* OP_LEFF */
 };
 
 
@@ -136,3 +158,52 @@ int luaP_isIT (Instruction i) {
   }
 }
 
+
+/*
+** Superinstructions are on by default; define LUA_USE_FUSION as 0 to
+** turn them off.
+*/
+#if !defined(LUA_USE_FUSION)
+#define LUA_USE_FUSION	1
+#endif
+
+
+/*
+** Fuse frequent pairs of instructions in 'code' (with 'n' instructions)
+** into superinstructions, which save one dispatch each time they run.
+** Only the opcode of the first instruction of a pair changes (see notes
+** in 'lopcodes.h'), so this pass can run over finished code, both from
+** the code generator and from binary chunks. (Comparisons need no
+** superinstructions, as they already execute their following jump; an
+** upvalue indexed by a constant string is already a single
+** OP_GETTABUP.)
+*/
+void luaP_fuse (Instruction *code, int n) {
+#if LUA_USE_FUSION
+  int pc;
+  for (pc = 0; pc + 1 < n; pc++) {
+    Instruction *i = &code[pc];
+    OpCode next = GET_OPCODE(*(i + 1));
+    switch (GET_OPCODE(*i)) {
+      case OP_MOVE: {
+        if (next == OP_CALL)
+          SET_OPCODE(*i, OP_MOVECALL);
+        break;
+      }
+      case OP_GETFIELD: {
+        if (next == OP_CALL)
+          SET_OPCODE(*i, OP_GETFIELDCALL);
+        break;
+      }
+      case OP_SELF: {
+        if (next == OP_CALL)
+          SET_OPCODE(*i, OP_SELFCALL);
+        break;
+      }
+      default: break;
+    }
+  }
+#else
+  UNUSED(code); UNUSED(n);
+#endif
+}
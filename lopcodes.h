@@ -340,11 +340,24 @@ OP_VARARG,/*	A C	R[A], R[A+1], ..., R[A+C-2] = vararg		*/
 
 OP_VARARGPREP,/*A	(adjust vararg parameters)			*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+OP_MOVECALL,/*	A B	OP_MOVE followed by OP_CALL	(*)		*/
+OP_GETFIELDCALL,/* A B C	OP_GETFIELD followed by OP_CALL			*/
+OP_SELFCALL,/*	A B C	OP_SELF followed by OP_CALL			*/
+
+OP_ADDFF,/*	A B C	OP_ADD specialized for floats	(*)		*/
+OP_SUBFF,/*	A B C	OP_SUB specialized for floats			*/
+OP_MULFF,/*	A B C	OP_MUL specialized for floats			*/
+OP_LTFF,/*	A B k	OP_LT specialized for floats			*/
+OP_LEFF/*	A B k	OP_LE specialized for floats			*/
 } OpCode;
 
 
-#define NUM_OPCODES	((int)(OP_EXTRAARG) + 1)
+#define NUM_OPCODES	((int)(OP_LEFF) + 1)
+
+/* first opcode internal to the VM (see notes) */
+#define OP_FIRSTINTERNAL	OP_MOVECALL
 
 
 
@@ -399,6 +412,22 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
   original operand was a float. (It must be corrected in case of
   metamethods.)
 
+  (*) Opcodes from OP_MOVECALL on are internal to the VM: the code
+  generator never emits them and binary chunks never contain them.
+  Each one has the operands and the mode of its original opcode.
+
+  (*) Opcodes OP_MOVECALL-OP_SELFCALL are superinstructions.
+  'luaP_fuse' creates them by changing only the opcode of the first
+  instruction of a frequent pair, so the second instruction stays in
+  place (jumps into it and debug information are not affected). The
+  VM executes the second instruction right after the first one,
+  without going through the dispatch.
+
+  (*) Opcodes OP_ADDFF-OP_LEFF are quickened instructions. The VM
+  rewrites an instruction into its version specialized for floats
+  when it finds float operands, and back into the generic version
+  when a specialized instruction finds other operands.
+
 ===========================================================================*/
 
 
@@ -422,8 +451,22 @@ LUAI_DDEC(const lu_byte luaP_opmodes[NUM_OPCODES];)
 #define testMMMode(m)	(luaP_opmodes[m] & (1 << 7))
 
 
+/*
+** Original opcode of an instruction, as created by the code generator
+** (for superinstructions, the opcode of their first instruction).
+*/
+LUAI_DDEC(const lu_byte luaP_baseop[NUM_OPCODES - OP_FIRSTINTERNAL];)
+
+#define isinternalop(op)	((op) >= OP_FIRSTINTERNAL)
+
+#define GET_BASEOP(i)	(isinternalop(GET_OPCODE(i)) \
+	? cast(OpCode, luaP_baseop[GET_OPCODE(i) - OP_FIRSTINTERNAL]) \
+	: GET_OPCODE(i))
+
+
 LUAI_FUNC int luaP_isOT (Instruction i);
 LUAI_FUNC int luaP_isIT (Instruction i);
+LUAI_FUNC void luaP_fuse (Instruction *code, int n);
 
 
 #endif
@@ -96,6 +96,14 @@ static const char *const opnames[] = {
   "VARARG",
   "VARARGPREP",
   "EXTRAARG",
+  "MOVECALL",
+  "GETFIELDCALL",
+  "SELFCALL",
+  "ADDFF",
+  "SUBFF",
+  "MULFF",
+  "LTFF",
+  "LEFF",
   NULL
 };
 
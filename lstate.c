@@ -146,7 +146,7 @@ LUAI_FUNC void luaE_incCstack (lua_State *L) {
 static void stack_init (lua_State *L1, lua_State *L) {
   int i; CallInfo *ci;
   /* initialize stack array */
-  L1->stack.p = luaM_newvector(L, BASIC_STACK_SIZE + EXTRA_STACK, StackValue);
+  L1->stack.p = cast(StkId, luaM_newblock(L, stackbytes(BASIC_STACK_SIZE)));
   L1->tbclist.p = L1->stack.p;
   for (i = 0; i < BASIC_STACK_SIZE + EXTRA_STACK; i++)
     setnilvalue(s2v(L1->stack.p + i));  /* erase new stack */
@@ -172,7 +172,7 @@ static void freestack (lua_State *L) {
   freeCI(L);
   lua_assert(L->nci == 0);
   /* free stack */
-  luaM_freearray(L, L->stack.p, cast_sizet(stacksize(L) + EXTRA_STACK));
+  luaM_freemem(L, L->stack.p, stackbytes(stacksize(L)));
 }
 
 
@@ -242,7 +242,7 @@ lu_mem luaE_threadsize (lua_State *L) {
   lu_mem sz = cast(lu_mem, sizeof(LX))
             + cast_uint(L->nci) * sizeof(CallInfo);
   if (L->stack.p != NULL)
-    sz += cast_uint(stacksize(L) + EXTRA_STACK) * sizeof(StackValue);
+    sz += stackbytes(stacksize(L));
   return sz;
 }
 
@@ -258,7 +258,13 @@ static void close_state (lua_State *L) {
     luai_userstateclose(L);
   }
   luaM_freearray(L, G(L)->strt.hash, cast_sizet(G(L)->strt.size));
+  if (G(L)->strt.old != NULL)  /* in the middle of a resize? */
+    luaM_freearray(L, G(L)->strt.old, cast_sizet(G(L)->strt.oldsize));
+  lua_assert(g->rootshape.child == NULL);  /* all shapes were freed */
   freestack(L);
+#if defined(LUAI_PAGEHEAP)
+  luaM_freepages(L);
+#endif
   lua_assert(gettotalbytes(g) == sizeof(global_State));
   (*g->frealloc)(g->ud, g, sizeof(global_State), 0);  /* free main block */
 }
@@ -297,7 +303,7 @@ void luaE_freethread (lua_State *L, lua_State *L1) {
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
   freestack(L1);
-  luaM_free(L, l);
+  luaM_freeobject(L, l, sizeof(*l));
 }
 
 
@@ -351,13 +357,31 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   g->seed = seed;
   g->gcstp = GCSTPGC;  /* no GC while building state */
   g->strt.size = g->strt.nuse = 0;
-  g->strt.hash = NULL;
+  g->strt.oldsize = g->strt.moved = 0;
+  g->strt.hash = g->strt.old = NULL;
+  g->rootshape.parent = g->rootshape.child = g->rootshape.sibling = NULL;
+  g->rootshape.nref = 1;  /* the root is never freed */
+  g->rootshape.nkeys = g->rootshape.bloom = g->rootshape.nchild = 0;
+  g->deadshapes = NULL;
+  g->gcpool = NULL;
+  g->gcfreer = NULL;
+  g->pageheap = NULL;
+  g->graystack = NULL;
+  g->ngray = g->sizegray = 0;
+  g->cardhash = NULL;
+  g->lastcards = NULL;
+  g->ncards = g->sizecardhash = 0;
+  g->ephlog = NULL;
+  g->nephlog = g->sizeephlog = 0;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
   g->gcstate = GCSpause;
   g->gckind = KGC_INC;
   g->gcstopem = 0;
   g->gcemergency = 0;
+  g->gcrecpauses = 0;
+  g->gcdeferfin = 0;
+  g->gclogeph = 0;
   g->finobj = g->tobefnz = g->fixedgc = NULL;
   g->firstold1 = g->survival = g->old1 = g->reallyold = NULL;
   g->finobjsur = g->finobjold1 = g->finobjrold = NULL;
@@ -368,14 +392,19 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   g->GCtotalbytes = sizeof(global_State);
   g->GCmarked = 0;
   g->GCdebt = 0;
+  g->GClimit = 0;  /* no memory limit */
   setivalue(&g->nilvalue, 0);  /* to signal that state is not yet built */
   setgcparam(g, PAUSE, LUAI_GCPAUSE);
   setgcparam(g, STEPMUL, LUAI_GCMUL);
   setgcparam(g, STEPSIZE, LUAI_GCSTEPSIZE);
   setgcparam(g, MINORMUL, LUAI_GENMINORMUL);
+  setgcparam(g, NURSERY, LUAI_GENNURSERY);
   setgcparam(g, MINORMAJOR, LUAI_MINORMAJOR);
   setgcparam(g, MAJORMINOR, LUAI_MAJORMINOR);
   for (i=0; i < LUA_NUMTYPES; i++) g->mt[i] = NULL;
+  for (i=0; i < GCPAUSEN; i++) g->gcpauses[i] = 0;
+  memset(&g->gcstats, 0, sizeof(g->gcstats));
+  g->gcstats.nnew[LUA_TTHREAD] = 1;  /* main thread */
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
     close_state(L);
@@ -77,7 +77,8 @@ typedef struct CallInfo CallInfo;
 **   - all kinds of weak tables during propagation phase;
 **   - all threads.
 ** 'weak': tables with weak values to be cleared;
-** 'ephemeron': ephemeron tables with white->white entries;
+** 'ephemeron': ephemeron tables with white->white entries (or with
+**   any white key, while the collector logs their entries);
 ** 'allweak': tables with weak keys and/or weak values to be cleared.
 **
 ** The exceptions to that "gray rule" are:
@@ -158,16 +159,44 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define stacksize(th)	cast_int((th)->stack_last.p - (th)->stack.p)
 
 
+/*
+** Deltas of the list of to-be-closed variables ('tbclist'). With NaN
+** boxing, stack slots have no room for them, so they are kept in an
+** array of shorts following the stack slots in the same block.
+*/
+#if !defined(LUAI_NANBOX)
+#define stackslotsize	sizeof(StackValue)
+#define tbcdelta(L,o)	((o)->tbclist.delta)
+#else
+#define stackslotsize	(sizeof(StackValue) + sizeof(unsigned short))
+#define tbcdelta(L,o)  \
+	(cast(unsigned short *, (L)->stack_last.p + EXTRA_STACK) \
+	  [(o) - (L)->stack.p])
+#endif
+
+/* size in bytes of a stack block with 'n' slots (plus the extra ones) */
+#define stackbytes(n)	(cast_sizet((n) + EXTRA_STACK) * stackslotsize)
+
+
 /* kinds of Garbage Collection */
 #define KGC_INC		0	/* incremental gc */
 #define KGC_GENMINOR	1	/* generational gc in minor (regular) mode */
 #define KGC_GENMAJOR	2	/* generational in major mode */
 
 
+/*
+** The string table is resized incrementally: while 'old' is not NULL,
+** its buckets are being moved to 'hash'. The first 'moved' buckets of
+** 'old' were already moved (and are garbage); the other ones still
+** hold their strings.
+*/
 typedef struct stringtable {
   TString **hash;  /* array of buckets (linked lists of strings) */
+  TString **old;  /* buckets being moved to 'hash' (or NULL) */
   int nuse;  /* number of elements */
   int size;  /* number of buckets */
+  int oldsize;  /* number of buckets in 'old' */
+  int moved;  /* number of buckets of 'old' already moved */
 } stringtable;
 
 
@@ -325,6 +354,43 @@ typedef struct LX {
 } LX;
 
 
+/*
+** Number of buckets in the histogram of collector pauses. Bucket 0
+** counts pauses shorter than 1 microsecond; bucket 'i' counts pauses
+** in the interval [2^(i-1), 2^i) microseconds; the last one also
+** counts all longer pauses.
+*/
+#define GCPAUSEN	24
+
+
+/*
+** Kinds of allocation sites counted in 'gcstats.sites'
+*/
+#define MEMSBLOCK	0  /* new blocks other than objects (arrays, etc.) */
+#define MEMSOBJ		1  /* new collectable objects */
+#define MEMSRESIZE	2  /* reallocations of existing blocks */
+#define MEMNSITES	3
+
+
+/*
+** Allocation statistics. Counters per object type are indexed by the
+** type without variant bits (so upvalues and prototypes have their
+** own entries). Freed bytes are accumulated in 'freed' during a cycle
+** and moved to 'lastfreed' when the cycle ends.
+*/
+typedef struct GCStats {
+  lu_mem nnew[LUA_TOTALTYPES];  /* number of objects created */
+  lu_mem nfree[LUA_TOTALTYPES];  /* number of objects freed */
+  lu_mem freed[LUA_TOTALTYPES];  /* bytes freed in current cycle */
+  lu_mem lastfreed[LUA_TOTALTYPES];  /* bytes freed in last cycle */
+  lu_mem sites[MEMNSITES];  /* bytes requested by each kind of site */
+  lu_mem nrefused;  /* allocation attempts refused by the memory limit */
+  lu_mem npendingfin;  /* number of objects in 'tobefnz' */
+  lu_mem nfinalized;  /* number of finalizers called */
+} GCStats;
+
+
+
 /*
 ** 'global state', shared by all threads of this state
 */
@@ -335,27 +401,48 @@ typedef struct global_State {
   l_mem GCdebt;  /* bytes counted but not yet allocated */
   l_mem GCmarked;  /* number of objects marked in a GC cycle */
   l_mem GCmajorminor;  /* auxiliary counter to control major-minor shifts */
+  l_mem GClimit;  /* maximum number of bytes in use (0 means no limit) */
   stringtable strt;  /* hash table for strings */
+  Shape rootshape;  /* empty shape, root of the tree of shapes */
+  Shape *deadshapes;  /* list of shapes to be freed */
   TValue l_registry;
   TValue nilvalue;  /* a nil value */
   unsigned int seed;  /* randomized seed for hashes */
   lu_byte gcparams[LUA_GCPN];
+  lu_mem gcpauses[GCPAUSEN];  /* histogram of collector pauses */
+  GCStats gcstats;  /* allocation statistics */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcstopem;  /* stops emergency collections */
   lu_byte gcstp;  /* control whether GC is running */
   lu_byte gcemergency;  /* true if this is an emergency collection */
+  lu_byte gcrecpauses;  /* true if recording pause times */
+  lu_byte gcdeferfin;  /* true if the program calls the finalizers */
+  lu_byte gclogeph;  /* true while 'ephlog' is complete */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
   GCObject *gray;  /* list of gray objects */
+  GCObject **graystack;  /* stack of gray objects (page heap only) */
+  int ngray;  /* number of objects in 'graystack' */
+  int sizegray;  /* size of 'graystack' */
   GCObject *grayagain;  /* list of objects to be traversed atomically */
   GCObject *weak;  /* list of tables with weak values */
   GCObject *ephemeron;  /* list of ephemeron tables (weak keys) */
   GCObject *allweak;  /* list of all-weak tables */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
+  struct GCPool *gcpool;  /* threads for parallel marking (or NULL) */
+  struct GCFreer *gcfreer;  /* thread for background freeing (or NULL) */
+  struct PageHeap *pageheap;  /* pages for small objects (or NULL) */
+  struct Cards **cardhash;  /* cards of large touched tables */
+  struct Cards *lastcards;  /* cards last used by a barrier (or NULL) */
+  unsigned int ncards;  /* number of tables in 'cardhash' */
+  unsigned int sizecardhash;  /* size of 'cardhash' */
+  Node **ephlog;  /* ephemeron entries with white keys */
+  unsigned int nephlog;  /* number of entries in 'ephlog' */
+  unsigned int sizeephlog;  /* size of 'ephlog' */
   /* fields for generational collector */
   GCObject *survival;  /* start of objects that survived one GC cycle */
   GCObject *old1;  /* start of old1 objects */
@@ -38,6 +38,18 @@
 #endif
 
 
+/*
+** Number of buckets moved to the new vector, during a resize of the
+** string table, for each new string. It must be at least 4, so that
+** a resize always finishes before the table needs to grow again. (A
+** table shrunk to 'n' buckets has '2n' buckets to move and can be
+** full again after 'n/2' new strings.)
+*/
+#if !defined(STRMOVE)
+#define STRMOVE		4
+#endif
+
+
 /*
 ** equality for long strings
 */
@@ -50,6 +62,73 @@ int luaS_eqlngstr (TString *a, TString *b) {
 }
 
 
+#if defined(LUAI_WORDHASH)
+
+/*
+** Keyed word-at-a-time hash: SipHash-1-3 over words of type 'size_t'
+** (with 32-bit words, the same construction with the rotations of
+** HalfSipHash). Each word goes through one round and the result
+** through three more, so the chain of dependent operations has one
+** step per word instead of one per byte. The key comes from the seed:
+** without the key, one cannot build strings that collide, but the key
+** is only as hard to guess as the seed, which has the size of an
+** 'unsigned' and, by default, little entropy (see 'luai_makeseed').
+** Resistance to collision attacks needs a random seed.
+*/
+
+/* number of bits in a word */
+#define WORDBITS	cast_int(sizeof(size_t) * CHAR_BIT)
+
+/* a word from two 32-bit halves (only the low half, for 32-bit words) */
+#define mkword(hi,lo)	((cast_sizet(hi) << 16 << 16) | cast_sizet(lo))
+
+/* an odd multiplier, to spread the seed over the second key word */
+#define WORDMUL		mkword(0x9E3779B9u, 0x7F4A7C15u)
+
+#define rotl(x,b)	(((x) << (b)) | ((x) >> (WORDBITS - (b))))
+
+#define sipround(v0,v1,v2,v3,r) {  \
+	v0 += v1; v1 = rotl(v1, r[0]); v1 ^= v0; v0 = rotl(v0, r[1]);  \
+	v2 += v3; v3 = rotl(v3, r[2]); v3 ^= v2;  \
+	v0 += v3; v3 = rotl(v3, r[3]); v3 ^= v0;  \
+	v2 += v1; v1 = rotl(v1, r[4]); v1 ^= v2; v2 = rotl(v2, r[5]); }
+
+#define loadword(w,p)	memcpy(&(w), p, sizeof(size_t))
+
+unsigned luaS_hash (const char *str, size_t l, unsigned seed) {
+  static const int r64[] = {13, 32, 16, 21, 17, 32};
+  static const int r32[] = {5, 16, 8, 7, 13, 16};
+  const int *r = (WORDBITS == 64) ? r64 : r32;
+  size_t k0 = cast_sizet(seed);
+  size_t k1 = k0 * WORDMUL;
+  size_t v0 = k0 ^ mkword(0x736f6d65u, 0x70736575u);
+  size_t v1 = k1 ^ mkword(0x646f7261u, 0x6e646f6du);
+  size_t v2 = k0 ^ mkword(0x6c796765u, 0x6e657261u);
+  size_t v3 = k1 ^ mkword(0x74656462u, 0x79746573u);
+  const char *end = str + (l - l % sizeof(size_t));  /* after whole words */
+  size_t w;
+  for (; str < end; str += sizeof(size_t)) {
+    loadword(w, str);
+    v3 ^= w;
+    sipround(v0, v1, v2, v3, r);
+    v0 ^= w;
+  }
+  w = cast_sizet(l) << (WORDBITS - 8);  /* last word has the length... */
+  for (l %= sizeof(size_t); l > 0; l--)  /* ...and the remaining bytes */
+    w |= cast_sizet(cast_byte(str[l - 1])) << (8 * (l - 1));
+  v3 ^= w;
+  sipround(v0, v1, v2, v3, r);
+  v0 ^= w;
+  v2 ^= 0xff;
+  sipround(v0, v1, v2, v3, r);
+  sipround(v0, v1, v2, v3, r);
+  sipround(v0, v1, v2, v3, r);
+  w = v0 ^ v1 ^ v2 ^ v3;
+  return cast_uint(w ^ (w >> 16 >> 16));  /* fold high half (if any) */
+}
+
+#else
+
 unsigned luaS_hash (const char *str, size_t l, unsigned seed) {
   unsigned int h = seed ^ cast_uint(l);
   for (; l > 0; l--)
@@ -57,6 +136,8 @@ unsigned luaS_hash (const char *str, size_t l, unsigned seed) {
   return h;
 }
 
+#endif
+
 
 unsigned luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_VLNGSTR);
@@ -69,46 +150,72 @@ unsigned luaS_hashlongstr (TString *ts) {
 }
 
 
-static void tablerehash (TString **vect, int osize, int nsize) {
-  int i;
-  for (i = osize; i < nsize; i++)  /* clear new elements */
-    vect[i] = NULL;
-  for (i = 0; i < osize; i++) {  /* rehash old part of the array */
-    TString *p = vect[i];
-    vect[i] = NULL;
+/*
+** Returns the list where a string with hash 'h' is (or should be):
+** during a resize, strings in buckets of 'old' not yet moved are
+** still there.
+*/
+static TString **strlist (stringtable *tb, unsigned int h) {
+  if (tb->old != NULL) {  /* resizing? */
+    unsigned int i = lmod(h, tb->oldsize);
+    if (i >= cast_uint(tb->moved))  /* bucket not moved yet? */
+      return &tb->old[i];
+  }
+  return &tb->hash[lmod(h, tb->size)];
+}
+
+
+/*
+** Move up to 'n' buckets of the old vector to the new one, freeing
+** the old vector after moving its last bucket. The new vector is not
+** cleared when created: as both sizes are powers of 2, a new bucket
+** 'k' receives the old buckets congruent to 'k' modulo the smaller
+** size, so it is cleared when the first of them is moved. Before
+** that, 'strlist' never goes to it.
+*/
+void luaS_rehash (lua_State *L, int n) {
+  stringtable *tb = &G(L)->strt;
+  for (; n > 0 && tb->old != NULL; n--) {
+    int i = tb->moved;
+    TString *p = tb->old[i];
+    int k;
+    for (k = i; k < tb->size; k += tb->oldsize)  /* clear new buckets */
+      tb->hash[k] = NULL;
     while (p) {  /* for each string in the list */
       TString *hnext = p->u.hnext;  /* save next */
-      unsigned int h = lmod(p->hash, nsize);  /* new position */
-      p->u.hnext = vect[h];  /* chain it into array */
-      vect[h] = p;
+      unsigned int h = lmod(p->hash, tb->size);  /* new position */
+      p->u.hnext = tb->hash[h];  /* chain it into new vector */
+      tb->hash[h] = p;
       p = hnext;
     }
+    tb->moved = i + 1;
+    if (tb->moved == tb->oldsize) {  /* moved all buckets? */
+      luaM_freearray(L, tb->old, cast_sizet(tb->oldsize));
+      tb->old = NULL;
+      tb->oldsize = tb->moved = 0;
+    }
   }
 }
 
 
 /*
-** Resize the string table. If allocation fails, keep the current size.
-** (This can degrade performance, but any non-zero size should work
-** correctly.)
+** Start a resize of the string table; its buckets are moved to the
+** new vector by 'luaS_rehash', a few at a time. If allocation fails,
+** keep the current size. (This can degrade performance, but any
+** non-zero size should work correctly.)
 */
 void luaS_resize (lua_State *L, int nsize) {
   stringtable *tb = &G(L)->strt;
-  int osize = tb->size;
   TString **newvect;
-  if (nsize < osize)  /* shrinking table? */
-    tablerehash(tb->hash, osize, nsize);  /* depopulate shrinking part */
-  newvect = luaM_reallocvector(L, tb->hash, osize, nsize, TString*);
-  if (l_unlikely(newvect == NULL)) {  /* reallocation failed? */
-    if (nsize < osize)  /* was it shrinking table? */
-      tablerehash(tb->hash, nsize, osize);  /* restore to original size */
-    /* leave table as it was */
-  }
-  else {  /* allocation succeeded */
+  if (tb->old != NULL)  /* previous resize not finished? */
+    luaS_rehash(L, tb->oldsize - tb->moved);  /* finish it */
+  newvect = luaM_reallocvector(L, NULL, 0, nsize, TString*);
+  if (l_likely(newvect != NULL)) {  /* allocation succeeded? */
+    tb->old = tb->hash;
+    tb->oldsize = tb->size;
+    tb->moved = 0;
     tb->hash = newvect;
     tb->size = nsize;
-    if (nsize > osize)
-      tablerehash(newvect, osize, nsize);  /* rehash for new size */
   }
 }
 
@@ -135,7 +242,8 @@ void luaS_init (lua_State *L) {
   int i, j;
   stringtable *tb = &G(L)->strt;
   tb->hash = luaM_newvector(L, MINSTRTABSIZE, TString*);
-  tablerehash(tb->hash, 0, MINSTRTABSIZE);  /* clear array */
+  for (i = 0; i < MINSTRTABSIZE; i++)  /* clear array */
+    tb->hash[i] = NULL;
   tb->size = MINSTRTABSIZE;
   /* pre-create memory-error message */
   g->memerrmsg = luaS_newliteral(L, MEMERRMSG);
@@ -189,7 +297,7 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
-  TString **p = &tb->hash[lmod(ts->hash, tb->size)];
+  TString **p = strlist(tb, ts->hash);
   while (*p != ts)  /* find previous element */
     p = &(*p)->u.hnext;
   *p = (*p)->u.hnext;  /* remove element from its list */
@@ -216,7 +324,7 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   global_State *g = G(L);
   stringtable *tb = &g->strt;
   unsigned int h = luaS_hash(str, l, g->seed);
-  TString **list = &tb->hash[lmod(h, tb->size)];
+  TString **list = strlist(tb, h);
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
   for (ts = *list; ts != NULL; ts = ts->u.hnext) {
     if (l == cast_uint(ts->shrlen) &&
@@ -228,9 +336,11 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
     }
   }
   /* else must create a new string */
-  if (tb->nuse >= tb->size) {  /* need to grow string table? */
+  if (tb->nuse >= tb->size)  /* need to grow string table? */
     growstrtab(L, tb);
-    list = &tb->hash[lmod(h, tb->size)];  /* rehash with new size */
+  if (tb->old != NULL) {  /* resizing? */
+    luaS_rehash(L, STRMOVE);  /* move some buckets */
+    list = strlist(tb, h);  /* string may go elsewhere now */
   }
   ts = createstrobj(L, sizestrshr(l), LUA_VSHRSTR, h);
   ts->shrlen = cast(ls_byte, l);
@@ -20,6 +20,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lua.h"
 
 #include "lauxlib.h"
@@ -346,10 +350,35 @@ static const luaL_Reg stringmetamethods[] = {
 #define CAP_POSITION	(-2)
 
 
+/* a set of characters, with one bit for each possible char */
+typedef unsigned char CharSet[(UCHAR_MAX + 1) / CHAR_BIT];
+
+#define testcharset(cs,c)	((cs)[(c) / CHAR_BIT] & (1u << ((c) % CHAR_BIT)))
+
+
+/*
+** Item of a compiled pattern, for a position where the matcher finds
+** a single-char class
+*/
+typedef struct PatItem {
+  unsigned short len;  /* length of the class (0 if not compiled) */
+  unsigned short set;  /* 1 + index of its char set (0 if none) */
+} PatItem;
+
+
+/* compiled pattern */
+typedef struct CPattern {
+  PatItem *items;  /* one for each position in the pattern */
+  CharSet *sets;  /* sets of '%x' and '[set]' classes */
+} CPattern;
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
+  const char *p_init;  /* init of pattern (including a '^') */
   const char *p_end;  /* end ('\0') of pattern */
+  const CPattern *cp;  /* compiled pattern, or NULL */
   lua_State *L;
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   int level;  /* total number of captures (finished or unfinished) */
@@ -391,19 +420,23 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/*
+** Returns the end of the single-char class starting at 'p', or NULL if
+** the class is malformed.
+*/
+static const char *classlimit (const char *p, const char *p_end) {
   switch (*p++) {
     case L_ESC: {
-      if (l_unlikely(p == ms->p_end))
-        luaL_error(ms->L, "malformed pattern (ends with '%%')");
+      if (l_unlikely(p == p_end))
+        return NULL;  /* pattern ends with '%' */
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a ']' */
-        if (l_unlikely(p == ms->p_end))
-          luaL_error(ms->L, "malformed pattern (missing ']')");
-        if (*(p++) == L_ESC && p < ms->p_end)
+        if (l_unlikely(p == p_end))
+          return NULL;  /* missing ']' */
+        if (*(p++) == L_ESC && p < p_end)
           p++;  /* skip escapes (e.g. '%]') */
       } while (*p != ']');
       return p+1;
@@ -415,6 +448,25 @@ static const char *classend (MatchState *ms, const char *p) {
 }
 
 
+/* item for position 'p' of a compiled pattern */
+#define getitem(ms,p)	(&(ms)->cp->items[(p) - (ms)->p_init])
+
+
+static const char *classend (MatchState *ms, const char *p) {
+  const char *ep;
+  if (ms->cp != NULL && getitem(ms, p)->len != 0)  /* compiled? */
+    return p + getitem(ms, p)->len;
+  ep = classlimit(p, ms->p_end);
+  if (l_unlikely(ep == NULL)) {
+    if (*p == L_ESC)
+      luaL_error(ms->L, "malformed pattern (ends with '%%')");
+    else
+      luaL_error(ms->L, "malformed pattern (missing ']')");
+  }
+  return ep;
+}
+
+
 static int match_class (int c, int cl) {
   int res;
   switch (tolower(cl)) {
@@ -458,19 +510,29 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
+/*
+** Check whether char 'c' matches the single-char class [p, ep), using
+** the set precomputed for that class when the pattern is compiled.
+*/
+static int classmatch (MatchState *ms, int c, const char *p,
+                       const char *ep) {
+  if (ms->cp != NULL && getitem(ms, p)->set != 0)
+    return testcharset(ms->cp->sets[getitem(ms, p)->set - 1], c) != 0;
+  switch (*p) {
+    case '.': return 1;  /* matches any char */
+    case L_ESC: return match_class(c, cast_uchar(*(p+1)));
+    case '[': return matchbracketclass(c, p, ep-1);
+    default:  return (cast_uchar(*p) == c);
+  }
+}
+
+
 static int singlematch (MatchState *ms, const char *s, const char *p,
                         const char *ep) {
   if (s >= ms->src_end)
     return 0;
-  else {
-    int c = cast_uchar(*s);
-    switch (*p) {
-      case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, cast_uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
-      default:  return (cast_uchar(*p) == c);
-    }
-  }
+  else
+    return classmatch(ms, cast_uchar(*s), p, ep);
 }
 
 
@@ -597,8 +659,8 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
               luaL_error(ms->L, "missing '[' after '%%f' in pattern");
             ep = classend(ms, p);  /* points to what is next */
             previous = (s == ms->src_init) ? '\0' : *(s - 1);
-            if (!matchbracketclass(cast_uchar(previous), p, ep - 1) &&
-               matchbracketclass(cast_uchar(*s), p, ep - 1)) {
+            if (!classmatch(ms, cast_uchar(previous), p, ep) &&
+               classmatch(ms, cast_uchar(*s), p, ep)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
             }
             s = NULL;  /* match failed */
@@ -661,22 +723,44 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+/*
+** Search for 's2' in 's1'. Only positions where both the first and the
+** last chars of 's2' match are compared in full, which avoids most of
+** the quadratic behavior of repetitive subjects and long needles. With
+** SSE2, each step tests 16 positions at once; the remaining positions
+** (or all of them, without SSE2) go through 'memchr' for the first char.
+*/
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else if (l2 == 1) return (const char *)memchr(s1, *s2, l1);
   else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= ct_diff2sz(init - s1);
-        s1 = init;
+    const char *last = s1 + (l1 - l2);  /* last position for a match */
+    char lc = s2[l2 - 1];  /* last char of 's2' */
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i vf = _mm_set1_epi8(s2[0]);
+    __m128i vl = _mm_set1_epi8(lc);
+    while (last - s1 >= 15) {  /* 16 whole positions ahead? */
+      __m128i f = _mm_loadu_si128(cast(const __m128i *, s1));
+      __m128i l = _mm_loadu_si128(cast(const __m128i *, s1 + l2 - 1));
+      unsigned int m = cast_uint(_mm_movemask_epi8(_mm_and_si128(
+                         _mm_cmpeq_epi8(f, vf), _mm_cmpeq_epi8(l, vl))));
+      while (m != 0) {  /* check each candidate */
+        const char *init = s1 + __builtin_ctz(m);
+        if (memcmp(init + 1, s2 + 1, l2 - 2) == 0)
+          return init;
+        m &= m - 1;  /* remove candidate */
       }
+      s1 += 16;
+    }
+#endif
+    while (s1 <= last &&
+           (s1 = (const char *)memchr(s1, *s2,
+                                      ct_diff2sz(last - s1) + 1)) != NULL) {
+      if (s1[l2 - 1] == lc && memcmp(s1 + 1, s2 + 1, l2 - 2) == 0)
+        return s1;
+      s1++;  /* try again after this position */
     }
     return NULL;  /* not found */
   }
@@ -746,13 +830,46 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
+/*
+** Length of the literal prefix of a pattern: its first chars that are
+** not special and have no suffix, and so must start any match. (Chars
+** that could be a suffix, as well as '\0', end the prefix.)
+*/
+static size_t literalprefix (const char *p, size_t lp) {
+  size_t i = 0;
+  while (i < lp && strchr(SPECIALS ")", p[i]) == NULL &&
+         (i + 1 == lp || strchr("*+?-", p[i + 1]) == NULL))
+    i++;
+  return i;
+}
+
+
+/*
+** Next position from 's' on where a match can start, that is, the next
+** occurrence of the literal prefix of the pattern (the first 'lpre'
+** chars of 'p'). For anchored matches, the prefix must be right at 's'.
+** Returns NULL if there is no such position.
+*/
+static const char *nextstart (MatchState *ms, const char *s,
+                              const char *p, size_t lpre, int anchor) {
+  size_t l = ct_diff2sz(ms->src_end - s);
+  if (!anchor)
+    return lmemfind(s, l, p, lpre);
+  else
+    return (l >= lpre && memcmp(s, p, lpre) == 0) ? s : NULL;
+}
+
+
 static void prepstate (MatchState *ms, lua_State *L,
-                       const char *s, size_t ls, const char *p, size_t lp) {
+                       const char *s, size_t ls, const char *p, size_t lp,
+                       const CPattern *cp) {
   ms->L = L;
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
+  ms->p_init = p;
   ms->p_end = p + lp;
+  ms->cp = cp;
 }
 
 
@@ -762,6 +879,231 @@ static void reprepstate (MatchState *ms) {
 }
 
 
+/*
+** Compiled patterns. For each position in a pattern where the matcher
+** can find a single-char class, a compiled pattern keeps the length of
+** that class and, for '%x' and '[set]' classes, the set of chars that
+** the class matches. The matcher still walks the pattern itself, so
+** errors and backtracking are exactly as without compilation, but it
+** does not parse a class again for each char in the subject.
+** Each instance of the library keeps a small LRU cache of compiled
+** patterns, indexed by the addresses of the pattern strings. The cache
+** anchors these strings (in user values of the cache), so that their
+** addresses cannot be reused while they are there. Only patterns used
+** at least PATMINUSES times are compiled.
+*/
+
+/* number of patterns in the cache */
+#if !defined(LUA_PATCACHESIZE)
+#define LUA_PATCACHESIZE	16
+#endif
+
+/* number of uses of a pattern before it is compiled */
+#if !defined(PATMINUSES)
+#define PATMINUSES	2
+#endif
+
+/* maximum size (including the '\0') of a locale name kept by the cache */
+#define LOCALESIZE	64
+
+
+typedef struct PatCache {
+  struct {
+    const char *p;  /* pattern (anchored in user value 2*i + 1) */
+    size_t lp;  /* length of pattern */
+    const CPattern *cp;  /* compiled pattern (anchored in user value 2*i + 2) */
+    unsigned int uses;  /* number of uses (up to PATMINUSES) */
+    unsigned int lastuse;  /* time of last use */
+  } e[LUA_PATCACHESIZE];
+  unsigned int clock;  /* current time for the LRU policy */
+  char locale[LOCALESIZE];  /* locale used to build the char sets */
+} PatCache;
+
+
+typedef struct CompState {
+  const char *p;  /* pattern being compiled */
+  size_t lp;  /* length of pattern */
+  CPattern *cp;  /* compiled pattern */
+  unsigned short nsets;  /* number of char sets in use */
+} CompState;
+
+
+/*
+** Compile the class at position 'i' of the pattern. Returns the
+** position after the class, or 0 if the class is malformed.
+*/
+static size_t compileclass (CompState *cs, size_t i) {
+  const char *p = cs->p + i;
+  const char *ep = classlimit(p, cs->p + cs->lp);
+  PatItem *item = &cs->cp->items[i];
+  if (ep == NULL)
+    return 0;  /* leave the error to the matcher */
+  if (item->len == 0) {  /* not compiled yet? */
+    item->len = cast(unsigned short, ep - p);
+    if (*p == L_ESC || *p == '[') {
+      unsigned char *set = cs->cp->sets[cs->nsets];
+      int c;
+      memset(set, 0, sizeof(CharSet));
+      for (c = 0; c <= UCHAR_MAX; c++) {
+        if ((*p == L_ESC) ? match_class(c, cast_uchar(*(p + 1)))
+                          : matchbracketclass(c, p, ep - 1))
+          set[c / CHAR_BIT] |= cast(unsigned char, 1u << (c % CHAR_BIT));
+      }
+      item->set = ++cs->nsets;
+    }
+  }
+  return i + item->len;
+}
+
+
+/*
+** Compile the classes of the pattern from position 'i' on, following
+** the same path through the pattern as 'match'. It stops at anything
+** malformed, leaving the rest of the pattern (and the error) to the
+** matcher.
+*/
+static void compilefrom (CompState *cs, size_t i) {
+  const char *p = cs->p;
+  size_t lp = cs->lp;
+  while (i < lp) {
+    switch (p[i]) {
+      case '(': {  /* start capture */
+        i += (p[i + 1] == ')') ? 2 : 1;
+        break;
+      }
+      case ')': {  /* end capture */
+        i++;
+        break;
+      }
+      case '$': {
+        if (i + 1 == lp)  /* is the '$' the last char in pattern? */
+          return;  /* end of pattern */
+        goto dflt;
+      }
+      case L_ESC: {
+        switch (p[i + 1]) {
+          case 'b': {  /* balanced string */
+            if (i + 2 >= lp - 1)  /* missing arguments? */
+              return;
+            i += 4;
+            break;
+          }
+          case 'f': {  /* frontier */
+            i += 2;
+            if (p[i] != '[' || (i = compileclass(cs, i)) == 0)
+              return;
+            break;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {  /* capture results */
+            i += 2;
+            break;
+          }
+          default: goto dflt;
+        }
+        break;
+      }
+      default: dflt: {  /* pattern class plus optional suffix */
+        if ((i = compileclass(cs, i)) == 0)
+          return;
+        if (p[i] == '*' || p[i] == '+' || p[i] == '?' || p[i] == '-')
+          i++;  /* skip suffix */
+        break;
+      }
+    }
+  }
+}
+
+
+/*
+** Compile pattern 'p' into a new userdata, which is left on the stack.
+*/
+static const CPattern *compilepattern (lua_State *L, const char *p,
+                                                     size_t lp) {
+  CompState cs;
+  size_t nsets = 0;  /* upper bound for the number of char sets */
+  size_t i;
+  for (i = 0; i < lp; i++) {
+    if (p[i] == L_ESC || p[i] == '[')
+      nsets++;
+  }
+  cs.cp = (CPattern *)lua_newuserdatauv(L, sizeof(CPattern) +
+                   lp * sizeof(PatItem) + nsets * sizeof(CharSet), 0);
+  cs.cp->items = (PatItem *)(cs.cp + 1);
+  cs.cp->sets = (CharSet *)(cs.cp->items + lp);
+  memset(cs.cp->items, 0, lp * sizeof(PatItem));
+  cs.p = p; cs.lp = lp; cs.nsets = 0;
+  compilefrom(&cs, 0);
+  if (*p == '^')  /* may be used as an anchor? */
+    compilefrom(&cs, 1);  /* compile the path for anchored matches too */
+  return cs.cp;
+}
+
+
+/*
+** Char sets for classes such as '%a' depend on the current locale, so
+** the cache drops all compiled patterns when the locale changes.
+*/
+static void checklocale (lua_State *L, PatCache *pc) {
+  const char *loc = setlocale(LC_CTYPE, NULL);
+  if (loc == NULL) loc = "";
+  if (l_unlikely(strncmp(loc, pc->locale, LOCALESIZE - 1) != 0)) {
+    int i;
+    for (i = 0; i < LUA_PATCACHESIZE; i++) {
+      if (pc->e[i].cp != NULL) {
+        pc->e[i].cp = NULL;
+        lua_pushnil(L);
+        lua_setiuservalue(L, lua_upvalueindex(1), 2*i + 2);
+      }
+    }
+    strncpy(pc->locale, loc, LOCALESIZE - 1);
+    pc->locale[LOCALESIZE - 1] = '\0';
+  }
+}
+
+
+/*
+** Get the compiled form of pattern 'p' (the string at index 'arg'), or
+** NULL if it is not compiled. Pushes onto the stack a value that keeps
+** that compiled form alive while in use (even if the cache drops it).
+*/
+static const CPattern *getcpattern (lua_State *L, int arg,
+                                    const char *p, size_t lp) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  int i;
+  int lru = 0;  /* least recently used entry */
+  checklocale(L, pc);
+  for (i = 0; i < LUA_PATCACHESIZE; i++) {
+    if (pc->e[i].p == p && pc->e[i].lp == lp) {  /* found pattern? */
+      pc->e[i].lastuse = ++pc->clock;
+      if (pc->e[i].cp == NULL && lp <= USHRT_MAX &&
+          ++pc->e[i].uses >= PATMINUSES) {  /* time to compile it? */
+        pc->e[i].cp = compilepattern(L, p, lp);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, lua_upvalueindex(1), 2*i + 2);
+        return pc->e[i].cp;
+      }
+      lua_getiuservalue(L, lua_upvalueindex(1), 2*i + 2);
+      return pc->e[i].cp;
+    }
+    else if (pc->e[i].lastuse < pc->e[lru].lastuse)
+      lru = i;
+  }
+  /* pattern is not in the cache; replace the least recently used entry */
+  lua_pushvalue(L, arg);
+  lua_setiuservalue(L, lua_upvalueindex(1), 2*lru + 1);
+  lua_pushnil(L);
+  lua_setiuservalue(L, lua_upvalueindex(1), 2*lru + 2);
+  pc->e[lru].p = p;
+  pc->e[lru].lp = lp;
+  pc->e[lru].cp = NULL;
+  pc->e[lru].uses = 0;
+  pc->e[lru].lastuse = ++pc->clock;
+  return getcpattern(L, arg, p, lp);  /* count this use */
+}
+
+
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
   const char *s = luaL_checklstring(L, 1, &ls);
@@ -785,14 +1127,18 @@ static int str_find_aux (lua_State *L, int find) {
     MatchState ms;
     const char *s1 = s + init;
     int anchor = (*p == '^');
-    if (anchor) {
-      p++; lp--;  /* skip anchor character */
-    }
-    prepstate(&ms, L, s, ls, p, lp);
+    size_t lpre;  /* length of literal prefix */
+    prepstate(&ms, L, s, ls, p, lp, getcpattern(L, 2, p, lp));
+    if (anchor)
+      p++;  /* skip anchor character */
+    lpre = literalprefix(p, ct_diff2sz(ms.p_end - p));
     do {
       const char *res;
+      if ((s1 = nextstart(&ms, s1, p, lpre, anchor)) == NULL)
+        break;  /* no more places for a match */
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      /* the prefix is already matched */
+      if ((res=match(&ms, s1 + lpre, p + lpre)) != NULL) {
         if (find) {
           lua_pushinteger(L, ct_diff2S(s1 - s) + 1);  /* start */
           lua_pushinteger(L, ct_diff2S(res - s));   /* end */
@@ -822,6 +1168,7 @@ static int str_match (lua_State *L) {
 typedef struct GMatchState {
   const char *src;  /* current position */
   const char *p;  /* pattern */
+  size_t lpre;  /* length of its literal prefix */
   const char *lastmatch;  /* end of last match */
   MatchState ms;  /* match state */
 } GMatchState;
@@ -833,8 +1180,11 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if ((src = nextstart(&gm->ms, src, gm->p, gm->lpre, 0)) == NULL)
+      break;  /* no more places for a match */
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+    e = match(&gm->ms, src + gm->lpre, gm->p + gm->lpre);
+    if (e != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
       return push_captures(&gm->ms, src, e);
     }
@@ -853,9 +1203,11 @@ static int gmatch (lua_State *L) {
   gm = (GMatchState *)lua_newuserdatauv(L, sizeof(GMatchState), 0);
   if (init > ls)  /* start after string's end? */
     init = ls + 1;  /* avoid overflows in 's + init' */
-  prepstate(&gm->ms, L, s, ls, p, lp);
+  /* compiled pattern also goes to the closure */
+  prepstate(&gm->ms, L, s, ls, p, lp, getcpattern(L, 2, p, lp));
   gm->src = s + init; gm->p = p; gm->lastmatch = NULL;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  gm->lpre = literalprefix(p, lp);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -940,6 +1292,7 @@ static int str_gsub (lua_State *L) {
   /* max replacements */
   lua_Integer max_s = luaL_optinteger(L, 4, cast_st2S(srcl) + 1);
   int anchor = (*p == '^');
+  size_t lpre;  /* length of literal prefix */
   lua_Integer n = 0;  /* replacement count */
   int changed = 0;  /* change flag */
   MatchState ms;
@@ -947,15 +1300,22 @@ static int str_gsub (lua_State *L) {
   luaL_argexpected(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table");
+  /* keep compiled pattern (if any) on the stack while in use */
+  prepstate(&ms, L, src, srcl, p, lp, getcpattern(L, 2, p, lp));
   luaL_buffinit(L, &b);
-  if (anchor) {
-    p++; lp--;  /* skip anchor character */
-  }
-  prepstate(&ms, L, src, srcl, p, lp);
+  if (anchor)
+    p++;  /* skip anchor character */
+  lpre = literalprefix(p, ct_diff2sz(ms.p_end - p));
   while (n < max_s) {
     const char *e;
+    const char *start = nextstart(&ms, src, p, lpre, anchor);
+    if (start == NULL)
+      break;  /* no more matches */
+    luaL_addlstring(&b, src, ct_diff2sz(start - src));  /* skipped text */
+    src = start;
     reprepstate(&ms);  /* (re)prepare state for new match */
-    if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
+    e = match(&ms, src + lpre, p + lpre);  /* prefix is already matched */
+    if (e != NULL && e != lastmatch) {  /* match? */
       n++;
       changed = add_value(&ms, &b, src, e, tr) | changed;
       src = lastmatch = e;
@@ -1263,27 +1623,27 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
-static int str_format (lua_State *L) {
-  int top = lua_gettop(L);
-  int arg = 1;
+/*
+** Add to buffer 'b' the result of formatting the values up to index
+** 'top' with the format string at index 'arg'.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg, int top) {
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
   const char *flags;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format ('%...') */
       unsigned maxitem = MAX_ITEM;  /* maximum length for the result */
-      char *buff = luaL_prepbuffsize(&b, maxitem);  /* to put result */
+      char *buff = luaL_prepbuffsize(b, maxitem);  /* to put result */
       int nb = 0;  /* number of bytes in result */
       if (++arg > top)
-        return luaL_argerror(L, arg, "no value");
+        luaL_argerror(L, arg, "no value");
       strfrmt = getformat(L, strfrmt, form);
       switch (*strfrmt++) {
         case 'c': {
@@ -1314,7 +1674,7 @@ static int str_format (lua_State *L) {
           break;
         case 'f':
           maxitem = MAX_ITEMF;  /* extra space for '%f' */
-          buff = luaL_prepbuffsize(&b, maxitem);
+          buff = luaL_prepbuffsize(b, maxitem);
           /* FALLTHROUGH */
         case 'e': case 'E': case 'g': case 'G': {
           lua_Number n = luaL_checknumber(L, arg);
@@ -1335,21 +1695,21 @@ static int str_format (lua_State *L) {
         }
         case 'q': {
           if (form[2] != '\0')  /* modifiers? */
-            return luaL_error(L, "specifier '%%q' cannot have modifiers");
-          addliteral(L, &b, arg);
+            luaL_error(L, "specifier '%%q' cannot have modifiers");
+          addliteral(L, b, arg);
           break;
         }
         case 's': {
           size_t l;
           const char *s = luaL_tolstring(L, arg, &l);
           if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
+            luaL_addvalue(b);  /* keep entire string */
           else {
             luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
             checkformat(L, form, L_FMTFLAGSC, 1);
             if (strchr(form, '.') == NULL && l >= 100) {
               /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
+              luaL_addvalue(b);  /* keep entire string */
             }
             else {  /* format the string into 'buff' */
               nb = l_sprintf(buff, maxitem, form, s);
@@ -1359,13 +1719,21 @@ static int str_format (lua_State *L) {
           break;
         }
         default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid conversion '%s' to 'format'", form);
+          luaL_error(L, "invalid conversion '%s' to 'format'", form);
         }
       }
       lua_assert(cast_uint(nb) < maxitem);
-      luaL_addsize(&b, cast_uint(nb));
+      luaL_addsize(b, cast_uint(nb));
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  int top = lua_gettop(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 1, top);
   luaL_pushresult(&b);
   return 1;
 }
@@ -1595,15 +1963,16 @@ static void copywithendian (char *dest, const char *src,
 }
 
 
-static int str_pack (lua_State *L) {
-  luaL_Buffer b;
+/*
+** Add to buffer 'b' the values after index 'arg' packed with the format
+** string at index 'arg'. (There must be a mark between the values and
+** the buffer, so that missing values are not confused with the buffer.)
+*/
+static void addpack (lua_State *L, luaL_Buffer *b, int arg) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
+  const char *fmt = luaL_checkstring(L, arg);  /* format string */
   size_t totalsize = 0;  /* accumulate total size of result */
   initheader(L, &h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     unsigned ntoalign;
     size_t size;
@@ -1612,7 +1981,7 @@ static int str_pack (lua_State *L) {
                      "result too long");
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+     luaL_addchar(b, LUAL_PACKPADBYTE);  /* fill alignment */
     arg++;
     switch (opt) {
       case Kint: {  /* signed integers */
@@ -1621,7 +1990,7 @@ static int str_pack (lua_State *L) {
           lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
           luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
         }
-        packint(&b, (lua_Unsigned)n, h.islittle, cast_uint(size), (n < 0));
+        packint(b, (lua_Unsigned)n, h.islittle, cast_uint(size), (n < 0));
         break;
       }
       case Kuint: {  /* unsigned integers */
@@ -1629,43 +1998,43 @@ static int str_pack (lua_State *L) {
         if (size < SZINT)  /* need overflow check? */
           luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
                            arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, cast_uint(size), 0);
+        packint(b, (lua_Unsigned)n, h.islittle, cast_uint(size), 0);
         break;
       }
       case Kfloat: {  /* C float */
         float f = (float)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = luaL_prepbuffsize(b, sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        luaL_addsize(b, size);
         break;
       }
       case Knumber: {  /* Lua float */
         lua_Number f = luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = luaL_prepbuffsize(b, sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        luaL_addsize(b, size);
         break;
       }
       case Kdouble: {  /* C double */
         double f = (double)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = luaL_prepbuffsize(b, sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        luaL_addsize(b, size);
         break;
       }
       case Kchar: {  /* fixed-size string */
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, len <= size, arg, "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
+        luaL_addlstring(b, s, len);  /* add string */
         if (len < size) {  /* does it need padding? */
           size_t psize = size - len;  /* pad size */
-          char *buff = luaL_prepbuffsize(&b, psize);
+          char *buff = luaL_prepbuffsize(b, psize);
           memset(buff, LUAL_PACKPADBYTE, psize);
-          luaL_addsize(&b, psize);
+          luaL_addsize(b, psize);
         }
         break;
       }
@@ -1676,8 +2045,8 @@ static int str_pack (lua_State *L) {
                          len < ((lua_Unsigned)1 << (size * NB)),
                          arg, "string length does not fit in given size");
         /* pack length */
-        packint(&b, (lua_Unsigned)len, h.islittle, cast_uint(size), 0);
-        luaL_addlstring(&b, s, len);
+        packint(b, (lua_Unsigned)len, h.islittle, cast_uint(size), 0);
+        luaL_addlstring(b, s, len);
         totalsize += len;
         break;
       }
@@ -1685,17 +2054,25 @@ static int str_pack (lua_State *L) {
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
+        luaL_addlstring(b, s, len);
+        luaL_addchar(b, '\0');  /* add zero at the end */
         totalsize += len + 1;
         break;
       }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+      case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
       case Kpaddalign: case Knop:
         arg--;  /* undo increment */
         break;
     }
   }
+}
+
+
+static int str_pack (lua_State *L) {
+  luaL_Buffer b;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  addpack(L, &b, 1);
   luaL_pushresult(&b);
   return 1;
 }
@@ -1834,17 +2211,203 @@ static int str_unpack (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** STRING BUFFERS
+** =======================================================
+*/
+
+/*
+** A string buffer keeps its contents in a box (see 'luaL_newbox'),
+** stored as its user value; the userdata itself only keeps the length
+** of the contents. Each operation opens a 'luaL_Buffer' over that box,
+** so that it can use all the machinery for buffers (e.g., to format
+** or pack values in place). 'tostring' hands large contents over to
+** the resulting string, without copying.
+*/
+
+#define SBUFHANDLE	"string.buffer"
+
+
+typedef struct StrBuf {
+  size_t n;  /* length of contents */
+} StrBuf;
+
+
+#define tosbuf(L)	((StrBuf *)luaL_checkudata(L, 1, SBUFHANDLE))
+
+
+/*
+** Open buffer 'B' over the contents of the string buffer at index 1.
+** (Its box goes to the top of the stack.)
+*/
+static void openbuf (lua_State *L, StrBuf *sb, luaL_Buffer *B) {
+  lua_getiuservalue(L, 1, 1);  /* push box */
+  luaL_buffinitbox(L, B, sb->n);
+}
+
+
+/*
+** Close buffer 'B', keeping its contents in the string buffer, and
+** return the string buffer. (Contents added by an operation that
+** raises an error are not kept, as the length is not updated.)
+*/
+static int closebuf (lua_State *L, StrBuf *sb, luaL_Buffer *B) {
+  sb->n = luaL_bufflen(B);
+  lua_settop(L, 1);  /* remove box (and anything else) */
+  return 1;
+}
+
+
+static int sbuf_new (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  StrBuf *sb;
+  luaL_argcheck(L, 0 <= size && l_castS2U(size) <= MAX_SIZE, 1,
+                   "invalid size");
+  lua_settop(L, 0);
+  sb = (StrBuf *)lua_newuserdatauv(L, sizeof(StrBuf), 1);
+  sb->n = 0;
+  luaL_setmetatable(L, SBUFHANDLE);
+  luaL_newbox(L);
+  lua_setiuservalue(L, 1, 1);
+  if (size > 0) {  /* reserve some space? */
+    luaL_Buffer B;
+    openbuf(L, sb, &B);
+    luaL_prepbuffsize(&B, cast_sizet(size));
+    return closebuf(L, sb, &B);
+  }
+  return 1;
+}
+
+
+static int sbuf_put (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  int top = lua_gettop(L);
+  int arg;
+  luaL_Buffer B;
+  openbuf(L, sb, &B);
+  for (arg = 2; arg <= top; arg++) {
+    if (lua_type(L, arg) == LUA_TNUMBER) {  /* convert it in place */
+      char *buff = luaL_prepbuffsize(&B, LUA_N2SBUFFSZ);
+      luaL_addsize(&B, lua_numbertocstring(L, arg, buff) - 1);
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      luaL_addlstring(&B, s, l);
+    }
+  }
+  return closebuf(L, sb, &B);
+}
+
+
+static int sbuf_format (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  int top = lua_gettop(L);
+  luaL_Buffer B;
+  openbuf(L, sb, &B);
+  addformat(L, &B, 2, top);
+  return closebuf(L, sb, &B);
+}
+
+
+static int sbuf_pack (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  luaL_Buffer B;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  openbuf(L, sb, &B);
+  addpack(L, &B, 2);
+  return closebuf(L, sb, &B);
+}
+
+
+static int sbuf_reserve (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_Buffer B;
+  luaL_argcheck(L, 0 <= size && l_castS2U(size) <= MAX_SIZE, 2,
+                   "invalid size");
+  lua_settop(L, 1);
+  openbuf(L, sb, &B);
+  luaL_prepbuffsize(&B, cast_sizet(size));
+  return closebuf(L, sb, &B);
+}
+
+
+static int sbuf_reset (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  sb->n = 0;  /* keep the memory for new contents */
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sbuf_tostring (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  luaL_Buffer B;
+  lua_settop(L, 1);
+  openbuf(L, sb, &B);
+  luaL_pushboxresult(&B);
+  sb->n = 0;  /* contents went to the string */
+  return 1;
+}
+
+
+static int sbuf_len (lua_State *L) {
+  StrBuf *sb = tosbuf(L);
+  lua_pushinteger(L, cast_st2S(sb->n));
+  return 1;
+}
+
+
+/*
+** methods for string buffers
+*/
+static const luaL_Reg sbuf_meth[] = {
+  {"format", sbuf_format},
+  {"pack", sbuf_pack},
+  {"put", sbuf_put},
+  {"reserve", sbuf_reserve},
+  {"reset", sbuf_reset},
+  {"tostring", sbuf_tostring},
+  {NULL, NULL}
+};
+
+
+/*
+** metamethods for string buffers
+*/
+static const luaL_Reg sbuf_metameth[] = {
+  {"__index", NULL},  /* placeholder */
+  {"__len", sbuf_len},
+  {NULL, NULL}
+};
+
+
+static void createsbufmeta (lua_State *L) {
+  luaL_newmetatable(L, SBUFHANDLE);  /* metatable for string buffers */
+  luaL_setfuncs(L, sbuf_metameth, 0);  /* add metamethods */
+  luaL_newlibtable(L, sbuf_meth);  /* create method table */
+  luaL_setfuncs(L, sbuf_meth, 0);  /* add methods to method table */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg strlib[] = {
+  {"buffer", sbuf_new},
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
-  {"find", str_find},
+  {"find", NULL},  /* placeholder */
   {"format", str_format},
-  {"gmatch", gmatch},
-  {"gsub", str_gsub},
+  {"gmatch", NULL},  /* placeholder */
+  {"gsub", NULL},  /* placeholder */
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
+  {"match", NULL},  /* placeholder */
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
@@ -1873,8 +2436,28 @@ static void createmetatable (lua_State *L) {
 /*
 ** Open string library
 */
+/* functions that use the cache of compiled patterns */
+static const luaL_Reg pmlib[] = {
+  {"find", str_find},
+  {"gmatch", gmatch},
+  {"gsub", str_gsub},
+  {"match", str_match},
+  {NULL, NULL}
+};
+
+
+static void createpatcache (lua_State *L) {
+  PatCache *pc = (PatCache *)lua_newuserdatauv(L, sizeof(PatCache),
+                                                  2 * LUA_PATCACHESIZE);
+  memset(pc, 0, sizeof(PatCache));
+  luaL_setfuncs(L, pmlib, 1);  /* functions share the cache as upvalue */
+}
+
+
 LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, strlib);
+  createpatcache(L);
+  createsbufmeta(L);
   createmetatable(L);
   return 1;
 }
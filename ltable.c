@@ -21,12 +21,20 @@
 ** in its main position (i.e. the 'original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** A hash part with only a few short-string keys may be kept as a
+** vector of values whose keys are given by a shared shape (see
+** 'Shapes', below). With LUAI_SWISSHASH, hash parts use open
+** addressing instead of chaining (see 'Open addressing', below).
 */
 
 #include <math.h>
 #include <limits.h>
 #include <string.h>
 
+#if defined(LUAI_SWISSHASH) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lua.h"
 
 #include "ldebug.h"
@@ -50,17 +58,24 @@
 
 /*
 ** The union 'Limbox' stores 'lastfree' and ensures that what follows it
-** is properly aligned to store a Node.
+** is properly aligned to store a Node. With open addressing, all hash
+** parts have a 'Limbox', which stores 'growth' instead.
 */
 typedef struct { Node *dummy; Node follows_pNode; } Limbox_aux;
 
 typedef union {
   Node *lastfree;
+  unsigned growth;  /* number of keys the hash part can still get */
   char padding[offsetof(Limbox_aux, follows_pNode)];
 } Limbox;
 
+#if !defined(LUAI_SWISSHASH)
 #define haslastfree(t)     ((t)->lsizenode >= LIMFORLAST)
+#else
+#define haslastfree(t)     1
+#endif
 #define getlastfree(t)     ((cast(Limbox *, (t)->node) - 1)->lastfree)
+#define getgrowth(t)       ((cast(Limbox *, (t)->node) - 1)->growth)
 
 
 /*
@@ -74,7 +89,7 @@ typedef union {
 ** MAXASIZEB is the maximum number of elements in the array part such
 ** that the size of the array fits in 'size_t'.
 */
-#define MAXASIZEB	(MAX_SIZET/(sizeof(Value) + 1))
+#define MAXASIZEB	(MAX_SIZET/(sizeof(Value) + ARRTAGSIZE))
 
 
 /*
@@ -128,14 +143,67 @@ typedef union {
 ** (DEADKEY, NULL) that is different from any valid TValue.
 */
 static const Node dummynode_ = {
+#if !defined(LUAI_NANBOX)
   {{NULL}, LUA_VEMPTY,  /* value's value and type */
    LUA_TDEADKEY, 0, {NULL}}  /* key type, next, and key value */
+#else
+  {{nbbox(NBSIMPLE, LUA_VEMPTY)}, 0, {nbbox(NBDEADKEY, 0)}}
+#endif
 };
 
 
 static const TValue absentkey = {ABSTKEYCONSTANT};
 
 
+/*
+** Maximum number of keys in a shape. (Tables that need more keys go
+** to a regular hash part.)
+*/
+#define MAXSHAPEKEYS	16
+
+/*
+** Maximum number of children of a shape. A table whose new key would
+** need one more child goes to a regular hash part. (Otherwise, many
+** tables each with a key of its own would make the list of children,
+** which is searched linearly, grow without bounds.)
+*/
+#define MAXSHAPECHILDREN	64
+
+/* bit for a key in the 'bloom' field of a shape */
+#define shapebit(ts)	(1u << lmod((ts)->hash, 32))
+
+
+/*
+** Return the index of 'key' in shape 's', or -1 if it is absent.
+*/
+static int shapeindex (const Shape *s, const TString *key) {
+  if (s->bloom & shapebit(key)) {  /* can 'key' be in the shape? */
+    unsigned i;
+    for (i = 0; i < s->nkeys; i++) {
+      if (s->keys[i] == key)
+        return cast_int(i);
+    }
+  }
+  return -1;
+}
+
+
+/*
+** Search function for shaped tables, where only short strings can be
+** keys.
+*/
+static const TValue *getshaped (Table *t, const TValue *key) {
+  if (ttisshrstring(key)) {
+    int i = shapeindex(getshape(t), tsvalue(key));
+    if (i >= 0)
+      return gslot(t, i);
+  }
+  return &absentkey;
+}
+
+
+#if !defined(LUAI_SWISSHASH)
+
 /*
 ** Hash for integers. To allow a good hash, use the remainder operator
 ** ('%'). If integer fits as a non-negative int, compute an int
@@ -150,6 +218,8 @@ static Node *hashint (const Table *t, lua_Integer i) {
     return hashmod(t, ui);
 }
 
+#endif
+
 
 /*
 ** Hash for floating-point numbers.
@@ -181,6 +251,160 @@ static unsigned l_hashfloat (lua_Number n) {
 #endif
 
 
+#if defined(LUAI_SWISSHASH)
+
+/*
+** {=============================================================
+** Open addressing
+** ==============================================================
+*/
+
+/*
+** With open addressing, the node vector is followed by a vector of
+** control bytes, one for each node. A free node has control CTRLEMPTY;
+** a node with a key has the low 7 bits of the key's hash ('h2'). A key
+** is searched in groups of GROUPSIZE consecutive nodes, starting at the
+** group selected by the other bits of its hash ('h1') and following a
+** triangular sequence, which visits all groups, until a group with a
+** free node. Only nodes whose control bytes match 'h2' have their keys
+** compared, and the control bytes of a whole group are matched at once.
+** As in the chained table, a removed entry keeps its key (with an empty
+** value), so nodes become free only in a rehash. A hash part smaller
+** than a group has its control vector padded with CTRLPAD, which
+** matches neither a hash nor a free node.
+*/
+
+#define GROUPBITS	4
+#define GROUPSIZE	(1u << GROUPBITS)
+
+#define CTRLEMPTY	0x80
+#define CTRLPAD		0xFF
+
+#define hashh1(h)	((h) >> 7)
+#define hashh2(h)	cast_byte((h) & 0x7F)
+
+/* number of groups in the hash part of 't' */
+#define numgroups(t)	((sizenode(t) + GROUPSIZE - 1) >> GROUPBITS)
+
+/* control bytes of group 'g' of the hash part of 't' */
+#define gctrl(t,g) \
+	(cast(lu_byte *, gnode(t, sizenode(t))) + (g) * GROUPSIZE)
+
+/* size of the control vector for a hash part with 'size' nodes */
+#define sizectrl(size)	(((size) + GROUPSIZE - 1) & ~(GROUPSIZE - 1))
+
+/*
+** Maximum number of keys in a hash part with 'size' nodes. Parts with
+** more than one group keep 1/8 of their nodes free, so that searches
+** for absent keys stop early.
+*/
+#define maxload(size)	((size) <= GROUPSIZE ? (size) : (size) - ((size) >> 3))
+
+/* number of keys that fit in the current hash part of 't' */
+#define hashlimit(t)	(isdummy(t) ? 0 : maxload(sizenode(t)))
+
+/*
+** Go through the groups of table 't' for hash 'h'.
+*/
+#define forgroups(t,h,g,i)  \
+  for (i = 0, g = hashh1(h) & (numgroups(t) - 1); i < numgroups(t); \
+       i++, g = (g + i) & (numgroups(t) - 1))
+
+
+/* a set of nodes in a group, one bit for each node */
+typedef unsigned int Gmask;
+
+/*
+** Return the nodes in a group whose control bytes are equal to 'b'.
+*/
+#if defined(__SSE2__)
+
+static Gmask matchctrl (const lu_byte *ctrl, lu_byte b) {
+  __m128i g = _mm_loadu_si128(cast(const __m128i *, ctrl));
+  __m128i eq = _mm_cmpeq_epi8(g, _mm_set1_epi8(cast(char, b)));
+  return cast_uint(_mm_movemask_epi8(eq));
+}
+
+#else
+
+static Gmask matchctrl (const lu_byte *ctrl, lu_byte b) {
+  Gmask m = 0;
+  unsigned i;
+  for (i = 0; i < GROUPSIZE; i++)
+    m |= cast_uint(ctrl[i] == b) << i;
+  return m;
+}
+
+#endif
+
+
+/* index of the first node in a non-empty set */
+#if defined(__GNUC__)
+#define firstnode(m)	cast_uint(__builtin_ctz(m))
+#else
+static unsigned firstnode (Gmask m) {
+  unsigned i = 0;
+  while (!(m & 1u)) { m >>= 1; i++; }
+  return i;
+}
+#endif
+
+
+/*
+** Mix the bits of a raw hash, so that all of them affect both 'h1'
+** and 'h2'. (This is the finalizer of MurmurHash3.)
+*/
+static unsigned mixhash (unsigned h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static unsigned hashintkey (lua_Integer i) {
+  lua_Unsigned ui = l_castS2U(i);
+  return mixhash(cast_uint((ui ^ ((ui >> 16) >> 16)) & UINT_MAX));
+}
+
+
+/*
+** Hash of a key. Unlike main positions, it does not depend on the
+** size of the table.
+*/
+static unsigned hashTV (const TValue *key) {
+  switch (ttypetag(key)) {
+    case LUA_VNUMINT:
+      return hashintkey(ivalue(key));
+    case LUA_VNUMFLT:
+      return mixhash(l_hashfloat(fltvalue(key)));
+    case LUA_VSHRSTR:
+      return mixhash(tsvalue(key)->hash);
+    case LUA_VLNGSTR:
+      return mixhash(luaS_hashlongstr(tsvalue(key)));
+    case LUA_VFALSE:
+      return mixhash(0);
+    case LUA_VTRUE:
+      return mixhash(1);
+    case LUA_VLIGHTUSERDATA:
+      return mixhash(point2uint(pvalue(key)));
+    case LUA_VLCF:
+      return mixhash(point2uint(fvalue(key)));
+    default:
+      return mixhash(point2uint(gcvalue(key)));
+  }
+}
+
+/* }============================================================= */
+
+#else
+
+/* number of keys that fit in the current hash part of 't' */
+#define hashlimit(t)	allocsizenode(t)
+
+
 /*
 ** returns the 'main' position of an element in a table (that is,
 ** the index of its hash value).
@@ -229,6 +453,8 @@ l_sinline Node *mainpositionfromnode (const Table *t, Node *nd) {
   return mainpositionTV(t, &key);
 }
 
+#endif
+
 
 /*
 ** Check whether key 'k1' is equal to the key in node 'n2'. This
@@ -279,17 +505,40 @@ static int equalkey (const TValue *k1, const Node *n2, int deadok) {
 ** See explanation about 'deadok' in function 'equalkey'.
 */
 static const TValue *getgeneric (Table *t, const TValue *key, int deadok) {
-  Node *n = mainpositionTV(t, key);
-  for (;;) {  /* check whether 'key' is somewhere in the chain */
-    if (equalkey(key, n, deadok))
-      return gval(n);  /* that's it */
-    else {
-      int nx = gnext(n);
-      if (nx == 0)
-        return &absentkey;  /* not found */
-      n += nx;
+  if (isshaped(t))
+    return getshaped(t, key);  /* shaped tables have no dead keys */
+#if defined(LUAI_SWISSHASH)
+  if (!isdummy(t)) {
+    unsigned h = hashTV(key);
+    unsigned g, i;
+    forgroups(t, h, g, i) {
+      const lu_byte *ctrl = gctrl(t, g);
+      Gmask m;
+      for (m = matchctrl(ctrl, hashh2(h)); m != 0; m &= m - 1) {
+        Node *n = gnode(t, g * GROUPSIZE + firstnode(m));
+        if (equalkey(key, n, deadok))
+          return gval(n);  /* that's it */
+      }
+      if (matchctrl(ctrl, CTRLEMPTY) != 0)  /* group has a free node? */
+        break;  /* then key is not in the table */
     }
   }
+  return &absentkey;  /* not found */
+#else
+  {
+    Node *n = mainpositionTV(t, key);
+    for (;;) {  /* check whether 'key' is somewhere in the chain */
+      if (equalkey(key, n, deadok))
+        return gval(n);  /* that's it */
+      else {
+        int nx = gnext(n);
+        if (nx == 0)
+          return &absentkey;  /* not found */
+        n += nx;
+      }
+    }
+  }
+#endif
 }
 
 
@@ -325,6 +574,28 @@ static unsigned keyinarray (Table *t, const TValue *key) {
 }
 
 
+/*
+** Returns the position of 'key' in table 't', counting first the slots
+** of the array part and then the ones of the hash part, from 0; if the
+** key is not in the table, returns UINT_MAX. (The collector uses these
+** positions for its cards.)
+*/
+unsigned luaH_slotof (Table *t, const TValue *key) {
+  unsigned i = keyinarray(t, key);
+  if (i != 0)  /* is 'key' inside array part? */
+    return i - 1;
+  else {
+    const TValue *n = getgeneric(t, key, 1);
+    if (isabstkey(n))
+      return UINT_MAX;
+    else if (isshaped(t))
+      return t->asize + cast_uint(n - gslot(t, 0));
+    else
+      return t->asize + cast_uint(nodefromval(n) - gnode(t, 0));
+  }
+}
+
+
 /*
 ** returns the index of a 'key' for table traversals. First goes all
 ** elements in the array part, then elements in the hash part. The
@@ -341,7 +612,10 @@ static unsigned findindex (lua_State *L, Table *t, TValue *key,
     const TValue *n = getgeneric(t, key, 1);
     if (l_unlikely(isabstkey(n)))
       luaG_runerror(L, "invalid key to 'next'");  /* key not found */
-    i = cast_uint(nodefromval(n) - gnode(t, 0));  /* key index in hash table */
+    if (isshaped(t))
+      i = cast_uint(n - gslot(t, 0));  /* key index in shape */
+    else
+      i = cast_uint(nodefromval(n) - gnode(t, 0));  /* key index in hash */
     /* hash elements are numbered after array ones */
     return (i + 1) + asize;
   }
@@ -352,13 +626,24 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   unsigned int asize = t->asize;
   unsigned int i = findindex(L, t, s2v(key), asize);  /* find original key */
   for (; i < asize; i++) {  /* try first array part */
-    lu_byte tag = *getArrTag(t, i);
+    lu_byte tag = arrkeytag(t, i);
     if (!tagisempty(tag)) {  /* a non-empty entry? */
       setivalue(s2v(key), cast_int(i) + 1);
       farr2val(t, i, tag, s2v(key + 1));
       return 1;
     }
   }
+  if (isshaped(t)) {  /* shaped hash part? */
+    const Shape *s = getshape(t);
+    for (i -= asize; i < s->nkeys; i++) {
+      if (!isempty(gslot(t, i))) {  /* a non-empty entry? */
+        setsvalue2s(L, key, s->keys[i]);
+        setobj2s(L, key + 1, gslot(t, i));
+        return 1;
+      }
+    }
+    return 0;  /* no more elements */
+  }
   for (i -= asize; i < sizenode(t); i++) {  /* hash part */
     if (!isempty(gval(gnode(t, i)))) {  /* a non-empty entry? */
       Node *n = gnode(t, i);
@@ -371,17 +656,204 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
 }
 
 
+/*
+** {=============================================================
+** Shapes
+** ==============================================================
+*/
+
+/*
+** A table whose hash part has only short-string keys (up to
+** MAXSHAPEKEYS of them) may keep that part "shaped": the keys go to a
+** shape, shared by all tables that got the same keys in the same
+** order, and the values go to a dense vector of slots, where slot 'i'
+** holds the value for the i-th key of the shape. A removed field keeps
+** its key in the shape, with an empty slot. A shaped table moves to a
+** regular hash part when it gets a key that is not a short string,
+** more than MAXSHAPEKEYS keys, a new key after a field was removed, or
+** a new key whose shape would exceed MAXSHAPECHILDREN siblings.
+** Shapes are not collectable objects; each one counts the tables and
+** child shapes using it, and it is freed when that count drops to zero.
+** Its keys are marked by the tables using it.
+*/
+
+/* size of a shape with 'n' keys */
+#define sizeshape(n)	(offsetof(Shape, keys) + (n) * sizeof(TString *))
+
+
+/*
+** Release a reference to shape 's'. A shape with no more references
+** is removed from its parent's list, releasing the parent, and goes to
+** the list 'deadshapes'. (It cannot be freed right away, as the
+** collector accounts only for the objects it frees; see
+** 'luaH_freeshapes'. The root shape has a permanent reference.)
+*/
+static void shapedecref (lua_State *L, Shape *s) {
+  global_State *g = G(L);
+  while (--s->nref == 0) {
+    Shape *p = s->parent;
+    Shape **l = &p->child;
+    while (*l != s)  /* find 's' in the list of its siblings */
+      l = &(*l)->sibling;
+    *l = s->sibling;  /* remove it */
+    p->nchild--;
+    s->sibling = g->deadshapes;  /* link it in the list of dead shapes */
+    g->deadshapes = s;
+    s = p;
+  }
+}
+
+
+/*
+** Free all shapes no longer used by any table.
+*/
+void luaH_freeshapes (lua_State *L) {
+  global_State *g = G(L);
+  while (g->deadshapes != NULL) {
+    Shape *s = g->deadshapes;
+    g->deadshapes = s->sibling;
+    luaM_freemem(L, s, sizeshape(s->nkeys));
+  }
+}
+
+
+/*
+** Find the child of shape 's' that extends it with 'key'. A found
+** shape moves to the front of the list, as tables built by the same
+** code tend to follow the same transitions.
+*/
+static Shape *findchild (Shape *s, const TString *key) {
+  Shape **l = &s->child;
+  Shape *c;
+  while ((c = *l) != NULL) {
+    if (c->keys[s->nkeys] == key) {
+      *l = c->sibling;  /* move 'c' to the front of the list */
+      c->sibling = s->child;
+      s->child = c;
+      return c;
+    }
+    l = &c->sibling;
+  }
+  return NULL;
+}
+
+
+/*
+** Create a child of shape 's' that extends it with 'key'.
+*/
+static Shape *newchild (lua_State *L, Shape *s, TString *key) {
+  unsigned n = s->nkeys;
+  Shape *c = cast(Shape *, luaM_newblock(L, sizeshape(n + 1)));
+  unsigned i;
+  for (i = 0; i < n; i++)
+    c->keys[i] = s->keys[i];
+  c->keys[n] = key;
+  c->nkeys = n + 1;
+  c->bloom = s->bloom | shapebit(key);
+  c->nref = 0;  /* no users yet */
+  c->child = NULL;
+  c->parent = s;
+  c->nchild = 0;
+  s->nref++;  /* parent is used by its new child */
+  c->sibling = s->child;
+  s->child = c;
+  s->nchild++;
+  return c;
+}
+
+
+/*
+** Creates a shaped hash part for table 't', with shape 's' and 'size'
+** empty slots.
+*/
+static void setshapevector (lua_State *L, Table *t, Shape *s,
+                                                    unsigned size) {
+  int lsize = luaO_ceillog2(size);
+  unsigned i;
+  char *block;
+  lua_assert(0 < size && size <= MAXSHAPEKEYS && s->nkeys <= size);
+  size = twoto(lsize);
+  block = luaM_newblock(L, size * sizeof(TValue) + sizeof(Shapebox));
+  t->node = cast(Node *, block + sizeof(Shapebox));
+  t->lsizenode = cast_byte(lsize);
+  t->flags = cast_byte((t->flags & NOTBITDUMMY) | BITSHAPE);
+  getshape(t) = s;
+  s->nref++;
+  for (i = 0; i < size; i++)
+    setempty(gslot(t, i));
+}
+
+
+/*
+** Check whether a table with shape 's' (or with an empty hash part)
+** can get a new key in its shape: it cannot have too many keys nor
+** removed fields.
+*/
+static int shapecangrow (Table *t, const Shape *s) {
+  unsigned i;
+  if (s->nkeys >= MAXSHAPEKEYS)
+    return 0;
+  for (i = 0; i < s->nkeys; i++) {
+    if (isempty(gslot(t, i)))
+      return 0;  /* a removed field */
+  }
+  return 1;
+}
+
+
+/*
+** Try to insert a new key into a shaped table without allocating
+** memory, that is, when it has a free slot and the shape for its new
+** key set already exists. (That is the common case for constructors.)
+** Return 0 if it could not insert the key.
+*/
+static int shapeinsertkey (Table *t, const TString *key, TValue *value) {
+  Shape *s = getshape(t);
+  if (s->nkeys < sizenode(t) && shapecangrow(t, s)) {
+    Shape *c = findchild(s, key);
+    if (c != NULL) {
+      c->nref++;
+      getshape(t) = c;
+      lua_assert(s->nref > 1);  /* 's' is still used by 'c' */
+      s->nref--;
+      setobj2t(cast(lua_State *, 0), gslot(t, s->nkeys), value);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* }============================================================= */
+
+
 /* Extra space in Node array if it has a lastfree entry */
 #define extraLastfree(t)	(haslastfree(t) ? sizeof(Limbox) : 0)
 
+/* Extra space after Node array for control bytes */
+#if defined(LUAI_SWISSHASH)
+#define extraCtrl(t)		sizectrl(cast_sizet(sizenode(t)))
+#else
+#define extraCtrl(t)		0
+#endif
+
 /* 'node' size in bytes */
 static size_t sizehash (Table *t) {
-  return cast_sizet(sizenode(t)) * sizeof(Node) + extraLastfree(t);
+  if (isshaped(t))  /* slots plus the shape box */
+    return cast_sizet(sizenode(t)) * sizeof(TValue) + sizeof(Shapebox);
+  else
+    return cast_sizet(sizenode(t)) * sizeof(Node) + extraLastfree(t) +
+           extraCtrl(t);
 }
 
 
 static void freehash (lua_State *L, Table *t) {
-  if (!isdummy(t)) {
+  if (isshaped(t)) {
+    char *arr = cast_charp(t->node) - sizeof(Shapebox);
+    size_t size = sizehash(t);
+    shapedecref(L, getshape(t));
+    luaM_freearray(L, arr, size);
+  }
+  else if (!isdummy(t)) {
     /* get pointer to the beginning of Node array */
     char *arr = cast_charp(t->node) - extraLastfree(t);
     luaM_freearray(L, arr, sizehash(t));
@@ -396,7 +868,8 @@ static void freehash (lua_State *L, Table *t) {
 */
 
 static int insertkey (Table *t, const TValue *key, TValue *value);
-static void newcheckedkey (Table *t, const TValue *key, TValue *value);
+static void newcheckedkey (lua_State *L, Table *t, const TValue *key,
+                                                   TValue *value);
 
 
 /*
@@ -467,7 +940,7 @@ static void countint (lua_Integer key, Counters *ct) {
 
 
 l_sinline int arraykeyisempty (const Table *t, unsigned key) {
-  int tag = *getArrTag(t, key - 1);
+  int tag = arrkeytag(t, key - 1);
   return tagisempty(tag);
 }
 
@@ -505,14 +978,20 @@ static void numusearray (const Table *t, Counters *ct) {
 
 /*
 ** Count keys in hash part of table 't'. As this only happens during
-** a rehash, all nodes have been used. A node can have a nil value only
+** a rehash, all nodes have been used (except, with open addressing,
+** those kept free by 'maxload'). A used node can have a nil value only
 ** if it was deleted after being created.
 */
 static void numusehash (const Table *t, Counters *ct) {
   unsigned i = sizenode(t);
   unsigned total = 0;
+  lua_assert(!isshaped(t));
   while (i--) {
     Node *n = &t->node[i];
+#if defined(LUAI_SWISSHASH)
+    if (gctrl(t, 0)[i] == CTRLEMPTY)
+      continue;  /* a free node */
+#endif
     if (isempty(gval(n))) {
       lua_assert(!keyisnil(n));  /* entry was deleted; key cannot be nil */
       ct->deleted = 1;
@@ -529,13 +1008,16 @@ static void numusehash (const Table *t, Counters *ct) {
 
 /*
 ** Convert an "abstract size" (number of slots in an array) to
-** "concrete size" (number of bytes in the array).
+** "concrete size" (number of bytes in the array). A typed array has
+** no tags.
 */
-static size_t concretesize (unsigned int size) {
+static size_t concretesize (unsigned int size, int typed) {
   if (size == 0)
     return 0;
-  else  /* space for the two arrays plus an unsigned in between */
-    return size * (sizeof(Value) + 1) + sizeof(unsigned);
+  else if (typed)
+    return size * sizeof(Value) + ARRHEADSIZE;
+  else  /* space for the two arrays plus the header in between */
+    return size * (sizeof(Value) + ARRTAGSIZE) + ARRHEADSIZE;
 }
 
 
@@ -549,19 +1031,21 @@ static size_t concretesize (unsigned int size) {
 ** elements to their new position, so the copy implicit in realloc is a
 ** waste. Moreover, most allocators will move the array anyway when the
 ** new size is double the old one (the most common case).
+** A typed array keeps its kind (and its length).
 */
 static Value *resizearray (lua_State *L , Table *t,
                                unsigned oldasize,
                                unsigned newasize) {
+  int typed = istyped(t);
   if (oldasize == newasize)
     return t->array;  /* nothing to be done */
   else if (newasize == 0) {  /* erasing array? */
     Value *op = t->array - oldasize;  /* original array's real address */
-    luaM_freemem(L, op, concretesize(oldasize));  /* free it */
+    luaM_freemem(L, op, concretesize(oldasize, typed));  /* free it */
     return NULL;
   }
   else {
-    size_t newasizeb = concretesize(newasize);
+    size_t newasizeb = concretesize(newasize, typed);
     Value *np = cast(Value *,
                   luaM_reallocvector(L, NULL, 0, newasizeb, lu_byte));
     if (np == NULL)  /* allocation error? */
@@ -569,7 +1053,7 @@ static Value *resizearray (lua_State *L , Table *t,
     np += newasize;  /* shift pointer to the end of value segment */
     if (oldasize > 0) {
       /* move common elements to new position */
-      size_t oldasizeb = concretesize(oldasize);
+      size_t oldasizeb = concretesize(oldasize, typed);
       Value *op = t->array;  /* original array */
       unsigned tomove = (oldasize < newasize) ? oldasize : newasize;
       size_t tomoveb = (oldasize < newasize) ? oldasizeb : newasizeb;
@@ -582,6 +1066,167 @@ static Value *resizearray (lua_State *L , Table *t,
 }
 
 
+/*
+** {=============================================================
+** Typed arrays
+** ==============================================================
+*/
+
+/*
+** Minimum size for an array part to become typed. (Small arrays gain
+** little from it.)
+*/
+#define MINTYPED	8
+
+
+/*
+** Try to set entry 'k' (a C index) of the typed array part of 't'
+** with 'value', keeping the array typed. That works for a value of
+** the kind of the array in an entry up to its length (which then may
+** grow by one), and for nil in an absent entry or in the last one
+** (which then shrinks the array by one). (An empty typed array can
+** change its kind.) Returns 0 if the array would need tags.
+*/
+static int trysettyped (Table *t, unsigned k, const TValue *value) {
+  unsigned n = *lenhint(t);
+  lu_byte tt = rawtt(value);
+  if (k <= n && (tt == arrkind(t) ||
+                 (n == 0 && (tt == LUA_VNUMINT || tt == LUA_VNUMFLT)))) {
+    setarrkind(t, tt);
+    *getArrVal(t, k) = value->value_;
+    if (k == n)  /* new entry? */
+      *lenhint(t) = n + 1;
+    return 1;
+  }
+  else if (ttisnil(value) && k + 1 >= n) {
+    if (k + 1 == n)  /* removing last entry? */
+      *lenhint(t) = k;
+    return 1;
+  }
+  else
+    return 0;
+}
+
+
+/*
+** Pre-set for entry 'k' of a typed array part. Fails for an absent
+** entry in a table that may have a '__newindex' metamethod, and when
+** the array would need tags.
+*/
+int luaH_psettyped (Table *t, unsigned k, TValue *val) {
+  lua_assert(istyped(t) && k < t->asize);
+  if ((k < *lenhint(t) || checknoTM(t->metatable, TM_NEWINDEX)) &&
+      trysettyped(t, k, val))
+    return HOK;
+  else
+    return ~cast_int(k);
+}
+
+
+#if !defined(LUAI_NANBOX)
+
+/*
+** Move the entries of the array part of 't' to a new block with
+** the given kind and length. Returns 0 if the allocation fails.
+*/
+static int retypearray (lua_State *L, Table *t, lu_byte kind,
+                                                unsigned n) {
+  unsigned asize = t->asize;
+  int typed = (kind != ARRGENERIC);
+  Value *op = t->array;
+  Value *np = cast(Value *, luaM_reallocvector(L, NULL, 0,
+                                concretesize(asize, typed), lu_byte));
+  if (np == NULL)
+    return 0;
+  np += asize;  /* shift pointer to the end of value segment */
+  memcpy(np - n, op - n, n * sizeof(Value));  /* move the entries */
+  luaM_freemem(L, op - asize, concretesize(asize, !typed));
+  t->array = np;
+  *lenhint(t) = n;
+  setarrkind(t, kind);
+  return 1;
+}
+
+
+/*
+** Convert the typed array part of 't' to a generic one.
+*/
+static void untypearray (lua_State *L, Table *t) {
+  lu_byte kind = arrkind(t);
+  unsigned n = *lenhint(t);
+  unsigned i;
+  if (l_unlikely(!retypearray(L, t, ARRGENERIC, n)))
+    luaM_error(L);  /* raise error (with array unchanged) */
+  for (i = 0; i < n; i++)
+    *getArrTag(t, i) = kind;
+  for (; i < t->asize; i++)
+    setarrempty(t, i);
+}
+
+
+/*
+** Check whether the generic array part of 't' can become typed: its
+** first entries must all be integers or all be floats, and the other
+** entries must be empty. Failing to allocate the new array is not an
+** error; the array simply stays generic.
+*/
+static void checktyped (lua_State *L, Table *t) {
+  unsigned asize = t->asize;
+  if (asize >= MINTYPED && !istyped(t)) {
+    lu_byte kind = arrtag(t, 0);
+    unsigned n, i;
+    if (kind != LUA_VNUMINT && kind != LUA_VNUMFLT)
+      return;
+    for (n = 1; n < asize && arrtag(t, n) == kind; n++) ;
+    for (i = n; i < asize; i++) {
+      if (!tagisempty(arrtag(t, i)))
+        return;  /* array has a hole or a value of another type */
+    }
+    retypearray(L, t, kind, n);
+  }
+}
+
+#else
+
+#define untypearray(L,t)	((void)(L), lua_assert(0))
+#define checktyped(L,t)		((void)0)
+
+#endif
+
+
+/*
+** Set entry 'k' (a C index) of the array part of 't', converting a
+** typed array part to a generic one if needed.
+*/
+static void arrset (lua_State *L, Table *t, unsigned k, TValue *value) {
+  if (istyped(t) && !trysettyped(t, k, value))
+    untypearray(L, t);
+  if (!istyped(t))
+    obj2arr(t, k, value);
+}
+
+
+/*
+** Check whether the hash part of 't' has a non-empty entry with an
+** integer key in the interval [lo + 1, hi], which would go to the
+** array part if it grew to size 'hi'.
+*/
+static int hasarraykeys (Table *t, unsigned lo, unsigned hi) {
+  unsigned i;
+  if (isdummy(t) || isshaped(t))  /* no integer keys? */
+    return 0;
+  for (i = 0; i < sizenode(t); i++) {
+    Node *n = gnode(t, i);
+    if (keyisinteger(n) && !isempty(gval(n)) &&
+        l_castS2U(keyival(n)) - 1u - lo < cast(lua_Unsigned, hi - lo))
+      return 1;
+  }
+  return 0;
+}
+
+/* }============================================================= */
+
+
 /*
 ** Creates an array for the hash part of a table with the given
 ** size, or reuses the dummy node if size is zero.
@@ -598,6 +1243,22 @@ static void setnodevector (lua_State *L, Table *t, unsigned size) {
   else {
     int i;
     int lsize = luaO_ceillog2(size);
+#if defined(LUAI_SWISSHASH)
+    if (size > maxload(twoto(lsize)))  /* too many keys for that size? */
+      lsize++;
+    if (lsize > MAXHBITS || (1 << lsize) > MAXHSIZE)
+      luaG_runerror(L, "table overflow");
+    size = twoto(lsize);
+    {
+      size_t bsize = size * sizeof(Node) + sizeof(Limbox) + sizectrl(size);
+      char *node = luaM_newblock(L, bsize);
+      t->node = cast(Node *, node + sizeof(Limbox));
+      t->lsizenode = cast_byte(lsize);
+      getgrowth(t) = maxload(size);
+      memset(gctrl(t, 0), CTRLEMPTY, size);
+      memset(gctrl(t, 0) + size, CTRLPAD, sizectrl(size) - size);
+    }
+#else
     if (lsize > MAXHBITS || (1 << lsize) > MAXHSIZE)
       luaG_runerror(L, "table overflow");
     size = twoto(lsize);
@@ -610,6 +1271,7 @@ static void setnodevector (lua_State *L, Table *t, unsigned size) {
       getlastfree(t) = gnode(t, size);  /* all positions are free */
     }
     t->lsizenode = cast_byte(lsize);
+#endif
     setnodummy(t);
     for (i = 0; i < cast_int(size); i++) {
       Node *n = gnode(t, i);
@@ -627,6 +1289,17 @@ static void setnodevector (lua_State *L, Table *t, unsigned size) {
 static void reinserthash (lua_State *L, Table *ot, Table *t) {
   unsigned j;
   unsigned size = sizenode(ot);
+  if (isshaped(ot)) {  /* keys come from the shape */
+    const Shape *s = getshape(ot);
+    for (j = 0; j < s->nkeys; j++) {
+      if (!isempty(gslot(ot, j))) {
+        TValue k;
+        setsvalue(L, &k, s->keys[j]);
+        newcheckedkey(L, t, &k, gslot(ot, j));
+      }
+    }
+    return;
+  }
   for (j = 0; j < size; j++) {
     Node *old = gnode(ot, j);
     if (!isempty(gval(old))) {
@@ -634,28 +1307,30 @@ static void reinserthash (lua_State *L, Table *ot, Table *t) {
          already present in the table */
       TValue k;
       getnodekey(L, &k, old);
-      newcheckedkey(t, &k, gval(old));
+      newcheckedkey(L, t, &k, gval(old));
     }
   }
 }
 
 
+/* bits in 'flags' describing the kind of hash part */
+#define BITSHASH	(BITDUMMY | BITSHAPE)
+
 /*
 ** Exchange the hash part of 't1' and 't2'. (In 'flags', only the
-** dummy bit must be exchanged: The 'isrealasize' is not related
-** to the hash part, and the metamethod bits do not change during
-** a resize, so the "real" table can keep their values.)
+** dummy and shape bits must be exchanged: The metamethod bits do not
+** change during a resize, so the "real" table can keep their values.)
 */
 static void exchangehashpart (Table *t1, Table *t2) {
   lu_byte lsizenode = t1->lsizenode;
   Node *node = t1->node;
-  int bitdummy1 = t1->flags & BITDUMMY;
+  int bits1 = t1->flags & BITSHASH;
   t1->lsizenode = t2->lsizenode;
   t1->node = t2->node;
-  t1->flags = cast_byte((t1->flags & NOTBITDUMMY) | (t2->flags & BITDUMMY));
+  t1->flags = cast_byte((t1->flags & ~BITSHASH) | (t2->flags & BITSHASH));
   t2->lsizenode = lsizenode;
   t2->node = node;
-  t2->flags = cast_byte((t2->flags & NOTBITDUMMY) | bitdummy1);
+  t2->flags = cast_byte((t2->flags & ~BITSHASH) | bits1);
 }
 
 
@@ -666,8 +1341,9 @@ static void exchangehashpart (Table *t1, Table *t2) {
 static void reinsertOldSlice (Table *t, unsigned oldasize,
                                         unsigned newasize) {
   unsigned i;
+  lua_assert(!istyped(t));
   for (i = newasize; i < oldasize; i++) {  /* traverse vanishing slice */
-    lu_byte tag = *getArrTag(t, i);
+    lu_byte tag = arrtag(t, i);
     if (!tagisempty(tag)) {  /* a non-empty entry? */
       TValue key, aux;
       setivalue(&key, l_castU2S(i) + 1);  /* make the key */
@@ -683,7 +1359,7 @@ static void reinsertOldSlice (Table *t, unsigned oldasize,
 */
 static void clearNewSlice (Table *t, unsigned oldasize, unsigned newasize) {
   for (; oldasize < newasize; oldasize++)
-    *getArrTag(t, oldasize) = LUA_VEMPTY;
+    setarrempty(t, oldasize);
 }
 
 
@@ -702,17 +1378,33 @@ static void clearNewSlice (Table *t, unsigned oldasize, unsigned newasize) {
 ** Note that if the new size for the array part ('newasize') is equal to
 ** the old one ('oldasize'), this function will do nothing with that
 ** part.
+** If 'shaped' is true, the new hash part is an empty shaped part (in
+** which case the array cannot shrink).
+** A typed array part stays typed only if it does not shrink and no
+** key moves from the hash part into it; otherwise, it first becomes
+** generic.
 */
-void luaH_resize (lua_State *L, Table *t, unsigned newasize,
-                                          unsigned nhsize) {
+static void resize (lua_State *L, Table *t, unsigned newasize,
+                                            unsigned nhsize, int shaped) {
   Table newt;  /* to keep the new hash part */
   unsigned oldasize = t->asize;
   Value *newarray;
+  int typed;
   if (newasize > MAXASIZE)
     luaG_runerror(L, "table overflow");
+  luaC_tablemoved(t);  /* all entries may move */
+  if (istyped(t) && (newasize < oldasize ||
+                     hasarraykeys(t, oldasize, newasize)))
+    untypearray(L, t);
+  typed = istyped(t);
   /* create new hash part with appropriate size into 'newt' */
   newt.flags = 0;
-  setnodevector(L, &newt, nhsize);
+  if (shaped) {
+    lua_assert(newasize >= oldasize);
+    setshapevector(L, &newt, &G(L)->rootshape, nhsize);
+  }
+  else
+    setnodevector(L, &newt, nhsize);
   if (newasize < oldasize) {  /* will array shrink? */
     /* re-insert into the new hash the elements from vanishing slice */
     exchangehashpart(t, &newt);  /* pretend table has new hash */
@@ -729,18 +1421,48 @@ void luaH_resize (lua_State *L, Table *t, unsigned newasize,
   exchangehashpart(t, &newt);  /* 't' has the new hash ('newt' has the old) */
   t->array = newarray;  /* set new array part */
   t->asize = newasize;
-  if (newarray != NULL)
+  if (newarray != NULL && !typed) {
     *lenhint(t) = newasize / 2u;  /* set an initial hint */
-  clearNewSlice(t, oldasize, newasize);
+    setarrkind(t, ARRGENERIC);
+    clearNewSlice(t, oldasize, newasize);
+  }
   /* re-insert elements from old hash part into new parts */
   reinserthash(L, &newt, t);  /* 'newt' now has the old hash */
   freehash(L, &newt);  /* free old hash part */
 }
 
 
+/*
+** A table sized for only a few hash entries (e.g., by a constructor)
+** starts with a shaped hash part, as it is probably a record.
+*/
+void luaH_resize (lua_State *L, Table *t, unsigned newasize,
+                                          unsigned nhsize) {
+  int shaped = (isdummy(t) && newasize >= t->asize &&
+                0 < nhsize && nhsize <= MAXSHAPEKEYS);
+  resize(L, t, newasize, nhsize, shaped);
+}
+
+
 void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
-  unsigned nsize = allocsizenode(t);
-  luaH_resize(L, t, nasize, nsize);
+  if (isshaped(t) && nasize >= t->asize) {  /* keep the shaped part */
+    unsigned oldasize = t->asize;
+    int typed = istyped(t);
+    Value *newarray;
+    luaC_tablemoved(t);  /* slots of the hash part will shift */
+    newarray = resizearray(L, t, oldasize, nasize);
+    if (l_unlikely(newarray == NULL && nasize > 0))  /* allocation failed? */
+      luaM_error(L);  /* raise error (with array unchanged) */
+    t->array = newarray;
+    t->asize = nasize;
+    if (newarray != NULL && !typed) {
+      *lenhint(t) = nasize / 2u;  /* set an initial hint */
+      setarrkind(t, ARRGENERIC);
+      clearNewSlice(t, oldasize, nasize);
+    }
+  }
+  else
+    resize(L, t, nasize, hashlimit(t), 0);
 }
 
 
@@ -778,7 +1500,7 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
     nsize += nsize >> 2;
   }
   /* resize the table to new computed sizes */
-  luaH_resize(L, t, asize, nsize);
+  resize(L, t, asize, nsize, 0);
 }
 
 /*
@@ -799,7 +1521,8 @@ Table *luaH_new (lua_State *L) {
 
 
 lu_mem luaH_size (Table *t) {
-  lu_mem sz = cast(lu_mem, sizeof(Table)) + concretesize(t->asize);
+  lu_mem sz = cast(lu_mem, sizeof(Table)) +
+              concretesize(t->asize, istyped(t));
   if (!isdummy(t))
     sz += sizehash(t);
   return sz;
@@ -812,10 +1535,12 @@ lu_mem luaH_size (Table *t) {
 void luaH_free (lua_State *L, Table *t) {
   freehash(L, t);
   resizearray(L, t, t->asize, 0);
-  luaM_free(L, t);
+  luaM_freeobject(L, t, sizeof(*t));
 }
 
 
+#if !defined(LUAI_SWISSHASH)
+
 static Node *getfreepos (Table *t) {
   if (haslastfree(t)) {  /* does it have 'lastfree' information? */
     /* look for a spot before 'lastfree', updating 'lastfree' */
@@ -847,7 +1572,9 @@ static Node *getfreepos (Table *t) {
 ** could not insert key (could not find a free space).
 */
 static int insertkey (Table *t, const TValue *key, TValue *value) {
-  Node *mp = mainpositionTV(t, key);
+  Node *mp;
+  lua_assert(!isshaped(t));
+  mp = mainpositionTV(t, key);
   /* table cannot already contain the key */
   lua_assert(isabstkey(getgeneric(t, key, 0)));
   if (!isempty(gval(mp)) || isdummy(t)) {  /* main position is taken? */
@@ -859,6 +1586,7 @@ static int insertkey (Table *t, const TValue *key, TValue *value) {
     othern = mainpositionfromnode(t, mp);
     if (othern != mp) {  /* is colliding node out of its main position? */
       /* yes; move colliding node into free position */
+      luaC_tablemoved(t);
       while (othern + gnext(othern) != mp)  /* find previous */
         othern += gnext(othern);
       gnext(othern) = cast_int(f - othern);  /* rechain to point to 'f' */
@@ -884,15 +1612,67 @@ static int insertkey (Table *t, const TValue *key, TValue *value) {
   return 1;
 }
 
+#else
+
+/*
+** Inserts a new key into a hash table. The key goes to the first node,
+** in the groups for its hash, that either has a deleted entry with the
+** same 'h2' or is free. (Reusing deleted entries ensures that the table
+** never has a dead key equal to a live one in a node that a search
+** would visit first, which would confuse 'next'.) Return 0 if could not
+** insert key (table has no space for another key).
+*/
+static int insertkey (Table *t, const TValue *key, TValue *value) {
+  unsigned h, g, i;
+  lua_assert(!isshaped(t));
+  if (isdummy(t))
+    return 0;
+  /* table cannot already contain the key */
+  lua_assert(isabstkey(getgeneric(t, key, 0)));
+  h = hashTV(key);
+  forgroups(t, h, g, i) {
+    lu_byte *ctrl = gctrl(t, g);
+    Node *n = NULL;
+    Gmask m;
+    for (m = matchctrl(ctrl, hashh2(h)); m != 0; m &= m - 1) {
+      Node *d = gnode(t, g * GROUPSIZE + firstnode(m));
+      if (isempty(gval(d))) {  /* a deleted entry? */
+        n = d;  /* reuse it */
+        break;
+      }
+    }
+    if (n == NULL) {  /* no deleted entry to reuse? */
+      m = matchctrl(ctrl, CTRLEMPTY);
+      if (m == 0)  /* no free node in this group? */
+        continue;  /* try next group */
+      else if (getgrowth(t) == 0)  /* cannot use another free node? */
+        return 0;
+      else {
+        unsigned f = firstnode(m);
+        n = gnode(t, g * GROUPSIZE + f);
+        ctrl[f] = hashh2(h);
+        getgrowth(t)--;
+      }
+    }
+    setnodekey(n, key);
+    setobj2t(cast(lua_State *, 0), gval(n), value);
+    return 1;
+  }
+  return 0;  /* no free nodes */
+}
+
+#endif
+
 
 /*
 ** Insert a key in a table where there is space for that key, the
 ** key is valid, and the value is not nil.
 */
-static void newcheckedkey (Table *t, const TValue *key, TValue *value) {
+static void newcheckedkey (lua_State *L, Table *t, const TValue *key,
+                                                   TValue *value) {
   unsigned i = keyinarray(t, key);
   if (i > 0)  /* is key in the array part? */
-    obj2arr(t, i - 1, value);  /* set value in the array */
+    arrset(L, t, i - 1, value);  /* set value in the array */
   else {
     int done = insertkey(t, key, value);  /* insert key in the hash part */
     lua_assert(done);  /* it cannot fail */
@@ -901,15 +1681,74 @@ static void newcheckedkey (Table *t, const TValue *key, TValue *value) {
 }
 
 
+/*
+** Insert a new short-string key into a table that is shaped or has an
+** empty hash part, growing its slots and creating a new shape as
+** needed. Return 0 if the table should use a regular hash part.
+*/
+static int shapenewkey (lua_State *L, Table *t, TString *key,
+                                                TValue *value) {
+  Shape *s = isdummy(t) ? &G(L)->rootshape : getshape(t);
+  unsigned n = s->nkeys;
+  Shape *c;
+  if (!shapecangrow(t, s))
+    return 0;
+  if (s->nchild >= MAXSHAPECHILDREN && findchild(s, key) == NULL)
+    return 0;  /* no room for a new child */
+  if (n == allocsizenode(t)) {  /* no free slots? */
+    Table newt;  /* to keep the new slots */
+    unsigned i;
+    luaC_tablemoved(t);
+    newt.flags = 0;
+    setshapevector(L, &newt, s, (n == 0) ? 1 : 2 * n);
+    for (i = 0; i < n; i++)
+      setobj2t(L, gslot(&newt, i), gslot(t, i));
+    exchangehashpart(t, &newt);
+    freehash(L, &newt);  /* free old slots */
+  }
+  c = findchild(s, key);
+  if (c == NULL)
+    c = newchild(L, s, key);
+  c->nref++;
+  getshape(t) = c;
+  shapedecref(L, s);
+  setobj2t(L, gslot(t, n), value);
+  return 1;
+}
+
+
+/*
+** Move the fields of a shaped table to a regular hash part, with
+** space for one more key.
+*/
+static void shapetohash (lua_State *L, Table *t) {
+  const Shape *s = getshape(t);
+  unsigned i;
+  unsigned size = 1;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!isempty(gslot(t, i)))
+      size++;
+  }
+  resize(L, t, t->asize, size, 0);
+}
+
+
 static void luaH_newkey (lua_State *L, Table *t, const TValue *key,
                                                  TValue *value) {
   if (!ttisnil(value)) {  /* do not insert nil values */
-    int done = insertkey(t, key, value);
-    if (!done) {  /* could not find a free place? */
-      rehash(L, t, key);  /* grow table */
-      newcheckedkey(t, key, value);  /* insert key in grown table */
+    if (!((isdummy(t) || isshaped(t)) && ttisshrstring(key) &&
+          shapenewkey(L, t, tsvalue(key), value))) {
+      int done;
+      if (isshaped(t))
+        shapetohash(L, t);  /* key cannot go to the shape */
+      done = insertkey(t, key, value);
+      if (!done) {  /* could not find a free place? */
+        rehash(L, t, key);  /* grow table */
+        newcheckedkey(L, t, key, value);  /* insert key in grown table */
+        checktyped(L, t);  /* array part may become typed */
+      }
     }
-    luaC_barrierback(L, obj2gco(t), key);
+    luaC_barriertable(L, t, key, key);
     /* for debugging only: any new key may force an emergency collection */
     condchangemem(L, (void)0, (void)0, 1);
   }
@@ -917,17 +1756,39 @@ static void luaH_newkey (lua_State *L, Table *t, const TValue *key,
 
 
 static const TValue *getintfromhash (Table *t, lua_Integer key) {
-  Node *n = hashint(t, key);
   lua_assert(!ikeyinarray(t, key));
-  for (;;) {  /* check whether 'key' is somewhere in the chain */
-    if (keyisinteger(n) && keyival(n) == key)
-      return gval(n);  /* that's it */
-    else {
-      int nx = gnext(n);
-      if (nx == 0) break;
-      n += nx;
+  if (isshaped(t))
+    return &absentkey;  /* shaped tables have only string keys */
+#if defined(LUAI_SWISSHASH)
+  if (!isdummy(t)) {
+    unsigned h = hashintkey(key);
+    unsigned g, i;
+    forgroups(t, h, g, i) {
+      const lu_byte *ctrl = gctrl(t, g);
+      Gmask m;
+      for (m = matchctrl(ctrl, hashh2(h)); m != 0; m &= m - 1) {
+        Node *n = gnode(t, g * GROUPSIZE + firstnode(m));
+        if (keyisinteger(n) && keyival(n) == key)
+          return gval(n);  /* that's it */
+      }
+      if (matchctrl(ctrl, CTRLEMPTY) != 0)  /* group has a free node? */
+        break;  /* then key is not in the table */
     }
   }
+#else
+  {
+    Node *n = hashint(t, key);
+    for (;;) {  /* check whether 'key' is somewhere in the chain */
+      if (keyisinteger(n) && keyival(n) == key)
+        return gval(n);  /* that's it */
+      else {
+        int nx = gnext(n);
+        if (nx == 0) break;
+        n += nx;
+      }
+    }
+  }
+#endif
   return &absentkey;
 }
 
@@ -949,7 +1810,7 @@ static lu_byte finishnodeget (const TValue *val, TValue *res) {
 lu_byte luaH_getint (Table *t, lua_Integer key, TValue *res) {
   unsigned k = ikeyinarray(t, key);
   if (k > 0) {
-    lu_byte tag = *getArrTag(t, k - 1);
+    lu_byte tag = arrkeytag(t, k - 1);
     if (!tagisempty(tag))
       farr2val(t, k - 1, tag, res);
     return tag;
@@ -963,18 +1824,43 @@ lu_byte luaH_getint (Table *t, lua_Integer key, TValue *res) {
 ** search function for short strings
 */
 const TValue *luaH_Hgetshortstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
   lua_assert(strisshr(key));
-  for (;;) {  /* check whether 'key' is somewhere in the chain */
-    if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
-      return gval(n);  /* that's it */
-    else {
-      int nx = gnext(n);
-      if (nx == 0)
-        return &absentkey;  /* not found */
-      n += nx;
+  if (isshaped(t)) {
+    int i = shapeindex(getshape(t), key);
+    return (i >= 0) ? gslot(t, i) : &absentkey;
+  }
+#if defined(LUAI_SWISSHASH)
+  if (!isdummy(t)) {
+    unsigned h = mixhash(key->hash);
+    unsigned g, i;
+    forgroups(t, h, g, i) {
+      const lu_byte *ctrl = gctrl(t, g);
+      Gmask m;
+      for (m = matchctrl(ctrl, hashh2(h)); m != 0; m &= m - 1) {
+        Node *n = gnode(t, g * GROUPSIZE + firstnode(m));
+        if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
+          return gval(n);  /* that's it */
+      }
+      if (matchctrl(ctrl, CTRLEMPTY) != 0)  /* group has a free node? */
+        break;  /* then key is not in the table */
+    }
+  }
+  return &absentkey;  /* not found */
+#else
+  {
+    Node *n = hashstr(t, key);
+    for (;;) {  /* check whether 'key' is somewhere in the chain */
+      if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
+        return gval(n);  /* that's it */
+      else {
+        int nx = gnext(n);
+        if (nx == 0)
+          return &absentkey;  /* not found */
+        n += nx;
+      }
     }
   }
+#endif
 }
 
 
@@ -983,6 +1869,38 @@ lu_byte luaH_getshortstr (Table *t, TString *key, TValue *res) {
 }
 
 
+/*
+** Index of a present 'slot' in the hash part of a table.
+*/
+static unsigned hashindex (Table *t, const TValue *slot) {
+  if (isshaped(t))
+    return cast_uint(slot - gslot(t, 0));
+  else
+    return cast_uint(nodefromval(slot) - t->node);
+}
+
+
+/*
+** Update an inline cache with the position of 'slot', if the key is
+** present in the table.
+*/
+static void updatecache (Table *t, const TValue *slot, unsigned *ic) {
+  if (!isabstkey(slot))
+    *ic = hashindex(t, slot);
+}
+
+
+/*
+** Slow path of 'luaH_fastgetcached': a 'luaH_getshortstr' that also
+** updates the inline cache.
+*/
+lu_byte luaH_getcached (Table *t, TString *key, TValue *res, unsigned *ic) {
+  const TValue *slot = luaH_Hgetshortstr(t, key);
+  updatecache(t, slot, ic);
+  return finishnodeget(slot, res);
+}
+
+
 static const TValue *Hgetlongstr (Table *t, TString *key) {
   TValue ko;
   lua_assert(!strisshr(key));
@@ -1040,7 +1958,7 @@ static int retpsetcode (Table *t, const TValue *slot) {
   if (isabstkey(slot))
     return HNOTFOUND;  /* no slot with that key */
   else  /* return node encoded */
-    return cast_int((cast(Node*, slot) - t->node)) + HFIRSTNODE;
+    return cast_int(hashindex(t, slot)) + HFIRSTNODE;
 }
 
 
@@ -1070,7 +1988,10 @@ int luaH_psetint (Table *t, lua_Integer key, TValue *val) {
 }
 
 
-static int psetint (Table *t, lua_Integer key, TValue *val) {
+/*
+** Pre-set for any integer key, in the array or in the hash part.
+*/
+int luaH_pseti (Table *t, lua_Integer key, TValue *val) {
   int hres;
   luaH_fastseti(t, key, val, hres);
   return hres;
@@ -1078,15 +1999,16 @@ static int psetint (Table *t, lua_Integer key, TValue *val) {
 
 
 /*
-** This function could be just this:
-**    return finishnodeset(t, luaH_Hgetshortstr(t, key), val);
+** Pre-set for a short-string key 'key' whose 'slot' was already
+** searched. This function could be just this:
+**    return finishnodeset(t, slot, val);
 ** However, it optimizes the common case created by constructors (e.g.,
 ** {x=1, y=2}), which creates a key in a table that has no metatable,
 ** it is not old/black, and it already has space for the key.
 */
 
-int luaH_psetshortstr (Table *t, TString *key, TValue *val) {
-  const TValue *slot = luaH_Hgetshortstr(t, key);
+static int psetshortstr (Table *t, TString *key, const TValue *slot,
+                                                 TValue *val) {
   if (!ttisnil(slot)) {  /* key already has a value? (all too common) */
     setobj(((lua_State*)NULL), cast(TValue*, slot), val);  /* update it */
     return HOK;  /* done */
@@ -1096,11 +2018,19 @@ int luaH_psetshortstr (Table *t, TString *key, TValue *val) {
       return HOK;  /* done (value is already nil/absent) */
     if (isabstkey(slot) &&  /* key is absent? */
        !(isblack(t) && iswhite(key))) {  /* and don't need barrier? */
-      TValue tk;  /* key as a TValue */
-      setsvalue(cast(lua_State *, NULL), &tk, key);
-      if (insertkey(t, &tk, val)) {  /* insert key, if there is space */
-        invalidateTMcache(t);
-        return HOK;
+      if (isshaped(t)) {
+        if (shapeinsertkey(t, key, val)) {  /* next shape is ready? */
+          invalidateTMcache(t);
+          return HOK;
+        }
+      }
+      else {
+        TValue tk;  /* key as a TValue */
+        setsvalue(cast(lua_State *, NULL), &tk, key);
+        if (insertkey(t, &tk, val)) {  /* insert key, if there is space */
+          invalidateTMcache(t);
+          return HOK;
+        }
       }
     }
   }
@@ -1111,6 +2041,22 @@ int luaH_psetshortstr (Table *t, TString *key, TValue *val) {
 }
 
 
+int luaH_psetshortstr (Table *t, TString *key, TValue *val) {
+  return psetshortstr(t, key, luaH_Hgetshortstr(t, key), val);
+}
+
+
+/*
+** Slow path of 'luaH_fastpsetcached'. (A key inserted by this call is
+** not cached; it will be in the next execution of the instruction.)
+*/
+int luaH_psetcached (Table *t, TString *key, TValue *val, unsigned *ic) {
+  const TValue *slot = luaH_Hgetshortstr(t, key);
+  updatecache(t, slot, ic);
+  return psetshortstr(t, key, slot, val);
+}
+
+
 int luaH_psetstr (Table *t, TString *key, TValue *val) {
   if (strisshr(key))
     return luaH_psetshortstr(t, key, val);
@@ -1122,12 +2068,12 @@ int luaH_psetstr (Table *t, TString *key, TValue *val) {
 int luaH_pset (Table *t, const TValue *key, TValue *val) {
   switch (ttypetag(key)) {
     case LUA_VSHRSTR: return luaH_psetshortstr(t, tsvalue(key), val);
-    case LUA_VNUMINT: return psetint(t, ivalue(key), val);
+    case LUA_VNUMINT: return luaH_pseti(t, ivalue(key), val);
     case LUA_VNIL: return HNOTFOUND;
     case LUA_VNUMFLT: {
       lua_Integer k;
       if (luaV_flttointeger(fltvalue(key), &k, F2Ieq)) /* integral index? */
-        return psetint(t, k, val);  /* use specialized version */
+        return luaH_pseti(t, k, val);  /* use specialized version */
       /* else... */
     }  /* FALLTHROUGH */
     default:
@@ -1160,12 +2106,18 @@ void luaH_finishset (lua_State *L, Table *t, const TValue *key,
     }
     luaH_newkey(L, t, key, value);
   }
-  else if (hres > 0) {  /* regular Node? */
-    setobj2t(L, gval(gnode(t, hres - HFIRSTNODE)), value);
+  else if (hres > 0) {  /* regular Node or slot? */
+    hres -= HFIRSTNODE;
+    if (isshaped(t)) {
+      setobj2t(L, gslot(t, hres), value);
+    }
+    else {
+      setobj2t(L, gval(gnode(t, hres)), value);
+    }
   }
   else {  /* array entry */
     hres = ~hres;  /* real index */
-    obj2arr(t, cast_uint(hres), value);
+    arrset(L, t, cast_uint(hres), value);
   }
 }
 
@@ -1188,7 +2140,7 @@ void luaH_set (lua_State *L, Table *t, const TValue *key, TValue *value) {
 void luaH_setint (lua_State *L, Table *t, lua_Integer key, TValue *value) {
   unsigned ik = ikeyinarray(t, key);
   if (ik > 0)
-    obj2arr(t, ik - 1, value);
+    arrset(L, t, ik - 1, value);
   else {
     int ok = rawfinishnodeset(getintfromhash(t, key), value);
     if (!ok) {
@@ -1270,6 +2222,8 @@ static lua_Unsigned newhint (Table *t, unsigned hint) {
 */
 lua_Unsigned luaH_getn (Table *t) {
   unsigned asize = t->asize;
+  if (istyped(t) && *lenhint(t) < asize)
+    return *lenhint(t);  /* a typed array knows its length */
   if (asize > 0) {  /* is there an array part? */
     const unsigned maxvicinity = 4;
     unsigned limit = *lenhint(t);  /* start with the hint */
@@ -1319,7 +2273,13 @@ lua_Unsigned luaH_getn (Table *t) {
 /* export this function for the test library */
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
+#if defined(LUAI_SWISSHASH)
+  /* first node of the first group for the key */
+  unsigned h = hashTV(key);
+  return gnode(t, (hashh1(h) & (numgroups(t) - 1)) * GROUPSIZE);
+#else
   return mainpositionTV(t, key);
+#endif
 }
 
 #endif
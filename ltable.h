@@ -37,6 +37,27 @@
 
 
 
+/*
+** Bit BITSHAPE set in 'flags' means the hash part of the table is a
+** vector of values (slots) whose keys are given by a shape. The
+** shape is kept in a 'Shapebox' just before the slots, in the same
+** block, and 'lsizenode' is the log2 of the number of slots.
+*/
+
+#define BITSHAPE		(1 << 7)
+#define isshaped(t)		((t)->flags & BITSHAPE)
+
+typedef struct { Shape *dummy; TValue follows_pTValue; } Shapebox_aux;
+
+typedef union {
+  Shape *shape;
+  char padding[offsetof(Shapebox_aux, follows_pTValue)];
+} Shapebox;
+
+#define getshape(t)	((cast(Shapebox *, (t)->node) - 1)->shape)
+#define gslot(t,i)	(cast(TValue *, (t)->node) + (i))
+
+
 /* allocated size for hash nodes */
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
@@ -49,7 +70,9 @@
 #define luaH_fastgeti(t,k,res,tag) \
   { Table *h = t; lua_Unsigned u = l_castS2U(k) - 1u; \
     if ((u < h->asize)) { \
-      tag = *getArrTag(h, u); \
+      tag = arrkind(h); \
+      if (tag == ARRGENERIC) tag = arrtag(h, u); \
+      else if (u >= *lenhint(h)) tag = LUA_VEMPTY; \
       if (!tagisempty(tag)) { farr2val(h, u, tag, res); }} \
     else { tag = luaH_getint(h, (k), res); }}
 
@@ -57,19 +80,70 @@
 #define luaH_fastseti(t,k,val,hres) \
   { Table *h = t; lua_Unsigned u = l_castS2U(k) - 1u; \
     if ((u < h->asize)) { \
-      lu_byte *tag = getArrTag(h, u); \
-      if (checknoTM(h->metatable, TM_NEWINDEX) || !tagisempty(*tag)) \
-        { fval2arr(h, u, tag, val); hres = HOK; } \
-      else hres = ~cast_int(u); } \
+      if (arrkind(h) == ARRGENERIC) { \
+        if (checknoTM(h->metatable, TM_NEWINDEX) || \
+            !tagisempty(arrtag(h, u))) \
+          { obj2arr(h, u, val); hres = HOK; } \
+        else hres = ~cast_int(u); } \
+      else if (rawtt(val) == arrkind(h) && u < *lenhint(h)) \
+        { *getArrVal(h, u) = (val)->value_; hres = HOK; } \
+      else hres = luaH_psettyped(h, cast_uint(u), val); } \
     else { hres = luaH_psetint(h, k, val); }}
 
 
+/*
+** Fast accesses through inline caches (see 'luaF_initicache'). 'ic'
+** points to the index of the node (or slot, in a shaped table) where
+** key 'k' (a short string) was last found. The cache hits when that
+** node still holds that key with a non-empty value; for a shaped table,
+** that is a check of the shape plus an indexed load. As the value is
+** present, metamethods do not matter, so there is no need to invalidate
+** caches when a table is rehashed or gets a new metatable: a stale
+** index simply misses.
+*/
+#define icvalidnode(h,k,ni) \
+  ((ni) < sizenode(h) && keyisshrstr(gnode(h, ni)) && \
+   keystrval(gnode(h, ni)) == (k) && !isempty(gval(gnode(h, ni))))
+
+#define icvalidslot(h,k,ni) \
+  ((ni) < getshape(h)->nkeys && getshape(h)->keys[ni] == (k) && \
+   !isempty(gslot(h, ni)))
+
+#define icvalid(h,k,ni) \
+  (isshaped(h) ? icvalidslot(h,k,ni) : icvalidnode(h,k,ni))
+
+#define icslot(h,ni)	(isshaped(h) ? gslot(h, ni) : gval(gnode(h, ni)))
+
+#define luaH_fastgetcached(t,k,res,ic,tag) \
+  { Table *h = t; unsigned ni = *(ic); \
+    if (icvalid(h, k, ni)) { \
+      const TValue *slot = icslot(h, ni); \
+      tag = ttypetag(slot); setobj(cast(lua_State *, NULL), res, slot); } \
+    else { tag = luaH_getcached(h, k, res, ic); }}
+
+#define luaH_fastpsetcached(t,k,val,ic,hres) \
+  { Table *h = t; unsigned ni = *(ic); \
+    if (icvalid(h, k, ni)) { \
+      setobj(cast(lua_State *, NULL), icslot(h, ni), val); \
+      hres = HOK; } \
+    else { hres = luaH_psetcached(h, k, val, ic); }}
+
+
 /* results from pset */
 #define HOK		0
 #define HNOTFOUND	1
 #define HNOTATABLE	2
 #define HFIRSTNODE	3
 
+/*
+** True if a failed 'pset' with result 'hres' was for an entry present
+** in a typed array part. (A typed part cannot hold some values, so a
+** 'pset' can fail even for a present key; such an update must not go
+** to a '__newindex' metamethod.)
+*/
+#define luaH_ispresent(t,hres)  \
+  ((hres) < 0 && istyped(t) && cast_uint(~(hres)) < *lenhint(t))
+
 /*
 ** 'luaH_get*' operations set 'res', unless the value is absent, and
 ** return the tag of the result.
@@ -79,7 +153,8 @@
 ** slot with that key but with no value, 'luaH_pset*' return an encoding
 ** of where the key is (usually called 'hres'). (pset cannot set that
 ** value because there might be a metamethod.) If the slot is in the
-** hash part, the encoding is (HFIRSTNODE + hash index); if the slot is
+** hash part, the encoding is (HFIRSTNODE + hash index), where the hash
+** index of a shaped table is the index of its slot; if the slot is
 ** in the array part, the encoding is (~array index), a negative value.
 ** The value HNOTATABLE is used by the fast macros to signal that the
 ** value being indexed is not a table.
@@ -95,23 +170,24 @@
 /*
 ** The array part of a table is represented by an inverted array of
 ** values followed by an array of tags, to avoid wasting space with
-** padding. In between them there is an unsigned int, explained later.
-** The 'array' pointer points between the two arrays, so that values are
-** indexed with negative indices and tags with non-negative indices.
-
-             Values                              Tags
-  --------------------------------------------------------
-  ...  |   Value 1     |   Value 0     |unsigned|0|1|...
-  --------------------------------------------------------
+** padding. In between them there are an unsigned int and a byte,
+** explained later. The 'array' pointer points between the two arrays,
+** so that values are indexed with negative indices and tags with
+** non-negative indices.
+
+             Values                                 Tags
+  -------------------------------------------------------------
+  ...  |   Value 1     |   Value 0     |unsigned|kind|0|1|...
+  -------------------------------------------------------------
                                        ^ t->array
 
-** All accesses to 't->array' should be through the macros 'getArrTag'
-** and 'getArrVal'.
+** A typed array part has no array of tags. With NaN boxing, values
+** carry their own tags, so there is neither an array of tags nor the
+** kind byte.
+** All accesses to 't->array' should be through the macros 'getArrVal',
+** 'arrtag', and 'setarrempty'.
 */
 
-/* Computes the address of the tag for the abstract C-index 'k' */
-#define getArrTag(t,k)	(cast(lu_byte*, (t)->array) + sizeof(unsigned) + (k))
-
 /* Computes the address of the value for the abstract C-index 'k' */
 #define getArrVal(t,k)	((t)->array - 1 - (k))
 
@@ -124,6 +200,44 @@
 #define lenhint(t)	cast(unsigned*, (t)->array)
 
 
+/*
+** An array part is either generic, with a tag for each entry, or
+** typed. A typed array part keeps only integers or only floats, with
+** no tags: its kind is the tag of all its values. It has no holes:
+** its entries are the first 'n' ones, where 'n' is the value in
+** 'lenhint' (which in this case is not a hint, but the exact length of
+** the array). Entries after 'n' are empty, whatever their contents.
+** The kind of the array part goes in a byte after the length hint.
+** (With NaN boxing, values carry their own tags, so there is no gain
+** in typed arrays; all array parts are generic.)
+*/
+#define ARRGENERIC	0
+
+#define istyped(t)	((t)->asize > 0 && arrkind(t) != ARRGENERIC)
+
+/* tag of entry 'k' (a C index) in the array part of 't' */
+#define arrkeytag(t,k)  \
+  (arrkind(t) == ARRGENERIC ? arrtag(t,k)  \
+                            : ((k) < *lenhint(t)) ? arrkind(t) : LUA_VEMPTY)
+
+
+#if !defined(LUAI_NANBOX)
+
+/* size of the tag of each array entry */
+#define ARRTAGSIZE	1
+
+/* size of the space between the two arrays (hint plus kind) */
+#define ARRHEADSIZE	(sizeof(unsigned) + 1)
+
+#define arrkind(t)	(cast(lu_byte*, (t)->array)[sizeof(unsigned)])
+#define setarrkind(t,k)	(arrkind(t) = (k))
+
+/* Computes the address of the tag for the abstract C-index 'k' */
+#define getArrTag(t,k)	(cast(lu_byte*, (t)->array) + ARRHEADSIZE + (k))
+
+#define arrtag(t,k)	(*getArrTag(t,k))
+#define setarrempty(t,k)	(*getArrTag(t,k) = LUA_VEMPTY)
+
 /*
 ** Move TValues to/from arrays, using C indices
 */
@@ -136,26 +250,46 @@
 
 /*
 ** Often, we need to check the tag of a value before moving it. The
-** following macros also move TValues to/from arrays, but receive the
-** precomputed tag value or address as an extra argument.
+** following macro also moves TValues from arrays, but receives the
+** precomputed tag value as an extra argument.
 */
 #define farr2val(h,k,tag,res)  \
   ((res)->tt_ = tag, (res)->value_ = *getArrVal(h,(k)))
 
-#define fval2arr(h,k,tag,val)  \
-  (*tag = (val)->tt_, *getArrVal(h,(k)) = (val)->value_)
+#else
+
+#define ARRTAGSIZE	0
+#define ARRHEADSIZE	sizeof(unsigned)
+
+#define arrkind(t)	ARRGENERIC
+#define setarrkind(t,k)	((void)(k))
+
+#define arrtag(t,k)	nbtag(getArrVal(t,k)->u)
+#define setarrempty(t,k)	(getArrVal(t,k)->u = nbbox(NBSIMPLE, LUA_VEMPTY))
+
+#define arr2obj(h,k,val)	((val)->value_ = *getArrVal(h,(k)))
+#define obj2arr(h,k,val)	(*getArrVal(h,(k)) = (val)->value_)
+#define farr2val(h,k,tag,res)	((void)(tag), arr2obj(h,k,res))
+
+#endif
 
 
 LUAI_FUNC lu_byte luaH_get (Table *t, const TValue *key, TValue *res);
 LUAI_FUNC lu_byte luaH_getshortstr (Table *t, TString *key, TValue *res);
 LUAI_FUNC lu_byte luaH_getstr (Table *t, TString *key, TValue *res);
 LUAI_FUNC lu_byte luaH_getint (Table *t, lua_Integer key, TValue *res);
+LUAI_FUNC lu_byte luaH_getcached (Table *t, TString *key, TValue *res,
+                                  unsigned *ic);
 
 /* Special get for metamethods */
 LUAI_FUNC const TValue *luaH_Hgetshortstr (Table *t, TString *key);
 
 LUAI_FUNC int luaH_psetint (Table *t, lua_Integer key, TValue *val);
+LUAI_FUNC int luaH_pseti (Table *t, lua_Integer key, TValue *val);
+LUAI_FUNC int luaH_psettyped (Table *t, unsigned k, TValue *val);
 LUAI_FUNC int luaH_psetshortstr (Table *t, TString *key, TValue *val);
+LUAI_FUNC int luaH_psetcached (Table *t, TString *key, TValue *val,
+                               unsigned *ic);
 LUAI_FUNC int luaH_psetstr (Table *t, TString *key, TValue *val);
 LUAI_FUNC int luaH_pset (Table *t, const TValue *key, TValue *val);
 
@@ -172,7 +306,9 @@ LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned nasize,
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned nasize);
 LUAI_FUNC lu_mem luaH_size (Table *t);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_freeshapes (lua_State *L);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
+LUAI_FUNC unsigned luaH_slotof (Table *t, const TValue *key);
 LUAI_FUNC lua_Unsigned luaH_getn (Table *t);
 
 
@@ -193,6 +193,9 @@ Memcontrol l_memcontrol =
    {0UL, 0UL, 0UL, 0UL, 0UL, 0UL, 0UL, 0UL, 0UL}};
 
 
+Dispatchcount l_dispatchcount = {0UL, 0UL};
+
+
 static void freeblock (Memcontrol *mc, Header *block) {
   if (block) {
     size_t size = block->d.size;
@@ -270,6 +273,35 @@ void *debug_realloc (void *ud, void *b, size_t oldsize, size_t size) {
 }
 
 
+/*
+** Objects in the page heap do not go through the allocator; these
+** functions apply its limits and its count of memory to them.
+*/
+int luai_pagealloctest (size_t size) {
+  Memcontrol *mc = &l_memcontrol;
+  if (mc->failnext) {
+    mc->failnext = 0;
+    return 0;  /* fake a single memory allocation error */
+  }
+  if (mc->countlimit != ~0UL) {  /* count limit in use? */
+    if (mc->countlimit == 0)
+      return 0;  /* fake a memory allocation error */
+    mc->countlimit--;
+  }
+  if (mc->total + size > mc->memlimit)
+    return 0;  /* fake a memory allocation error */
+  mc->total += size;
+  if (mc->total > mc->maxmem)
+    mc->maxmem = mc->total;
+  return 1;
+}
+
+
+void luai_pagefreetest (size_t size) {
+  l_memcontrol.total -= size;
+}
+
+
 /* }====================================================================== */
 
 
@@ -400,10 +432,26 @@ static void checktable (global_State *g, Table *h) {
   Node *n, *limit = gnode(h, sizenode(h));
   GCObject *hgc = obj2gco(h);
   checkobjrefN(g, hgc, h->metatable);
-  for (i = 0; i < asize; i++) {
-    TValue aux;
-    arr2obj(h, i, &aux);
-    checkvalref(g, hgc, &aux);
+  if (istyped(h))  /* no references; check its length */
+    assert(*lenhint(h) <= asize);
+  else {
+    for (i = 0; i < asize; i++) {
+      TValue aux;
+      arr2obj(h, i, &aux);
+      checkvalref(g, hgc, &aux);
+    }
+  }
+  if (isshaped(h)) {
+    const Shape *s = getshape(h);
+    assert(s->nkeys <= sizenode(h));
+    for (i = 0; i < s->nkeys; i++) {
+      assert(strisshr(s->keys[i]));
+      checkobjref(g, hgc, obj2gco(s->keys[i]));
+      checkvalref(g, hgc, gslot(h, i));
+    }
+    for (; i < sizenode(h); i++)
+      assert(isempty(gslot(h, i)));
+    return;
   }
   for (n = gnode(h, 0); n < limit; n++) {
     if (!isempty(gval(n))) {
@@ -549,7 +597,7 @@ static void checkrefs (global_State *g, GCObject *o) {
 **   * old objects cannot be white.
 **   * old objects must be black, except for 'touched1', 'old0',
 **     threads, and open upvalues.
-**   * 'touched1' objects must be gray.
+**   * 'touched1' objects must be gray, except for tables using cards.
 */
 static void checkobject (global_State *g, GCObject *o, int maybedead,
                          int listage) {
@@ -567,21 +615,31 @@ static void checkobject (global_State *g, GCObject *o, int maybedead,
         o->tt == LUA_VTHREAD ||
         (o->tt == LUA_VUPVAL && upisopen(gco2upv(o))));
       }
-      assert(getage(o) != G_TOUCHED1 || isgray(o));
+      assert(getage(o) != G_TOUCHED1 || isgray(o) || o->tt == LUA_VTABLE);
     }
     checkrefs(g, o);
   }
 }
 
 
+static void checkgrayobj (global_State *g, GCObject *o) {
+  /* black objects in gray lists are 'touched2' or tables using cards */
+  if (isgray(o))
+    assert(getage(o) != G_TOUCHED2);
+  else
+    assert(getage(o) == G_TOUCHED2 ||
+           (getage(o) == G_TOUCHED1 && o->tt == LUA_VTABLE));
+  assert(!testbit(o->marked, TESTBIT));
+  if (keepinvariant(g))
+    l_setbit(o->marked, TESTBIT);  /* mark that object is in a gray list */
+}
+
+
 static l_mem checkgraylist (global_State *g, GCObject *o) {
   int total = 0;  /* count number of elements in the list */
   cast_void(g);  /* better to keep it if we need to print an object */
   while (o) {
-    assert(!!isgray(o) ^ (getage(o) == G_TOUCHED2));
-    assert(!testbit(o->marked, TESTBIT));
-    if (keepinvariant(g))
-      l_setbit(o->marked, TESTBIT);  /* mark that object is in a gray list */
+    checkgrayobj(g, o);
     total++;
     switch (o->tt) {
       case LUA_VTABLE: o = gco2t(o)->gclist; break;
@@ -600,6 +658,22 @@ static l_mem checkgraylist (global_State *g, GCObject *o) {
 }
 
 
+#if defined(LUAI_PAGEHEAP)
+
+static l_mem checkgraystack (global_State *g) {
+  int i;
+  for (i = 0; i < g->ngray; i++)
+    checkgrayobj(g, g->graystack[i]);
+  return g->ngray;
+}
+
+#else
+
+#define checkgraystack(g)	0
+
+#endif
+
+
 /*
 ** Check objects in gray lists.
 */
@@ -607,6 +681,7 @@ static l_mem checkgrays (global_State *g) {
   l_mem total = 0;  /* count number of elements in all lists */
   if (!keepinvariant(g)) return total;
   total += checkgraylist(g, g->gray);
+  total += checkgraystack(g);
   total += checkgraylist(g, g->grayagain);
   total += checkgraylist(g, g->weak);
   total += checkgraylist(g, g->allweak);
@@ -629,7 +704,7 @@ static void incifingray (global_State *g, GCObject *o, l_mem *count) {
     return;  /* upvalues are never in gray lists */
   }
   /* these are the ones that must be in gray lists */
-  if (isgray(o) || getage(o) == G_TOUCHED2) {
+  if (isgray(o) || getage(o) >= G_TOUCHED1) {
     (*count)++;
     assert(testbit(o->marked, TESTBIT));
     resetbit(o->marked, TESTBIT);  /* prepare for next cycle */
@@ -665,12 +740,62 @@ static l_mem checklist (global_State *g, int maybedead, int tof,
 }
 
 
+/*
+** Is bucket 'k' of the new vector of a string table in use? (During a
+** resize, it is only after the first old bucket going to it was moved.)
+*/
+static int strbucketinuse (stringtable *tb, int k) {
+  return (tb->old == NULL ||
+          lmod(cast_uint(k), tb->oldsize) < cast_uint(tb->moved));
+}
+
+
+static int checkstrlist (stringtable *tb, TString *ts, int isold, int i) {
+  int n = 0;
+  for (; ts != NULL; ts = ts->u.hnext) {
+    assert(ts->tt == LUA_VSHRSTR);
+    if (isold)
+      assert(lmod(ts->hash, tb->oldsize) == cast_uint(i));
+    else {
+      assert(lmod(ts->hash, tb->size) == cast_uint(i));
+      assert(tb->old == NULL ||  /* old bucket was moved */
+             lmod(ts->hash, tb->oldsize) < cast_uint(tb->moved));
+    }
+    n++;
+  }
+  return n;
+}
+
+
+/*
+** Check the string table: every string must be in the bucket where
+** 'internshrstr' would look for it. During a resize, that is its
+** bucket in the old vector, if not moved yet, or in the new vector.
+*/
+static void checkstrtab (global_State *g) {
+  stringtable *tb = &g->strt;
+  int n = 0;
+  int i;
+  for (i = 0; i < tb->size; i++) {
+    if (strbucketinuse(tb, i))
+      n += checkstrlist(tb, tb->hash[i], 0, i);
+  }
+  if (tb->old != NULL) {
+    assert(0 <= tb->moved && tb->moved < tb->oldsize);
+    for (i = tb->moved; i < tb->oldsize; i++)
+      n += checkstrlist(tb, tb->old[i], 1, i);
+  }
+  assert(n == tb->nuse);
+}
+
+
 int lua_checkmemory (lua_State *L) {
   global_State *g = G(L);
   GCObject *o;
   int maybedead;
   l_mem totalin;  /* total of objects that are in gray lists */
   l_mem totalshould;  /* total of objects that should be in gray lists */
+  lu_mem npending = 0;  /* number of objects in 'tobefnz' */
   if (keepinvariant(g)) {
     assert(!iswhite(mainthread(g)));
     assert(!iswhite(gcvalue(&g->l_registry)));
@@ -699,9 +824,14 @@ int lua_checkmemory (lua_State *L) {
     incifingray(g, o, &totalshould);
     assert(tofinalize(o));
     assert(o->tt == LUA_VUSERDATA || o->tt == LUA_VTABLE);
+    npending++;
   }
+  assert(npending == g->gcstats.npendingfin);
+  /* log of ephemeron entries lives only inside atomic phases */
+  assert(!g->gclogeph && g->ephlog == NULL);
   if (keepinvariant(g))
     assert(totalin == totalshould);
+  checkstrtab(g);
   return 0;
 }
 
@@ -716,11 +846,11 @@ int lua_checkmemory (lua_State *L) {
 */
 
 
-static char *buildop (Proto *p, int pc, char *buff) {
+static char *buildop (Proto *p, int pc, char *buff, int raw) {
   char *obuff = buff;
   Instruction i = p->code[pc];
-  OpCode o = GET_OPCODE(i);
-  const char *name = opnames[o];
+  OpCode o = GET_BASEOP(i);  /* show code as generated... */
+  const char *name = opnames[raw ? GET_OPCODE(i) : o];  /* ...unless raw */
   int line = luaG_getfuncline(p, pc);
   int lineinfo = (p->lineinfo != NULL) ? p->lineinfo[pc] : 0;
   if (lineinfo == ABSLINEINFO)
@@ -761,7 +891,7 @@ void luaI_printcode (Proto *pt, int size) {
   int pc;
   for (pc=0; pc<size; pc++) {
     char buff[100];
-    printf("%s\n", buildop(pt, pc, buff));
+    printf("%s\n", buildop(pt, pc, buff, 0));
   }
   printf("-------\n");
 }
@@ -769,24 +899,25 @@ void luaI_printcode (Proto *pt, int size) {
 
 void luaI_printinst (Proto *pt, int pc) {
   char buff[100];
-  printf("%s\n", buildop(pt, pc, buff));
+  printf("%s\n", buildop(pt, pc, buff, 0));
 }
 #endif
 
 
 static int listcode (lua_State *L) {
-  int pc;
+  int pc, raw;
   Proto *p;
   luaL_argcheck(L, lua_isfunction(L, 1) && !lua_iscfunction(L, 1),
                  1, "Lua function expected");
   p = getproto(obj_at(L, 1));
+  raw = lua_toboolean(L, 2);
   lua_newtable(L);
   setnameval(L, "maxstack", p->maxstacksize);
   setnameval(L, "numparams", p->numparams);
   for (pc=0; pc<p->sizecode; pc++) {
     char buff[100];
     lua_pushinteger(L, pc+1);
-    lua_pushstring(L, buildop(p, pc, buff));
+    lua_pushstring(L, buildop(p, pc, buff, raw));
     lua_settable(L, -3);
   }
   return 1;
@@ -803,7 +934,7 @@ static int printcode (lua_State *L) {
   printf("numparams: %d\n", p->numparams);
   for (pc=0; pc<p->sizecode; pc++) {
     char buff[100];
-    printf("%s\n", buildop(p, pc, buff));
+    printf("%s\n", buildop(p, pc, buff, 0));
   }
   return 0;
 }
@@ -883,6 +1014,18 @@ static int get_limits (lua_State *L) {
 }
 
 
+/*
+** Return the number of instructions fetched through the dispatch and
+** the number of instructions run as part of superinstructions (which
+** would need a dispatch without them).
+*/
+static int dispatch_query (lua_State *L) {
+  lua_pushinteger(L, cast(lua_Integer, l_dispatchcount.dispatched));
+  lua_pushinteger(L, cast(lua_Integer, l_dispatchcount.fused));
+  return 2;
+}
+
+
 static int mem_query (lua_State *L) {
   if (lua_isnone(L, 1)) {
     lua_pushinteger(L, cast(lua_Integer, l_memcontrol.total));
@@ -1077,32 +1220,51 @@ static int table_query (lua_State *L) {
     lua_pushinteger(L, cast(lua_Integer, asize));
     lua_pushinteger(L, cast(lua_Integer, allocsizenode(t)));
     lua_pushinteger(L, cast(lua_Integer, asize > 0 ? *lenhint(t) : 0));
-    return 3;
+    if (!istyped(t))
+      lua_pushnil(L);
+    else  /* kind of the typed array */
+      lua_pushstring(L, arrkind(t) == LUA_VNUMINT ? "integer" : "float");
+    return 4;
   }
   else if (cast_uint(i) < asize) {
+    lu_byte tag = arrkeytag(t, cast_uint(i));
     lua_pushinteger(L, i);
-    if (!tagisempty(*getArrTag(t, i)))
-      arr2obj(t, cast_uint(i), s2v(L->top.p));
+    if (!tagisempty(tag))
+      farr2val(t, cast_uint(i), tag, s2v(L->top.p));
     else
       setnilvalue(s2v(L->top.p));
     api_incr_top(L);
     lua_pushnil(L);
   }
   else if (cast_uint(i -= cast_int(asize)) < sizenode(t)) {
-    TValue k;
-    getnodekey(L, &k, gnode(t, i));
-    if (!isempty(gval(gnode(t, i))) ||
-        ttisnil(&k) ||
-        ttisnumber(&k)) {
-      pushobject(L, &k);
+    if (isshaped(t)) {
+      const Shape *s = getshape(t);
+      if (cast_uint(i) < s->nkeys)
+        lua_pushstring(L, getshrstr(s->keys[i]));
+      else
+        lua_pushnil(L);
+      if (!isempty(gslot(t, i)))
+        pushobject(L, gslot(t, i));
+      else
+        lua_pushnil(L);
+      lua_pushinteger(L, 0);
+    }
+    else {
+      TValue k;
+      getnodekey(L, &k, gnode(t, i));
+      if (!isempty(gval(gnode(t, i))) ||
+          ttisnil(&k) ||
+          ttisnumber(&k)) {
+        pushobject(L, &k);
+      }
+      else
+        lua_pushliteral(L, "<undef>");
+      if (!isempty(gval(gnode(t, i))))
+        pushobject(L, gval(gnode(t, i)));
+      else
+        lua_pushnil(L);
+      lua_pushinteger(L, gnext(&t->node[i]));
     }
-    else
-      lua_pushliteral(L, "<undef>");
-    if (!isempty(gval(gnode(t, i))))
-      pushobject(L, gval(gnode(t, i)));
-    else
-      lua_pushnil(L);
-    lua_pushinteger(L, gnext(&t->node[i]));
   }
   return 3;
 }
@@ -1137,21 +1299,46 @@ static int test_applyparam (lua_State *L) {
 }
 
 
+static int pushstrlist (lua_State *L, TString *ts, stringtable *tb,
+                        int s) {
+  int n = 0;
+  for (; ts != NULL; ts = ts->u.hnext) {
+    if (lmod(ts->hash, tb->size) == cast_uint(s)) {
+      setsvalue2s(L, L->top.p, ts);
+      api_incr_top(L);
+      n++;
+    }
+  }
+  return n;
+}
+
+
+/*
+** With no arguments, returns the size of the string table, its number
+** of strings, and the number of buckets still to be moved by a resize.
+** Otherwise, returns the strings whose position is the given bucket
+** (which, during a resize, can be still in the old vector).
+*/
 static int string_query (lua_State *L) {
   stringtable *tb = &G(L)->strt;
   int s = cast_int(luaL_optinteger(L, 1, 0)) - 1;
   if (s == -1) {
     lua_pushinteger(L ,tb->size);
     lua_pushinteger(L ,tb->nuse);
-    return 2;
+    lua_pushinteger(L, (tb->old == NULL) ? 0 : tb->oldsize - tb->moved);
+    return 3;
   }
   else if (s < tb->size) {
-    TString *ts;
     int n = 0;
-    for (ts = tb->hash[s]; ts != NULL; ts = ts->u.hnext) {
-      setsvalue2s(L, L->top.p, ts);
-      api_incr_top(L);
-      n++;
+    if (strbucketinuse(tb, s))
+      n += pushstrlist(L, tb->hash[s], tb, s);
+    if (tb->old != NULL) {  /* look for it in the old vector too */
+      int step = (tb->size < tb->oldsize) ? tb->size : tb->oldsize;
+      int i;
+      for (i = s % step; i < tb->oldsize; i += step) {
+        if (i >= tb->moved)  /* bucket not moved yet? */
+          n += pushstrlist(L, tb->old[i], tb, s);
+      }
     }
     return n;
   }
@@ -1309,6 +1496,13 @@ static int loadlib (lua_State *L) {
   return 0;
 }
 
+static int setmemlimit (lua_State *L) {
+  lua_State *L1 = getstate(L);
+  size_t limit = cast_sizet(luaL_checkinteger(L, 2));
+  lua_pushinteger(L, cast_st2S(lua_setmemlimit(L1, limit)));
+  return 1;
+}
+
 static int closestate (lua_State *L) {
   lua_State *L1 = getstate(L);
   lua_close(L1);
@@ -2089,6 +2283,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"checkmemory", lua_checkmemory},
   {"closestate", closestate},
   {"d2s", d2s},
+  {"dispatches", dispatch_query},
   {"doonnewstack", doonnewstack},
   {"doremote", doremote},
   {"gccolor", gc_color},
@@ -2108,6 +2303,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"loadlib", loadlib},
   {"checkpanic", checkpanic},
   {"newstate", newstate},
+  {"setmemlimit", setmemlimit},
   {"newuserdata", newuserdata},
   {"num2int", num2int},
   {"makeseed", makeseed},
@@ -2155,6 +2351,18 @@ int luaB_opentests (lua_State *L) {
   lua_assert(f == debug_realloc && ud == cast_voidp(&l_memcontrol));
   lua_setallocf(L, f, ud);  /* exercise this function */
   luaL_newlib(L, tests_funcs);
+#if defined(LUAI_SWISSHASH)
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "swisshash");  /* hash parts use open addressing */
+#endif
+#if !defined(LUAI_NANBOX)
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "typedarrays");  /* array parts may be typed */
+#endif
+#if defined(LUAI_PAGEHEAP)
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, "pageheap");  /* small objects do not use 'frealloc' */
+#endif
   return 1;
 }
 
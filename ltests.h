@@ -62,10 +62,29 @@ typedef struct Memcontrol {
 LUA_API Memcontrol l_memcontrol;
 
 
+/* counters for instruction dispatches in the interpreter */
+typedef struct Dispatchcount {
+  unsigned long dispatched;  /* instructions fetched through the dispatch */
+  unsigned long fused;  /* instructions run as part of superinstructions */
+} Dispatchcount;
+
+LUA_API Dispatchcount l_dispatchcount;
+
+#define luai_countdispatch(L)	(l_dispatchcount.dispatched++)
+#define luai_countfused(L)	(l_dispatchcount.fused++)
+
+
 #define luai_tracegc(L,f)		luai_tracegctest(L, f)
 LUAI_FUNC void luai_tracegctest (lua_State *L, int first);
 
 
+/* apply the limits of the test allocator to objects in pages */
+#define luai_pagealloc(L,s)	luai_pagealloctest(s)
+#define luai_pagefree(L,s)	luai_pagefreetest(s)
+LUAI_FUNC int luai_pagealloctest (size_t size);
+LUAI_FUNC void luai_pagefreetest (size_t size);
+
+
 /*
 ** generic variable for debug tricks
 */
@@ -141,6 +160,9 @@ LUA_API void *debug_realloc (void *ud, void *block,
 #define STRCACHE_N	23
 #define STRCACHE_M	5
 
+#define LUA_PATCACHESIZE	3
+#define PATMINUSES	1
+
 #undef LUAI_USER_ALIGNMENT_T
 #define LUAI_USER_ALIGNMENT_T   union { char b[sizeof(void*) * 8]; }
 
@@ -302,6 +302,7 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                           const char *chunkname, const char *mode);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data, int strip);
+LUA_API int (lua_heapsnapshot) (lua_State *L, lua_Writer writer, void *data);
 
 
 /*
@@ -338,6 +339,13 @@ LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 #define LUA_GCGEN		7
 #define LUA_GCINC		8
 #define LUA_GCPARAM		9
+#define LUA_GCTHREADS		10
+#define LUA_GCBGFREE		11
+#define LUA_GCSTEPTIME		12
+#define LUA_GCPAUSES		13
+#define LUA_GCSTATS		14
+#define LUA_GCDEFERFIN		15
+#define LUA_GCRUNFIN		16
 
 
 /*
@@ -353,8 +361,11 @@ LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 #define LUA_GCPSTEPMUL		4  /* GC "speed" */
 #define LUA_GCPSTEPSIZE		5  /* GC granularity */
 
+/* parameter for generational mode */
+#define LUA_GCPNURSERY		6  /* minimum size of young generation */
+
 /* number of parameters */
-#define LUA_GCPN		6
+#define LUA_GCPN		7
 
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
@@ -377,6 +388,7 @@ LUA_API size_t  (lua_stringtonumber) (lua_State *L, const char *s);
 
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
+LUA_API size_t    (lua_setmemlimit) (lua_State *L, size_t limit);
 
 LUA_API void (lua_toclose) (lua_State *L, int idx);
 LUA_API void (lua_closeslot) (lua_State *L, int idx);
@@ -92,6 +92,72 @@
 #endif
 
 
+/*
+@@ LUA_USE_JIT compiles hot Lua functions to native code. It is only
+** available for x86-64 on Posix systems; elsewhere, it is ignored.
+*/
+/* #define LUA_USE_JIT */
+
+#if defined(LUA_USE_JIT) && \
+    !(defined(__x86_64__) && defined(LUA_USE_POSIX))
+#undef LUA_USE_JIT
+#endif
+
+
+/*
+@@ LUAI_SWISSHASH makes the hash parts of tables use open addressing,
+** with a byte of control information per node, probed in groups of 16
+** nodes (with SSE2 instructions, when available). The default is a
+** chained scatter table.
+*/
+/* #define LUAI_SWISSHASH */
+
+
+/*
+@@ LUAI_WORDHASH makes the hash of strings a keyed hash (SipHash-1-3)
+** that reads whole words (of type 'size_t') instead of single bytes.
+** It is faster for longer strings. Its key comes from the seed, so it
+** resists collision attacks only with a random seed. The default is
+** the classic shift-and-xor hash over each byte.
+*/
+/* #define LUAI_WORDHASH */
+
+
+/*
+@@ LUAI_PAGEHEAP allocates small collectable objects from aligned pages
+** of fixed-size cells, whose headers keep the colors of their objects
+** in side maps. So, marking does not write into the objects, which
+** keeps their memory pages untouched (e.g., shared after a 'fork').
+** This option disables LUA_USE_GCTHREADS.
+*/
+/* #define LUAI_PAGEHEAP */
+
+
+/*
+@@ LUA_USE_GCTHREADS allows the collector to use several threads to
+** traverse objects in the atomic phase of a cycle (which, in a full
+** collection, does all the marking), while the program is stopped. The
+** number of threads is set with 'lua_gc'; by default, there is only
+** one. It also allows dead objects to be freed by a background thread
+** (which is off by default, as it needs a thread-safe allocator). It
+** needs Posix threads and the atomic builtins of GCC.
+*/
+/* #define LUA_USE_GCTHREADS */
+
+#if defined(LUA_USE_GCTHREADS) && \
+    (!(defined(LUA_USE_POSIX) && defined(__GNUC__)) || defined(LUAI_PAGEHEAP))
+#undef LUA_USE_GCTHREADS
+#endif
+
+
+/*
+@@ LUA_USE_POOLALLOC makes 'luaL_newstate' use an allocator that serves
+** small blocks from pools with size classes, instead of 'realloc'.
+** ('luaL_newstatex' can select either allocator.)
+*/
+/* #define LUA_USE_POOLALLOC */
+
+
 /*
 @@ LUAI_IS32INT is true iff 'int' has (at least) 32 bits.
 */
@@ -141,6 +207,25 @@
 #define LUA_32BITS	0
 
 
+/*
+@@ LUAI_NANBOX represents each value as a single 'double' (NaN boxing),
+** halving the size of stack slots, array entries, and constants.
+** Integers in that representation have only 32 bits, so this option
+** selects 'int' for Lua integers. It needs C99 and pointers with at
+** most 47 significant bits, which is the case for user space in usual
+** 64-bit systems. (The compiler to native code does not support this
+** representation.)
+*/
+/* #define LUAI_NANBOX */
+
+#if defined(LUAI_NANBOX)
+#if defined(LUA_USE_C89)
+#error "NaN boxing is not compatible with C89"
+#endif
+#undef LUA_USE_JIT
+#endif
+
+
 /*
 @@ LUA_C89_NUMBERS ensures that Lua uses the largest types available for
 ** C89 ('long' and 'double'); Windows always has '__int64', so it does
@@ -164,6 +249,13 @@
 #endif
 #define LUA_FLOAT_TYPE	LUA_FLOAT_FLOAT
 
+#elif defined(LUAI_NANBOX)	/* }{ */
+/*
+** 32-bit integers (fit in a boxed value) and 'double'
+*/
+#define LUA_INT_TYPE	LUA_INT_INT
+#define LUA_FLOAT_TYPE	LUA_FLOAT_DOUBLE
+
 #elif LUA_C89_NUMBERS	/* }{ */
 /*
 ** largest types available for C89 ('long' and 'double')
@@ -20,6 +20,7 @@
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "lundump.h"
@@ -328,6 +329,9 @@ static void loadFunction (LoadState *S, Proto *f) {
     f->flag |= PF_FIXED;  /* signal that code is fixed */
   f->maxstacksize = loadByte(S);
   loadCode(S, f);
+  luaF_initicache(S->L, f);
+  if (!S->fixed)  /* fixed code cannot change */
+    luaP_fuse(f->code, f->sizecode);
   loadConstants(S, f);
   loadUpvalues(S, f);
   loadProtos(S, f);
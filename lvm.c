@@ -23,6 +23,7 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -334,10 +335,10 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
     if (hres != HNOTATABLE) {  /* is 't' a table? */
       Table *h = hvalue(t);  /* save 't' table */
       tm = fasttm(L, h->metatable, TM_NEWINDEX);  /* get metamethod */
-      if (tm == NULL) {  /* no metamethod? */
+      if (tm == NULL || luaH_ispresent(h, hres)) {  /* raw set? */
         luaH_finishset(L, h, key, val, hres);  /* set new value */
         invalidateTMcache(h);
-        luaC_barrierback(L, obj2gco(h), val);
+        luaC_barriertable(L, h, key, val);
         return;
       }
       /* else will try the metamethod */
@@ -811,7 +812,7 @@ void luaV_finishOp (lua_State *L) {
   CallInfo *ci = L->ci;
   StkId base = ci->func.p + 1;
   Instruction inst = *(ci->u.l.savedpc - 1);  /* interrupted instruction */
-  OpCode op = GET_OPCODE(inst);
+  OpCode op = GET_BASEOP(inst);
   switch (op) {  /* finish its execution */
     case OP_MMBIN: case OP_MMBINI: case OP_MMBINK: {
       setobjs2s(L, base + GETARG_A(*(ci->u.l.savedpc - 2)), --L->top.p);
@@ -974,6 +975,58 @@ void luaV_finishOp (lua_State *L) {
   op_arith_aux(L, v1, v2, iop, fop); }
 
 
+/*
+** Change the opcode of the current instruction. ('pc' already points
+** to the next instruction.)
+*/
+#define setcurrentop(op)	SET_OPCODE(*cast(Instruction *, pc - 1), op)
+
+/*
+** Quicken the current instruction into its version 'op' specialized
+** for floats. Fixed code cannot change.
+*/
+#define quicken(op)  \
+	{ if (!(cl->p->flag & PF_FIXED)) setcurrentop(op); }
+
+
+/*
+** Arithmetic operations with register operands that are quickened
+** into 'qop' when both operands are floats.
+*/
+#define op_arithQ(L,iop,fop,qop) {  \
+  StkId ra = RA(i); \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = vRC(i);  \
+  if (ttisinteger(v1) && ttisinteger(v2)) {  \
+    lua_Integer i1 = ivalue(v1); lua_Integer i2 = ivalue(v2);  \
+    pc++; setivalue(s2v(ra), iop(L, i1, i2));  \
+  }  \
+  else {  \
+    if (ttisfloat(v1) && ttisfloat(v2))  \
+      quicken(qop);  \
+    op_arithf_aux(L, v1, v2, fop);  \
+  }}
+
+
+/*
+** Arithmetic operations specialized for floats. If an operand is not
+** a float, turn the instruction back into its generic version 'gop'
+** and go to its handler.
+*/
+#define op_arithFF(L,fop,gop) {  \
+  StkId ra = RA(i); \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = vRC(i);  \
+  if (l_likely(ttisfloat(v1) && ttisfloat(v2))) {  \
+    lua_Number n1 = fltvalue(v1); lua_Number n2 = fltvalue(v2);  \
+    pc++; setfltvalue(s2v(ra), fop(L, n1, n2));  \
+  }  \
+  else {  \
+    setcurrentop(gop);  \
+    goto D_##gop;  \
+  }}
+
+
 /*
 ** Bitwise operations with constant operand.
 */
@@ -1004,9 +1057,10 @@ void luaV_finishOp (lua_State *L) {
 /*
 ** Order operations with register operands. 'opn' actually works
 ** for all numbers, but the fast track improves performance for
-** integers.
+** integers. When both operands are floats, the instruction is
+** quickened into 'qop'.
 */
-#define op_order(L,opi,opn,other) {  \
+#define op_order(L,opi,opn,other,qop) {  \
   StkId ra = RA(i); \
   int cond;  \
   TValue *rb = vRB(i);  \
@@ -1015,13 +1069,34 @@ void luaV_finishOp (lua_State *L) {
     lua_Integer ib = ivalue(rb);  \
     cond = opi(ia, ib);  \
   }  \
-  else if (ttisnumber(s2v(ra)) && ttisnumber(rb))  \
+  else if (ttisnumber(s2v(ra)) && ttisnumber(rb)) {  \
+    if (ttisfloat(s2v(ra)) && ttisfloat(rb))  \
+      quicken(qop);  \
     cond = opn(s2v(ra), rb);  \
+  }  \
   else  \
     Protect(cond = other(L, s2v(ra), rb));  \
   docondjump(); }
 
 
+/*
+** Order operations specialized for floats. If an operand is not a
+** float, turn the instruction back into its generic version 'gop' and
+** go to its handler.
+*/
+#define op_orderFF(L,opf,gop) {  \
+  StkId ra = RA(i); \
+  int cond;  \
+  TValue *rb = vRB(i);  \
+  if (l_likely(ttisfloat(s2v(ra)) && ttisfloat(rb)))  \
+    cond = opf(fltvalue(s2v(ra)), fltvalue(rb));  \
+  else {  \
+    setcurrentop(gop);  \
+    goto D_##gop;  \
+  }  \
+  docondjump(); }
+
+
 /*
 ** Order operations with immediate operand. (Immediate operand is
 ** always small enough to have an exact representation as a float.)
@@ -1066,6 +1141,14 @@ void luaV_finishOp (lua_State *L) {
 #define KC(i)	(k+GETARG_C(i))
 #define RKC(i)	((TESTARG_k(i)) ? k + GETARG_C(i) : s2v(base + GETARG_C(i)))
 
+/*
+** Inline cache of the current instruction. Prototypes without caches
+** use a dummy one, which always misses.
+*/
+#define ICACHE()  \
+	(l_likely(cl->p->icache != NULL) ? cl->p->icache + pcRel(pc, cl->p) \
+	                                 : (noicache = 0, &noicache))
+
 
 
 #define updatetrap(ci)  (trap = ci->u.l.trap)
@@ -1131,6 +1214,16 @@ void luaV_finishOp (lua_State *L) {
 #define luai_threadyield(L)	{lua_unlock(L); lua_lock(L);}
 #endif
 
+/*
+** macros to count instructions fetched through the dispatch and
+** instructions executed as the second part of a superinstruction
+** (used by the test library to measure superinstructions)
+*/
+#if !defined(luai_countdispatch)
+#define luai_countdispatch(L)	((void)0)
+#define luai_countfused(L)	((void)0)
+#endif
+
 /* 'c' is the limit of live values in the stack */
 #define checkGC(L,c)  \
 	{ luaC_condGC(L, (savepc(L), L->top.p = (c)), \
@@ -1144,6 +1237,7 @@ void luaV_finishOp (lua_State *L) {
     trap = luaG_traceexec(L, pc);  /* handle hooks */ \
     updatebase(ci);  /* correct stack */ \
   } \
+  luai_countdispatch(L); \
   i = *(pc++); \
 }
 
@@ -1151,6 +1245,45 @@ void luaV_finishOp (lua_State *L) {
 #define vmcase(l)	case l:
 #define vmbreak		break
 
+/*
+** Handler that other handlers can enter directly: superinstructions
+** enter the handler of their second instruction, and quickened
+** instructions enter the handler of their generic version.
+*/
+#define vmcasedirect(l)	vmcase(l) D_##l:
+
+/*
+** End of the first part of a superinstruction: go directly to the
+** handler of the next instruction. When 'trap' is on, the next
+** instruction must go through 'vmfetch'.
+*/
+#define vmfuse(l)  \
+	{ if (l_likely(!trap)) { \
+	    luai_countfused(L); i = *(pc++); goto D_##l; } \
+	  vmbreak; }
+
+
+#if defined(LUA_USE_JIT)
+/*
+** Continue the current function in native code, if it has been
+** compiled and there are no hooks; the interpreter resumes wherever the
+** native code stops. Functions not yet compiled count towards their
+** compilation.
+*/
+#define jitenter()  { \
+  Proto *jp = cl->p; \
+  if (jp->jit != NULL) { \
+    if (!trap) { \
+      pc = jp->code + luaJ_run(L, cl, base, cast_int(pc - jp->code)); \
+      updatetrap(ci); \
+    } \
+  } \
+  else if (jp->jitcount > 0 && --jp->jitcount == 0) \
+    luaJ_compile(L, jp); }
+#else
+#define jitenter()	((void)0)
+#endif
+
 
 void luaV_execute (lua_State *L, CallInfo *ci) {
   LClosure *cl;
@@ -1158,6 +1291,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   StkId base;
   const Instruction *pc;
   int trap;
+  unsigned noicache;  /* dummy inline cache */
 #if LUA_USE_JUMPTABLE
 #include "ljumptab.h"
 #endif
@@ -1170,6 +1304,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   if (l_unlikely(trap))
     trap = luaG_tracecall(L);
   base = ci->func.p + 1;
+  jitenter();
   /* main loop of interpreter */
   for (;;) {
     Instruction i;  /* instruction being executed */
@@ -1260,7 +1395,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a short string */
         lu_byte tag;
-        luaV_fastget(upval, key, s2v(ra), luaH_getshortstr, tag);
+        luaV_fastgetcached(upval, key, s2v(ra), ICACHE(), tag);
         if (tagisempty(tag))
           Protect(luaV_finishget(L, upval, rc, ra, tag));
         vmbreak;
@@ -1298,7 +1433,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a short string */
         lu_byte tag;
-        luaV_fastget(rb, key, s2v(ra), luaH_getshortstr, tag);
+        luaV_fastgetcached(rb, key, s2v(ra), ICACHE(), tag);
         if (tagisempty(tag))
           Protect(luaV_finishget(L, rb, rc, ra, tag));
         vmbreak;
@@ -1309,9 +1444,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = KB(i);
         TValue *rc = RKC(i);
         TString *key = tsvalue(rb);  /* key must be a short string */
-        luaV_fastset(upval, key, rc, hres, luaH_psetshortstr);
+        luaV_fastsetcached(upval, key, rc, ICACHE(), hres);
         if (hres == HOK)
-          luaV_finishfastset(L, upval, rc);
+          luaV_finishfastset(L, upval, rb, rc);
         else
           Protect(luaV_finishset(L, upval, rb, rc, hres));
         vmbreak;
@@ -1328,7 +1463,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           luaV_fastset(s2v(ra), rb, rc, hres, luaH_pset);
         }
         if (hres == HOK)
-          luaV_finishfastset(L, s2v(ra), rc);
+          luaV_finishfastset(L, s2v(ra), rb, rc);
         else
           Protect(luaV_finishset(L, s2v(ra), rb, rc, hres));
         vmbreak;
@@ -1340,7 +1475,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = RKC(i);
         luaV_fastseti(s2v(ra), b, rc, hres);
         if (hres == HOK)
-          luaV_finishfastset(L, s2v(ra), rc);
+          luaV_finishfastseti(L, s2v(ra), b, rc);
         else {
           TValue key;
           setivalue(&key, b);
@@ -1354,9 +1489,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = KB(i);
         TValue *rc = RKC(i);
         TString *key = tsvalue(rb);  /* key must be a short string */
-        luaV_fastset(s2v(ra), key, rc, hres, luaH_psetshortstr);
+        luaV_fastsetcached(s2v(ra), key, rc, ICACHE(), hres);
         if (hres == HOK)
-          luaV_finishfastset(L, s2v(ra), rc);
+          luaV_finishfastset(L, s2v(ra), rb, rc);
         else
           Protect(luaV_finishset(L, s2v(ra), rb, rc, hres));
         vmbreak;
@@ -1389,7 +1524,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a short string */
         setobj2s(L, ra + 1, rb);
-        luaV_fastget(rb, key, s2v(ra), luaH_getshortstr, tag);
+        luaV_fastgetcached(rb, key, s2v(ra), ICACHE(), tag);
         if (tagisempty(tag))
           Protect(luaV_finishget(L, rb, rc, ra, tag));
         vmbreak;
@@ -1460,16 +1595,16 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         }
         vmbreak;
       }
-      vmcase(OP_ADD) {
-        op_arith(L, l_addi, luai_numadd);
+      vmcasedirect(OP_ADD) {
+        op_arithQ(L, l_addi, luai_numadd, OP_ADDFF);
         vmbreak;
       }
-      vmcase(OP_SUB) {
-        op_arith(L, l_subi, luai_numsub);
+      vmcasedirect(OP_SUB) {
+        op_arithQ(L, l_subi, luai_numsub, OP_SUBFF);
         vmbreak;
       }
-      vmcase(OP_MUL) {
-        op_arith(L, l_muli, luai_nummul);
+      vmcasedirect(OP_MUL) {
+        op_arithQ(L, l_muli, luai_nummul, OP_MULFF);
         vmbreak;
       }
       vmcase(OP_MOD) {
@@ -1602,6 +1737,8 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
       }
       vmcase(OP_JMP) {
         dojump(ci, i, 0);
+        if (GETARG_sJ(i) < 0)  /* backward jump? */
+          jitenter();
         vmbreak;
       }
       vmcase(OP_EQ) {
@@ -1612,12 +1749,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         docondjump();
         vmbreak;
       }
-      vmcase(OP_LT) {
-        op_order(L, l_lti, LTnum, lessthanothers);
+      vmcasedirect(OP_LT) {
+        op_order(L, l_lti, LTnum, lessthanothers, OP_LTFF);
         vmbreak;
       }
-      vmcase(OP_LE) {
-        op_order(L, l_lei, LEnum, lessequalothers);
+      vmcasedirect(OP_LE) {
+        op_order(L, l_lei, LEnum, lessequalothers, OP_LEFF);
         vmbreak;
       }
       vmcase(OP_EQK) {
@@ -1674,7 +1811,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         }
         vmbreak;
       }
-      vmcase(OP_CALL) {
+      vmcasedirect(OP_CALL) {
         StkId ra = RA(i);
         CallInfo *newci;
         int b = GETARG_B(i);
@@ -1801,6 +1938,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         else if (floatforloop(ra))  /* float loop */
           pc -= GETARG_Bx(i);  /* jump back */
         updatetrap(ci);  /* allows a signal to break the loop */
+        jitenter();
         vmbreak;
       }
       vmcase(OP_FORPREP) {
@@ -1851,8 +1989,10 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
       vmcase(OP_TFORLOOP) {
        l_tforloop: {
         StkId ra = RA(i);
-        if (!ttisnil(s2v(ra + 3)))  /* continue loop? */
+        if (!ttisnil(s2v(ra + 3))) {  /* continue loop? */
           pc -= GETARG_Bx(i);  /* jump back */
+          jitenter();
+        }
         vmbreak;
       }}
       vmcase(OP_SETLIST) {
@@ -1875,11 +2015,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           lua_assert(GETARG_vB(i) == 0);
           luaH_resizearray(L, h, last);  /* preallocate it at once */
         }
+        lua_assert(!istyped(h));  /* constructors build generic arrays */
         for (; n > 0; n--) {
           TValue *val = s2v(ra + n);
           obj2arr(h, last - 1, val);
+          luaC_barriertablei(L, h, l_castU2S(last), val);
           last--;
-          luaC_barrierback(L, obj2gco(h), val);
         }
         vmbreak;
       }
@@ -1909,6 +2050,54 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         lua_assert(0);
         vmbreak;
       }
+      vmcase(OP_MOVECALL) {
+        StkId ra = RA(i);
+        setobjs2s(L, ra, RB(i));
+        vmfuse(OP_CALL);
+      }
+      vmcase(OP_GETFIELDCALL) {
+        StkId ra = RA(i);
+        TValue *rb = vRB(i);
+        TValue *rc = KC(i);
+        TString *key = tsvalue(rc);  /* key must be a short string */
+        lu_byte tag;
+        luaV_fastgetcached(rb, key, s2v(ra), ICACHE(), tag);
+        if (tagisempty(tag))
+          Protect(luaV_finishget(L, rb, rc, ra, tag));
+        vmfuse(OP_CALL);
+      }
+      vmcase(OP_SELFCALL) {
+        StkId ra = RA(i);
+        lu_byte tag;
+        TValue *rb = vRB(i);
+        TValue *rc = KC(i);
+        TString *key = tsvalue(rc);  /* key must be a short string */
+        setobj2s(L, ra + 1, rb);
+        luaV_fastgetcached(rb, key, s2v(ra), ICACHE(), tag);
+        if (tagisempty(tag))
+          Protect(luaV_finishget(L, rb, rc, ra, tag));
+        vmfuse(OP_CALL);
+      }
+      vmcase(OP_ADDFF) {
+        op_arithFF(L, luai_numadd, OP_ADD);
+        vmbreak;
+      }
+      vmcase(OP_SUBFF) {
+        op_arithFF(L, luai_numsub, OP_SUB);
+        vmbreak;
+      }
+      vmcase(OP_MULFF) {
+        op_arithFF(L, luai_nummul, OP_MUL);
+        vmbreak;
+      }
+      vmcase(OP_LTFF) {
+        op_orderFF(L, luai_numlt, OP_LT);
+        vmbreak;
+      }
+      vmcase(OP_LEFF) {
+        op_orderFF(L, luai_numle, OP_LE);
+        vmbreak;
+      }
     }
   }
 }
@@ -94,15 +94,29 @@ typedef enum {
 #define luaV_fastset(t,k,val,hres,f) \
   (hres = (!ttistable(t) ? HNOTATABLE : f(hvalue(t), k, val)))
 
+/*
+** Variants of 'luaV_fastget'/'luaV_fastset' for short-string keys
+** using the inline cache 'ic'.
+*/
+#define luaV_fastgetcached(t,k,res,ic,tag) \
+  if (!ttistable(t)) tag = LUA_VNOTABLE; \
+  else { luaH_fastgetcached(hvalue(t), k, res, ic, tag); }
+
+#define luaV_fastsetcached(t,k,val,ic,hres) \
+  if (!ttistable(t)) hres = HNOTATABLE; \
+  else { luaH_fastpsetcached(hvalue(t), k, val, ic, hres); }
+
 #define luaV_fastseti(t,k,val,hres) \
   if (!ttistable(t)) hres = HNOTATABLE; \
   else { luaH_fastseti(hvalue(t), k, val, hres); }
 
 
 /*
-** Finish a fast set operation (when fast set succeeds).
+** Finish a fast set operation with key 'k' (or integer key 'i'), when
+** fast set succeeds.
 */
-#define luaV_finishfastset(L,t,v)	luaC_barrierback(L, gcvalue(t), v)
+#define luaV_finishfastset(L,t,k,v)	luaC_barriertable(L, hvalue(t), k, v)
+#define luaV_finishfastseti(L,t,i,v)	luaC_barriertablei(L, hvalue(t), i, v)
 
 
 /*
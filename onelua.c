@@ -74,6 +74,7 @@
 #include "lzio.c"
 #include "lctype.c"
 #include "lopcodes.c"
+#include "lobject.c"
 #include "lmem.c"
 #include "lundump.c"
 #include "ldump.c"
@@ -84,12 +85,12 @@
 #include "lparser.c"
 #include "ldebug.c"
 #include "lfunc.c"
-#include "lobject.c"
 #include "ltm.c"
 #include "lstring.c"
 #include "ltable.c"
 #include "ldo.c"
 #include "lvm.c"
+#include "ljit.c"
 #include "lapi.c"
 
 /* auxiliary library -- used by all */
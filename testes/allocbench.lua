@@ -0,0 +1,80 @@
+-- $Id: testes/allocbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for the memory allocator (not run by 'all.lua').
+-- Compare builds with and without LUA_USE_POOLALLOC with
+--     lua allocbench.lua [scale]
+
+local SCALE = tonumber(arg and arg[1]) or 1
+
+local clock = os.clock
+
+
+-- peak and current resident set size in KB (Linux only)
+local function rss ()
+  local f = io.open("/proc/self/status")
+  if not f then return "?", "?" end
+  local s = f:read("a")
+  f:close()
+  return tonumber(s:match("VmHWM:%s*(%d+)")), tonumber(s:match("VmRSS:%s*(%d+)"))
+end
+
+
+local function bench (name, f)
+  collectgarbage()
+  local t0 = clock()
+  local n = f(SCALE)
+  local t = clock() - t0
+  local peak, cur = rss()
+  print(string.format("%-10s %10.1f %10s %10s",
+        name, n / t / 1e6, peak, cur))
+end
+
+
+print(string.format("%-10s %10s %10s %10s",
+      "test", "Mobj/s", "peak KB", "now KB"))
+
+-- short-lived small tables
+bench("tables", function (s)
+  local n = 2000000 * s
+  for i = 1, n do local t = {i, i} end
+  return n
+end)
+
+-- short-lived records (hash part) and closures
+bench("records", function (s)
+  local n = 1000000 * s
+  for i = 1, n do
+    local t = {x = i, y = i}
+    local f = function () return t end
+  end
+  return 2 * n
+end)
+
+-- new short strings
+bench("strings", function (s)
+  local n = 1000000 * s
+  for i = 1, n do local str = "s" .. i end
+  return n
+end)
+
+-- a big live set with churn
+bench("churn", function (s)
+  local n = 200000 * s
+  local live = {}
+  for i = 1, n do live[i] = {i, tostring(i)} end
+  for r = 1, 5 do
+    for i = 1, n, 2 do live[i] = {i, {}} end
+  end
+  return n * 2 + 5 * n
+end)
+
+-- growing tables (reallocations between size classes)
+bench("growth", function (s)
+  local n = 20000 * s
+  for i = 1, n do
+    local t = {}
+    for j = 1, 40 do t[j] = j end
+  end
+  return n * 7
+end)
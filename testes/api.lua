@@ -936,10 +936,11 @@ do
   collectgarbage()
   assert(collectgarbage("count") <= x+1)
   -- udata with finalizer
+  a = {__gc = function () end}
+  for i = 1, 100 do a.__gc() end   -- (let a JIT compile it before counting)
   collectgarbage()
   x = collectgarbage("count")
   collectgarbage("stop")
-  a = {__gc = function () end}
   for i=1,1000 do debug.setmetatable(T.newuserdata(0), a) end
   assert(collectgarbage("count") >= x+10)
   collectgarbage()  -- this collection only calls TM, without freeing memory
@@ -1589,6 +1590,73 @@ do   -- garbage collection with no extra memory
   T.closestate(L)
 end
 
+
+do   -- memory limits in many states
+  local N = 200
+  local states = {}
+  for i = 1, N do
+    local L = T.newstate()
+    T.loadlib(L, -1, 0)   -- load all libraries
+    if i % 2 == 0 then T.doremote(L, "collectgarbage'generational'") end
+    local inuse = math.tointeger(T.doremote(L, "return collectgarbage'count'"
+                                              .. " * 1024 // 1"))
+    local limit = inuse + 16 * 1024 + (i % 7) * 8 * 1024
+    assert(T.setmemlimit(L, limit) == 0)
+    assert(T.setmemlimit(L, limit) == limit)
+    T.doremote(L, "LIMIT = " .. limit)
+    states[i] = L
+  end
+
+  -- load the same code in all states
+  for i = 1, N do
+    assert(T.doremote(states[i], [[
+      function inlimit ()
+        return collectgarbage("count") * 1024 <= LIMIT
+      end
+      function refused ()
+        return collectgarbage("stats").limit.refused
+      end
+      function churn (n)   -- create lots of garbage
+        for i = 1, n do
+          local t = {i, tostring(i), string.rep("x", i % 100)}
+        end
+        return inlimit()
+      end
+      function grow ()   -- create live data until it fails
+        local t = {}
+        for i = 1, math.huge do t[i] = {i, i} end
+      end
+    ]]) == nil)
+  end
+
+  for round = 1, 3 do
+    for i = 1, N do   -- garbage alone never hits the limit
+      local L = states[i]
+      local refused = T.doremote(L, "return refused()")
+      assert(T.doremote(L, "return tostring(churn(500))") == "true")
+      assert(T.doremote(L, "return refused()") == refused)
+    end
+    for i = 1, N do   -- live data does
+      local L = states[(i * 7 + round) % N + 1]
+      local a, msg, status = T.doremote(L, "grow()")
+      assert(a == nil and string.find(msg, "memory") and status == 4)
+      assert(T.doremote(L, "return tostring(inlimit())") == "true")
+      assert(tonumber(T.doremote(L, "return refused()")) > 0)
+    end
+  end
+
+  -- a limit below the memory in use refuses any allocation...
+  local L = states[1]
+  local limit = T.setmemlimit(L, 1)
+  local a, msg, status = T.doremote(L, "return {}")
+  assert(a == nil and status == 4)
+  -- ...until it is raised again
+  assert(T.setmemlimit(L, limit) == 1)
+  assert(T.doremote(L, "return tostring(churn(100))") == "true")
+
+  for i = 1, N do T.closestate(states[i]) end
+end
+
 print'+'
 
 -- testing some auxlib functions
@@ -480,5 +480,98 @@ do   -- basic check for SETLIST
   assert(count == 1)
 end
 
+do   print("testing superinstructions")
+  local debug = require "debug"
+  local function id (x) return x end
+  local obj = {k = 10, m = function (self) return self.k end}
+  local function f (t, a)
+    local x = id(a)          -- MOVE + CALL
+    local y = id(t.k)        -- GETFIELD + CALL
+    return x + y + obj:m()   -- SELF + CALL
+  end
+  local t = {k = 20}
+
+  -- count instructions that did not need a dispatch
+  local function fused (f, ...)
+    local d0, f0 = T.dispatches()
+    local r = f(...)
+    local d1, f1 = T.dispatches()
+    return f1 - f0, r
+  end
+  -- 3 in 'f', 1 in 'obj.m', plus one in the call to 'T.dispatches'
+  local n, r = fused(f, t, 1)
+  assert(n == 4 and r == 31)
+
+  -- the disassembler and dumps show the original instructions
+  check(f, 'GETUPVAL', 'MOVE', 'CALL', 'GETUPVAL', 'GETFIELD', 'CALL',
+           'ADD', 'MMBIN', 'GETUPVAL', 'SELF', 'CALL', 'ADD', 'MMBIN',
+           'RETURN1')
+  local f1 = load(string.dump(f))
+  checkequal(f, f1)
+  debug.setupvalue(f1, 1, id)
+  debug.setupvalue(f1, 2, obj)
+  n, r = fused(f1, t, 2)
+  assert(n == 4 and r == 32)
+
+  -- hooks see every instruction
+  local count = 0
+  debug.sethook(function () count = count + 1 end, "", 1)
+  n, r = fused(f, t, 3)
+  debug.sethook()
+  assert(n == 0 and r == 33 and count > 14)
+
+end
+
+do   print("testing quickening")
+  -- check the first opcodes of 'f', as they are now ('raw') or
+  -- as they were generated
+  local function checkops (f, raw, ops)
+    local c = T.listcode(f, raw)
+    for i = 1, #ops do
+      assert(ops[i] == string.match(c[i], "%u%w+"))
+    end
+  end
+  local function f (a, b)
+    local x = a + b; local y = a - b; local z = a * b
+    if a < b then x = 1 end
+    if a <= b then y = 1 end
+    return x, y, z
+  end
+  local ops = {'ADD', 'MMBIN', 'SUB', 'MMBIN', 'MUL', 'MMBIN', 'LT', 'JMP',
+               'LOADI', 'LE', 'JMP', 'LOADI'}
+  local qops = {'ADDFF', 'MMBIN', 'SUBFF', 'MMBIN', 'MULFF', 'MMBIN',
+                'LTFF', 'JMP', 'LOADI', 'LEFF', 'JMP', 'LOADI'}
+  -- integers do not change the code
+  f(1, 2)
+  checkops(f, true, ops)
+  -- floats quicken it
+  f(1.5, 2.5)
+  checkops(f, true, qops)
+  checkops(f, false, ops)
+  local x, y, z = f(2.5, 1.5)
+  assert(x == 4.0 and y == 1.0 and z == 3.75)
+  -- other operands turn it back
+  x, y, z = f(2, 1.5)
+  assert(x == 3.5 and y == 0.5 and z == 3.0)
+  checkops(f, true, ops)
+  f(0.5, 0.25)
+  checkops(f, true, qops)
+  local mt = {__add = function () return "a" end,
+              __sub = function () return "s" end,
+              __mul = function () return "m" end,
+              __lt = function () return true end,
+              __le = function () return false end}
+  local t = setmetatable({}, mt)
+  x, y, z = f(t, t)
+  assert(x == 1 and y == "s" and z == "m")
+  checkops(f, true, ops)
+  -- dumps have the original code
+  f(1.5, 2.5)
+  local f1 = load(string.dump(f))
+  checkops(f1, true, ops)
+  x, y, z = f1(1.5, 2.5)
+  assert(x == 1 and y == 1 and z == 3.75)
+end
+
 print 'OK'
 
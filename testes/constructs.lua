@@ -403,4 +403,139 @@ _G.GLOB1 = nil
 checkload("for x do", "expected")
 checkload("x:call", "expected")
 
+
+do   print("testing hot code")
+  -- Run 'f' often enough to be compiled to native code (in builds
+  -- with a compiler) and then compare its results for the given
+  -- arguments with those of a fresh copy, which runs interpreted.
+  local function same (x, y)
+    return x == y and math.type(x) == math.type(y) or (x ~= x and y ~= y)
+  end
+  local function compare (f, ...)
+    for _ = 1, 200 do f(1, 2) end
+    local fresh = load(string.dump(f))
+    local r1 = table.pack(pcall(f, ...))
+    local r2 = table.pack(pcall(fresh, ...))
+    assert(r1.n == r2.n)
+    for i = 1, r1.n do
+      if type(r1[i]) == "table" then
+        for k, v in pairs(r2[i]) do assert(same(r1[i][k], v)) end
+      else
+        assert(same(r1[i], r2[i]))
+      end
+    end
+  end
+
+  local function arith (a, b)
+    return {a + b, a - b, a * b, a / b, -a, a + 1, a * 2.0, a - 3,
+            a + 0.5, a / 4}
+  end
+  local function bits (a, b)
+    return {a & b, a | b, a ~ b, a & 3, a | 8}
+  end
+  local function order (a, b)
+    return {a < b, a <= b, a > b, a >= b, a == b, a ~= b,
+            a < 1, a <= 2, a > 3, a >= 4, a == 1, a ~= 2.5}
+  end
+  local function const (a)
+    return {a == "x", a == nil, a == true, a == false, a == 10, a == 0.5,
+            not a, a and 1, a or 2, (a and "yes" or "no")}
+  end
+  local mt = setmetatable({}, {__add = function () return "add" end,
+                               __lt = function () return true end,
+                               __le = function () return false end,
+                               __unm = function () return "unm" end,
+                               __eq = function () return true end})
+  local NaN <const> = 0/0
+  local args = {{1, 2}, {1.5, 0.5}, {1, 2.0}, {-0.0, 0.0}, {NaN, 1},
+                {1, NaN}, {"10", 2}, {2, "10"}, {mt, 1}, {mt, mt}, {{}, 1},
+                {math.mininteger, -1}, {math.maxinteger, 1}, {1, nil},
+                {"x"}, {true}, {false}, {nil}, {10}, {0.5}, {10.0}}
+  for _, f in ipairs{arith, bits, order, const} do
+    for _, a in ipairs(args) do compare(f, a[1], a[2]) end
+  end
+
+  -- upvalues and table accesses
+  local up = 0
+  local t = setmetatable({10, 20, x = 1},
+                         {__index = function (_, k) return k end})
+  local function access (k, v)
+    up = v
+    return {t[1], t[2], t[3], t[k], t.x, t.y, up, math.pi, string.len}
+  end
+  for _ = 1, 200 do access(1, 2) end
+  local r = access("z", {})
+  assert(r[1] == 10 and r[2] == 20 and r[3] == 3 and r[4] == "z" and
+         r[5] == 1 and r[6] == "y" and type(r[7]) == "table" and
+         r[8] == math.pi and r[9] == string.len and up == r[7])
+  r = access(2.0, nil)
+  assert(r[4] == 20 and r[7] == nil and up == nil)
+  t = "abc"   -- not a table anymore
+  r = access(2, 3)
+  assert(r[1] == nil and r[5] == nil and r[7] == 3)
+
+  local function update (t, k, v)
+    t[1] = v; t[k] = v; t.x = v; t[2] = 10; t.y = false; HOTX = v
+  end
+  for _ = 1, 200 do update({}, 3, 1) end
+  local u = {}
+  update(u, "k", {})
+  assert(type(u[1]) == "table" and u.k == u[1] and u.x == u[1] and
+         u[2] == 10 and u.y == false and HOTX == u[1])
+  local log = {}
+  u = setmetatable({}, {__newindex = function (t, k, v)
+                                       log[#log + 1] = k; rawset(t, k, v)
+                                     end})
+  update(u, 1.0, 2.5)
+  assert(u[1] == 2.5 and u.x == 2.5 and u[2] == 10 and u.y == false and
+         HOTX == 2.5 and #log == 4)
+  local function checkerror (msg, ...)
+    local st, err = pcall(update, ...)
+    assert(not st and string.find(err, msg))
+  end
+  checkerror("index a nil value", nil, 1, 1)
+  checkerror("index a number value", 3, 1, 1)
+  checkerror("index is NaN", {}, 0/0, 1)
+  HOTX = nil
+
+  -- loops
+  local function loop (n, step, f)
+    local s = 0
+    for i = 1, n, step do
+      s = s + i
+      if i == n // 2 then f() end
+    end
+    local j = 0.0
+    while j < 10 do j = j + 0.5 end
+    return s, j
+  end
+  local function nop () end
+  for _ = 1, 200 do loop(10, 1, nop) end
+  assert(loop(100, 1, nop) == 5050)
+  assert(loop(4, 0.5, nop) == 17.5)
+  assert(loop(math.maxinteger, math.maxinteger // 2, nop) ==
+         3 + 3 * (math.maxinteger // 2))
+  -- hooks set inside a hot loop
+  local count = 0
+  local function sethook ()
+    debug.sethook(function () count = count + 1 end, "", 1)
+  end
+  assert(loop(1000, 1, sethook) == 500500)
+  debug.sethook()
+  assert(count > 1000)
+  -- yields inside a hot loop
+  local co = coroutine.wrap(loop)
+  assert(co(1000, 1, coroutine.yield) == nil)
+  assert(co() == 500500)
+  -- native code is memory of the state, freed with its function
+  collectgarbage()
+  local m0 = collectgarbage("count")
+  for i = 1, 20 do
+    local f = load("local s = 0; for i = 1, 1000 do s = s + i end; return s")
+    assert(f() == 500500)
+  end
+  collectgarbage()
+  assert(collectgarbage("count") < m0 + 8)
+end
+
 print'OK'
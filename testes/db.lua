@@ -1053,5 +1053,55 @@ do   -- tests for 'source' in binary dumps
          debug.getinfo(h).source == '=?')
 end
 
+
+do   print("testing heap snapshots")
+  local hd = dofile("heapdiff.lua")
+  local file = os.tmpname()
+  local function idof (x)
+    return math.tointeger(tonumber(string.format("%p", x)))
+  end
+  local function mk ()
+    local t = {}
+    for i = 1, 100 do t[i] = {i} end
+    local w = setmetatable({}, {__mode = "v"})
+    w.x = {}   -- only weakly reachable
+    return t, w, idof(w.x)
+  end
+  local t, w, wx = mk()
+  XXheapsnap = t
+  assert(debug.heapsnapshot(file))
+  local S = hd.read(file)
+  local A = hd.analyze(S)
+  local it = S.index[idof(t)]
+  assert(S.tag[it] & 0xf == 5)
+  assert(A.retained[it] >= S.size[it] + 100 * S.size[S.index[idof(t[1])]])
+  assert(A.idom[S.index[idof(t[1])]] == it)
+  assert(S.index[wx] and not A.retained[S.index[wx]])   -- not reachable
+  local p = hd.path(S, A, S.index[idof(t[1])])
+  assert(string.find(p, "^registry%[2%]%.XXheapsnap%[1%]$") or
+         string.find(p, "^mainthread%[%d+%]%[1%]$"))
+  -- diff
+  for i = 101, 1000 do t[i] = {i} end
+  assert(debug.heapsnapshot(file))
+  local S2 = hd.read(file)
+  local A2 = hd.analyze(S2)
+  local d = hd.diff(S, A, S2, A2, 5)
+  assert(d[1].delta >= 900 * S.size[S.index[idof(t[1])]])
+  assert(hd.bytype(S2).table.count >= hd.bytype(S).table.count + 900)
+  os.remove(file)
+  XXheapsnap = nil
+  local a, b = debug.heapsnapshot("/non-existent/dir/file")
+  assert(a == nil and type(b) == "string")
+  if T then   -- no memory available
+    local hs = debug.heapsnapshot
+    T.totalmem(T.totalmem())
+    a = hs(file)
+    T.totalmem(0)
+    assert(a == true)
+    assert(hd.read(file).n > 0)
+    os.remove(file)
+  end
+end
+
 print"OK"
 
@@ -155,6 +155,10 @@ checkmessage("a = {} <= 1", "attempt to compare")
 checkmessage("aaa=1; bbbb=2; aaa=math.sin(3)+bbbb(3)", "global 'bbbb'")
 checkmessage("aaa={}; do local aaa=1 end aaa:bbbb(3)", "method 'bbbb'")
 checkmessage("local a={}; a.bbbb(3)", "field 'bbbb'")
+-- superinstructions (GETFIELD/SELF/MOVE followed by CALL)
+checkmessage("local a={}; a.bbbb()", "field 'bbbb'")
+checkmessage("aaa={}; do local aaa=1 end aaa:bbbb()", "method 'bbbb'")
+checkmessage("local a, b; a(b)", "local 'a'")
 assert(not string.find(doit"aaa={13}; local bbbb=1; aaa[bbbb](3)", "'bbbb'"))
 checkmessage("aaa={13}; local bbbb=1; aaa[bbbb](3)", "number")
 checkmessage("aaa=(1)..{}", "a table value")
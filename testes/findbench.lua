@@ -0,0 +1,75 @@
+-- $Id: testes/findbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for substring search (not run by 'all.lua'). Searches
+-- subjects from 100 bytes to 100 MB for strings that are not there,
+-- with plain 'find', with patterns that start with a literal prefix,
+-- and with 'gsub'. For each size, the subject is scanned repeatedly
+-- until about the same total volume is covered. Reports the speed of
+-- the scans in GB/s (best of a few runs). Run it with
+--     lua findbench.lua [MB scanned per test]
+
+local VOLUME = math.floor((tonumber(arg and arg[1]) or 100) * 1e6)
+local RUNS = 3
+local SIZES = {100, 10000, 1000000, 100000000}
+
+local clock = os.clock
+local format = string.format
+local find, gsub = string.find, string.gsub
+
+math.randomseed(42)
+
+-- random text over a small alphabet, where first chars match often
+local function text (size)
+  local t = {}
+  for i = 1, 4096 do
+    t[i] = string.char(string.byte("abcd", math.random(4)))
+  end
+  local block = table.concat(t)
+  return string.rep(block, size // #block + 1):sub(1, size)
+end
+
+
+-- best time of 'RUNS' calls to 'f'
+local function best (f)
+  local min = math.huge
+  for _ = 1, RUNS do
+    local t0 = clock()
+    f()
+    local t = clock() - t0
+    if t < min then min = t end
+  end
+  return min
+end
+
+
+local long = string.rep("abcd", 16) .. "x"   -- 65 chars
+local rep = string.rep("a", 63) .. "b"   -- for a subject of only 'a's
+
+local tests = {
+  {"plain, 4 chars", false, function (s) return find(s, "abcx", 1, true) end},
+  {"plain, 65 chars", false, function (s) return find(s, long, 1, true) end},
+  {"plain, repetitive", true, function (s) return find(s, rep, 1, true) end},
+  {"prefix pattern", false, function (s) return find(s, "dab=(%w+)") end},
+  {"gsub literal", false, function (s) return gsub(s, "abcx", "") end},
+}
+
+print(format("%d MB per test", VOLUME // 1e6))
+io.write(format("%-20s", ""))
+for _, size in ipairs(SIZES) do io.write(format("%10d B", size)) end
+print()
+for _, t in ipairs(tests) do
+  local name, allas, f = t[1], t[2], t[3]
+  io.write(format("%-20s", name))
+  for _, size in ipairs(SIZES) do
+    local s = allas and string.rep("a", size) or text(size)
+    assert(f(s) == s or f(s) == nil)
+    local n = math.max(1, VOLUME // size)
+    local time = best(function ()
+      for _ = 1, n do f(s) end
+    end)
+    io.write(format("%7.2f GB/s", n * size / time / 1e9))
+    io.flush()
+  end
+  print()
+end
@@ -342,6 +342,35 @@ K = nil
 GC()
 -- assert(next(a) == nil)
 
+do   -- long chains through ephemerons
+  local eph = setmetatable({}, mt)
+  local wv = setmetatable({}, {__mode = 'v'})
+  local function check (first, n)
+    local i, k = 0, first
+    while eph[k] do k = eph[k]; i = i + 1 end
+    assert(i == n and eph[k] == false)
+  end
+  local first = {}
+  local k = first
+  for i = 1, 1000 do local n = {i}; eph[k] = n; wv[i] = n; k = n end
+  eph[k] = false     -- end of the chain
+  for i = 1, 1000 do eph[{}] = {}; wv[-i] = {} end   -- garbage
+  GC()
+  check(first, 1000)
+  assert(#wv == 1000 and wv[-1] == nil)
+  if T then   -- collect when the log of ephemeron entries cannot grow
+    for i = 1, 1000 do eph[{}] = {}; wv[-i] = {} end
+    T.totalmem(T.totalmem() + 200)
+    collectgarbage()
+    T.totalmem(0)
+    check(first, 1000)
+    assert(#wv == 1000 and wv[-1] == nil)
+  end
+  first = nil; k = nil
+  GC()
+  assert(next(eph) == nil and next(wv) == nil)
+end
+
 
 -- testing errors during GC
 if T then
@@ -600,6 +629,198 @@ if T then
 end
 
 
+do  print("parallel marking")
+  local old = collectgarbage("threads", 4)
+  local n = collectgarbage("threads")   -- 4 or 1 (if not available)
+  assert(n == 4 or n == 1)
+  assert(collectgarbage("threads", 0) == n)   -- 0 does not change it
+  assert(not pcall(collectgarbage, "threads", -1))
+
+  -- a large graph, with objects of all kinds
+  local N = 20000
+  local a = {}
+  local weak = setmetatable({}, {__mode = "v"})
+  local eph = setmetatable({}, {__mode = "k"})
+  for i = 1, N do
+    local t = {i, tostring(i), {x = i}}
+    t.f = function () return t[1] end
+    a[i] = t
+    weak[i] = t[3]
+    weak[-i] = {}     -- collectable
+    eph[t] = {t}      -- kept by its key
+    eph[{}] = i       -- collectable
+  end
+  a[N + 1] = coroutine.wrap(function (x)
+    while true do x = coroutine.yield(x) end
+  end)
+  for _, mode in ipairs{"incremental", "generational", "incremental"} do
+    collectgarbage(mode)
+    collectgarbage()
+    collectgarbage()
+    for i = 1, N do
+      local t = a[i]
+      assert(t[2] == tostring(i) and t[3].x == i and t.f() == i)
+      assert(weak[i] == t[3] and weak[-i] == nil)
+      assert(eph[t][1] == t)
+    end
+    local c = 0
+    for k in pairs(eph) do c = c + 1 end
+    assert(c == N)
+    assert(a[N + 1](10) == 10)
+  end
+  a = nil
+  collectgarbage()
+  assert(next(weak) == nil and next(eph) == nil)
+  assert(collectgarbage("threads", 1) == n)
+  assert(collectgarbage("threads") == 1)
+  collectgarbage("threads", old)
+end
+
+
+do  print("time-budgeted steps")
+  local function sum (h)
+    local s = 0
+    for i = 1, #h do s = s + h[i] end
+    return s
+  end
+  assert(not pcall(collectgarbage, "steptime", -1))
+  assert(not pcall(collectgarbage, "steptime", 10))
+  local h = collectgarbage("pauses", true)
+  assert(#h > 10 and sum(h) == 0)
+  for _, mode in ipairs{"incremental", "generational", "incremental"} do
+    collectgarbage(mode)
+    collectgarbage("stop")
+    local a = {}
+    for i = 1, 10000 do a[i] = {i} end
+    a = nil
+    if mode == "generational" then
+      collectgarbage("steptime", 0.001)   -- a young collection
+    else
+      local n = 0
+      repeat    -- tiny budgets still make progress
+        n = n + 1
+      until collectgarbage("steptime", 0)
+      assert(n > 1)
+      repeat until collectgarbage("steptime", 0.001)
+    end
+    collectgarbage("restart")
+  end
+  collectgarbage()
+  local s = sum(collectgarbage("pauses", false))
+  assert(s > 5)
+  local a = {}
+  for i = 1, 10000 do a[i] = {} end   -- some automatic steps
+  collectgarbage()
+  assert(sum(collectgarbage("pauses")) == s)   -- not recording anymore
+  collectgarbage("pauses", true)
+  repeat local x = {} until sum(collectgarbage("pauses")) > 0
+  collectgarbage("pauses", false)
+end
+
+
+do  print("allocation statistics")
+  collectgarbage()
+  local s0 = collectgarbage("stats")
+  local a = {}
+  for i = 1, 1000 do a[i] = {} end
+  local co = coroutine.create(print)
+  local s1 = collectgarbage("stats")
+  assert(s1.table.created - s0.table.created >= 1000)
+  assert(s1.table.count - s0.table.count >= 1000)
+  assert(s1.table.bytes - s0.table.bytes >= 1000 * 16)
+  assert(s1.thread.count == s0.thread.count + 1)
+  assert(s1.sites.objects > s0.sites.objects)
+  local total = 0
+  for _, st in pairs(s1) do
+    assert(st.count == nil or st.count <= st.created)
+    total = total + (st.bytes or 0)
+  end
+  assert(total <= collectgarbage("count") * 1024)
+  a = nil; co = nil
+  collectgarbage()
+  local s2 = collectgarbage("stats")
+  assert(s2.table.count < s1.table.count - 980)   -- (stats tables are alive)
+  assert(s2.table.freed >= (s1.table.bytes - s0.table.bytes) // 2)
+  assert(s2.thread.count == s0.thread.count)
+  assert(s2.table.created > s1.table.created)
+end
+
+
+do print("deferred finalizers")
+  local tracegc = require"tracegc"
+  tracegc.stop()    -- its finalizer would be counted as pending too
+  local count = 0
+  local mt = {__gc = function () count = count + 1 end}
+  local fin0 = collectgarbage("stats").finalizers
+  for _, mode in ipairs{"incremental", "generational", "incremental"} do
+    collectgarbage(mode)
+    collectgarbage()
+    count = 0
+    assert(not collectgarbage("deferfin", true))
+    assert(collectgarbage("deferfin"))
+    for i = 1, 100 do setmetatable({}, mt) end
+    collectgarbage()
+    collectgarbage()
+    assert(count == 0)   -- collector did not call them
+    local fin = collectgarbage("stats").finalizers
+    assert(fin.pending == 100)
+    -- a dedicated coroutine calls them in batches
+    local finalizer = coroutine.wrap(function ()
+      while true do coroutine.yield(collectgarbage("runfin", 30)) end
+    end)
+    assert(finalizer() == 30 and count == 30)
+    assert(finalizer() == 30 and finalizer() == 30 and count == 90)
+    assert(collectgarbage("stats").finalizers.pending == 10)
+    assert(finalizer() == 10 and finalizer() == 0 and count == 100)
+    fin = collectgarbage("stats").finalizers
+    assert(fin.pending == 0 and fin.called >= fin0.called + 100)
+    assert(collectgarbage("deferfin", false))
+  end
+
+  -- objects are finalized only once, even when finalizers fail
+  if T then
+    count = 0
+    warn("@on"); warn("@store")
+    collectgarbage("deferfin", true)
+    for i = 1, 10 do
+      setmetatable({}, {__gc = function ()
+        count = count + 1
+        if i == 5 then error("@expected@") end
+      end})
+    end
+    collectgarbage()
+    assert(collectgarbage("runfin") == 10 and count == 10)
+    assert(string.match(_WARN, "@(.-)@") == "expected"); _WARN = false
+    assert(collectgarbage("runfin") == 0 and count == 10)
+    collectgarbage("deferfin", false)
+    warn("@normal")
+  end
+  tracegc.start()
+end
+
+
+if not T then   -- (allocator of the test library is not thread safe)
+  print("background freeing")
+  local old = collectgarbage("bgfree", true)
+  local on = collectgarbage("bgfree")   -- false if not available
+  local m
+  for _, mode in ipairs{"incremental", "incremental", "generational",
+                        "incremental"} do
+    collectgarbage(mode)
+    local a = {}
+    for i = 1, 50000 do a[i] = {i, tostring(i) .. "x", function () end} end
+    a = nil
+    collectgarbage()
+    m = m or collectgarbage("count")
+    assert(collectgarbage("count") < m + 10)   -- accounting is not lost
+    for i = 1, 50000 do local t = {{}, {}} end   -- sweeps in steps
+  end
+  assert(collectgarbage("bgfree", false) == on)
+  assert(not collectgarbage("bgfree"))
+  collectgarbage("bgfree", old)
+end
+
+
 if T then
   print("emergency collections")
   collectgarbage()
@@ -608,15 +829,17 @@ if T then
   for i=1,200 do local a = {} end
   T.totalmem(0)
   collectgarbage()
-  local t = T.totalmem("table")
-  local a = {{}, {}, {}}   -- create 4 new tables
-  assert(T.totalmem("table") == t + 4)
-  t = T.totalmem("function")
-  a = function () end   -- create 1 new closure
-  assert(T.totalmem("function") == t + 1)
-  t = T.totalmem("thread")
-  a = coroutine.create(function () end)   -- create 1 new coroutine
-  assert(T.totalmem("thread") == t + 1)
+  if not T.pageheap then   -- (objects in pages are not counted by type)
+    local t = T.totalmem("table")
+    local a = {{}, {}, {}}   -- create 4 new tables
+    assert(T.totalmem("table") == t + 4)
+    t = T.totalmem("function")
+    a = function () end   -- create 1 new closure
+    assert(T.totalmem("function") == t + 1)
+    t = T.totalmem("thread")
+    a = coroutine.create(function () end)   -- create 1 new coroutine
+    assert(T.totalmem("thread") == t + 1)
+  end
 end
 
 
@@ -123,6 +123,36 @@ do   -- bug introduced in commit 9cf3299fa
 end
 
 
+do  print"testing cards in large tables"
+  local N = 10000
+  local t = {}
+  for i = 1, N do t[i] = i; t["k" .. i] = i end
+  collectgarbage()   -- 't' is old
+  assert(not T or T.gcage(t) == "old")
+  t[10] = {10}
+  -- a large table stays black, so that all writes hit the barrier
+  assert(not T or (T.gcage(t) == "touched1" and T.gccolor(t) == "black"))
+  t.k5000 = {5000}
+  t[N] = {N}
+  collectgarbage("step")   -- minor collection
+  assert(not T or (T.gcage(t) == "touched2" and T.gccolor(t) == "black"))
+  t.k1 = {1}
+  for i = 1, 3 do collectgarbage("step") end
+  assert(t[10][1] == 10 and t.k5000[1] == 5000 and t[N][1] == N and
+         t.k1[1] == 1)
+  -- new keys move entries and grow the table
+  for i = 1, N do
+    t["n" .. i] = {i}
+    if i % 500 == 0 then collectgarbage("step") end
+  end
+  for i = 1, 3 do collectgarbage("step") end
+  for i = 1, N do assert(t["n" .. i][1] == i) end
+  assert(t[10][1] == 10 and t.k5000[1] == 5000 and t[N][1] == N)
+  t = nil
+  collectgarbage("generational")   -- in case it shifted to major mode
+end
+
+
 if T == nil then
   (Message or print)('\n >>> testC not active: \z
                              skipping some generational tests <<<\n')
@@ -162,6 +192,22 @@ end
 assert(collectgarbage'isrunning')
 
 
+do  print"testing nursery size"
+  collectgarbage("generational")
+  local kb = math.floor(collectgarbage("count"))
+  local old = collectgarbage("param", "nursery", 4 * kb)
+  collectgarbage()   -- next minor collection only after 4 * kb Kbytes
+  local a = setmetatable({{}}, {__mode = "v"})   -- a young object
+  for i = 1, 20 * kb do   -- about doubles the heap (>> 'minormul'%)
+    local t = {i}
+  end
+  assert(a[1])   -- no collection yet
+  collectgarbage("param", "nursery", old)
+  collectgarbage()
+  assert(not a[1])
+end
+
+
 do  print"testing stop-the-world collection"
   local step = collectgarbage("param", "stepsize", 0);
   collectgarbage("incremental")
@@ -0,0 +1,76 @@
+-- $Id: testes/hashbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Microbenchmark for the hash part of tables (not run by 'all.lua').
+-- Compare builds with and without LUAI_SWISSHASH with
+--     lua hashbench.lua [total-ops]
+
+local OPS = tonumber(arg and arg[1]) or 2000000
+
+local clock = os.clock
+
+-- keys that go to the hash part
+local function strkeys (n)
+  local k = {}
+  for i = 1, n do k[i] = "key" .. i end
+  return k
+end
+
+local function intkeys (n)
+  local k = {}
+  for i = 1, n do k[i] = i * 1000003 end
+  return k
+end
+
+
+local function bench (kind, keys, n)
+  local rounds = math.max(1, OPS // n)
+  local t0, t
+
+  -- insert: build tables from scratch
+  t0 = clock()
+  for _ = 1, rounds do
+    t = {}
+    for i = 1, n do t[keys[i]] = i end
+  end
+  local insert = clock() - t0
+
+  -- lookup of present keys
+  t0 = clock()
+  local s = 0
+  for _ = 1, rounds do
+    for i = 1, n do s = s + t[keys[i]] end
+  end
+  local hit = clock() - t0
+  assert(s == rounds * n * (n + 1) // 2)
+
+  -- lookup of absent keys
+  local absent = (kind == "str") and strkeys(2 * n) or intkeys(2 * n)
+  t0 = clock()
+  for _ = 1, rounds do
+    for i = n + 1, 2 * n do assert(t[absent[i]] == nil) end
+  end
+  local miss = clock() - t0
+
+  -- delete all keys and insert them back
+  t0 = clock()
+  for _ = 1, rounds do
+    for i = 1, n do t[keys[i]] = nil end
+    for i = 1, n do t[keys[i]] = i end
+  end
+  local delete = clock() - t0
+
+  local ns = 1e9 / (rounds * n)
+  print(string.format("%-4s %8d %10.1f %10.1f %10.1f %10.1f",
+        kind, n, insert * ns, hit * ns, miss * ns, delete * ns))
+end
+
+
+print(string.format("%-4s %8s %10s %10s %10s %10s    (ns per key)",
+      "keys", "size", "insert", "hit", "miss", "del+ins"))
+for _, n in ipairs{8, 64, 512, 4096, 32768, 262144} do
+  bench("str", strkeys(n), n)
+end
+for _, n in ipairs{8, 64, 512, 4096, 32768, 262144} do
+  bench("int", intkeys(n), n)
+end
@@ -0,0 +1,382 @@
+-- $Id: testes/heapdiff.lua $
+-- See Copyright Notice in file all.lua
+
+-- Reader for heap snapshots written by 'debug.heapsnapshot' (not run
+-- by 'all.lua').
+--     lua heapdiff.lua [-n count] snap
+-- lists the objects that retain more memory, that is, the sizes of
+-- all objects they dominate (objects reachable from the roots only
+-- through them), with a shortest path from the roots to each one;
+--     lua heapdiff.lua [-n count] old new
+-- compares the memory used by each type in the two snapshots and lists
+-- the retainers, identified by their paths, that grew most.
+-- When loaded with no arguments (as by 'dofile'), returns a table
+-- with its functions.
+
+local M = {}
+
+local SIGNATURE = "\x1bLuaHeap"
+local VERSION = 1
+
+-- object flags
+local FIXED = 1
+local TOBEFNZ = 4
+
+-- kinds of edges
+local EEND, EREF, EWEAK, EFIELD, EINDEX, EMETA, EUPVAL = 0, 1, 2, 3, 4, 5, 6
+
+-- names of the basic types (plus upvalues and prototypes)
+local typenames = {[0] = "nil", "boolean", "userdata", "number", "string",
+  "table", "function", "userdata", "thread", "upvalue", "proto"}
+
+M.typenames = typenames
+
+
+local function typeof (tag) return typenames[tag & 0x0f] end
+
+
+local function varint (s, pos)
+  local x, shift = 0, 0
+  while true do
+    local b = string.byte(s, pos)
+    if not b then error("truncated snapshot") end
+    pos = pos + 1
+    x = x | ((b & 0x7f) << shift)
+    if b < 0x80 then return x, pos end
+    shift = shift + 7
+  end
+end
+
+
+-- Read a snapshot file. Objects are numbered from 1 in file order;
+-- 'index' maps ids (addresses) to these numbers. Edges of object 'i'
+-- are 'efirst[i]' to 'elast[i]' in arrays 'eto' (object number),
+-- 'ekind', and 'elabel'; edges to unknown objects (e.g., to dead
+-- ones) are dropped. Object 0 is a pseudo-root whose edges have
+-- names in 'rootname'.
+function M.read (fname)
+  local f = assert(io.open(fname, "rb"))
+  local s = f:read("a")
+  f:close()
+  if string.sub(s, 1, #SIGNATURE) ~= SIGNATURE then
+    error(fname .. ": not a heap snapshot")
+  end
+  local pos = #SIGNATURE + 1
+  if string.byte(s, pos) ~= VERSION then
+    error(fname .. ": bad snapshot version")
+  end
+  pos = pos + 1
+  local roots = {}
+  local registry, mainthread
+  registry, pos = varint(s, pos)
+  mainthread, pos = varint(s, pos)
+  roots[#roots + 1] = {registry, "registry"}
+  roots[#roots + 1] = {mainthread, "mainthread"}
+  for t = 0, 8 do
+    local mt
+    mt, pos = varint(s, pos)
+    if mt ~= 0 then
+      roots[#roots + 1] = {mt, "metatable(" .. typenames[t] .. ")"}
+    end
+  end
+  local S = {n = 0, id = {}, tag = {}, flags = {}, size = {}, str = {},
+             len = {}, index = {}, efirst = {}, elast = {},
+             eto = {}, ekind = {}, elabel = {}, rootname = {}}
+  local rawto = {}   -- edge targets as ids
+  local id, tag, flags, size, str, len = S.id, S.tag, S.flags, S.size,
+                                         S.str, S.len
+  local efirst, elast, ekind, elabel = S.efirst, S.elast, S.ekind, S.elabel
+  local ne = 0
+  local n = 0
+  while true do
+    local t = string.byte(s, pos)
+    if not t then error("truncated snapshot") end
+    pos = pos + 1
+    if t == 0 then break end
+    n = n + 1
+    tag[n] = t
+    id[n], pos = varint(s, pos)
+    flags[n] = string.byte(s, pos); pos = pos + 1
+    size[n], pos = varint(s, pos)
+    if typeof(t) == "string" then
+      local l
+      l, pos = varint(s, pos)
+      local k = math.min(l, 32)
+      len[n] = l
+      str[n] = string.sub(s, pos, pos + k - 1)
+      pos = pos + k
+    end
+    efirst[n] = ne + 1
+    while true do
+      local kind = string.byte(s, pos)
+      pos = pos + 1
+      if kind == EEND then break end
+      ne = ne + 1
+      ekind[ne] = kind
+      rawto[ne], pos = varint(s, pos)
+      if kind == EFIELD or kind == EINDEX or kind == EUPVAL then
+        elabel[ne], pos = varint(s, pos)
+      end
+    end
+    elast[n] = ne
+  end
+  S.n = n
+  local index = S.index
+  for i = 1, n do index[id[i]] = i end
+  -- edges of the pseudo-root
+  efirst[0] = ne + 1
+  for _, r in ipairs(roots) do
+    ne = ne + 1
+    ekind[ne] = EREF
+    rawto[ne] = r[1]
+    S.rootname[ne] = r[2]
+  end
+  for i = 1, n do
+    if flags[i] & (FIXED | TOBEFNZ) ~= 0 then
+      ne = ne + 1
+      ekind[ne] = EREF
+      rawto[ne] = id[i]
+      S.rootname[ne] = (flags[i] & FIXED ~= 0) and "fixed" or "tobefnz"
+    end
+  end
+  elast[0] = ne
+  local eto = S.eto
+  for e = 1, ne do eto[e] = index[rawto[e]] or false end
+  return S
+end
+
+
+-- Compute reachability, shortest paths, and dominators for snapshot
+-- 'S', using the iterative algorithm by Cooper, Harvey, and Kennedy.
+-- Fields of the result: 'parent' and 'pedge' (for shortest paths),
+-- 'idom' (immediate dominator), and 'retained' (bytes retained; nil
+-- for unreachable objects).
+function M.analyze (S)
+  local efirst, elast, eto, ekind = S.efirst, S.elast, S.eto, S.ekind
+  -- breadth-first search for shortest paths
+  local parent, pedge = {[0] = false}, {}
+  local queue, qh = {0}, 1
+  while qh <= #queue do
+    local v = queue[qh]; qh = qh + 1
+    for e = efirst[v], elast[v] do
+      local w = eto[e]
+      if w and ekind[e] ~= EWEAK and parent[w] == nil then
+        parent[w] = v
+        pedge[w] = e
+        queue[#queue + 1] = w
+      end
+    end
+  end
+  -- depth-first search for a postorder
+  local po, order = {}, {}
+  local stnode, stedge, top = {0}, {efirst[0]}, 1
+  local seen = {[0] = true}
+  while top > 0 do
+    local v, e = stnode[top], stedge[top]
+    if e <= elast[v] then
+      stedge[top] = e + 1
+      local w = eto[e]
+      if w and ekind[e] ~= EWEAK and not seen[w] then
+        seen[w] = true
+        top = top + 1
+        stnode[top], stedge[top] = w, efirst[w]
+      end
+    else
+      order[#order + 1] = v
+      po[v] = #order
+      top = top - 1
+    end
+  end
+  -- predecessors of reachable objects
+  local preds = {}
+  for _, v in ipairs(order) do
+    for e = efirst[v], elast[v] do
+      local w = eto[e]
+      if w and ekind[e] ~= EWEAK then
+        local p = preds[w]
+        if not p then p = {}; preds[w] = p end
+        p[#p + 1] = v
+      end
+    end
+  end
+  -- dominators
+  local idom = {[0] = 0}
+  local function intersect (a, b)
+    while a ~= b do
+      while po[a] < po[b] do a = idom[a] end
+      while po[b] < po[a] do b = idom[b] end
+    end
+    return a
+  end
+  local changed = true
+  while changed do
+    changed = false
+    for k = #order - 1, 1, -1 do   -- reverse postorder, skipping root
+      local v = order[k]
+      local new
+      for _, p in ipairs(preds[v]) do
+        if idom[p] then
+          new = new and intersect(p, new) or p
+        end
+      end
+      if idom[v] ~= new then
+        idom[v] = new
+        changed = true
+      end
+    end
+  end
+  -- retained sizes (dominated objects come earlier in postorder)
+  local size = S.size
+  local retained = {[0] = 0}
+  for k = 1, #order - 1 do retained[order[k]] = size[order[k]] end
+  for k = 1, #order - 1 do
+    local v = order[k]
+    retained[idom[v]] = retained[idom[v]] + retained[v]
+  end
+  return {parent = parent, pedge = pedge, idom = idom, retained = retained}
+end
+
+
+-- description of an object
+function M.describe (S, i)
+  local t = typeof(S.tag[i])
+  if t == "string" then
+    local s = string.format("%q", S.str[i])
+    if S.len[i] > #S.str[i] then s = s .. "..." end
+    return "string " .. s
+  else
+    return t
+  end
+end
+
+
+local function edgename (S, e)
+  local kind, label = S.ekind[e], S.elabel[e]
+  if S.rootname[e] then
+    return S.rootname[e]
+  elseif kind == EFIELD then
+    local k = S.index[label]
+    local name = k and S.str[k] or "?"
+    if k and string.find(name, "^[%a_][%w_]*$") and S.len[k] == #name then
+      return "." .. name
+    else
+      return string.format("[%q]", name)
+    end
+  elseif kind == EINDEX then
+    return "[" .. label .. "]"
+  elseif kind == EUPVAL then
+    return ":upvalue" .. label
+  elseif kind == EMETA then
+    return ":metatable"
+  else
+    return "->" .. typeof(S.tag[S.eto[e]])
+  end
+end
+
+
+-- a shortest path from the roots to object 'i'
+function M.path (S, A, i)
+  local names = {}
+  while i ~= 0 do
+    local e = A.pedge[i]
+    if not e then return nil end   -- not reachable
+    table.insert(names, 1, edgename(S, e))
+    i = A.parent[i]
+  end
+  return table.concat(names)
+end
+
+
+-- the 'n' objects retaining more memory, as a list of records
+function M.top (S, A, n)
+  local list = {}
+  for i = 1, S.n do
+    if A.retained[i] then list[#list + 1] = i end
+  end
+  table.sort(list, function (a, b) return A.retained[a] > A.retained[b] end)
+  local res = {}
+  for k = 1, math.min(n, #list) do
+    local i = list[k]
+    res[k] = {index = i, retained = A.retained[i], size = S.size[i],
+              path = M.path(S, A, i), what = M.describe(S, i)}
+  end
+  return res
+end
+
+
+-- number of objects and bytes by type
+function M.bytype (S)
+  local res = {}
+  for i = 1, S.n do
+    local t = typeof(S.tag[i])
+    local r = res[t]
+    if not r then r = {count = 0, bytes = 0}; res[t] = r end
+    r.count = r.count + 1
+    r.bytes = r.bytes + S.size[i]
+  end
+  return res
+end
+
+
+-- Compare the 'n' retainers that grew most from 'S1' to 'S2'. As
+-- addresses can be reused, retainers are matched by their paths
+-- among the '10 * n' largest ones in each snapshot (a retainer absent
+-- from the first list counts as new).
+function M.diff (S1, A1, S2, A2, n)
+  local old = {}
+  for _, r in ipairs(M.top(S1, A1, 10 * n)) do
+    if r.path then old[r.path] = r.retained end
+  end
+  local res = {}
+  for _, r in ipairs(M.top(S2, A2, 10 * n)) do
+    r.old = old[r.path] or 0
+    r.delta = r.retained - r.old
+    res[#res + 1] = r
+  end
+  table.sort(res, function (a, b) return a.delta > b.delta end)
+  for k = #res, n + 1, -1 do res[k] = nil end
+  return res
+end
+
+
+local args = {...}
+if #args == 0 then return M end
+
+
+local n = 20
+if args[1] == "-n" then
+  n = assert(tonumber(args[2]), "bad count")
+  table.remove(args, 1); table.remove(args, 1)
+end
+
+if #args == 1 then
+  local S = M.read(args[1])
+  local A = M.analyze(S)
+  print(string.format("%12s %10s  %s", "retained", "size", "object"))
+  for _, r in ipairs(M.top(S, A, n)) do
+    print(string.format("%12d %10d  %s %s", r.retained, r.size,
+                        r.what, r.path))
+  end
+elseif #args == 2 then
+  local S1, S2 = M.read(args[1]), M.read(args[2])
+  local A1, A2 = M.analyze(S1), M.analyze(S2)
+  local t1, t2 = M.bytype(S1), M.bytype(S2)
+  print(string.format("%-10s %10s %12s %10s %12s", "type", "count",
+                      "bytes", "+count", "+bytes"))
+  for _, t in ipairs{"string", "table", "function", "userdata",
+                     "thread", "upvalue", "proto"} do
+    local a = t1[t] or {count = 0, bytes = 0}
+    local b = t2[t] or {count = 0, bytes = 0}
+    print(string.format("%-10s %10d %12d %+10d %+12d", t, b.count,
+                        b.bytes, b.count - a.count, b.bytes - a.bytes))
+  end
+  print()
+  print(string.format("%12s %12s  %s", "retained", "growth", "object"))
+  for _, r in ipairs(M.diff(S1, A1, S2, A2, n)) do
+    print(string.format("%12d %+12d  %s %s", r.retained, r.delta,
+                        r.what, r.path))
+  end
+else
+  io.stderr:write("usage: lua heapdiff.lua [-n count] snap [newsnap]\n")
+  os.exit(1)
+end
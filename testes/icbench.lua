@@ -0,0 +1,111 @@
+-- $Id: testes/icbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Microbenchmark for field accesses with constant keys (not run by
+-- 'all.lua'). Loops over method calls and record fields of tables whose
+-- keys do not change, which is where the inline caches hit, plus a loop
+-- over tables of different shapes, where they keep missing. Compare
+-- builds with and without inline caches with
+--     lua icbench.lua [millions of iterations]
+
+local N = math.floor((tonumber(arg and arg[1]) or 5) * 1e6)
+local RUNS = 3
+
+local clock = os.clock
+
+
+-- best time of 'RUNS' calls to 'f'
+local function best (f)
+  local min = math.huge
+  for _ = 1, RUNS do
+    collectgarbage()
+    local t0 = clock()
+    f()
+    local t = clock() - t0
+    if t < min then min = t end
+  end
+  return min
+end
+
+
+-- a table with 'n' extra fields, so that the fields used by the loops
+-- are spread over a large hash part
+local function padded (t, n)
+  for i = 1, n do t["pad" .. i] = i end
+  return t
+end
+
+
+-- an object with methods in its class (through '__index')
+local Point = padded({}, 40)
+Point.__index = Point
+
+function Point.new (x, y)
+  return setmetatable({x = x, y = y}, Point)
+end
+
+function Point:move (dx, dy)
+  self.x = self.x + dx
+  self.y = self.y + dy
+end
+
+function Point:norm1 ()
+  return math.abs(self.x) + math.abs(self.y)
+end
+
+
+local tests = {
+  {"method calls", function ()
+    local p = Point.new(0, 0)
+    local s = 0
+    for i = 1, N do
+      p:move(1, -1)
+      s = s + p:norm1()
+    end
+    assert(p.x == N)
+  end},
+
+  {"record fields", function ()
+    local r = padded({count = 0, sum = 0, min = math.huge, max = 0}, 50)
+    for i = 1, N do
+      local v = i % 1000
+      r.count = r.count + 1
+      r.sum = r.sum + v
+      if v < r.min then r.min = v end
+      if v > r.max then r.max = v end
+    end
+    assert(r.count == N and r.min == 0 and r.max == 999)
+  end},
+
+  {"module fields", function ()
+    local m = padded({}, 60)
+    m.abs, m.floor, m.max = math.abs, math.floor, math.max
+    local s = 0
+    for i = 1, N do
+      s = m.max(s, m.floor(m.abs(-i) / 2))
+    end
+    assert(s == N // 2)
+  end},
+
+  {"mixed shapes", function ()   -- same sites, different tables
+    local objs = {}
+    for i = 1, 8 do
+      local o = padded({}, i * 7)
+      o.x = 0
+      objs[i] = o
+    end
+    for i = 1, N do
+      local o = objs[i % 8 + 1]
+      o.x = o.x + 1
+    end
+    assert(objs[1].x == N // 8)
+  end},
+}
+
+
+print(string.format("%d iterations per test", N))
+for _, t in ipairs(tests) do
+  local time = best(t[2])
+  print(string.format("%-16s %8.3f s %8.1f ns/iter",
+                      t[1], time, time / N * 1e9))
+end
@@ -0,0 +1,140 @@
+-- $Id: testes/jitbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for the baseline compiler (not run by 'all.lua'). Runs a
+-- few kernels in this interpreter and, if given the path of another
+-- executable, in that one too (through 'io.popen'), printing both
+-- times side by side. Each time is the best of a few runs. Run it with
+-- a plain build, passing a build with LUA_USE_JIT:
+--     lua jitbench.lua [path-to-jit-lua [scale]]
+
+local RUNS = 5
+
+local clock = os.clock
+
+
+-- best time of 'RUNS' calls to 'f'
+local function best (f, n)
+  local min = math.huge
+  for _ = 1, RUNS do
+    collectgarbage()
+    local t0 = clock()
+    f(n)
+    local t = clock() - t0
+    if t < min then min = t end
+  end
+  return min
+end
+
+
+local Account = {}
+Account.__index = Account
+
+function Account.new (b)
+  return setmetatable({balance = b, ops = 0}, Account)
+end
+
+function Account:deposit (v)
+  self.balance = self.balance + v
+  self.ops = self.ops + 1
+end
+
+function Account:get ()
+  return self.balance
+end
+
+
+local function fib (n)
+  if n < 2 then return n else return fib(n - 1) + fib(n - 2) end
+end
+
+
+local kernels = {
+  {"method calls", function (scale)
+    local a = Account.new(0)
+    local s = 0
+    for i = 1, 3000000 * scale do
+      a:deposit(1)
+      s = s + a:get()
+    end
+    assert(a.ops == 3000000 * scale)
+  end},
+
+  {"field accesses", function (scale)
+    local p = {x = 0, y = 0, vx = 1, vy = -1}
+    for i = 1, 5000000 * scale do
+      p.x = p.x + p.vx
+      p.y = p.y + p.vy
+      if p.x > 1000 then p.vx = -1 elseif p.x < 0 then p.vx = 1 end
+    end
+    assert(p.y == -5000000 * scale)
+  end},
+
+  {"float loop", function (scale)
+    local n = 10000000 * scale
+    local h = 1.0 / n
+    local s, x = 0.0, h / 2
+    for i = 1, n do   -- integral of 4/(1+x^2) in [0,1]
+      s = s + 4.0 / (1.0 + x * x)
+      x = x + h
+    end
+    assert(math.abs(s * h - math.pi) < 1e-6)
+  end},
+
+  {"sieve", function (scale)
+    local n = 1000000
+    local count
+    for _ = 1, scale do
+      local composite = {}
+      for i = 1, n do composite[i] = false end
+      count = 0
+      for i = 2, n do
+        if not composite[i] then
+          count = count + 1
+          for j = i * i, n, i do composite[j] = true end
+        end
+      end
+    end
+    assert(count == 78498)
+  end},
+
+  {"recursive fib", function (scale)
+    for _ = 1, scale do assert(fib(27) == 196418) end
+  end},
+}
+
+
+-- run all kernels, returning a list of times
+local function runall (scale)
+  local times = {}
+  for i, k in ipairs(kernels) do times[i] = best(k[2], scale) end
+  return times
+end
+
+
+if arg and arg[1] == "-times" then   -- called by another interpreter?
+  local times = runall(math.tointeger(arg[2]) or 1)
+  print(table.concat(times, " "))
+  return
+end
+
+
+local other = arg and arg[1]
+local scale = math.tointeger(arg and arg[2]) or 1
+local times = runall(scale)
+local otimes = {}
+if other then
+  local cmd = string.format("%s %s -times %d", other, arg[0], scale)
+  local f = assert(io.popen(cmd))
+  for t in f:read("a"):gmatch("%S+") do otimes[#otimes + 1] = tonumber(t) end
+  assert(f:close() and #otimes == #kernels, "could not run " .. other)
+end
+
+print(string.format("%-16s %10s %10s %8s", "kernel", "interp", "jit",
+                    "speedup"))
+for i, k in ipairs(kernels) do
+  local t, o = times[i], otimes[i]
+  print(string.format("%-16s %9.3fs %10s %8s", k[1], t,
+        o and string.format("%9.3fs", o) or "-",
+        o and string.format("%7.2fx", t / o) or "-"))
+end
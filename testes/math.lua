@@ -807,6 +807,17 @@ do
   a[1] = 1
   assert(not pcall(rawset, a, NaN, 1))
   assert(a[NaN] == undef)
+  -- NaNs with any bit pattern (some representations of values use
+  -- some of these patterns)
+  for _, s in ipairs{"\0\0\0\0\0\0\xf8\xff", "\1\0\0\0\0\0\xf8\xff",
+                     "\0\0\0\0\0\0\xfc\xff", "\xff\xff\xff\xff\xff\xff\xff\xff",
+                     "\1\0\0\0\0\0\xf0\x7f", "\0\0\0\0\0\0\xf8\x7f"} do
+    local x = string.unpack("<d", s)
+    local t = {x, -x, x * 2; [2.5] = x}
+    for _, v in ipairs{x, -x, t[1], t[2], t[3], t[2.5]} do
+      assert(v ~= v and math.type(v) == "float")
+    end
+  end
   -- strings with same binary representation as 0.0 (might create problems
   -- for constant manipulation in the pre-compiler)
   local a1, a2, a3, a4, a5 = 0, 0, "\0\0\0\0\0\0\0\0", 0, "\0\0\0\0\0\0\0\0"
@@ -815,6 +826,41 @@ do
 end
 
 
+do
+  -- the same instructions running with floats and other values
+  local function f (a, b) return a + b, a - b, a * b, a < b, a <= b end
+  local function check (a, b, ...)
+    local r = table.pack(f(a, b))
+    local e = table.pack(...)
+    for i = 1, 5 do
+      assert(r[i] == e[i] and math.type(r[i]) == math.type(e[i]))
+    end
+  end
+  for i = 1, 3 do
+    check(1.5, 0.5, 2.0, 1.0, 0.75, false, false)
+    check(3, 4, 7, -1, 12, true, true)
+    check(0.5, 0.5, 1.0, 0.0, 0.25, false, true)
+    check(2, 0.5, 2.5, 1.5, 1.0, false, false)
+    check(0.5, 2, 2.5, -1.5, 1.0, true, true)
+  end
+  checkerror("compare string with number", f, "10", 0.5)
+  local NaN <const> = 0/0
+  local r = table.pack(f(NaN, 1.0))
+  assert(r[1] ~= r[1] and not r[4] and not r[5])
+  checkerror("arithmetic on a table value %(local 'a'%)", f, {}, 1.0)
+  checkerror("arithmetic on a nil value %(local 'b'%)", f, 1.0, nil)
+  local mt = {__add = function () return "add" end,
+              __sub = function () return "sub" end,
+              __mul = function () return "mul" end,
+              __lt = function () return true end,
+              __le = function () return false end}
+  local t = setmetatable({}, mt)
+  check(t, 1.0, "add", "sub", "mul", true, false)
+  check(1.0, t, "add", "sub", "mul", true, false)
+  check(1.5, 0.5, 2.0, 1.0, 0.75, false, false)
+end
+
+
 --
 -- [[==================================================================
       print("testing 'math.random'")
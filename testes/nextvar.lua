@@ -34,6 +34,9 @@ end
 local function check (t, na, nh)
   if not T then return end
   local a, h = T.querytab(t)
+  if T.swisshash and h > 16 and h == 2 * nh then
+    h = nh   -- open addressing may keep more free nodes
+  end
   if a ~= na or h ~= nh then
     print(na, nh, a, h)
     assert(nil)
@@ -230,7 +233,9 @@ end
 -- insert and delete elements until a rehash occurr. Caller must ensure
 -- that a rehash will change the shape of the table. Must repeat because
 -- the insertion may collide with the deleted element, and then there is
--- no rehash.
+-- no rehash. (With open addressing, the rehash may keep the shape, as
+-- the hash part may already have the extra space; enough insertions
+-- ensure it happened.)
 local function forcerehash (t)
   local na, nh = T.querytab(t)
   local i = 10000
@@ -239,7 +244,7 @@ local function forcerehash (t)
     t[i] = true
     t[i] = undef
     local nna, nnh = T.querytab(t)
-  until nna ~= na or nnh ~= nh
+  until nna ~= na or nnh ~= nh or (T.swisshash and i > 10000 + 2 * nh)
 end
 
 
@@ -918,6 +923,223 @@ end
 assert(i == a.n)
 
 
+do   print("testing field accesses with inline caches")
+  -- the same instruction visits different tables and the same table
+  -- across rehashes, removals, and metatable changes
+  local function getx (t) return t.x end
+  local function setx (t, v) t.x = v end
+  local function callm (t) return t:m() end
+
+  local a = {x = 1}
+  local b = {y = 0, x = 2}
+  assert(getx(a) == 1 and getx(b) == 2 and getx(a) == 1)
+  for i = 1, 100 do a["k" .. i] = i end   -- force rehashes
+  assert(getx(a) == 1)
+  setx(a, 10); assert(getx(a) == 10 and a.x == 10)
+  a.x = nil   -- removed key now goes through '__index'
+  assert(getx(a) == nil)
+  setmetatable(a, {__index = function (_, k) return k .. "!" end})
+  assert(getx(a) == "x!")
+  local log = {}
+  setmetatable(b, {__newindex = function (t, k, v) log[#log + 1] = v end})
+  setx(b, 20); assert(b.x == 20 and #log == 0)
+  b.x = nil
+  setx(b, 30); assert(rawget(b, "x") == nil and log[1] == 30)
+  setx(a, 40); assert(getx(a) == 40)
+
+  local mt = {__index = {m = function () return "class" end}}
+  local o = setmetatable({}, mt)
+  assert(callm(o) == "class")
+  o.m = function () return "own" end
+  assert(callm(o) == "own")
+  o.m = nil
+  assert(callm(o) == "class")
+  mt.__index = {m = function () return "other" end}
+  assert(callm(o) == "other")
+
+  -- globals (accessed through '_ENV') change in the same way
+  local function getg () return XXXglobal end
+  XXXglobal = 1; assert(getg() == 1)
+  for i = 1, 100 do _G["XXXglobal" .. i] = i end
+  assert(getg() == 1)
+  XXXglobal = nil; assert(getg() == nil)
+  for i = 1, 100 do _G["XXXglobal" .. i] = nil end
+  collectgarbage()
+  XXXglobal = 2; assert(getg() == 2)
+  XXXglobal = nil
+
+  -- caches survive dumping and reloading
+  local f = load(string.dump(getx))
+  assert(f(a) == 40 and f(b) == nil and f({x = true}) == true)
+end
+
+
+do   print("testing tables with shapes")
+  -- records with the same keys share a shape; the same instruction
+  -- sees tables with different shapes and tables leaving their shapes
+  local function getx (t) return t.x end
+  local function mk (x, y) return {x = x, y = y} end
+  local a, b = mk(1, 2), mk(3, 4)
+  local c = {y = 5, x = 6}   -- same keys, other order
+  assert(getx(a) == 1 and getx(b) == 3 and getx(c) == 6)
+  local t = {}
+  t.x = 7; t.y = 8; t.z = 9   -- built field by field
+  assert(getx(t) == 7 and t.y == 8 and t.z == 9 and t.w == nil)
+  assert(t[1] == nil and t[true] == nil and t[2.5] == nil)
+
+  local keys = {}
+  for k, v in pairs(t) do keys[k] = v end
+  assert(keys.x == 7 and keys.y == 8 and keys.z == 9)
+  t.y = nil   -- removed field
+  assert(t.y == nil and next(t, "x") == "z" and getx(t) == 7)
+  t.y = 10   -- reuses its slot
+  assert(t.y == 10 and t.z == 9)
+  t.y = nil; t.w = 11   -- new key after a removal
+  assert(t.w == 11 and t.y == nil and getx(t) == 7 and t.z == 9)
+  a[1] = 12; a[2.5] = 13; a[true] = 14   -- keys that are not strings
+  assert(a[1] == 12 and a[2.5] == 13 and a[true] == 14 and getx(a) == 1)
+  for i = 1, 40 do b["k" .. i] = i end   -- too many keys
+  assert(getx(b) == 3 and b.y == 4 and b.k40 == 40)
+  assert(mk(5, 6).y == 6)   -- shapes of 'a' and 'b' are still there
+  local n = 0
+  for k in pairs(b) do n = n + 1 end
+  assert(n == 42)
+
+  -- shaped tables with an array part
+  local l = {10, 20, 30, x = 1, y = 2}
+  assert(#l == 3 and l.x == 1 and l[2] == 20)
+  table.insert(l, 40); l.z = 3
+  assert(#l == 4 and l.z == 3 and l.y == 2)
+
+  -- weak tables
+  local w = setmetatable({}, {__mode = "v"})
+  w.a = {}; w.b = 1; w.c = {}
+  local keep = w.c
+  collectgarbage()
+  assert(w.a == nil and w.b == 1 and w.c == keep)
+  w.a = 2
+  assert(w.a == 2)
+  w = setmetatable({}, {__mode = "k"})
+  w.a = {}; w.b = "x"
+  collectgarbage()
+  assert(w.a and w.b == "x")
+
+  -- many tables, each with a key of its own (the number of children of
+  -- a shape is bounded, so this is not quadratic)
+  local all = {}
+  for i = 1, 100000 do
+    local t = {}
+    t["u" .. i] = i
+    all[i] = (i % 2 == 0) and t or {x = i, ["v" .. i] = -i}
+  end
+  for i = 1, #all, 97 do
+    local t = all[i]
+    if i % 2 == 0 then
+      assert(t["u" .. i] == i and next(t, "u" .. i) == nil)
+    else
+      assert(t.x == i and t["v" .. i] == -i and getx(t) == i)
+    end
+  end
+  all = nil
+  assert(getx(mk(1, 2)) == 1)   -- common shapes still work
+
+  if T then
+    local t = {x = 1, y = 2}
+    local _, h = T.querytab(t)
+    assert(h == 2)
+    local k, v = T.querytab(t, 1)
+    assert(k == "y" and v == 2)
+  end
+end
+
+
+do   print("testing typed arrays")
+  local typed = T and T.typedarrays
+  local function kind (t)
+    if typed then return select(4, T.querytab(t)) end
+  end
+
+  local a = {}
+  for i = 1, 100 do a[i] = i * 10 end
+  assert(not typed or kind(a) == "integer")
+  assert(#a == 100 and a[1] == 10 and a[100] == 1000)
+  assert(a[0] == nil and a[101] == nil and a[1000] == nil)
+  local n = 0
+  for k, v in pairs(a) do n = n + 1; assert(v == k * 10) end
+  assert(n == 100)
+  n = 0
+  for i, v in ipairs(a) do n = n + 1; assert(v == i * 10) end
+  assert(n == 100)
+  assert(table.concat(a, ",", 1, 3) == "10,20,30")
+  assert(table.remove(a) == 1000 and #a == 99 and a[100] == nil)
+  a[#a] = nil; a[#a + 1] = -1; a[#a + 1] = nil
+  assert(#a == 99 and a[99] == -1)
+  table.sort(a)
+  assert(a[1] == -1 and a[2] == 10 and a[99] == 980)
+  assert(not typed or kind(a) == "integer")
+  collectgarbage()
+  assert(a[50] == 490)
+
+  -- values of other types make the array generic
+  a[10] = 1.5
+  assert(kind(a) == nil)
+  assert(a[10] == 1.5 and math.type(a[11]) == "integer" and #a == 99)
+  a = {}
+  for i = 1, 20 do a[i] = i end
+  a[5] = nil   -- a hole
+  assert(a[5] == nil and a[6] == 6 and a[20] == 20)
+  a = {}
+  for i = 1, 20 do a[i] = i end
+  a[22] = 22   -- not contiguous
+  assert(a[21] == nil and a[22] == 22)
+  a[21] = 21
+  assert(#a == 22)
+
+  -- floats
+  local f = {}
+  for i = 1, 30 do f[i] = i + 0.5 end
+  assert(not typed or kind(f) == "float")
+  f[31] = -0.0; f[32] = 0/0
+  assert(1/f[31] < 0 and f[32] ~= f[32] and #f == 32)
+  f[33] = 3   -- an integer in a float array
+  assert(math.type(f[33]) == "integer" and f[1] == 1.5 and #f == 33)
+  assert(kind(f) == nil)
+
+  -- integer keys coming from the hash part
+  local h = {x = 1}
+  for i = 1, 16 do h[i] = i end
+  for i = 18, 40 do h[i] = i end
+  h[17] = 17
+  for i = 1, 40 do assert(h[i] == i) end
+  assert(#h == 40 and h.x == 1)
+
+  -- metamethods: '__newindex' only for absent entries
+  local log = {}
+  local m = setmetatable({}, {__newindex = function (t, k, v)
+    log[#log + 1] = k; rawset(t, k, v)
+  end, __index = function (t, k) return "none" end})
+  for i = 1, 10 do m[i] = i end
+  assert(#log == 10 and m[11] == "none")
+  log = {}
+  m[3] = 30; m[10] = 100; m[2] = 2.5; m[11] = 11
+  assert(#log == 1 and log[1] == 11)
+  assert(m[3] == 30 and m[10] == 100 and m[2] == 2.5 and m[11] == 11)
+  log = {}
+  m = setmetatable({}, getmetatable(m))
+  for i = 1, 10 do rawset(m, i, i) end
+  m[10] = nil; m[10] = 10
+  assert(#log == 1 and log[1] == 10 and rawget(m, 10) == 10)
+  m[1] = nil   -- present entry; no metamethod
+  assert(#log == 1 and m[1] == "none" and rawget(m, 2) == 2)
+
+  -- weak values
+  local w = setmetatable({}, {__mode = "v"})
+  for i = 1, 10 do w[i] = i end
+  collectgarbage()
+  assert(#w == 10 and w[10] == 10)
+end
+
+
 -- testing yield inside __pairs
 do
   local t = setmetatable({10, 20, 30}, {__pairs = function (t)
@@ -436,5 +436,87 @@ do   -- test reuse of original string in gsub
   assert(r == s and string.format("%p", s) ~= string.format("%p", r))
 end
 
+do   -- plain searches against a naive search
+  local function naive (s, n, init)
+    for i = init, #s - #n + 1 do
+      if s:sub(i, i + #n - 1) == n then return i, i + #n - 1 end
+    end
+    return nil
+  end
+  local s = string.rep("aab", 15) .. "aac" .. string.rep("ab", 20) .. "\0a"
+  for len = 1, 40, 3 do
+    for i = 1, #s - len + 1, 5 do
+      local n = s:sub(i, i + len - 1)
+      for init = 1, #s, 11 do
+        local a, b = naive(s, n, init)
+        local a1, b1 = string.find(s, n, init, true)
+        assert(a == a1 and b == b1)
+        -- also through the matcher, with 'n' as a literal prefix
+        a1, b1 = string.find(s, n:gsub("%W", "%%%0") .. ".?", init)
+        assert(a == a1)
+      end
+    end
+  end
+  assert(string.find(string.rep("a", 100), string.rep("a", 50) .. "b",
+                     1, true) == nil)
+  assert(string.gsub(string.rep("xab", 30), "ab", "") ==
+         string.rep("x", 30))
+  assert(select(2, string.gsub(string.rep("xab", 30), "ab", "", 7)) == 7)
+  assert(string.gsub("abab", "^ab", "") == "ab")
+  assert(string.gsub("xabab", "^ab", "") == "xabab")
+end
+
+
+do   -- repeated uses of patterns (which may be compiled and cached)
+  local s = "12-34 (ab(c)) aad foo_bar"
+  local pats = {"^(%d+)%-(%d+)", "%f[%a]%a+", "()[%w_]+()", "%b()",
+                "(a)%1", "[^%s(]*d?", "%s+"}
+  local function results (p)
+    local t = {string.find(s, p)}
+    t[#t + 1] = string.gsub(s, p, "<%0>")
+    for a, b in string.gmatch(s, p) do t[#t + 1] = a; t[#t + 1] = b end
+    return table.concat(t, ",")
+  end
+  local first = {}
+  for i = 1, #pats do first[i] = results(pats[i]) end
+  for _ = 1, 3 do
+    for i = #pats, 1, -1 do assert(results(pats[i]) == first[i]) end
+  end
+
+  -- a pattern with '^' is anchored in 'find' but not in 'gmatch'
+  for _ = 1, 3 do
+    assert(select(2, string.find("aaa^a", "^a*")) == 3)
+    local t = {}
+    for m in string.gmatch("^a^aa", "^a*") do t[#t + 1] = m end
+    assert(t[1] == "^a" and t[2] == "^aa" and #t == 2)
+  end
+
+  -- errors happen only when the matcher gets to the malformed part
+  for _ = 1, 3 do
+    assert(string.find("abc", "x%") == nil)
+    assert(string.find("abc", "x[a") == nil)
+    assert(not pcall(string.find, "axc", "x%"))
+    assert(not pcall(string.find, "axc", "x[a"))
+  end
+
+  -- other patterns (and collections) while a pattern is in use
+  local n = 0
+  local r = string.gsub(string.rep("ab1 ", 10), "%a+%d", function (x)
+    for i = 1, 10 do string.find(x, "[" .. i .. "]") end
+    collectgarbage()
+    n = n + 1
+    return x:upper()
+  end)
+  assert(n == 10 and r == string.rep("AB1 ", 10))
+  n = 0
+  for w in string.gmatch(string.rep("xy2 ", 10), "[%a]+%d") do
+    assert(w == "xy2")
+    for i = 1, 10 do string.match(w, "%d" .. i) end
+    collectgarbage()
+    n = n + 1
+  end
+  assert(n == 10)
+end
+
 print('OK')
 
@@ -0,0 +1,75 @@
+-- $Id: testes/pmbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for pattern matching (not run by 'all.lua'). Runs a few
+-- patterns typical of log processing over synthetic log lines, with
+-- 'find', 'match', 'gmatch', and 'gsub'. Each time is the best of a
+-- few runs. Compare with a build that does not compile patterns
+-- (e.g., with -DPATMINUSES=1000000000) with
+--     lua pmbench.lua [thousands of lines]
+
+local N = math.floor((tonumber(arg and arg[1]) or 100) * 1e3)
+local RUNS = 3
+
+local clock = os.clock
+local random = math.random
+local format = string.format
+
+math.randomseed(42)
+
+local levels = {"INFO", "WARN", "ERROR", "DEBUG"}
+local users = {"alice", "bob_2", "carol", "dave99", "eve"}
+local lines = {}
+for i = 1, N do
+  lines[i] = format("2026-%02d-%02d %02d:%02d:%02d [%s] user=%s id=%d " ..
+                    "path=/srv/app%d/data/file%d.txt  took %d.%03dms",
+                    random(12), random(28), random(0, 23), random(0, 59),
+                    random(0, 59), levels[random(#levels)],
+                    users[random(#users)], random(1e6), random(9),
+                    random(1000), random(0, 500), random(0, 999))
+end
+
+
+-- best time of 'RUNS' calls to 'f'
+local function best (f)
+  local min = math.huge
+  for _ = 1, RUNS do
+    collectgarbage()
+    local t0 = clock()
+    f()
+    local t = clock() - t0
+    if t < min then min = t end
+  end
+  return min
+end
+
+
+local tests = {
+  {"match date", function (l)
+    return string.match(l, "^(%d+)%-(%d+)%-(%d+)") end},
+  {"match level", function (l)
+    return string.match(l, "%[(%u+)%]") end},
+  {"match user", function (l)
+    return string.match(l, "user=([%w_]+)") end},
+  {"find number", function (l)
+    return string.find(l, "took%s+[%d%.]+ms") end},
+  {"find frontier", function (l)
+    return string.find(l, "%f[%a]file%d+") end},
+  {"gmatch path", function (l)
+    local n = 0
+    for c in string.gmatch(l, "[^/%s]+") do n = n + 1 end
+    return n end},
+  {"gsub spaces", function (l)
+    return string.gsub(l, "%s+", " ") end},
+  {"gsub digits", function (l)
+    return string.gsub(l, "[0-9]", "#") end},
+}
+
+print(format("%d lines per test", N))
+for _, t in ipairs(tests) do
+  local name, f = t[1], t[2]
+  local time = best(function ()
+    for i = 1, N do f(lines[i]) end
+  end)
+  print(format("%-16s %8.1f ns/line", name, time / N * 1e9))
+end
@@ -33,7 +33,8 @@ do print "testing 'table.create'"
   t = table.create(0, 1024)
   memdiff = collectgarbage("count") * 1024 - m
   assert(memdiff > 1024 * 12)
-  assert(not T or select(2, T.querytab(t)) == 1024)
+  -- (open addressing keeps some free nodes)
+  assert(not T or select(2, T.querytab(t)) == (T.swisshash and 2048 or 1024))
 
   local maxint1 = 1 << (string.packsize("i") * 8 - 1)
   checkerror("out of range", table.create, maxint1)
@@ -0,0 +1,33 @@
+-- $Id: testes/strbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Latency benchmark for the string table (not run by 'all.lua').
+-- Interns new strings continuously and reports the longest time
+-- taken by a single creation, which includes any resize of the
+-- string table. Run it with
+--     lua strbench.lua [millions of strings]
+
+local N = math.floor((tonumber(arg and arg[1]) or 4) * 1e6)
+
+local clock = os.clock
+
+collectgarbage("stop")   -- measure only the string table
+
+local keep = {}
+local max, maxat = 0, 0
+local slow = 0   -- creations taking more than 1 ms
+local t0 = clock()
+for i = 1, N do
+  local c = clock()
+  local s = "s" .. i
+  c = clock() - c
+  keep[i] = s
+  if c > max then max, maxat = c, i end
+  if c > 1e-3 then slow = slow + 1 end
+end
+local total = clock() - t0
+
+print(string.format("%d strings in %.2f s (%.0f ns/string with timing)",
+                    N, total, total / N * 1e9))
+print(string.format("longest creation: %.3f ms (string %d)", max * 1e3, maxat))
+print(string.format("creations over 1 ms: %d", slow))
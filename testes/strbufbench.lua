@@ -0,0 +1,77 @@
+-- $Id: testes/strbufbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for string buffers (not run by 'all.lua'). Builds the same
+-- output with repeated concatenation, with 'table.concat', and with a
+-- string buffer, reporting the time and the garbage created by each
+-- method (memory of buffers, which is not accounted by the collector,
+-- does not appear there). Each time is the best of a few runs. Run it with
+--     lua strbufbench.lua [number of lines]
+
+local N = math.floor(tonumber(arg and arg[1]) or 100000)
+local RUNS = 3
+
+local clock = os.clock
+local format = string.format
+
+
+-- best time of 'RUNS' calls to 'f', plus the memory allocated by 'f'
+-- in the last run (with the collector stopped)
+local function best (f)
+  local min, kb = math.huge
+  for _ = 1, RUNS do
+    collectgarbage()
+    collectgarbage("stop")
+    local m0 = collectgarbage("count")
+    local t0 = clock()
+    local s = f()
+    local t = clock() - t0
+    kb = collectgarbage("count") - m0
+    collectgarbage("restart")
+    assert(#s > 0)
+    if t < min then min = t end
+  end
+  return min, kb
+end
+
+
+local methods = {
+  {"concatenation", function ()
+    local s = ""
+    for i = 1, N // 10 do   -- quadratic; use fewer lines
+      s = s .. "<li id=" .. i .. ">" .. "item" .. "</li>\n"
+    end
+    return s
+  end, 10},
+  {"table.concat", function ()
+    local t = {}
+    for i = 1, N do
+      t[#t + 1] = "<li id="; t[#t + 1] = i
+      t[#t + 1] = ">"; t[#t + 1] = "item"; t[#t + 1] = "</li>\n"
+    end
+    return table.concat(t)
+  end, 1},
+  {"format + concat", function ()
+    local t = {}
+    for i = 1, N do t[i] = format("<li id=%d>%s</li>\n", i, "item") end
+    return table.concat(t)
+  end, 1},
+  {"buffer:put", function ()
+    local b = string.buffer()
+    for i = 1, N do b:put("<li id=", i, ">", "item", "</li>\n") end
+    return b:tostring()
+  end, 1},
+  {"buffer:format", function ()
+    local b = string.buffer()
+    for i = 1, N do b:format("<li id=%d>%s</li>\n", i, "item") end
+    return b:tostring()
+  end, 1},
+}
+
+print(format("%d lines per test", N))
+for _, m in ipairs(methods) do
+  local time, kb = best(m[2])
+  local scale = m[3]   -- lines built are 'N / scale'
+  print(format("%-16s %8.1f ns/line %10.1f bytes/line", m[1],
+               time / N * scale * 1e9, kb * 1024 / N * scale))
+end
@@ -0,0 +1,126 @@
+-- $Id: testes/strhashbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for string hashing (not run by 'all.lua'). Interns short
+-- strings with several distributions of lengths, both new ones and
+-- a small set of already interned ones, plus sequential names, and
+-- hashes long strings used as table keys. Each time is the best of a few runs. With the test
+-- library, it also reports the lengths of chains in the string table
+-- (with all new strings alive). Compare builds with and without
+-- LUAI_WORDHASH with
+--     lua strhashbench.lua [millions of strings]
+
+local N = math.floor((tonumber(arg and arg[1]) or 1) * 1e6)
+local POOL = 10000   -- strings reused in lookups
+local RUNS = 3
+
+local clock = os.clock
+local sub = string.sub
+local random = math.random
+
+math.randomseed(42)
+
+-- a buffer of random text to take strings from
+local TEXTSIZE = 1 << 20
+local text
+do
+  local chars = "abcdefghijklmnopqrstuvwxyz_ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789./"
+  local t = {}
+  for i = 1, TEXTSIZE do
+    local c = random(#chars)
+    t[i] = sub(chars, c, c)
+  end
+  text = table.concat(t)
+end
+
+
+-- best time of 'RUNS' calls to 'f'; 'f' must leave no garbage behind
+local function best (f)
+  local min = math.huge
+  for _ = 1, RUNS do
+    collectgarbage()
+    local t0 = clock()
+    f()
+    local t = clock() - t0
+    if t < min then min = t end
+  end
+  return min
+end
+
+
+-- lengths of chains in the string table (needs the test library)
+local function chains ()
+  if not T then return "" end
+  local size, nuse = T.querystr()
+  local max, used = 0, 0
+  for i = 1, size do
+    local c = select("#", T.querystr(i))
+    if c > max then max = c end
+    if c > 0 then used = used + 1 end
+  end
+  return string.format("   chains: %d in %d buckets, mean %.2f, max %d",
+                       nuse, size, nuse / used, max)
+end
+
+
+-- distributions of lengths
+local dists = {
+  {"identifiers (2-12)", function () return random(2, 6) + random(0, 6) end},
+  {"keys (8-24)", function () return random(8, 24) end},
+  {"paths (24-40)", function () return random(24, 40) end},
+}
+
+print(string.format("%d strings per test", N))
+
+for _, d in ipairs(dists) do
+  local name, len = d[1], d[2]
+  local p, l = {}, {}
+  for i = 1, N do
+    l[i] = len()
+    p[i] = random(TEXTSIZE - l[i])
+  end
+  local keep
+  local new = best(function ()   -- new strings
+    keep = {}
+    for i = 1, N do keep[i] = sub(text, p[i], p[i] + l[i] - 1) end
+  end)
+  local stats = chains()
+  keep = nil
+  local pool = {}
+  for i = 1, POOL do pool[i] = sub(text, p[i], p[i] + l[i] - 1) end
+  local found = best(function ()   -- strings already interned
+    for r = 1, N, POOL do
+      for i = 1, POOL do local s = sub(text, p[i], p[i] + l[i] - 1) end
+    end
+  end)
+  print(string.format("%-20s new %6.1f ns/str   found %6.1f ns/str%s",
+                      name, new / N * 1e9, found / N * 1e9, stats))
+end
+
+
+-- sequential names, which differ only in their last bytes
+do
+  local keep
+  local new = best(function ()
+    keep = {}
+    for i = 1, N do keep[i] = "key" .. i end
+  end)
+  local stats = chains()
+  keep = nil
+  print(string.format("%-20s new %6.1f ns/str%22s%s",
+                      "sequential names", new / N * 1e9, "", stats))
+end
+
+
+-- long strings used as keys; each new key is hashed once
+for _, len in ipairs{64, 256, 4096} do
+  local n = math.max(1, N // (len // 16))
+  local p = {}
+  for i = 1, n do p[i] = random(TEXTSIZE - len) end
+  local time = best(function ()
+    local t = {}
+    for i = 1, n do t[sub(text, p[i], p[i] + len - 1)] = true end
+  end)
+  print(string.format("long keys (%4d)      %8.1f ns/key   %6.2f GB/s",
+                      len, time / n * 1e9, n * len / time / 1e9))
+end
@@ -541,5 +541,124 @@ else
   assert(z == y)
 end
 
+
+do print("testing string buffers")
+  local b = string.buffer()
+  assert(#b == 0 and b:tostring() == "")
+  -- all operations return the buffer itself
+  assert(b:put("a", 1, 2.5, "b") == b)
+  assert(b:format("<%d|%5.1f|%s>", 10, 1.5, "x") == b)
+  assert(b:pack("i2>i2", 1, 2) == b)
+  assert(#b == 22)
+  assert(b:tostring() == "a12.5b<10|  1.5|x>" .. string.pack("i2>i2", 1, 2))
+  assert(#b == 0 and b:tostring() == "")   -- 'tostring' empties it
+  -- numbers are converted like in 'tostring'
+  b:put(math.mininteger, -0.0, 1e100, 3.0)
+  assert(b:tostring() ==
+    tostring(math.mininteger) .. tostring(-0.0) .. "1e+100" .. "3.0")
+  -- alignment is relative to the start of each pack
+  b:put("x"):pack("!4 b i4", 1, 2)
+  assert(b:tostring() == "x" .. string.pack("!4 b i4", 1, 2))
+
+  -- large contents (handed over to the result) and small ones (copied)
+  local small = string.rep("x", 100)
+  b:reserve(10000)
+  for i = 1, 1000 do b:put(small) end
+  assert(#b == 100000)
+  local s = b:tostring()
+  assert(s == string.rep(small, 1000))
+  for i = 1, 10 do
+    b:put(small, i)
+    assert(b:tostring() == small .. i)
+  end
+  -- buffer keeps working after a handover
+  for i = 1, 1000 do b:put(small) end
+  assert(b:tostring() == s)
+  local t = {}
+  for i = 1, 500 do b:put(i, ","); t[i] = i .. "," end
+  assert(b:tostring() == table.concat(t))
+
+  -- 'reset' discards the contents
+  b:put("abc"):reset()
+  assert(#b == 0 and b:tostring() == "")
+  b:put("abc"):reset():put("def")
+  assert(b:tostring() == "def")
+
+  -- initial size
+  b = string.buffer(100)
+  assert(#b == 0)
+  b:put("hi")
+  assert(b:tostring() == "hi")
+
+  -- errors do not change the contents
+  b:put("keep")
+  checkerror("string expected, got table", b.put, b, "lost", {})
+  checkerror("number expected", b.format, b, "%d", "x")
+  checkerror("out of limits", b.pack, b, "i17", 1)
+  checkerror("invalid size", b.reserve, b, -1)
+  checkerror("invalid size", string.buffer, -1)
+  checkerror("string.buffer expected", b.put, {}, "x")
+  assert(b:tostring() == "keep")
+
+  -- buffers are collected with their contents
+  for i = 1, 100 do
+    string.buffer(1000):put(string.rep("a", 2000))
+  end
+  collectgarbage()
+end
+
+do print("testing resizes of the string table")
+  local N = 20000
+  local t = {}
+  for i = 1, N do
+    local s = "str" .. i
+    t[s] = i
+    t[i] = s
+  end
+  for i = 1, N do   -- a new instance is always the same string
+    local s = "str" .. i
+    assert(rawequal(s, t[i]) and t[s] == i)
+  end
+  t = nil
+
+  if T then
+    -- count strings through the buckets of the table
+    local function countstrings (size)
+      local n = 0
+      for k = 1, size do n = n + select("#", T.querystr(k)) end
+      return n
+    end
+
+    collectgarbage("stop")   -- keep the table as it is while checking
+    local keep = {}
+    local i = 0
+    local size, nuse, tomove
+    repeat   -- create strings until a resize is going on
+      i = i + 1; keep[i] = "key" .. i
+      size, nuse, tomove = T.querystr()
+    until tomove > 0
+    for j = 1, i do assert(rawequal(keep[j], "key" .. j)) end
+    assert(countstrings(size) == nuse)
+    -- keep creating strings until the resize finishes
+    while select(3, T.querystr()) > 0 do
+      i = i + 1; keep[i] = "key" .. i
+    end
+    for j = 1, i do assert(rawequal(keep[j], "key" .. j)) end
+    size, nuse = T.querystr()
+    assert(countstrings(size) == nuse)
+
+    -- shrink the table
+    keep = {keep[1], keep[i]}
+    collectgarbage("restart")
+    collectgarbage()
+    local size1, nuse1 = T.querystr()
+    assert(size1 < size)
+    collectgarbage("stop")
+    assert(countstrings(size1) == nuse1)
+    assert(rawequal(keep[1], "key1") and rawequal(keep[2], "key" .. i))
+    collectgarbage("restart")
+  end
+end
+
 print('OK')
 
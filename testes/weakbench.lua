@@ -0,0 +1,55 @@
+-- $Id: testes/weakbench.lua $
+-- See Copyright Notice in file all.lua
+
+-- Benchmark for the atomic phase with large weak tables (not run by
+-- 'all.lua'). Keeps a weak-keyed cache and a weak-valued cache where
+-- part of the entries die in each cycle, runs each cycle in small
+-- incremental steps, and reports the longest step, which is the
+-- atomic one. Run it with
+--     lua weakbench.lua [thousands of entries]
+
+local N = math.floor((tonumber(arg and arg[1]) or 500) * 1e3)
+local ROUNDS = 5
+
+local clock = os.clock
+
+collectgarbage("incremental")
+
+local keys = {}
+local eph = setmetatable({}, {__mode = "k"})   -- cache keyed by objects
+local wv = setmetatable({}, {__mode = "v"})    -- cache of objects
+for i = 1, N do
+  local k = {}
+  keys[i] = k
+  eph[k] = {i}
+  wv[i] = k
+  wv["x" .. i] = {}
+end
+collectgarbage()
+collectgarbage()
+
+local maxatomic, total = 0, 0
+for r = 1, ROUNDS do
+  for i = r, N, 4 do   -- a quarter of the entries die
+    local k = {}
+    keys[i] = k
+    eph[k] = {i}
+    wv[i] = k
+  end
+  collectgarbage("stop")
+  local t0 = clock()
+  local max = 0
+  repeat
+    local c = clock()
+    local done = collectgarbage("step", 0)
+    c = clock() - c
+    if c > max then max = c end
+  until done
+  total = total + (clock() - t0)
+  if max > maxatomic then maxatomic = max end
+  collectgarbage("restart")
+end
+
+print(string.format("%d entries per table, %d cycles", N, ROUNDS))
+print(string.format("longest step (atomic): %.2f ms", maxatomic * 1e3))
+print(string.format("average cycle: %.2f ms", total / ROUNDS * 1e3))